@@ -0,0 +1,525 @@
+#pragma once
+
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "Utils.h"
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#endif
+
+//batch file i/o for image lists: many reads in flight ahead of the consumer and writes that complete in the
+//background. io_uring is driven through its raw system calls (no liburing); where it is unavailable (old kernels,
+//containers that filter the calls) the same interface is served by a pool of threads doing pread/pwrite
+
+const unsigned IO_CHUNK_BYTES = 1u << 30; //largest single read or write, lengths are 32-bit in the rings
+
+//minimal io_uring instance: one submission and one completion ring, used from a single thread
+class IoUring {
+public:
+	IoUring(unsigned entries) {
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+		if (entries == 0) return;
+		io_uring_params params;
+		memset(&params, 0, sizeof(params));
+		ring_fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+		if (ring_fd < 0) return;
+		sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+		bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+		if (single_mmap) sq_size = cq_size = max(sq_size, cq_size);
+		sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+		sq_ring = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+		cq_ring = single_mmap ? sq_ring : mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+		sqes = (io_uring_sqe*)mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+		if ((sq_ring == MAP_FAILED) || (cq_ring == MAP_FAILED) || (sqes == MAP_FAILED)) {
+			Close();
+			return;
+		}
+		sq_tail = (unsigned*)((char*)sq_ring + params.sq_off.tail);
+		sq_mask = (unsigned*)((char*)sq_ring + params.sq_off.ring_mask);
+		sq_array = (unsigned*)((char*)sq_ring + params.sq_off.array);
+		cq_head = (unsigned*)((char*)cq_ring + params.cq_off.head);
+		cq_tail = (unsigned*)((char*)cq_ring + params.cq_off.tail);
+		cq_mask = (unsigned*)((char*)cq_ring + params.cq_off.ring_mask);
+		cqes = (io_uring_cqe*)((char*)cq_ring + params.cq_off.cqes);
+#endif
+	}
+
+	~IoUring() { Close(); }
+
+	IoUring(const IoUring&) = delete;
+
+	bool IsOpen() const { return ring_fd >= 0; }
+
+	//pins the buffers so that reads into them (buffer_index >= 0 in Queue) skip the per-request page mapping
+	bool RegisterBuffers(const vector<iovec>& buffers) {
+#if defined(__linux__) && defined(__NR_io_uring_register)
+		return syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, buffers.data(), (unsigned)buffers.size()) == 0;
+#else
+		return false;
+#endif
+	}
+
+	//adds a read or write to the submission ring, handed to the kernel by the next Submit
+	void Queue(bool write, int fd, void* buffer, unsigned length, uint64_t offset, uint64_t user_data, int buffer_index = -1) {
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+		unsigned tail = *sq_tail; //only this thread moves the tail
+		unsigned index = tail & *sq_mask;
+		io_uring_sqe& sqe = sqes[index];
+		memset(&sqe, 0, sizeof(sqe));
+		if (buffer_index >= 0) {
+			sqe.opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+			sqe.buf_index = (uint16_t)buffer_index;
+		}
+		else
+			sqe.opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+		sqe.fd = fd;
+		sqe.addr = (uint64_t)buffer;
+		sqe.len = length;
+		sqe.off = offset;
+		sqe.user_data = user_data;
+		sq_array[index] = index;
+		__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+		queued++;
+#endif
+	}
+
+	//submits the queued entries and, if wait is set, blocks until at least one completion is available
+	bool Submit(bool wait) {
+#if defined(__linux__) && defined(__NR_io_uring_enter)
+		for (;;) {
+			int result = (int)syscall(__NR_io_uring_enter, ring_fd, queued, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+			if (result >= 0) {
+				queued -= result;
+				return true;
+			}
+			if (errno != EINTR) return false;
+		}
+#else
+		return false;
+#endif
+	}
+
+	//takes the next completion, false when there is none yet
+	bool Complete(uint64_t& user_data, int& result) {
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+		unsigned head = *cq_head;
+		if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) return false;
+		const io_uring_cqe& cqe = cqes[head & *cq_mask];
+		user_data = cqe.user_data;
+		result = cqe.res;
+		__atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+		return true;
+#else
+		return false;
+#endif
+	}
+
+private:
+	void Close() {
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+		if (sqes && (sqes != MAP_FAILED)) munmap(sqes, sqes_size);
+		if (cq_ring && (cq_ring != MAP_FAILED) && (cq_ring != sq_ring)) munmap(cq_ring, cq_size);
+		if (sq_ring && (sq_ring != MAP_FAILED)) munmap(sq_ring, sq_size);
+		if (ring_fd >= 0) close(ring_fd);
+		ring_fd = -1;
+#endif
+	}
+
+	int ring_fd = -1;
+	unsigned queued = 0;
+	void* sq_ring = nullptr;
+	void* cq_ring = nullptr;
+	size_t sq_size = 0, cq_size = 0, sqes_size = 0;
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+	io_uring_sqe* sqes = nullptr;
+	io_uring_cqe* cqes = nullptr;
+#else
+	void* sqes = nullptr;
+#endif
+	unsigned *sq_tail = nullptr, *sq_mask = nullptr, *sq_array = nullptr;
+	unsigned *cq_head = nullptr, *cq_tail = nullptr, *cq_mask = nullptr;
+};
+
+//contents of one file of a BatchReader, valid until the next call to Next
+struct FileView {
+	string name;
+	const char* data = nullptr;
+	size_t size = 0;
+	bool ok = false; //false when the file could not be opened or read
+	bool skipped = false; //not read, as the consumer asked to load it by name itself
+};
+
+//reads a list of files in order, keeping up to depth of them in flight ahead of the consumer. each in-flight file
+//has a slot buffer; with io_uring the slots are sized for the largest file and registered once
+//files whose entry in wanted is false are handed out in order but not read (e.g. formats only loadable by name),
+//so they are not read twice; an empty wanted reads every file
+class BatchReader {
+public:
+	BatchReader(const vector<string>& files, size_t depth, bool use_uring = true, const vector<bool>& wanted = vector<bool>())
+		: files(files), wanted(wanted), depth(max((size_t)1, depth)), slots(this->depth), ring(use_uring ? 2 * (unsigned)this->depth : 0) {
+		if (use_uring && ring.IsOpen()) {
+			backend = "io_uring";
+			size_t largest = 0;
+			for (size_t i = 0; i < files.size(); i++) {
+				struct stat info;
+				if (Wanted(i) && (stat(files[i].c_str(), &info) == 0)) largest = max(largest, (size_t)info.st_size);
+			}
+			vector<iovec> buffers;
+			for (Slot& slot : slots) {
+				slot.buffer.resize(max((size_t)1, largest));
+				buffers.push_back({ slot.buffer.data(), slot.buffer.size() });
+			}
+			registered = ring.RegisterBuffers(buffers); //fails e.g. over RLIMIT_MEMLOCK, reads then go unregistered
+			if (registered) backend += " (registered buffers)";
+		}
+		else {
+			backend = use_uring ? "threads (io_uring unavailable)" : "threads";
+			for (size_t w = 0; w < this->depth; w++)
+				workers.emplace_back([this] { ReadWorker(); });
+		}
+	}
+
+	~BatchReader() {
+		{
+			lock_guard<mutex> lock(guard);
+			stopping = true;
+		}
+		ready_changed.notify_all();
+		for (thread& worker : workers) worker.join();
+		//the kernel may still be writing into the slots
+		while (in_flight > 0 && ring.Submit(true)) Reap();
+	}
+
+	BatchReader(const BatchReader&) = delete;
+
+	const string& Backend() const { return backend; }
+
+	//next file of the list, false after the last one
+	bool Next(FileView& view) {
+		if (next_file > 0) {
+			lock_guard<mutex> lock(guard);
+			slots[(next_file - 1) % depth].ready = false;
+			released = next_file;
+		}
+		ready_changed.notify_all();
+		if (next_file >= files.size()) return false;
+
+		Slot& slot = slots[next_file % depth];
+		if (workers.empty()) {
+			while ((started < files.size()) && (started < released + depth)) Start(started++);
+			ring.Submit(false);
+			while (!slot.ready && ring.Submit(true)) Reap();
+		}
+		else {
+			unique_lock<mutex> lock(guard);
+			ready_changed.wait(lock, [&] { return slot.ready && (slot.file == next_file); });
+		}
+
+		view.name = files[next_file];
+		view.data = slot.buffer.data();
+		view.size = slot.size;
+		view.ok = slot.ok;
+		view.skipped = !Wanted(next_file);
+		next_file++;
+		return true;
+	}
+
+private:
+	struct Slot {
+		vector<char> buffer;
+		size_t file = 0;
+		int fd = -1;
+		size_t size = 0, done = 0;
+		bool ok = false;
+		bool ready = false;
+		bool unregistered = false; //buffer replaced after registration
+	};
+
+	bool Wanted(size_t i) const { return wanted.empty() || wanted[i]; }
+
+	//opens file i and queues the read of its first chunk into its slot (io_uring)
+	void Start(size_t i) {
+		Slot& slot = slots[i % depth];
+		slot.file = i;
+		slot.done = 0;
+		slot.ok = false;
+		if (!Wanted(i)) {
+			slot.size = 0;
+			Finish(slot, true);
+			return;
+		}
+		slot.fd = open(files[i].c_str(), O_RDONLY);
+		struct stat info;
+		if ((slot.fd < 0) || (fstat(slot.fd, &info) != 0)) {
+			Finish(slot, false);
+			return;
+		}
+		slot.size = (size_t)info.st_size;
+		if (slot.size > slot.buffer.size()) { //grew since the constructor looked; a new buffer is not registered
+			slot.buffer.resize(slot.size);
+			slot.unregistered = true;
+		}
+		if (slot.size == 0) {
+			Finish(slot, true);
+			return;
+		}
+		QueueChunk(slot);
+	}
+
+	void QueueChunk(Slot& slot) {
+		unsigned length = (unsigned)min((size_t)IO_CHUNK_BYTES, slot.size - slot.done);
+		int buffer_index = (registered && !slot.unregistered) ? (int)(&slot - slots.data()) : -1;
+		ring.Queue(false, slot.fd, slot.buffer.data() + slot.done, length, slot.done, &slot - slots.data(), buffer_index);
+		in_flight++;
+	}
+
+	//handles the available completions, queueing the next chunk of files read only partly
+	void Reap() {
+		uint64_t index;
+		int result;
+		while (ring.Complete(index, result)) {
+			in_flight--;
+			Slot& slot = slots[index];
+			if (result <= 0) { //error, or the file shrank
+				Finish(slot, false);
+				continue;
+			}
+			slot.done += result;
+			if (slot.done < slot.size)
+				QueueChunk(slot);
+			else
+				Finish(slot, true);
+		}
+		ring.Submit(false);
+	}
+
+	void Finish(Slot& slot, bool ok) {
+		if (slot.fd >= 0) close(slot.fd);
+		slot.fd = -1;
+		slot.ok = ok;
+		slot.ready = true;
+	}
+
+	//thread-pool backend: every worker claims the next file and reads it once its slot has been released
+	void ReadWorker() {
+		for (;;) {
+			size_t i;
+			{
+				unique_lock<mutex> lock(guard);
+				if (started >= files.size()) return;
+				i = started++;
+				ready_changed.wait(lock, [&] { return stopping || (i < released + depth); });
+				if (stopping) return;
+			}
+			Slot& slot = slots[i % depth];
+			bool ok = !Wanted(i);
+			if (ok) slot.size = 0;
+			int fd = ok ? -1 : open(files[i].c_str(), O_RDONLY);
+			struct stat info;
+			if ((fd >= 0) && (fstat(fd, &info) == 0)) {
+				slot.buffer.resize(max(slot.buffer.size(), (size_t)info.st_size));
+				slot.size = (size_t)info.st_size;
+				size_t done = 0;
+				while (done < slot.size) {
+					ssize_t result = pread(fd, slot.buffer.data() + done, min((size_t)IO_CHUNK_BYTES, slot.size - done), done);
+					if (result < 0 && errno == EINTR) continue;
+					if (result <= 0) break;
+					done += result;
+				}
+				ok = (done == slot.size);
+			}
+			if (fd >= 0) close(fd);
+			{
+				lock_guard<mutex> lock(guard);
+				slot.file = i;
+				slot.ok = ok;
+				slot.ready = true;
+			}
+			ready_changed.notify_all();
+		}
+	}
+
+	vector<string> files;
+	vector<bool> wanted;
+	size_t depth;
+	vector<Slot> slots;
+	IoUring ring;
+	bool registered = false;
+	string backend;
+	size_t next_file = 0; //next file handed to the consumer
+	size_t started = 0; //files whose read has been started (or claimed by a worker)
+	size_t released = 0; //files the consumer is done with, their slots can be reused
+	size_t in_flight = 0;
+	mutex guard;
+	condition_variable ready_changed;
+	bool stopping = false;
+	vector<thread> workers;
+};
+
+//writes files in the background, up to depth at a time; Write only blocks while depth writes are outstanding
+class BatchWriter {
+public:
+	BatchWriter(size_t depth, bool use_uring = true)
+		: depth(max((size_t)1, depth)), ring(use_uring ? 2 * (unsigned)this->depth : 0) {
+		if (use_uring && ring.IsOpen())
+			backend = "io_uring";
+		else {
+			backend = use_uring ? "threads (io_uring unavailable)" : "threads";
+			for (size_t w = 0; w < this->depth; w++)
+				workers.emplace_back([this] { WriteWorker(); });
+		}
+	}
+
+	~BatchWriter() {
+		Finish();
+		{
+			lock_guard<mutex> lock(guard);
+			stopping = true;
+		}
+		changed.notify_all();
+		for (thread& worker : workers) worker.join();
+	}
+
+	BatchWriter(const BatchWriter&) = delete;
+
+	const string& Backend() const { return backend; }
+
+	void Write(const string& name, vector<char>&& data) {
+		if (workers.empty()) {
+			while (jobs.size() >= depth && ring.Submit(true)) Reap();
+			uint64_t id = next_id++;
+			Job& job = jobs[id];
+			job.name = name;
+			job.data = move(data);
+			job.fd = open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (job.fd < 0) {
+				Done(id, false);
+				return;
+			}
+			if (job.data.empty()) {
+				Done(id, true);
+				return;
+			}
+			QueueChunk(id, job);
+			ring.Submit(false);
+			Reap();
+		}
+		else {
+			unique_lock<mutex> lock(guard);
+			changed.wait(lock, [&] { return queue.size() + active < depth; });
+			queue.emplace_back(name, move(data));
+			changed.notify_all();
+		}
+	}
+
+	//waits for every write issued so far, returns the number of files that could not be written
+	size_t Finish() {
+		if (workers.empty()) {
+			while (!jobs.empty() && ring.Submit(true)) Reap();
+		}
+		else {
+			unique_lock<mutex> lock(guard);
+			changed.wait(lock, [&] { return queue.empty() && (active == 0); });
+		}
+		lock_guard<mutex> lock(guard);
+		return failed;
+	}
+
+private:
+	struct Job {
+		string name;
+		vector<char> data;
+		int fd = -1;
+		size_t done = 0;
+	};
+
+	void QueueChunk(uint64_t id, Job& job) {
+		unsigned length = (unsigned)min((size_t)IO_CHUNK_BYTES, job.data.size() - job.done);
+		ring.Queue(true, job.fd, job.data.data() + job.done, length, job.done, id);
+	}
+
+	void Reap() {
+		uint64_t id;
+		int result;
+		while (ring.Complete(id, result)) {
+			Job& job = jobs[id];
+			if (result <= 0) {
+				Done(id, false);
+				continue;
+			}
+			job.done += result;
+			if (job.done < job.data.size())
+				QueueChunk(id, job);
+			else
+				Done(id, true);
+		}
+		ring.Submit(false);
+	}
+
+	//close can report a failed write-back (e.g. on NFS or a full disk), so its result counts as that of the write
+	void Done(uint64_t id, bool ok) {
+		Job& job = jobs[id];
+		if ((job.fd >= 0) && (close(job.fd) != 0)) ok = false;
+		if (!ok) {
+			cerr << "Error: Cannot write '" << job.name << "'" << endl;
+			lock_guard<mutex> lock(guard);
+			failed++;
+		}
+		jobs.erase(id);
+	}
+
+	void WriteWorker() {
+		for (;;) {
+			pair<string, vector<char>> file;
+			{
+				unique_lock<mutex> lock(guard);
+				changed.wait(lock, [&] { return stopping || !queue.empty(); });
+				if (queue.empty()) return;
+				file = move(queue.front());
+				queue.pop_front();
+				active++;
+			}
+			bool ok = false;
+			int fd = open(file.first.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (fd >= 0) {
+				size_t done = 0;
+				while (done < file.second.size()) {
+					ssize_t result = pwrite(fd, file.second.data() + done, min((size_t)IO_CHUNK_BYTES, file.second.size() - done), done);
+					if (result < 0 && errno == EINTR) continue;
+					if (result <= 0) break;
+					done += result;
+				}
+				bool closed = (close(fd) == 0);
+				ok = (done == file.second.size()) && closed;
+			}
+			if (!ok) cerr << "Error: Cannot write '" << file.first << "'" << endl;
+			{
+				lock_guard<mutex> lock(guard);
+				active--;
+				if (!ok) failed++;
+			}
+			changed.notify_all();
+		}
+	}
+
+	size_t depth;
+	IoUring ring;
+	string backend;
+	map<uint64_t, Job> jobs; //io_uring writes in flight
+	uint64_t next_id = 0;
+	deque<pair<string, vector<char>>> queue; //thread pool: files waiting for a worker
+	size_t active = 0;
+	size_t failed = 0;
+	mutex guard;
+	condition_variable changed;
+	bool stopping = false;
+	vector<thread> workers;
+};
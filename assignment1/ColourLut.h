@@ -0,0 +1,138 @@
+#pragma once
+
+#include <cmath>
+#include <cctype>
+#include "Utils.h"
+
+//host side of the LUT engine (ImageCore::Grade): 1-D tone curves over the 16-bit range and 3-D colour LUTs read
+//from .cube files
+
+//interpolation of a ColourCube between its lattice points, numbered as in the apply_cube kernels
+const int CUBE_TRILINEAR = 0;
+const int CUBE_TETRAHEDRAL = 1;
+
+//where apply_cube keeps the lattice: AUTO picks an Image3D when the device has image support, else local memory
+const int CUBE_STAGING_AUTO = 0;
+const int CUBE_STAGING_IMAGE = 1;
+const int CUBE_STAGING_LOCAL = 2;
+
+//gamma correction, out = in^(1 / gamma) on the normalised range, so gamma > 1 brightens the mid-tones
+inline vector<cl_ushort> GammaCurve(float gamma) {
+	vector<cl_ushort> curve(65536);
+	for (int i = 0; i < 65536; i++)
+		curve[i] = (cl_ushort)lround(pow(i / 65535.0, 1.0 / gamma) * 65535.0);
+	return curve;
+}
+
+//logarithmic curve, out = log2(1 + in) / 16 on the 16-bit range, expanding the shadows
+inline vector<cl_ushort> LogCurve() {
+	vector<cl_ushort> curve(65536);
+	for (int i = 0; i < 65536; i++)
+		curve[i] = (cl_ushort)lround(log2(1.0 + i) / 16.0 * 65535.0);
+	return curve;
+}
+
+//custom curve from a text file of "input output" pairs on the normalised range [0, 1], in increasing input order
+//('#' starts a comment), interpolated linearly and held flat beyond the first and last points; false if unreadable
+inline bool LoadCurve(const string& file_name, vector<cl_ushort>& curve) {
+	ifstream file(file_name);
+	if (!file) return false;
+	vector<pair<double, double>> points;
+	for (string line; getline(file, line);) {
+		line = line.substr(0, line.find('#'));
+		double in, out;
+		if (sscanf(line.c_str(), "%lf %lf", &in, &out) != 2) continue;
+		if (!points.empty() && in <= points.back().first) return false;
+		points.emplace_back(in, out);
+	}
+	if (points.empty()) return false;
+	curve.resize(65536);
+	size_t next = 0;
+	for (int i = 0; i < 65536; i++) {
+		double x = i / 65535.0, y;
+		while (next < points.size() && points[next].first < x) next++;
+		if (next == 0) y = points.front().second;
+		else if (next == points.size()) y = points.back().second;
+		else {
+			const pair<double, double>& a = points[next - 1], & b = points[next];
+			y = a.second + (b.second - a.second) * (x - a.first) / (b.first - a.first);
+		}
+		curve[i] = (cl_ushort)lround(min(max(y, 0.0), 1.0) * 65535.0);
+	}
+	return true;
+}
+
+//curve from a command-line spec: gamma:G, log or file:PATH; false if the spec or the file is invalid
+inline bool ParseCurve(const string& spec, vector<cl_ushort>& curve) {
+	if (spec.compare(0, 6, "gamma:") == 0) {
+		float gamma = (float)atof(spec.c_str() + 6);
+		if (gamma <= 0) return false;
+		curve = GammaCurve(gamma);
+		return true;
+	}
+	if (spec == "log") {
+		curve = LogCurve();
+		return true;
+	}
+	if (spec.compare(0, 5, "file:") == 0) return LoadCurve(spec.substr(5), curve);
+	return false;
+}
+
+//3-D RGB LUT of a .cube file (LUT_3D_SIZE, DOMAIN_MIN/MAX, then size^3 "r g b" rows with red changing fastest).
+//the lattice is kept as 16-bit normalised values, size^3 x 3 in file order, as the kernels read it
+class ColourCube {
+public:
+	string title;
+	int size = 0;
+	float domain_min[3] = { 0.f, 0.f, 0.f };
+	float domain_max[3] = { 1.f, 1.f, 1.f };
+	vector<cl_ushort> lattice;
+
+	//false with a reason in error if the file cannot be read or is not a complete 3-D .cube
+	bool Load(const string& file_name, string& error) {
+		ifstream file(file_name);
+		if (!file) { error = "cannot open file"; return false; }
+		size = 0;
+		lattice.clear();
+		for (string line; getline(file, line);) {
+			line = line.substr(0, line.find('#'));
+			istringstream fields(line);
+			string keyword;
+			if (!(fields >> keyword)) continue;
+			if (keyword == "TITLE") {
+				size_t open = line.find('"'), close = line.rfind('"');
+				title = (open != string::npos && close > open) ? line.substr(open + 1, close - open - 1) : "";
+			}
+			else if (keyword == "LUT_1D_SIZE") { error = "1-D .cube files are not supported, use a curve"; return false; }
+			else if (keyword == "LUT_3D_SIZE") {
+				fields >> size;
+				if (size < 2 || size > 256) { error = "invalid LUT_3D_SIZE"; return false; }
+				lattice.reserve((size_t)size * size * size * 3);
+			}
+			else if (keyword == "DOMAIN_MIN") fields >> domain_min[0] >> domain_min[1] >> domain_min[2];
+			else if (keyword == "DOMAIN_MAX") fields >> domain_max[0] >> domain_max[1] >> domain_max[2];
+			else if (isdigit((unsigned char)keyword[0]) || keyword[0] == '-' || keyword[0] == '.') {
+				if (size == 0) { error = "lattice before LUT_3D_SIZE"; return false; }
+				float value[3];
+				istringstream row(line);
+				if (!(row >> value[0] >> value[1] >> value[2])) { error = "invalid lattice row"; return false; }
+				for (int k = 0; k < 3; k++)
+					lattice.push_back((cl_ushort)lround(min(max(value[k], 0.f), 1.f) * 65535.f));
+			}
+		}
+		if (size == 0 || lattice.size() != (size_t)size * size * size * 3) { error = "incomplete lattice"; return false; }
+		for (int k = 0; k < 3; k++)
+			if (domain_max[k] <= domain_min[k]) { error = "empty domain"; return false; }
+		return true;
+	}
+
+	//lattice as RGBA texels for a CL_RGBA / CL_UNORM_INT16 Image3D
+	vector<cl_ushort> Rgba() const {
+		size_t points = (size_t)size * size * size;
+		vector<cl_ushort> texels(points * 4, 65535);
+		for (size_t i = 0; i < points; i++)
+			for (int k = 0; k < 3; k++)
+				texels[i * 4 + k] = lattice[i * 3 + k];
+		return texels;
+	}
+};
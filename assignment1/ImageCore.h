@@ -0,0 +1,965 @@
+#pragma once
+
+#include <list>
+#include <array>
+#include "Utils.h"
+#include "ColourLut.h"
+
+//planar image kept in a device buffer between processing stages: channel c starts at sample c * width * height,
+//samples are ushort for 16-bit images and uchar for 8-bit ones
+struct DeviceImage {
+	cl::Buffer buffer;
+	int width = 0, height = 0, channels = 0;
+	int bits = 16;
+
+	size_t Pixels() const { return (size_t)width * height; }
+	size_t Samples() const { return Pixels() * channels; }
+	size_t Bytes() const { return Samples() * (bits == 8 ? sizeof(cl_uchar) : sizeof(cl_ushort)); }
+};
+
+//limits of ImageCore::Threshold: thresholds per channel and threshold sets scored (bins^thresholds)
+const int OTSU_MAX_THRESHOLDS = 3;
+const size_t OTSU_MAX_CANDIDATES = 1 << 24;
+
+//colour grade of ImageCore::Grade: a 1-D tone curve applied to every channel (65536 entries, none if empty) and a
+//3-D colour LUT applied to the first three channels (none if null), interpolated and staged as the CUBE_ constants
+struct GradeSpec {
+	vector<cl_ushort> curve;
+	const ColourCube* cube = nullptr;
+	int interpolation = CUBE_TRILINEAR;
+	int staging = CUBE_STAGING_AUTO;
+};
+
+//limits of ImageCore::Quantise: palette entries (cached in local memory) and bits per channel of the joint histogram
+const int QUANTISE_MAX_COLOURS = 256;
+const int QUANTISE_MAX_BITS = 6;
+
+//hysteresis launches of ImageCore::Canny enqueued between two reads of the convergence flag
+const int CANNY_BATCH = 8;
+
+//largest radius of ImageCore::Bilateral, whose weight tables live in constant memory; BilateralGrid takes any radius
+const int BILATERAL_MAX_RADIUS = 16;
+
+//smallest spatial cell [px] of ImageCore::BilateralGrid, so small radii do not give grids larger than the image
+const int BILATERAL_GRID_MIN_CELL = 4;
+
+//methods of ImageCore::Convolve with masks of any size: AUTO takes ImageCore::ConvolveMethod's choice
+const int CONVOLVE_AUTO = 0;
+const int CONVOLVE_DIRECT = 1;
+const int CONVOLVE_SEPARABLE = 2;
+const int CONVOLVE_FFT = 3;
+//taps from which a mask that is not separable is convolved through the FFT (direct convolution slows down beyond ~15x15)
+const int CONVOLVE_FFT_TAPS = 15 * 15;
+
+//3x3 masks for ImageCore::Convolve, row-major
+const float MASK_BOX_BLUR[9] = { 1.f / 9, 1.f / 9, 1.f / 9, 1.f / 9, 1.f / 9, 1.f / 9, 1.f / 9, 1.f / 9, 1.f / 9 };
+const float MASK_GAUSSIAN[9] = { 1.f / 16, 2.f / 16, 1.f / 16, 2.f / 16, 4.f / 16, 2.f / 16, 1.f / 16, 2.f / 16, 1.f / 16 };
+const float MASK_SHARPEN[9] = { 0.f, -1.f, 0.f, -1.f, 5.f, -1.f, 0.f, -1.f, 0.f };
+
+//mask of a command-line spec for ImageCore::Convolve, row-major: box:N (N x N box), gaussian:S (Gaussian of sigma S,
+//2 * ceil(3S) + 1 wide), disk:R (disk of radius R, not separable) or file:PATH (width and height, then the values row
+//by row); false if the spec or the file is invalid. sizes are odd, so every mask has a centre
+inline bool ParseMask(const string& spec, vector<float>& mask, int& width, int& height) {
+	mask.clear();
+	if (spec.compare(0, 4, "box:") == 0) {
+		width = height = atoi(spec.c_str() + 4);
+		if (width < 1 || width % 2 == 0) return false;
+		mask.assign(width * height, 1.f / (width * height));
+	}
+	else if (spec.compare(0, 9, "gaussian:") == 0) {
+		float sigma = (float)atof(spec.c_str() + 9);
+		if (sigma <= 0) return false;
+		int radius = (int)ceil(3 * sigma);
+		width = height = 2 * radius + 1;
+		for (int j = -radius; j <= radius; j++)
+			for (int i = -radius; i <= radius; i++)
+				mask.push_back(exp(-(i * i + j * j) / (2 * sigma * sigma)));
+	}
+	else if (spec.compare(0, 5, "disk:") == 0) {
+		int radius = atoi(spec.c_str() + 5);
+		if (radius < 0) return false;
+		width = height = 2 * radius + 1;
+		for (int j = -radius; j <= radius; j++)
+			for (int i = -radius; i <= radius; i++)
+				mask.push_back(i * i + j * j <= radius * radius ? 1.f : 0.f);
+	}
+	else if (spec.compare(0, 5, "file:") == 0) {
+		ifstream file(spec.substr(5));
+		if (!(file >> width >> height) || width < 1 || height < 1 || width % 2 == 0 || height % 2 == 0) return false;
+		mask.resize(width * height);
+		for (float& value : mask)
+			if (!(file >> value)) return false;
+		return true;
+	}
+	else return false;
+	//box, gaussian and disk masks are normalised to keep the brightness
+	float sum = 0;
+	for (float value : mask) sum += value;
+	for (float& value : mask) value /= sum;
+	return true;
+}
+
+//image-processing stages that take and return DeviceImage handles, so a chain of them (e.g. greyscale, smoothing
+//and equalisation) runs without host round trips: only Upload and Download move pixels between host and device.
+//the stages are enqueued on one in-order queue and nothing waits for them until Download.
+//on a profiling queue the device time of every stage and the transferred bytes are collected for Report
+class ImageCore {
+public:
+	ImageCore(const cl::Context& context, const cl::CommandQueue& queue, const string& kernel_file = "kernels/my_kernels.cl")
+		: context(context), queue(queue) {
+		profiling = (queue.getInfo<CL_QUEUE_PROPERTIES>() & CL_QUEUE_PROFILING_ENABLE) != 0;
+		cl::Program::Sources sources;
+		AddSources(sources, kernel_file);
+		program = cl::Program(context, sources);
+		try {
+			program.build();
+		}
+		catch (const cl::Error& err) {
+			cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+			std::cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(device) << std::endl;
+			std::cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << std::endl;
+			throw err;
+		}
+	}
+
+	//copies a planar 8- or 16-bit host image to the device, at its own depth so 8-bit images cross the bus at one byte per sample
+	DeviceImage Upload(const void* data, int width, int height, int channels, int bits) {
+		DeviceImage image = Allocate(width, height, channels, bits);
+		queue.enqueueWriteBuffer(image.buffer, CL_TRUE, 0, image.Bytes(), data, nullptr, StageEvent("upload"));
+		uploaded += image.Bytes();
+		return image;
+	}
+
+	//copies the image back to the host, image.Bytes() bytes; waits for every stage enqueued before it
+	void Download(const DeviceImage& image, void* data) {
+		queue.enqueueReadBuffer(image.buffer, CL_TRUE, 0, image.Bytes(), data, nullptr, StageEvent("download"));
+		downloaded += image.Bytes();
+	}
+
+	DeviceImage Convert(const DeviceImage& image, int bits) {
+		if (image.bits == bits) return image;
+		DeviceImage output = Allocate(image.width, image.height, image.channels, bits);
+		cl::Kernel kernel(program, bits == 16 ? "widen_8_to_16" : "narrow_16_to_8");
+		kernel.setArg(0, image.buffer);
+		kernel.setArg(1, output.buffer);
+		queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(image.Samples()), cl::NullRange, nullptr, StageEvent("convert"));
+		return output;
+	}
+
+	//luma of the first three channels; images with fewer channels are already grey and returned as they are
+	DeviceImage ToGrey(const DeviceImage& image) {
+		if (image.channels < 3) return image;
+		DeviceImage input = Convert(image, 16);
+		DeviceImage output = Allocate(input.width, input.height, 1, 16);
+		cl::Kernel kernel(program, "rgb2grey_planar");
+		kernel.setArg(0, input.buffer);
+		kernel.setArg(1, output.buffer);
+		queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(input.width, input.height), cl::NullRange, nullptr, StageEvent("grey"));
+		return output;
+	}
+
+	//3x3 convolution of every channel, edges repeated
+	DeviceImage Convolve(const DeviceImage& image, const float mask[9]) {
+		DeviceImage input = Convert(image, 16);
+		DeviceImage output = Allocate(input.width, input.height, input.channels, 16);
+		cl::Buffer dev_mask = TrackedBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, 9 * sizeof(float), "dev_mask", (void*)mask);
+		cl::Kernel kernel(program, "convolution3x3");
+		kernel.setArg(0, input.buffer);
+		kernel.setArg(1, output.buffer);
+		kernel.setArg(2, dev_mask);
+		queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(input.width, input.height, input.channels), cl::NullRange,
+			nullptr, StageEvent("convolve"));
+		return output;
+	}
+
+	//convolution of every channel with a mask_width x mask_height mask (odd sizes, row-major), edges repeated: direct
+	//(convolution2d), as a row and a column pass for separable masks (convolution_rows/cols), or through 2-D FFTs of the
+	//padded image (ConvolveFFT). CONVOLVE_AUTO picks the method with ConvolveMethod
+	DeviceImage Convolve(const DeviceImage& image, const vector<float>& mask, int mask_width, int mask_height, int method = CONVOLVE_AUTO) {
+		if (method == CONVOLVE_AUTO) method = ConvolveMethod(image, mask, mask_width, mask_height);
+		DeviceImage input = Convert(image, 16);
+		DeviceImage output = Allocate(input.width, input.height, input.channels, 16);
+		cl::NDRange image_range(input.width, input.height, input.channels);
+		if (method == CONVOLVE_FFT) {
+			if (!FftFits(input, mask_width, mask_height))
+				throw cl::Error(CL_OUT_OF_RESOURCES, "FFT rows of the padded image larger than the device's local memory");
+			ConvolveFFT(input, output, mask, mask_width, mask_height);
+		}
+		else if (method == CONVOLVE_SEPARABLE) {
+			vector<float> row, column;
+			if (!SeparateMask(mask, mask_width, mask_height, row, column))
+				throw cl::Error(CL_INVALID_VALUE, "mask is not separable");
+			cl::Buffer dev_row = TrackedBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, row.size() * sizeof(float), "dev_mask", row.data());
+			cl::Buffer dev_column = TrackedBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, column.size() * sizeof(float), "dev_mask", column.data());
+			cl::Buffer dev_rows = TrackedBuffer(context, CL_MEM_READ_WRITE, input.Samples() * sizeof(cl_float), "dev_convolve_rows");
+			cl::Kernel rows_kernel(program, "convolution_rows");
+			rows_kernel.setArg(0, input.buffer);
+			rows_kernel.setArg(1, dev_rows);
+			rows_kernel.setArg(2, input.width);
+			rows_kernel.setArg(3, input.height);
+			rows_kernel.setArg(4, dev_row);
+			rows_kernel.setArg(5, mask_width / 2);
+			cl::Kernel cols_kernel(program, "convolution_cols");
+			cols_kernel.setArg(0, dev_rows);
+			cols_kernel.setArg(1, output.buffer);
+			cols_kernel.setArg(2, input.width);
+			cols_kernel.setArg(3, input.height);
+			cols_kernel.setArg(4, dev_column);
+			cols_kernel.setArg(5, mask_height / 2);
+			queue.enqueueNDRangeKernel(rows_kernel, cl::NullRange, image_range, cl::NullRange, nullptr, StageEvent("convolve"));
+			queue.enqueueNDRangeKernel(cols_kernel, cl::NullRange, image_range, cl::NullRange, nullptr, StageEvent("convolve"));
+		}
+		else {
+			if (!ConstantFits(mask.size() * sizeof(float)))
+				throw cl::Error(CL_OUT_OF_RESOURCES, "mask larger than the device's constant memory, use a separable mask or the FFT");
+			cl::Buffer dev_mask = TrackedBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, mask.size() * sizeof(float), "dev_mask", (void*)mask.data());
+			cl::Kernel kernel(program, "convolution2d");
+			kernel.setArg(0, input.buffer);
+			kernel.setArg(1, output.buffer);
+			kernel.setArg(2, input.width);
+			kernel.setArg(3, input.height);
+			kernel.setArg(4, dev_mask);
+			kernel.setArg(5, mask_width);
+			kernel.setArg(6, mask_height);
+			queue.enqueueNDRangeKernel(kernel, cl::NullRange, image_range, cl::NullRange, nullptr, StageEvent("convolve"));
+		}
+		return output;
+	}
+
+	//method CONVOLVE_AUTO uses for a mask: separable masks (rank 1) take two 1-D passes, other masks of fewer than
+	//CONVOLVE_FFT_TAPS taps the direct kernel, and larger ones the FFT when its padded rows fit local memory. a mask
+	//that fits neither the FFT nor constant memory gets CONVOLVE_DIRECT, which then throws
+	int ConvolveMethod(const DeviceImage& image, const vector<float>& mask, int mask_width, int mask_height) {
+		vector<float> row, column;
+		if (SeparateMask(mask, mask_width, mask_height, row, column)) return CONVOLVE_SEPARABLE;
+		bool direct_fits = ConstantFits(mask.size() * sizeof(float));
+		if (mask_width * mask_height < CONVOLVE_FFT_TAPS && direct_fits) return CONVOLVE_DIRECT;
+		if (FftFits(image, mask_width, mask_height)) return CONVOLVE_FFT;
+		return CONVOLVE_DIRECT;
+	}
+
+	//histogram equalisation of every channel with the given number of bins (hist_local, scan_lookback, normalize_lut
+	//and back_project). channel c is addressed as the region starting at row c * height of a width-wide image
+	DeviceImage Equalise(const DeviceImage& image, int bins) {
+		return Equalise(image, bins, vector<cl_int>(), vector<array<int, 4>>());
+	}
+
+	//equalisation of an image whose histograms are partly known, e.g. a region of a tile container (TileStore.h):
+	//the histogram of channel c starts from base_histograms[c * bins] and only the regions (x, y, w, h) are counted
+	//on top of it. without base histograms the whole image is counted and regions is ignored
+	DeviceImage Equalise(const DeviceImage& image, int bins, const vector<cl_int>& base_histograms, const vector<array<int, 4>>& regions) {
+		DeviceImage input = Convert(image, 16);
+		DeviceImage output = Allocate(input.width, input.height, input.channels, 16);
+		HistogramPass pass = MakeHistogramPass(input, bins);
+		cl::Buffer dev_lut = TrackedBuffer(context, CL_MEM_READ_WRITE, 65536 * sizeof(cl_ushort), "dev_lut");
+		cl::Kernel lut_kernel(program, "normalize_lut");
+		lut_kernel.setArg(0, pass.cum_histogram);
+		lut_kernel.setArg(1, dev_lut);
+		lut_kernel.setArg(2, 65535.0f / input.Pixels());
+		lut_kernel.setArg(3, bins);
+		cl::Kernel backproject_kernel = MakeBackProject(input, output, dev_lut);
+
+		for (int c = 0; c < input.channels; c++) {
+			RunHistogramPass(pass, input, c, base_histograms.empty() ? nullptr : &base_histograms[(size_t)c * bins], regions);
+			queue.enqueueNDRangeKernel(lut_kernel, cl::NullRange, cl::NDRange(65536), cl::NullRange, nullptr, StageEvent("lut"));
+			backproject_kernel.setArg(7, c * input.height);
+			queue.enqueueNDRangeKernel(backproject_kernel, cl::NullRange, pass.global_shape, pass.local_shape, nullptr, StageEvent("back_project"));
+		}
+		return output;
+	}
+
+	//Otsu thresholding of every channel into levels evenly spaced grey levels (2 for a binary image, at most
+	//OTSU_MAX_THRESHOLDS + 1). the thresholds maximise the between-class variance of the channel's bins-bin histogram:
+	//every candidate set of thresholds is scored in parallel from the histogram's scans (otsu_candidates), the best
+	//is found by a reduction (otsu_select) and applied through a LUT and back_project, without reading anything back.
+	//bins^(levels - 1) must not exceed OTSU_MAX_CANDIDATES and bins must be at least levels
+	DeviceImage Threshold(const DeviceImage& image, int bins, int levels = 2) {
+		const size_t local_size = 256;
+		int thresholds = levels - 1;
+		size_t candidates = OtsuCandidates(bins, levels);
+		if (candidates == 0)
+			throw cl::Error(CL_INVALID_VALUE, "Otsu thresholding takes 2 to OTSU_MAX_THRESHOLDS + 1 levels");
+		if ((bins < levels) || (candidates > OTSU_MAX_CANDIDATES))
+			throw cl::Error(CL_INVALID_VALUE, "Otsu thresholding needs at least levels bins and at most OTSU_MAX_CANDIDATES threshold sets");
+		size_t groups = min((candidates + local_size - 1) / local_size, (size_t)1024);
+		DeviceImage input = Convert(image, 16);
+		DeviceImage output = Allocate(input.width, input.height, input.channels, 16);
+		HistogramPass pass = MakeHistogramPass(input, bins);
+		cl::Buffer dev_moment = TrackedBuffer(context, CL_MEM_READ_WRITE, bins * sizeof(cl_long), "dev_moment");
+		cl::Buffer dev_group_score = TrackedBuffer(context, CL_MEM_READ_WRITE, groups * sizeof(cl_long), "dev_otsu_groups");
+		cl::Buffer dev_group_id = TrackedBuffer(context, CL_MEM_READ_WRITE, groups * sizeof(cl_int), "dev_otsu_groups");
+		cl::Buffer dev_best = TrackedBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_int), "dev_otsu_best");
+		cl::Buffer dev_lut = TrackedBuffer(context, CL_MEM_READ_WRITE, 65536 * sizeof(cl_ushort), "dev_lut");
+
+		cl::Kernel moment_kernel(program, "scan_moment");
+		moment_kernel.setArg(0, pass.histogram);
+		moment_kernel.setArg(1, dev_moment);
+		moment_kernel.setArg(2, bins);
+		moment_kernel.setArg(3, cl::Local(local_size * sizeof(cl_long)));
+		cl::Kernel candidate_kernel(program, "otsu_candidates");
+		candidate_kernel.setArg(0, pass.cum_histogram);
+		candidate_kernel.setArg(1, dev_moment);
+		candidate_kernel.setArg(2, bins);
+		candidate_kernel.setArg(3, thresholds);
+		candidate_kernel.setArg(4, (cl_int)candidates);
+		candidate_kernel.setArg(5, cl::Local(local_size * sizeof(cl_long)));
+		candidate_kernel.setArg(6, cl::Local(local_size * sizeof(cl_int)));
+		candidate_kernel.setArg(7, dev_group_score);
+		candidate_kernel.setArg(8, dev_group_id);
+		cl::Kernel select_kernel(program, "otsu_select");
+		select_kernel.setArg(0, dev_group_score);
+		select_kernel.setArg(1, dev_group_id);
+		select_kernel.setArg(2, (cl_int)groups);
+		select_kernel.setArg(3, cl::Local(local_size * sizeof(cl_long)));
+		select_kernel.setArg(4, cl::Local(local_size * sizeof(cl_int)));
+		select_kernel.setArg(5, dev_best);
+		cl::Kernel lut_kernel(program, "threshold_lut");
+		lut_kernel.setArg(0, dev_best);
+		lut_kernel.setArg(1, dev_lut);
+		lut_kernel.setArg(2, bins);
+		lut_kernel.setArg(3, thresholds);
+		cl::Kernel backproject_kernel = MakeBackProject(input, output, dev_lut);
+
+		for (int c = 0; c < input.channels; c++) {
+			RunHistogramPass(pass, input, c, nullptr, vector<array<int, 4>>());
+			queue.enqueueNDRangeKernel(moment_kernel, cl::NullRange, cl::NDRange(local_size), cl::NDRange(local_size), nullptr, StageEvent("scan"));
+			queue.enqueueNDRangeKernel(candidate_kernel, cl::NullRange, cl::NDRange(groups * local_size), cl::NDRange(local_size),
+				nullptr, StageEvent("otsu"));
+			queue.enqueueNDRangeKernel(select_kernel, cl::NullRange, cl::NDRange(local_size), cl::NDRange(local_size), nullptr, StageEvent("otsu"));
+			queue.enqueueNDRangeKernel(lut_kernel, cl::NullRange, cl::NDRange(65536), cl::NullRange, nullptr, StageEvent("lut"));
+			backproject_kernel.setArg(7, c * input.height);
+			queue.enqueueNDRangeKernel(backproject_kernel, cl::NullRange, pass.global_shape, pass.local_shape, nullptr, StageEvent("back_project"));
+		}
+		return output;
+	}
+
+	//LUT engine: every channel goes through its own 65536-entry LUT, the equalisation LUT of its equalise_bins-bin
+	//histogram (identity when equalise_bins is 0) with spec.curve composed after it, then with a cube and at least
+	//three channels the first three go through the colour cube (apply_cube_image or apply_cube_local). the curve is
+	//folded into the LUTs and the cube kernel reads them itself, so equalisation and grading are one pass over the pixels
+	DeviceImage Grade(const DeviceImage& image, const GradeSpec& spec, int equalise_bins = 0) {
+		DeviceImage input = Convert(image, 16);
+		DeviceImage output = Allocate(input.width, input.height, input.channels, 16);
+		cl::Buffer dev_luts = TrackedBuffer(context, CL_MEM_READ_WRITE, input.channels * 65536 * sizeof(cl_ushort), "dev_lut");
+		vector<cl::Buffer> dev_lut(input.channels);
+		for (int c = 0; c < input.channels; c++) {
+			cl_buffer_region segment = { c * 65536 * sizeof(cl_ushort), 65536 * sizeof(cl_ushort) };
+			dev_lut[c] = dev_luts.createSubBuffer(CL_MEM_READ_WRITE, CL_BUFFER_CREATE_TYPE_REGION, &segment);
+		}
+
+		if (equalise_bins > 0) {
+			HistogramPass pass = MakeHistogramPass(input, equalise_bins);
+			cl::Kernel lut_kernel(program, "normalize_lut");
+			lut_kernel.setArg(0, pass.cum_histogram);
+			lut_kernel.setArg(2, 65535.0f / input.Pixels());
+			lut_kernel.setArg(3, equalise_bins);
+			for (int c = 0; c < input.channels; c++) {
+				RunHistogramPass(pass, input, c, nullptr, vector<array<int, 4>>());
+				lut_kernel.setArg(1, dev_lut[c]);
+				queue.enqueueNDRangeKernel(lut_kernel, cl::NullRange, cl::NDRange(65536), cl::NullRange, nullptr, StageEvent("lut"));
+			}
+		} else {
+			vector<cl_ushort> identity(input.channels * 65536);
+			for (size_t i = 0; i < identity.size(); i++)
+				identity[i] = (cl_ushort)i;
+			queue.enqueueWriteBuffer(dev_luts, CL_TRUE, 0, identity.size() * sizeof(cl_ushort), identity.data(), nullptr, StageEvent("lut"));
+		}
+		if (!spec.curve.empty()) {
+			cl::Buffer dev_curve = TrackedBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, 65536 * sizeof(cl_ushort), "dev_curve",
+				(void*)spec.curve.data());
+			cl::Kernel compose_kernel(program, "compose_lut");
+			compose_kernel.setArg(0, dev_luts);
+			compose_kernel.setArg(1, dev_curve);
+			queue.enqueueNDRangeKernel(compose_kernel, cl::NullRange, cl::NDRange(input.channels * 65536), cl::NullRange, nullptr, StageEvent("lut"));
+		}
+
+		int first = 0; //first channel left to back_project
+		if (spec.cube && input.channels >= 3) {
+			ApplyCube(input, output, dev_luts, spec);
+			first = 3;
+		}
+		for (int c = first; c < input.channels; c++) {
+			cl::Kernel backproject_kernel = MakeBackProject(input, output, dev_lut[c]);
+			backproject_kernel.setArg(7, c * input.height);
+			cl::NDRange local_shape = HistogramShape(backproject_kernel, input.width, input.height);
+			queue.enqueueNDRangeKernel(backproject_kernel, cl::NullRange, cl::NDRange(RoundUp(input.width, local_shape[0]), RoundUp(input.height, local_shape[1])),
+				local_shape, nullptr, StageEvent("back_project"));
+		}
+		return output;
+	}
+
+	//colour quantisation of the first three channels to a palette of colours entries (at most QUANTISE_MAX_COLOURS),
+	//all on the device: a joint histogram of the colours reduced to bits bits per channel (hist_rgb, 2^(3 bits) bins,
+	//counted in windows that fit local memory), palette entries seeded at weighted quantiles of the histogram
+	//(scan_lookback, palette_seed), iterations k-means steps over the histogram bins rather than the pixels
+	//(palette_assign, palette_update) and the mapping of every pixel to its nearest entry (palette_map). channels after
+	//the third are copied, images with fewer than three are returned as they are. with palette, the entries (normalised
+	//RGB, w unused) are read back once the mapping is done
+	DeviceImage Quantise(const DeviceImage& image, int colours, int bits = 5, int iterations = 8, vector<cl_float4>* palette = nullptr) {
+		const size_t local_size = 256;
+		if ((colours < 1) || (colours > QUANTISE_MAX_COLOURS))
+			throw cl::Error(CL_INVALID_VALUE, "quantisation takes 1 to QUANTISE_MAX_COLOURS colours");
+		if ((bits < 1) || (bits > QUANTISE_MAX_BITS))
+			throw cl::Error(CL_INVALID_VALUE, "quantisation takes 1 to QUANTISE_MAX_BITS bits per channel");
+		if (image.channels < 3) return image;
+		DeviceImage input = Convert(image, 16);
+		DeviceImage output = Allocate(input.width, input.height, input.channels, 16);
+		int bins = 1 << (3 * bits);
+		cl_int pixels = (cl_int)input.Pixels();
+		cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+		int window_bins = bins; //largest power of two of int counters that fits local memory, leaving some for the runtime
+		while (window_bins * sizeof(cl_int) + 1024 > device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>())
+			window_bins /= 2;
+		size_t groups = min((size_t)device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * 4, (input.Pixels() + local_size - 1) / local_size);
+
+		HistogramPass pass = MakeScanPass(bins);
+		cl::Buffer dev_palette = TrackedBuffer(context, CL_MEM_READ_WRITE, colours * sizeof(cl_float4), "dev_palette");
+		cl::Buffer dev_assignment = TrackedBuffer(context, CL_MEM_READ_WRITE, bins * sizeof(cl_int), "dev_assignment");
+		cl::Kernel hist_kernel(program, "hist_rgb");
+		hist_kernel.setArg(0, input.buffer);
+		hist_kernel.setArg(1, pass.histogram);
+		hist_kernel.setArg(2, pixels);
+		hist_kernel.setArg(3, bits);
+		hist_kernel.setArg(5, window_bins);
+		hist_kernel.setArg(6, cl::Local(window_bins * sizeof(cl_int)));
+		cl::Kernel seed_kernel(program, "palette_seed");
+		seed_kernel.setArg(0, pass.cum_histogram);
+		seed_kernel.setArg(1, bins);
+		seed_kernel.setArg(2, bits);
+		seed_kernel.setArg(3, colours);
+		seed_kernel.setArg(4, dev_palette);
+		cl::Kernel assign_kernel(program, "palette_assign");
+		assign_kernel.setArg(0, pass.histogram);
+		assign_kernel.setArg(1, bins);
+		assign_kernel.setArg(2, bits);
+		assign_kernel.setArg(3, dev_palette);
+		assign_kernel.setArg(4, colours);
+		assign_kernel.setArg(5, cl::Local(colours * sizeof(cl_float4)));
+		assign_kernel.setArg(6, dev_assignment);
+		cl::Kernel update_kernel(program, "palette_update");
+		update_kernel.setArg(0, pass.histogram);
+		update_kernel.setArg(1, dev_assignment);
+		update_kernel.setArg(2, bins);
+		update_kernel.setArg(3, bits);
+		update_kernel.setArg(4, dev_palette);
+		update_kernel.setArg(5, cl::Local(local_size * sizeof(cl_float4)));
+		cl::Kernel map_kernel(program, "palette_map");
+		map_kernel.setArg(0, input.buffer);
+		map_kernel.setArg(1, output.buffer);
+		map_kernel.setArg(2, pixels);
+		map_kernel.setArg(3, dev_palette);
+		map_kernel.setArg(4, colours);
+		map_kernel.setArg(5, cl::Local(colours * sizeof(cl_float4)));
+
+		queue.enqueueFillBuffer(pass.histogram, (cl_int)0, 0, bins * sizeof(cl_int));
+		for (int window = 0; window < bins; window += window_bins) {
+			hist_kernel.setArg(4, window);
+			queue.enqueueNDRangeKernel(hist_kernel, cl::NullRange, cl::NDRange(groups * local_size), cl::NDRange(local_size), nullptr, StageEvent("histogram"));
+		}
+		RunScan(pass);
+		queue.enqueueNDRangeKernel(seed_kernel, cl::NullRange, cl::NDRange(bins), cl::NullRange, nullptr, StageEvent("palette"));
+		for (int i = 0; i < iterations; i++) {
+			queue.enqueueNDRangeKernel(assign_kernel, cl::NullRange, cl::NDRange(RoundUp(bins, local_size)), cl::NDRange(local_size), nullptr, StageEvent("palette"));
+			queue.enqueueNDRangeKernel(update_kernel, cl::NullRange, cl::NDRange(colours * local_size), cl::NDRange(local_size), nullptr, StageEvent("palette"));
+		}
+		queue.enqueueNDRangeKernel(map_kernel, cl::NullRange, cl::NDRange(RoundUp(input.Pixels(), local_size)), cl::NDRange(local_size),
+			nullptr, StageEvent("quantise"));
+		if (input.channels > 3)
+			queue.enqueueCopyBuffer(input.buffer, output.buffer, 3 * input.Pixels() * sizeof(cl_ushort), 3 * input.Pixels() * sizeof(cl_ushort),
+				(input.channels - 3) * input.Pixels() * sizeof(cl_ushort), nullptr, StageEvent("quantise"));
+		if (palette) {
+			palette->resize(colours);
+			queue.enqueueReadBuffer(dev_palette, CL_TRUE, 0, colours * sizeof(cl_float4), palette->data());
+		}
+		return output;
+	}
+
+	//Canny edge map of the image's luma (ToGrey): one channel, 65535 on edges and 0 elsewhere. gradient_tile computes
+	//the Sobel (or Scharr) gradient from one local tile per work-group, nonmax_suppress thins it and splits it at the
+	//thresholds low and high (fractions of a full-scale step) into weak and strong edges, and hysteresis_tile promotes
+	//weak pixels connected to strong ones until nothing changes. hysteresis runs in batches of CANNY_BATCH launches
+	//chained by convergence flags on the device, so the host reads one flag per batch rather than per iteration
+	DeviceImage Canny(const DeviceImage& image, float low, float high, bool scharr = false) {
+		const int tile = 16; //CANNY_TILE of the kernels
+		DeviceImage input = Convert(ToGrey(image), 16);
+		DeviceImage output = Allocate(input.width, input.height, 1, 16);
+		cl::NDRange local_shape(tile, tile);
+		cl::NDRange global_shape(RoundUp(input.width, tile), RoundUp(input.height, tile));
+		cl::Buffer dev_magnitude = TrackedBuffer(context, CL_MEM_READ_WRITE, input.Pixels() * sizeof(cl_float), "dev_gradient");
+		cl::Buffer dev_direction = TrackedBuffer(context, CL_MEM_READ_WRITE, input.Pixels() * sizeof(cl_uchar), "dev_gradient");
+		cl::Buffer dev_state = TrackedBuffer(context, CL_MEM_READ_WRITE, input.Pixels() * sizeof(cl_uchar), "dev_edge_state");
+		cl::Buffer dev_flags = TrackedBuffer(context, CL_MEM_READ_WRITE, (CANNY_BATCH + 1) * sizeof(cl_int), "dev_edge_flags");
+
+		cl::Kernel gradient_kernel(program, "gradient_tile");
+		gradient_kernel.setArg(0, input.buffer);
+		gradient_kernel.setArg(1, dev_magnitude);
+		gradient_kernel.setArg(2, dev_direction);
+		gradient_kernel.setArg(3, input.width);
+		gradient_kernel.setArg(4, input.height);
+		gradient_kernel.setArg(5, (cl_int)scharr);
+		cl::Kernel nonmax_kernel(program, "nonmax_suppress");
+		nonmax_kernel.setArg(0, dev_magnitude);
+		nonmax_kernel.setArg(1, dev_direction);
+		nonmax_kernel.setArg(2, dev_state);
+		nonmax_kernel.setArg(3, input.width);
+		nonmax_kernel.setArg(4, input.height);
+		nonmax_kernel.setArg(5, low);
+		nonmax_kernel.setArg(6, high);
+		cl::Kernel hysteresis_kernel(program, "hysteresis_tile");
+		hysteresis_kernel.setArg(0, dev_state);
+		hysteresis_kernel.setArg(1, input.width);
+		hysteresis_kernel.setArg(2, input.height);
+		hysteresis_kernel.setArg(3, dev_flags);
+		cl::Kernel edge_kernel(program, "edge_map");
+		edge_kernel.setArg(0, dev_state);
+		edge_kernel.setArg(1, output.buffer);
+
+		queue.enqueueNDRangeKernel(gradient_kernel, cl::NullRange, global_shape, local_shape, nullptr, StageEvent("gradient"));
+		queue.enqueueNDRangeKernel(nonmax_kernel, cl::NullRange, global_shape, local_shape, nullptr, StageEvent("nonmax"));
+		vector<cl_int> flags(CANNY_BATCH + 1, 0);
+		for (cl_int converged = 0; !converged;) {
+			flags[0] = 1;
+			queue.enqueueWriteBuffer(dev_flags, CL_FALSE, 0, flags.size() * sizeof(cl_int), flags.data());
+			for (int pass = 0; pass < CANNY_BATCH; pass++) {
+				hysteresis_kernel.setArg(4, pass);
+				queue.enqueueNDRangeKernel(hysteresis_kernel, cl::NullRange, global_shape, local_shape, nullptr, StageEvent("hysteresis"));
+			}
+			cl_int last = 0;
+			queue.enqueueReadBuffer(dev_flags, CL_TRUE, CANNY_BATCH * sizeof(cl_int), sizeof(cl_int), &last);
+			converged = !last;
+		}
+		queue.enqueueNDRangeKernel(edge_kernel, cl::NullRange, cl::NDRange(input.Pixels()), cl::NullRange, nullptr, StageEvent("edges"));
+		return output;
+	}
+
+	//edge-preserving smoothing of every channel by a bilateral filter of the given radius (at most BILATERAL_MAX_RADIUS),
+	//with a Gaussian spatial weight of sigma radius / 2 and a Gaussian range weight of sigma sigma_range (a fraction of
+	//full scale). bilateral_tile computes it exactly, with the neighbourhoods in local memory and the spatial and range
+	//weight tables in constant memory; its cost grows with the square of the radius
+	DeviceImage Bilateral(const DeviceImage& image, int radius, float sigma_range) {
+		const int tile = 16; //BILATERAL_TILE of the kernel
+		const int range_shift = 4; //BILATERAL_RANGE_SHIFT
+		if ((radius < 0) || (radius > BILATERAL_MAX_RADIUS))
+			throw cl::Error(CL_INVALID_VALUE, "bilateral radius outside 0 to BILATERAL_MAX_RADIUS, use BilateralGrid");
+		DeviceImage input = Convert(image, 16);
+		DeviceImage output = Allocate(input.width, input.height, input.channels, 16);
+		int diameter = 2 * radius + 1;
+		float sigma_spatial = max(radius / 2.0f, 0.5f);
+		vector<cl_float> spatial(diameter * diameter), range(65536 >> range_shift);
+		for (int j = 0; j < diameter; j++)
+			for (int i = 0; i < diameter; i++)
+				spatial[j * diameter + i] = exp(-((i - radius) * (i - radius) + (j - radius) * (j - radius)) / (2 * sigma_spatial * sigma_spatial));
+		float sigma_levels = sigma_range * 65535;
+		for (size_t k = 0; k < range.size(); k++) {
+			float difference = k > 0 ? (k + 0.5f) * (1 << range_shift) : 0.f; //middle of the differences sharing the entry
+			range[k] = exp(-difference * difference / (2 * sigma_levels * sigma_levels));
+		}
+		cl::Buffer dev_spatial = TrackedBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, spatial.size() * sizeof(cl_float), "dev_bilateral_weights",
+			spatial.data());
+		cl::Buffer dev_range = TrackedBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, range.size() * sizeof(cl_float), "dev_bilateral_weights",
+			range.data());
+
+		cl::Kernel kernel(program, "bilateral_tile");
+		kernel.setArg(0, input.buffer);
+		kernel.setArg(1, output.buffer);
+		kernel.setArg(2, input.width);
+		kernel.setArg(3, input.height);
+		kernel.setArg(4, radius);
+		kernel.setArg(5, dev_spatial);
+		kernel.setArg(6, dev_range);
+		kernel.setArg(7, cl::Local((tile + 2 * radius) * (tile + 2 * radius) * sizeof(cl_ushort)));
+		queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(RoundUp(input.width, tile), RoundUp(input.height, tile), input.channels),
+			cl::NDRange(tile, tile, 1), nullptr, StageEvent("bilateral"));
+		return output;
+	}
+
+	//fast approximation of Bilateral with the same parameters (any radius) by a bilateral grid: grid_splat, grid_convert,
+	//three grid_blur passes and grid_slice over a grid of cells of radius / 2 pixels (at least BILATERAL_GRID_MIN_CELL)
+	//and sigma_range levels, so its cost barely depends on the radius. smaller radii give finer, larger grids; a grid
+	//larger than the device's largest allocation throws
+	DeviceImage BilateralGrid(const DeviceImage& image, int radius, float sigma_range) {
+		int cell = min(max(radius / 2, BILATERAL_GRID_MIN_CELL), 256);
+		int range_cell = max((int)lround(sigma_range * 65535), 1);
+		int gw = (image.width - 1) / cell + 2, gh = (image.height - 1) / cell + 2, gd = 65535 / range_cell + 2;
+		size_t cells = (size_t)gw * gh * gd * image.channels;
+		cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+		if (cells * sizeof(cl_float2) > device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>())
+			throw cl::Error(CL_OUT_OF_RESOURCES, "bilateral grid larger than the device's largest allocation, raise sigma_range");
+		DeviceImage input = Convert(image, 16);
+		DeviceImage output = Allocate(input.width, input.height, input.channels, 16);
+		cl::Buffer dev_sum = TrackedBuffer(context, CL_MEM_READ_WRITE, cells * sizeof(cl_uint), "dev_grid");
+		cl::Buffer dev_count = TrackedBuffer(context, CL_MEM_READ_WRITE, cells * sizeof(cl_uint), "dev_grid");
+		cl::Buffer dev_grid[2] = { TrackedBuffer(context, CL_MEM_READ_WRITE, cells * sizeof(cl_float2), "dev_grid"),
+			TrackedBuffer(context, CL_MEM_READ_WRITE, cells * sizeof(cl_float2), "dev_grid") };
+		cl::NDRange image_range(input.width, input.height, input.channels);
+
+		cl::Kernel splat_kernel(program, "grid_splat");
+		splat_kernel.setArg(0, input.buffer);
+		splat_kernel.setArg(1, dev_sum);
+		splat_kernel.setArg(2, dev_count);
+		cl::Kernel convert_kernel(program, "grid_convert");
+		convert_kernel.setArg(0, dev_sum);
+		convert_kernel.setArg(1, dev_count);
+		convert_kernel.setArg(2, dev_grid[0]);
+		cl::Kernel blur_kernel(program, "grid_blur");
+		blur_kernel.setArg(2, gw);
+		blur_kernel.setArg(3, gh);
+		blur_kernel.setArg(4, gd);
+		cl::Kernel slice_kernel(program, "grid_slice");
+		slice_kernel.setArg(0, input.buffer);
+		slice_kernel.setArg(1, dev_grid[1]); //after the three blur passes
+		slice_kernel.setArg(2, output.buffer);
+		int dimensions[7] = { input.width, input.height, cell, range_cell, gw, gh, gd };
+		for (int i = 0; i < 7; i++) {
+			splat_kernel.setArg(3 + i, dimensions[i]);
+			slice_kernel.setArg(3 + i, dimensions[i]);
+		}
+
+		queue.enqueueFillBuffer(dev_sum, (cl_uint)0, 0, cells * sizeof(cl_uint));
+		queue.enqueueFillBuffer(dev_count, (cl_uint)0, 0, cells * sizeof(cl_uint));
+		queue.enqueueNDRangeKernel(splat_kernel, cl::NullRange, image_range, cl::NullRange, nullptr, StageEvent("bilateral_grid"));
+		queue.enqueueNDRangeKernel(convert_kernel, cl::NullRange, cl::NDRange(cells), cl::NullRange, nullptr, StageEvent("bilateral_grid"));
+		for (int axis = 0; axis < 3; axis++) {
+			blur_kernel.setArg(0, dev_grid[axis % 2]);
+			blur_kernel.setArg(1, dev_grid[(axis + 1) % 2]);
+			blur_kernel.setArg(5, axis);
+			queue.enqueueNDRangeKernel(blur_kernel, cl::NullRange, cl::NDRange(gw, gh, gd * input.channels), cl::NullRange, nullptr,
+				StageEvent("bilateral_grid"));
+		}
+		queue.enqueueNDRangeKernel(slice_kernel, cl::NullRange, image_range, cl::NullRange, nullptr, StageEvent("bilateral_grid"));
+		return output;
+	}
+
+	//number of threshold sets Threshold scores, bins^(levels - 1), or 0 if levels is out of range
+	static size_t OtsuCandidates(int bins, int levels) {
+		if (levels < 2 || levels > OTSU_MAX_THRESHOLDS + 1) return 0;
+		size_t candidates = 1;
+		for (int i = 1; i < levels; i++) {
+			candidates *= bins;
+			if (candidates > OTSU_MAX_CANDIDATES) return candidates;
+		}
+		return candidates;
+	}
+
+	//device time [s] per stage in order of first use, of the stages enqueued since the last ClearStageTimes; needs a
+	//profiling queue and waits for those stages
+	vector<pair<string, double>> StageTimes() {
+		vector<pair<string, double>> times;
+		for (const auto& entry : events) {
+			size_t i = 0;
+			while (i < times.size() && times[i].first != entry.first) i++;
+			if (i == times.size()) times.emplace_back(entry.first, 0.0);
+			entry.second.wait();
+			times[i].second += (entry.second.getProfilingInfo<CL_PROFILING_COMMAND_END>() -
+				entry.second.getProfilingInfo<CL_PROFILING_COMMAND_START>()) * 1e-9;
+		}
+		return times;
+	}
+
+	void ClearStageTimes() {
+		events.clear();
+	}
+
+	//device time per stage in order of first use and the bytes moved by Upload and Download; needs a profiling queue
+	string Report() {
+		stringstream sstream;
+		sstream << "Stage device time [s]:" << endl;
+		for (const pair<string, double>& stage : StageTimes())
+			sstream << "  " << stage.first << ": " << stage.second << endl;
+		sstream << "Transferred: " << uploaded << " B up, " << downloaded << " B down" << endl;
+		return sstream.str();
+	}
+
+private:
+	//histogram of one channel and its inclusive scan, with the buffers and kernels reused across channels
+	struct HistogramPass {
+		int bins = 0;
+		size_t tiles = 0;
+		cl::Buffer histogram, cum_histogram;
+		cl::Buffer next_tile, tile_flags, tile_aggregates, tile_prefixes;
+		cl::Kernel hist_kernel, scan_kernel;
+		cl::NDRange local_shape, global_shape; //of hist_local over the whole image, also used for back_project
+	};
+
+	static const size_t scan_local_size = 256;
+
+	HistogramPass MakeHistogramPass(const DeviceImage& input, int bins) {
+		HistogramPass pass = MakeScanPass(bins);
+		pass.hist_kernel = cl::Kernel(program, "hist_local");
+		pass.hist_kernel.setArg(0, input.buffer);
+		pass.hist_kernel.setArg(1, pass.histogram);
+		pass.hist_kernel.setArg(2, bins);
+		pass.hist_kernel.setArg(3, cl::Local(bins * sizeof(cl_int)));
+		pass.hist_kernel.setArg(4, input.width);
+		pass.hist_kernel.setArg(5, input.height);
+		pass.hist_kernel.setArg(6, input.width);
+		pass.hist_kernel.setArg(7, 0);
+		pass.hist_kernel.setArg(8, 0);
+		pass.local_shape = HistogramShape(pass.hist_kernel, input.width, input.height);
+		pass.global_shape = cl::NDRange(RoundUp(input.width, pass.local_shape[0]), RoundUp(input.height, pass.local_shape[1]));
+		return pass;
+	}
+
+	//the histogram buffers and the scan of a pass without hist_local, for histograms counted by other kernels
+	HistogramPass MakeScanPass(int bins) {
+		HistogramPass pass;
+		pass.bins = bins;
+		pass.tiles = (bins + scan_local_size - 1) / scan_local_size;
+		pass.histogram = TrackedBuffer(context, CL_MEM_READ_WRITE, bins * sizeof(cl_int), "dev_histogram");
+		pass.cum_histogram = TrackedBuffer(context, CL_MEM_READ_WRITE, bins * sizeof(cl_int), "dev_cum_histogram");
+		pass.next_tile = TrackedBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_int), "dev_scan_tiles");
+		pass.tile_flags = TrackedBuffer(context, CL_MEM_READ_WRITE, pass.tiles * sizeof(cl_int), "dev_scan_tiles");
+		pass.tile_aggregates = TrackedBuffer(context, CL_MEM_READ_WRITE, pass.tiles * sizeof(cl_int), "dev_scan_tiles");
+		pass.tile_prefixes = TrackedBuffer(context, CL_MEM_READ_WRITE, pass.tiles * sizeof(cl_int), "dev_scan_tiles");
+		pass.scan_kernel = cl::Kernel(program, "scan_lookback");
+		pass.scan_kernel.setArg(0, pass.histogram);
+		pass.scan_kernel.setArg(1, pass.cum_histogram);
+		pass.scan_kernel.setArg(2, bins);
+		pass.scan_kernel.setArg(3, cl::Local(scan_local_size * sizeof(cl_int)));
+		pass.scan_kernel.setArg(4, cl::Local(scan_local_size * sizeof(cl_int)));
+		pass.scan_kernel.setArg(5, pass.next_tile);
+		pass.scan_kernel.setArg(6, pass.tile_flags);
+		pass.scan_kernel.setArg(7, pass.tile_aggregates);
+		pass.scan_kernel.setArg(8, pass.tile_prefixes);
+		return pass;
+	}
+
+	//counts channel c and scans the counts; base and regions as for Equalise, the whole channel without a base
+	void RunHistogramPass(HistogramPass& pass, const DeviceImage& input, int c, const cl_int* base, const vector<array<int, 4>>& regions) {
+		if (!base) {
+			pass.hist_kernel.setArg(8, c * input.height);
+			queue.enqueueFillBuffer(pass.histogram, (cl_int)0, 0, pass.bins * sizeof(cl_int));
+			queue.enqueueNDRangeKernel(pass.hist_kernel, cl::NullRange, pass.global_shape, pass.local_shape, nullptr, StageEvent("histogram"));
+		} else {
+			queue.enqueueWriteBuffer(pass.histogram, CL_TRUE, 0, pass.bins * sizeof(cl_int), base);
+			for (const array<int, 4>& region : regions) {
+				pass.hist_kernel.setArg(4, region[2]);
+				pass.hist_kernel.setArg(5, region[3]);
+				pass.hist_kernel.setArg(7, region[0]);
+				pass.hist_kernel.setArg(8, c * input.height + region[1]);
+				queue.enqueueNDRangeKernel(pass.hist_kernel, cl::NullRange, cl::NDRange(RoundUp(region[2], pass.local_shape[0]), RoundUp(region[3], pass.local_shape[1])),
+					pass.local_shape, nullptr, StageEvent("histogram"));
+			}
+		}
+		RunScan(pass);
+	}
+
+	//inclusive scan of pass.histogram into pass.cum_histogram
+	void RunScan(HistogramPass& pass) {
+		queue.enqueueFillBuffer(pass.next_tile, (cl_int)0, 0, sizeof(cl_int));
+		queue.enqueueFillBuffer(pass.tile_flags, (cl_int)0, 0, pass.tiles * sizeof(cl_int));
+		queue.enqueueNDRangeKernel(pass.scan_kernel, cl::NullRange, cl::NDRange(pass.tiles * scan_local_size), cl::NDRange(scan_local_size),
+			nullptr, StageEvent("scan"));
+	}
+
+	//back_project of the whole of one channel through lut; argument 7 (the channel's first row) is set per channel
+	cl::Kernel MakeBackProject(const DeviceImage& input, const DeviceImage& output, const cl::Buffer& lut) {
+		cl::Kernel kernel(program, "back_project");
+		kernel.setArg(0, input.buffer);
+		kernel.setArg(1, output.buffer);
+		kernel.setArg(2, lut);
+		kernel.setArg(3, input.width);
+		kernel.setArg(4, input.height);
+		kernel.setArg(5, input.width);
+		kernel.setArg(6, 0);
+		return kernel;
+	}
+
+	//the first three channels of input through their LUTs in luts and the colour cube of spec into output. the lattice
+	//goes to an RGBA Image3D (filtered by the texture units) or to local memory, where it has to fit whole
+	void ApplyCube(const DeviceImage& input, const DeviceImage& output, const cl::Buffer& luts, const GradeSpec& spec) {
+		const size_t local_size = 256;
+		const ColourCube& cube = *spec.cube;
+		cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+		bool image_support = device.getInfo<CL_DEVICE_IMAGE_SUPPORT>() != CL_FALSE;
+		size_t lattice_bytes = cube.lattice.size() * sizeof(cl_ushort);
+		int staging = spec.staging;
+		if (staging == CUBE_STAGING_AUTO)
+			staging = image_support ? CUBE_STAGING_IMAGE : CUBE_STAGING_LOCAL;
+		if (staging == CUBE_STAGING_IMAGE && !image_support)
+			throw cl::Error(CL_INVALID_OPERATION, "colour cube staged as an image on a device without image support");
+		if (staging == CUBE_STAGING_LOCAL && lattice_bytes > device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>())
+			throw cl::Error(CL_OUT_OF_RESOURCES, "colour cube larger than the device's local memory");
+		cl_float4 domain_min = { { cube.domain_min[0], cube.domain_min[1], cube.domain_min[2], 0.f } };
+		cl_float4 domain_max = { { cube.domain_max[0], cube.domain_max[1], cube.domain_max[2], 1.f } };
+
+		cl::Kernel kernel;
+		cl::Image3D dev_cube; //held until the kernel is enqueued
+		cl::Buffer dev_lattice;
+		int arg = 4;
+		if (staging == CUBE_STAGING_IMAGE) {
+			vector<cl_ushort> texels = cube.Rgba();
+			dev_cube = cl::Image3D(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, cl::ImageFormat(CL_RGBA, CL_UNORM_INT16),
+				cube.size, cube.size, cube.size, 0, 0, texels.data());
+			kernel = cl::Kernel(program, "apply_cube_image");
+			kernel.setArg(arg++, dev_cube);
+		} else {
+			dev_lattice = TrackedBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, lattice_bytes, "dev_cube",
+				(void*)cube.lattice.data());
+			kernel = cl::Kernel(program, "apply_cube_local");
+			kernel.setArg(arg++, dev_lattice);
+			kernel.setArg(arg++, cl::Local(lattice_bytes));
+		}
+		kernel.setArg(0, input.buffer);
+		kernel.setArg(1, output.buffer);
+		kernel.setArg(2, luts);
+		kernel.setArg(3, (cl_int)input.Pixels());
+		kernel.setArg(arg++, cube.size);
+		kernel.setArg(arg++, spec.interpolation);
+		kernel.setArg(arg++, domain_min);
+		kernel.setArg(arg++, domain_max);
+		queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(RoundUp(input.Pixels(), local_size)), cl::NDRange(local_size),
+			nullptr, StageEvent("grade"));
+	}
+
+	//row and column taps of a rank-1 mask (mask[j][i] = column[j] * row[i], to a relative 1e-5), false for other masks
+	static bool SeparateMask(const vector<float>& mask, int mask_width, int mask_height, vector<float>& row, vector<float>& column) {
+		size_t peak = 0;
+		for (size_t k = 1; k < mask.size(); k++)
+			if (fabs(mask[k]) > fabs(mask[peak])) peak = k;
+		float scale = mask[peak];
+		if (scale == 0) return false;
+		int peak_row = (int)(peak / mask_width), peak_column = (int)(peak % mask_width);
+		row.assign(mask.begin() + peak_row * mask_width, mask.begin() + (peak_row + 1) * mask_width);
+		column.resize(mask_height);
+		for (int j = 0; j < mask_height; j++)
+			column[j] = mask[j * mask_width + peak_column] / scale;
+		for (int j = 0; j < mask_height; j++)
+			for (int i = 0; i < mask_width; i++)
+				if (fabs(mask[j * mask_width + i] - column[j] * row[i]) > 1e-5f * fabs(scale)) return false;
+		return true;
+	}
+
+	//sides of the power-of-two array the FFT pads an image to, so the mask does not wrap around into it
+	static int FftSide(int size, int mask_size) {
+		int side = 1;
+		while (side < size + 2 * (mask_size / 2)) side *= 2;
+		return side;
+	}
+
+	//whether a kernel argument of the given size fits the device's constant memory (convolution2d's mask)
+	bool ConstantFits(size_t bytes) {
+		cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+		return bytes <= device.getInfo<CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE>();
+	}
+
+	//whether fft_rows can hold the longest padded row of the image in local memory
+	bool FftFits(const DeviceImage& image, int mask_width, int mask_height) {
+		cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+		size_t side = max(FftSide(image.width, mask_width), FftSide(image.height, mask_height));
+		return side * sizeof(cl_float2) + 1024 <= device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+	}
+
+	//frequency-domain convolution, channel by channel: the image padded by fft_load and the mask padded on the device by
+	//fft_load_mask (flipped and centred on the origin, so the product is the same correlation convolution2d computes)
+	//are transformed by FFT2D into the transposed spectrum, multiplied, and transformed back by row passes and a
+	//transpose in the opposite order, which returns the array to its own layout. all of it is timed as stage "convolve"
+	void ConvolveFFT(const DeviceImage& input, const DeviceImage& output, const vector<float>& mask, int mask_width, int mask_height) {
+		int rx = mask_width / 2, ry = mask_height / 2;
+		int padded_width = FftSide(input.width, mask_width), padded_height = FftSide(input.height, mask_height);
+		size_t elements = (size_t)padded_width * padded_height;
+		cl::Buffer dev_data = TrackedBuffer(context, CL_MEM_READ_WRITE, elements * sizeof(cl_float2), "dev_fft");
+		cl::Buffer dev_transposed = TrackedBuffer(context, CL_MEM_READ_WRITE, elements * sizeof(cl_float2), "dev_fft");
+		cl::Buffer dev_spectrum = TrackedBuffer(context, CL_MEM_READ_WRITE, elements * sizeof(cl_float2), "dev_fft");
+
+		cl::Buffer dev_mask = TrackedBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, mask.size() * sizeof(float), "dev_mask", (void*)mask.data());
+		cl::Kernel mask_kernel(program, "fft_load_mask");
+		mask_kernel.setArg(0, dev_mask);
+		mask_kernel.setArg(1, dev_data);
+		mask_kernel.setArg(2, mask_width);
+		mask_kernel.setArg(3, mask_height);
+		mask_kernel.setArg(4, padded_width);
+		mask_kernel.setArg(5, padded_height);
+		queue.enqueueNDRangeKernel(mask_kernel, cl::NullRange, cl::NDRange(padded_width, padded_height), cl::NullRange, nullptr, StageEvent("convolve"));
+		FFT2D(dev_data, dev_spectrum, padded_width, padded_height);
+
+		cl::Kernel load_kernel(program, "fft_load");
+		load_kernel.setArg(0, input.buffer);
+		load_kernel.setArg(1, dev_data);
+		cl::Kernel multiply_kernel(program, "spectrum_multiply");
+		multiply_kernel.setArg(0, dev_transposed);
+		multiply_kernel.setArg(1, dev_spectrum);
+		cl::Kernel store_kernel(program, "fft_store");
+		store_kernel.setArg(0, dev_data);
+		store_kernel.setArg(1, output.buffer);
+		int arguments[6] = { input.width, input.height, 0, padded_width, rx, ry };
+		for (int c = 0; c < input.channels; c++) {
+			arguments[2] = c;
+			for (int i = 0; i < 6; i++) {
+				load_kernel.setArg(2 + i, arguments[i]);
+				store_kernel.setArg(2 + i, arguments[i]);
+			}
+			queue.enqueueNDRangeKernel(load_kernel, cl::NullRange, cl::NDRange(padded_width, padded_height), cl::NullRange, nullptr, StageEvent("convolve"));
+			FFT2D(dev_data, dev_transposed, padded_width, padded_height);
+			queue.enqueueNDRangeKernel(multiply_kernel, cl::NullRange, cl::NDRange(elements), cl::NullRange, nullptr, StageEvent("convolve"));
+			FftRows(dev_transposed, padded_height, padded_width, 1.f);
+			TransposeComplex(dev_transposed, dev_data, padded_height, padded_width);
+			FftRows(dev_data, padded_width, padded_height, 1.f);
+			queue.enqueueNDRangeKernel(store_kernel, cl::NullRange, cl::NDRange(input.width, input.height), cl::NullRange, nullptr, StageEvent("convolve"));
+		}
+	}
+
+	//forward 2-D FFT of a width x height array in data (overwritten) into transposed, height x width
+	void FFT2D(const cl::Buffer& data, const cl::Buffer& transposed, int width, int height) {
+		FftRows(data, width, height, -1.f);
+		TransposeComplex(data, transposed, width, height);
+		FftRows(transposed, height, width, -1.f);
+	}
+
+	//fft_rows over rows rows of n points (a power of two), forward for direction -1 and inverse for +1
+	void FftRows(const cl::Buffer& data, int n, int rows, float direction) {
+		int log2n = 0;
+		while ((1 << log2n) < n) log2n++;
+		size_t group_size = min(max(n / 2, 1), 256);
+		cl::Kernel kernel(program, "fft_rows");
+		kernel.setArg(0, data);
+		kernel.setArg(1, n);
+		kernel.setArg(2, log2n);
+		kernel.setArg(3, direction);
+		kernel.setArg(4, cl::Local(n * sizeof(cl_float2)));
+		queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(rows * group_size), cl::NDRange(group_size), nullptr, StageEvent("convolve"));
+	}
+
+	void TransposeComplex(const cl::Buffer& input, const cl::Buffer& output, int width, int height) {
+		cl::Kernel kernel(program, "transpose_complex");
+		kernel.setArg(0, input);
+		kernel.setArg(1, output);
+		kernel.setArg(2, width);
+		kernel.setArg(3, height);
+		queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(RoundUp(width, 16), RoundUp(height, 16)), cl::NDRange(16, 16), nullptr, StageEvent("convolve"));
+	}
+
+	DeviceImage Allocate(int width, int height, int channels, int bits) {
+		DeviceImage image;
+		image.width = width;
+		image.height = height;
+		image.channels = channels;
+		image.bits = bits;
+		image.buffer = TrackedBuffer(context, CL_MEM_READ_WRITE, image.Bytes(), "device_image");
+		return image;
+	}
+
+	//event slot for a command of the given stage, or none when the queue does not profile
+	cl::Event* StageEvent(const string& stage) {
+		if (!profiling) return nullptr;
+		events.emplace_back(stage, cl::Event());
+		return &events.back().second;
+	}
+
+	//local shape of hist_local (and back_project) tuned once per image size; without profiling the candidates are
+	//timed on the host on queue itself, so the tuning stays ordered with the stages around it
+	cl::NDRange HistogramShape(const cl::Kernel& kernel, int width, int height) {
+		pair<int, int> size(width, height);
+		if (tuned_shapes.find(size) == tuned_shapes.end())
+			tuned_shapes[size] = TuneLocalShape(queue, kernel, width, height, profiling);
+		return tuned_shapes[size];
+	}
+
+	cl::Context context;
+	cl::CommandQueue queue;
+	cl::Program program;
+	bool profiling = false;
+	list<pair<string, cl::Event>> events; //a list, so the slots handed out stay where they are
+	map<pair<int, int>, cl::NDRange> tuned_shapes;
+	size_t uploaded = 0, downloaded = 0;
+};
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstring>
+#include "Utils.h"
+
+//histogram sidecar of one equalised image: the per-channel histograms, cumulative histograms and LUTs, so a later
+//run can apply the same LUTs (e.g. to resized or cropped versions of the image) without recomputing them.
+//binary, little endian:
+//  magic "CLHIST01", u32 channels, u32 bins, char scan[4] (bl, hs, lb or host, zero padded), u64 source_hash
+//  (HashSamples of the 16-bit input samples), u64 pixels (counted by the histograms), then for every channel bins u32
+//  histogram counts, bins u32 cumulative counts and 65536 u16 LUT entries
+
+const char SIDECAR_MAGIC[8] = { 'C', 'L', 'H', 'I', 'S', 'T', '0', '1' };
+
+//FNV-1a over a block of memory, identifies the source image of a sidecar
+inline uint64_t HashSamples(const void* data, size_t bytes) {
+	uint64_t hash = 14695981039346656037ull;
+	const unsigned char* byte = (const unsigned char*)data;
+	for (size_t i = 0; i < bytes; i++) {
+		hash ^= byte[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+struct HistogramSidecar {
+	int channels = 0;
+	int bins = 0;
+	string scan;
+	uint64_t source_hash = 0;
+	uint64_t pixels = 0;
+	vector<vector<cl_uint>> histograms, cum_histograms; //[channel][bins]
+	vector<vector<cl_ushort>> luts; //[channel][65536]
+
+	//sizes the tables of an equalisation with the given channels and bins
+	void Assign(int channel_count, int bin_count) {
+		channels = channel_count;
+		bins = bin_count;
+		histograms.assign(channels, vector<cl_uint>(bins));
+		cum_histograms.assign(channels, vector<cl_uint>(bins));
+		luts.assign(channels, vector<cl_ushort>(65536));
+	}
+
+	bool Save(const string& file_name) const {
+		ofstream file(file_name, ios::binary | ios::trunc);
+		if (!file) return false;
+		char scan_name[4] = { 0 };
+		strncpy(scan_name, scan.c_str(), sizeof(scan_name));
+		uint32_t counts[2] = { (uint32_t)channels, (uint32_t)bins };
+		file.write(SIDECAR_MAGIC, sizeof(SIDECAR_MAGIC));
+		file.write((const char*)counts, sizeof(counts));
+		file.write(scan_name, sizeof(scan_name));
+		file.write((const char*)&source_hash, sizeof(source_hash));
+		file.write((const char*)&pixels, sizeof(pixels));
+		for (int c = 0; c < channels; c++) {
+			file.write((const char*)histograms[c].data(), bins * sizeof(cl_uint));
+			file.write((const char*)cum_histograms[c].data(), bins * sizeof(cl_uint));
+			file.write((const char*)luts[c].data(), 65536 * sizeof(cl_ushort));
+		}
+		return (bool)file;
+	}
+
+	//false if the file cannot be read or is not a complete sidecar
+	bool Load(const string& file_name) {
+		ifstream file(file_name, ios::binary);
+		char magic[sizeof(SIDECAR_MAGIC)];
+		uint32_t counts[2];
+		char scan_name[5] = { 0 };
+		if (!file.read(magic, sizeof(magic)) || memcmp(magic, SIDECAR_MAGIC, sizeof(magic)) != 0) return false;
+		if (!file.read((char*)counts, sizeof(counts)) || counts[0] == 0 || counts[1] == 0 || counts[1] > 65536) return false;
+		file.read(scan_name, 4);
+		file.read((char*)&source_hash, sizeof(source_hash));
+		file.read((char*)&pixels, sizeof(pixels));
+		streamoff tables = file.tellg();
+		file.seekg(0, ios::end);
+		streamoff expected = (streamoff)(counts[0] * (2 * counts[1] * sizeof(cl_uint) + 65536 * sizeof(cl_ushort)));
+		if (!file || file.tellg() - tables != expected) return false;
+		file.seekg(tables);
+		Assign(counts[0], counts[1]);
+		scan = scan_name;
+		for (int c = 0; c < channels; c++) {
+			file.read((char*)histograms[c].data(), bins * sizeof(cl_uint));
+			file.read((char*)cum_histograms[c].data(), bins * sizeof(cl_uint));
+			file.read((char*)luts[c].data(), 65536 * sizeof(cl_ushort));
+		}
+		return (bool)file;
+	}
+};
@@ -0,0 +1,212 @@
+#pragma once
+
+#include <array>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "Utils.h"
+
+//tiled image container: the 16-bit planar samples of an image cut into fixed-size square tiles, with the histogram of
+//every tile stored next to them, so the histogram of any region can be assembled from whole tiles and only its
+//partial edge tiles need to be read. all fields are little endian (native on the devices used here):
+//  header, TILE_HEADER_BYTES bytes: magic "CLTILES1", then u32 width, height, channels, bits (8 or 16, depth of the
+//  source image), tile_size, bins, tiles_x, tiles_y, u64 pixel_offset, histogram_offset, zero padding
+//  pixels at pixel_offset (page aligned, so mapped tiles start on a page): [channel][tile_y][tile_x] tiles of
+//  tile_size x tile_size u16 samples, row by row; the edge tiles of the right and bottom are zero padded
+//  histograms at histogram_offset (end of the pixels rounded up to 64 bytes): [channel][tile_y][tile_x] of bins u32
+//  counts, binned as hist_local bins (bin = value * bins >> 16) and counting only the samples inside the image
+
+const char TILE_MAGIC[8] = { 'C', 'L', 'T', 'I', 'L', 'E', 'S', '1' };
+const size_t TILE_HEADER_BYTES = 64;
+const size_t TILE_PIXEL_ALIGN = 4096;
+
+struct TileHeader {
+	char magic[8];
+	uint32_t width, height, channels, bits, tile_size, bins, tiles_x, tiles_y;
+	uint64_t pixel_offset, histogram_offset;
+};
+
+//header of an image with the given layout
+inline TileHeader MakeTileHeader(int width, int height, int channels, int bits, int tile_size, int bins) {
+	TileHeader header;
+	memcpy(header.magic, TILE_MAGIC, sizeof(TILE_MAGIC));
+	header.width = width;
+	header.height = height;
+	header.channels = channels;
+	header.bits = bits;
+	header.tile_size = tile_size;
+	header.bins = bins;
+	header.tiles_x = (width + tile_size - 1) / tile_size;
+	header.tiles_y = (height + tile_size - 1) / tile_size;
+	header.pixel_offset = RoundUp(TILE_HEADER_BYTES, TILE_PIXEL_ALIGN);
+	header.histogram_offset = RoundUp(header.pixel_offset + (uint64_t)channels * header.tiles_x * header.tiles_y * tile_size * tile_size * sizeof(uint16_t), 64);
+	return header;
+}
+
+//writes a planar 16-bit image (channel c starts at sample c * width * height) as a tile container. histograms holds
+//the [channel][tile_y][tile_x][bins] tile histograms if they were computed already, e.g. on the device by hist_tiles;
+//empty to count them here while the tiles are cut
+inline bool WriteTileFile(const string& file_name, const uint16_t* data, int width, int height, int channels, int bits,
+	int tile_size, int bins, const vector<cl_uint>& histograms = vector<cl_uint>()) {
+	TileHeader header = MakeTileHeader(width, height, channels, bits, tile_size, bins);
+	size_t tile_count = (size_t)header.tiles_x * header.tiles_y;
+	if (!histograms.empty() && histograms.size() != channels * tile_count * bins) return false;
+	ofstream file(file_name, ios::binary);
+	if (!file) return false;
+
+	vector<char> head(header.pixel_offset, 0);
+	memcpy(head.data(), &header, sizeof(header));
+	file.write(head.data(), head.size());
+
+	vector<cl_uint> counted(histograms.empty() ? channels * tile_count * bins : 0, 0);
+	vector<uint16_t> tile((size_t)tile_size * tile_size);
+	for (int c = 0; c < channels; c++) {
+		const uint16_t* plane = data + (size_t)c * width * height;
+		for (uint32_t ty = 0; ty < header.tiles_y; ty++) {
+			for (uint32_t tx = 0; tx < header.tiles_x; tx++) {
+				int x0 = tx * tile_size, y0 = ty * tile_size;
+				int w = min(tile_size, width - x0), h = min(tile_size, height - y0);
+				fill(tile.begin(), tile.end(), 0);
+				for (int y = 0; y < h; y++)
+					memcpy(&tile[(size_t)y * tile_size], plane + (size_t)(y0 + y) * width + x0, w * sizeof(uint16_t));
+				if (!counted.empty()) {
+					cl_uint* histogram = &counted[((size_t)c * tile_count + ty * header.tiles_x + tx) * bins];
+					for (int y = 0; y < h; y++)
+						for (int x = 0; x < w; x++)
+							histogram[((uint32_t)tile[(size_t)y * tile_size + x] * bins) >> 16]++;
+				}
+				file.write((const char*)tile.data(), tile.size() * sizeof(uint16_t));
+			}
+		}
+	}
+	vector<char> padding(header.histogram_offset - file.tellp(), 0);
+	file.write(padding.data(), padding.size());
+	const vector<cl_uint>& tile_histograms = histograms.empty() ? counted : histograms;
+	file.write((const char*)tile_histograms.data(), tile_histograms.size() * sizeof(cl_uint));
+	return (bool)file;
+}
+
+//histogram of a region (x, y, w, h) assembled from a tile container: the stored histograms of the tiles that lie
+//wholly inside it, plus the rectangles of partial edge tiles whose samples still have to be counted
+struct TileRegionPlan {
+	vector<cl_int> histograms; //[channel][bins], the sum of the interior tile histograms
+	vector<array<int, 4>> edges; //x, y, w, h relative to the region, at most four
+	size_t interior_tiles = 0; //per channel
+	size_t edge_pixels = 0; //per channel
+};
+
+//read-only memory map of a tile container; tiles are paged in from the file as they are touched
+class TileFile {
+public:
+	TileFile() = default;
+	~TileFile() { Close(); }
+
+	TileFile(const TileFile&) = delete;
+
+	bool Open(const string& file_name) {
+		Close();
+		int fd = open(file_name.c_str(), O_RDONLY);
+		if (fd < 0) return false;
+		struct stat status;
+		if (fstat(fd, &status) == 0 && (size_t)status.st_size >= TILE_HEADER_BYTES) {
+			size = status.st_size;
+			void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			data = (mapped == MAP_FAILED) ? nullptr : (const char*)mapped;
+		}
+		close(fd);
+		if (!data) return false;
+		memcpy(&header, data, sizeof(header));
+		TileHeader expected = MakeTileHeader(header.width, header.height, header.channels, header.bits, max(header.tile_size, 1u), max(header.bins, 1u));
+		if (memcmp(header.magic, TILE_MAGIC, sizeof(TILE_MAGIC)) != 0 || header.tile_size == 0 || header.bins == 0 ||
+			header.tiles_x != expected.tiles_x || header.tiles_y != expected.tiles_y || header.pixel_offset != expected.pixel_offset ||
+			header.histogram_offset != expected.histogram_offset ||
+			size < header.histogram_offset + (uint64_t)header.channels * header.tiles_x * header.tiles_y * header.bins * sizeof(cl_uint)) {
+			Close();
+			return false;
+		}
+		return true;
+	}
+
+	void Close() {
+		if (data) munmap((void*)data, size);
+		data = nullptr;
+		size = 0;
+	}
+
+	const TileHeader& Header() const { return header; }
+
+	//tile_size x tile_size samples of a tile, row by row
+	const uint16_t* Tile(int c, int tx, int ty) const {
+		size_t tile_samples = (size_t)header.tile_size * header.tile_size;
+		return (const uint16_t*)(data + header.pixel_offset) + (TileIndex(c, tx, ty)) * tile_samples;
+	}
+
+	const cl_uint* Histogram(int c, int tx, int ty) const {
+		return (const cl_uint*)(data + header.histogram_offset) + TileIndex(c, tx, ty) * header.bins;
+	}
+
+	//copies the samples of a region into a planar w x h image, reading only the tiles it overlaps
+	void ReadRegion(int x, int y, int w, int h, uint16_t* region) const {
+		int tile_size = header.tile_size;
+		for (int c = 0; c < (int)header.channels; c++) {
+			uint16_t* plane = region + (size_t)c * w * h;
+			for (int ty = y / tile_size; ty <= (y + h - 1) / tile_size; ty++) {
+				for (int tx = x / tile_size; tx <= (x + w - 1) / tile_size; tx++) {
+					const uint16_t* tile = Tile(c, tx, ty);
+					int x0 = max(x, tx * tile_size), x1 = min(x + w, (tx + 1) * tile_size);
+					int y0 = max(y, ty * tile_size), y1 = min(y + h, (ty + 1) * tile_size);
+					for (int row = y0; row < y1; row++)
+						memcpy(plane + (size_t)(row - y) * w + (x0 - x), tile + (size_t)(row - ty * tile_size) * tile_size + (x0 - tx * tile_size),
+							(x1 - x0) * sizeof(uint16_t));
+				}
+			}
+		}
+	}
+
+	//histogram plan of a region at the given bin count, which has to divide the stored one (stored bins fold into
+	//requested bins exactly, as value * bins >> 16 is the stored bin divided by their ratio)
+	TileRegionPlan PlanRegion(int x, int y, int w, int h, int bins) const {
+		TileRegionPlan plan;
+		int tile_size = header.tile_size;
+		int ratio = header.bins / bins;
+		plan.histograms.assign((size_t)header.channels * bins, 0);
+		//interior tiles [tx0, tx1) x [ty0, ty1); a tile on the right or bottom image border is interior if the region reaches that border
+		int tx0 = (x + tile_size - 1) / tile_size, ty0 = (y + tile_size - 1) / tile_size;
+		int tx1 = (x + w == (int)header.width) ? header.tiles_x : (x + w) / tile_size;
+		int ty1 = (y + h == (int)header.height) ? header.tiles_y : (y + h) / tile_size;
+		if (tx1 <= tx0 || ty1 <= ty0) {
+			plan.edges.push_back({ 0, 0, w, h });
+			plan.edge_pixels = (size_t)w * h;
+			return plan;
+		}
+		plan.interior_tiles = (size_t)(tx1 - tx0) * (ty1 - ty0);
+		for (int c = 0; c < (int)header.channels; c++) {
+			cl_int* histogram = &plan.histograms[(size_t)c * bins];
+			for (int ty = ty0; ty < ty1; ty++)
+				for (int tx = tx0; tx < tx1; tx++) {
+					const cl_uint* tile_histogram = Histogram(c, tx, ty);
+					for (int i = 0; i < (int)header.bins; i++)
+						histogram[i / ratio] += tile_histogram[i];
+				}
+		}
+		//the interior in region coordinates, and the top, bottom, left and right bands around it
+		int ix0 = tx0 * tile_size - x, iy0 = ty0 * tile_size - y;
+		int ix1 = min(tx1 * tile_size - x, w), iy1 = min(ty1 * tile_size - y, h);
+		array<int, 4> bands[4] = { { 0, 0, w, iy0 }, { 0, iy1, w, h - iy1 }, { 0, iy0, ix0, iy1 - iy0 }, { ix1, iy0, w - ix1, iy1 - iy0 } };
+		for (const array<int, 4>& band : bands) {
+			if (band[2] <= 0 || band[3] <= 0) continue;
+			plan.edges.push_back(band);
+			plan.edge_pixels += (size_t)band[2] * band[3];
+		}
+		return plan;
+	}
+
+private:
+	size_t TileIndex(int c, int tx, int ty) const {
+		return ((size_t)c * header.tiles_y + ty) * header.tiles_x + tx;
+	}
+
+	TileHeader header;
+	const char* data = nullptr;
+	size_t size = 0;
+};
@@ -4,6 +4,19 @@
 #include <vector>
 #include <iostream>
 #include <sstream>
+#include <map>
+#include <mutex>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <cstdint>
+#include <cstdlib>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 #define CL_USE_DEPRECATED_OPENCL_1_2_APIS
 #define CL_HPP_MINIMUM_OPENCL_VERSION 120
@@ -198,6 +211,31 @@ cl::Context GetContext(int platform_id, int device_id) {
 	return cl::Context();
 }
 
+//creates a context on the index-th of count equal partitions of a device (clCreateSubDevices)
+//used to give each batch worker process its own share of a CPU device's compute units
+//falls back to the whole device when it cannot be partitioned (e.g. most GPUs)
+cl::Context GetSubDeviceContext(int platform_id, int device_id, int index, int count) {
+	vector<cl::Platform> platforms;
+	cl::Platform::get(&platforms);
+	vector<cl::Device> devices;
+	platforms[platform_id].getDevices((cl_device_type)CL_DEVICE_TYPE_ALL, &devices);
+	cl::Device device = devices[device_id];
+
+	cl_uint compute_units = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+	cl_uint units_per_partition = max(1u, compute_units / count);
+	const cl_device_partition_property properties[] = { CL_DEVICE_PARTITION_EQUALLY, (cl_device_partition_property)units_per_partition, 0 };
+	vector<cl::Device> sub_devices;
+	try {
+		device.createSubDevices(properties, &sub_devices);
+	}
+	catch (const cl::Error& err) {
+		cerr << "Note: cannot partition " << device.getInfo<CL_DEVICE_NAME>() << " (" << getErrorString(err.err()) << "), using the whole device" << endl;
+		return cl::Context({ device });
+	}
+
+	return cl::Context({ sub_devices[index % sub_devices.size()] });
+}
+
 enum ProfilingResolution {
 	PROF_NS = 1,
 	PROF_US = 1000,
@@ -223,3 +261,714 @@ string GetFullProfilingInfo(const cl::Event& evnt, ProfilingResolution resolutio
 
 	return sstream.str();
 }
+
+
+//returns the queue itself if it has profiling enabled, otherwise a new profiling queue on the same device
+//lets one-off measurements (tuning, calibration) run while the main queue stays unprofiled
+cl::CommandQueue ProfilingQueue(const cl::CommandQueue& queue) {
+	if (queue.getInfo<CL_QUEUE_PROPERTIES>() & CL_QUEUE_PROFILING_ENABLE)
+		return queue;
+	return cl::CommandQueue(queue.getInfo<CL_QUEUE_CONTEXT>(), queue.getInfo<CL_QUEUE_DEVICE>(), CL_QUEUE_PROFILING_ENABLE);
+}
+
+double SecondsSince(const chrono::steady_clock::time_point& start) {
+	return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+//seconds taken by the command of event, enqueued on queue at start: its profiled duration on a profiling queue,
+//otherwise the host time until the queue has finished
+double CommandSeconds(const cl::CommandQueue& queue, const cl::Event& event, const chrono::steady_clock::time_point& start) {
+	if (queue.getInfo<CL_QUEUE_PROPERTIES>() & CL_QUEUE_PROFILING_ENABLE) {
+		event.wait();
+		return (event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event.getProfilingInfo<CL_PROFILING_COMMAND_START>()) * 1e-9;
+	}
+	queue.finish();
+	return SecondsSince(start);
+}
+
+//rounds a global size up to the next multiple of the local size
+size_t RoundUp(size_t global_size, size_t local_size) {
+	return ((global_size + local_size - 1) / local_size) * local_size;
+}
+
+//resource usage of a kernel as built for a device; the local memory includes the local arguments already set
+struct KernelResources {
+	string name;
+	cl_ulong local_memory = 0;
+	cl_ulong private_memory = 0;
+	size_t max_group_size = 0;
+	size_t preferred_multiple = 0;
+};
+
+KernelResources GetKernelResources(const cl::Kernel& kernel, const cl::Device& device) {
+	KernelResources resources;
+	resources.name = kernel.getInfo<CL_KERNEL_FUNCTION_NAME>();
+	resources.local_memory = kernel.getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(device);
+	resources.private_memory = kernel.getWorkGroupInfo<CL_KERNEL_PRIVATE_MEM_SIZE>(device);
+	resources.max_group_size = kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+	resources.preferred_multiple = kernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device);
+	return resources;
+}
+
+//estimated residency of work-groups of group_size items on one compute unit. OpenCL does not expose the per-unit
+//limits, so the device's local memory (shared by the resident groups) and its max work-group size (taken as the
+//work-items a unit holds at once) stand in for them: the figures are estimates, not what the hardware schedules.
+//groups_per_unit is 0 when the group cannot be launched at all
+struct Occupancy {
+	size_t groups_per_unit = 0;
+	string limit; //"work-items", "local memory" or why the group does not fit
+	double occupancy = 0; //resident work-items over the unit's estimated capacity
+	double lane_efficiency = 0; //group size over the group size rounded up to the preferred multiple
+};
+
+Occupancy GetOccupancy(const KernelResources& resources, const cl::Device& device, size_t group_size) {
+	Occupancy result;
+	cl_ulong local_capacity = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+	size_t item_capacity = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+	if ((group_size == 0) || (group_size > resources.max_group_size)) {
+		result.limit = "group too large";
+		return result;
+	}
+	if (resources.local_memory > local_capacity) {
+		result.limit = "local memory too small";
+		return result;
+	}
+	size_t by_items = max((size_t)1, item_capacity / group_size);
+	size_t by_local = resources.local_memory ? (size_t)(local_capacity / resources.local_memory) : by_items;
+	result.groups_per_unit = min(by_items, by_local);
+	result.limit = (by_local < by_items) ? "local memory" : "work-items";
+	result.occupancy = min(1.0, (double)(result.groups_per_unit * group_size) / item_capacity);
+	size_t multiple = max((size_t)1, resources.preferred_multiple);
+	result.lane_efficiency = (double)group_size / RoundUp(group_size, multiple);
+	return result;
+}
+
+//one row per kernel and the group size it is launched with
+string OccupancyReport(const vector<pair<cl::Kernel, size_t>>& launches, const cl::Device& device) {
+	stringstream sstream;
+	sstream << "Estimated occupancy on " << device.getInfo<CL_DEVICE_NAME>() << " (" << device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>()
+		<< " B local memory per compute unit; its capacity is estimated as the max work-group size, "
+		<< device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>() << " work-items):" << endl;
+	sstream << "  kernel, local [B], private [B], max group, preferred multiple, group, est. groups/CU, est. occupancy, lane efficiency, limit" << endl;
+	for (const auto& launch : launches) {
+		KernelResources resources = GetKernelResources(launch.first, device);
+		Occupancy occupancy = GetOccupancy(resources, device, launch.second);
+		sstream << "  " << resources.name << ", " << resources.local_memory << ", " << resources.private_memory << ", "
+			<< resources.max_group_size << ", " << resources.preferred_multiple << ", " << launch.second << ", "
+			<< occupancy.groups_per_unit << ", " << occupancy.occupancy << ", " << occupancy.lane_efficiency << ", " << occupancy.limit << endl;
+	}
+	return sstream.str();
+}
+
+//book-keeping of live and peak bytes per allocation site, for host memory and device buffers
+//device buffers report their release through a destructor callback that may run on a runtime thread
+class MemoryTracker {
+public:
+	struct Site {
+		bool device = false;
+		size_t live = 0;
+		size_t peak = 0;
+		size_t allocations = 0;
+	};
+
+	void Allocate(const string& site_name, size_t bytes, bool device) {
+		lock_guard<mutex> lock(guard);
+		Site& site = sites[site_name];
+		site.device = device;
+		site.live += bytes;
+		site.peak = max(site.peak, site.live);
+		site.allocations++;
+		size_t& live = device ? device_live : host_live;
+		size_t& peak = device ? device_peak : host_peak;
+		live += bytes;
+		peak = max(peak, live);
+	}
+
+	void Release(const string& site_name, size_t bytes, bool device) {
+		lock_guard<mutex> lock(guard);
+		sites[site_name].live -= bytes;
+		(device ? device_live : host_live) -= bytes;
+	}
+
+	size_t HostPeak() { lock_guard<mutex> lock(guard); return host_peak; }
+	size_t DevicePeak() { lock_guard<mutex> lock(guard); return device_peak; }
+
+	string Report() {
+		lock_guard<mutex> lock(guard);
+		stringstream sstream;
+		sstream << "\nMemory report [B]:" << endl;
+		for (const auto& entry : sites) {
+			sstream << "  " << (entry.second.device ? "device " : "host   ") << entry.first
+				<< ": peak " << entry.second.peak << ", live " << entry.second.live
+				<< ", allocations " << entry.second.allocations << endl;
+		}
+		sstream << "  Host peak: " << host_peak << ", device peak: " << device_peak << endl;
+		return sstream.str();
+	}
+
+private:
+	mutex guard;
+	map<string, Site> sites;
+	size_t host_live = 0, host_peak = 0;
+	size_t device_live = 0, device_peak = 0;
+};
+
+MemoryTracker& GetMemoryTracker() {
+	static MemoryTracker tracker;
+	return tracker;
+}
+
+//scoped record of a host allocation made elsewhere (e.g. a CImg or vector), released when it goes out of scope
+class HostAllocation {
+public:
+	HostAllocation(const string& site, size_t bytes) : site(site), bytes(bytes) { GetMemoryTracker().Allocate(site, bytes, false); }
+	~HostAllocation() { GetMemoryTracker().Release(site, bytes, false); }
+	HostAllocation(const HostAllocation&) = delete;
+private:
+	string site;
+	size_t bytes;
+};
+
+//compact binary trace of the commands an application issues: buffer allocations, transfers, fills, copies and
+//kernel launches with their arguments and ranges. replay re-executes a trace on synthetic data (see replay.cpp)
+//every record starts with its type byte and the host time in ns since the trace was opened, followed by
+//  alloc: id u32, size u64, flags u64, payload
+//  write: id, offset u64, size u64, payload
+//  read: id, offset, size
+//  fill: id, offset, size, pattern size u32, pattern
+//  copy: source id, destination id, source offset u64, destination offset u64, size u64
+//  kernel: name length u16, name, dimensions u8, offset, global and local range as 3 x u64 each (0 when absent),
+//          argument count u8, then per argument index u8, size u32, kind u8 and bytes (id for buffers, u64 for local memory)
+//a payload is its size u64 (0 when not stored) followed by the bytes
+enum TraceRecordType : uint8_t {
+	TRACE_ALLOC = 1,
+	TRACE_WRITE,
+	TRACE_READ,
+	TRACE_FILL,
+	TRACE_COPY,
+	TRACE_KERNEL
+};
+
+enum TraceArgKind : uint8_t {
+	TRACE_ARG_BUFFER,
+	TRACE_ARG_LOCAL,
+	TRACE_ARG_VALUE
+};
+
+const char TRACE_MAGIC[8] = { 'C', 'L', 'T', 'R', 'A', 'C', 'E', '1' };
+
+//written data up to this size is stored so that indices and counters replay faithfully; larger writes (the images)
+//are replaced by synthetic data. the initial contents of CL_MEM_COPY_HOST_PTR buffers (masks, curves, cubes and tile
+//lists, never images) are stored whatever their size, as a tile list of random descriptors would address memory
+//outside the images
+const size_t TRACE_PAYLOAD_LIMIT = 65536;
+
+class CommandRecorder {
+public:
+	bool Open(const string& file_name) {
+		lock_guard<mutex> lock(guard);
+		file.open(file_name, ios::binary | ios::trunc);
+		if (!file) return false;
+		file.write(TRACE_MAGIC, sizeof(TRACE_MAGIC));
+		start = chrono::steady_clock::now();
+		return true;
+	}
+
+	bool IsOpen() const { return file.is_open(); }
+
+	void Close() {
+		lock_guard<mutex> lock(guard);
+		if (file.is_open()) file.close();
+	}
+
+	size_t Records() { lock_guard<mutex> lock(guard); return records; }
+
+	void Alloc(cl_mem buffer, size_t size, cl_mem_flags flags, const void* host_ptr) {
+		lock_guard<mutex> lock(guard);
+		Register(buffer, size, flags, (flags & CL_MEM_COPY_HOST_PTR) ? host_ptr : nullptr);
+	}
+
+	void Write(cl_mem buffer, size_t offset, size_t size, const void* data) {
+		lock_guard<mutex> lock(guard);
+		uint32_t id = Id(buffer);
+		Header(TRACE_WRITE);
+		Put(id); Put((uint64_t)offset); Put((uint64_t)size);
+		Payload(data, size);
+	}
+
+	void Read(cl_mem buffer, size_t offset, size_t size) {
+		lock_guard<mutex> lock(guard);
+		uint32_t id = Id(buffer);
+		Header(TRACE_READ);
+		Put(id); Put((uint64_t)offset); Put((uint64_t)size);
+	}
+
+	void Fill(cl_mem buffer, size_t offset, size_t size, const void* pattern, size_t pattern_size) {
+		lock_guard<mutex> lock(guard);
+		uint32_t id = Id(buffer);
+		Header(TRACE_FILL);
+		Put(id); Put((uint64_t)offset); Put((uint64_t)size); Put((uint32_t)pattern_size);
+		file.write((const char*)pattern, pattern_size);
+	}
+
+	void Copy(cl_mem source, cl_mem destination, size_t source_offset, size_t destination_offset, size_t size) {
+		lock_guard<mutex> lock(guard);
+		uint32_t source_id = Id(source), destination_id = Id(destination);
+		Header(TRACE_COPY);
+		Put(source_id); Put(destination_id); Put((uint64_t)source_offset); Put((uint64_t)destination_offset); Put((uint64_t)size);
+	}
+
+	//the runtime may hand out the handle of a released kernel again, so a new kernel starts without arguments
+	void ClearArgs(cl_kernel kernel) {
+		lock_guard<mutex> lock(guard);
+		args.erase(kernel);
+	}
+
+	//arguments are kept per kernel object and written out with each launch
+	void SetArg(cl_kernel kernel, cl_uint index, TraceArgKind kind, const void* data, size_t size) {
+		lock_guard<mutex> lock(guard);
+		vector<uint8_t>& arg = args[kernel][index];
+		arg.assign(1, kind);
+		if (kind == TRACE_ARG_BUFFER) {
+			uint32_t id = Id(*(const cl_mem*)data);
+			arg.insert(arg.end(), (const uint8_t*)&id, (const uint8_t*)&id + sizeof(id));
+		}
+		else
+			arg.insert(arg.end(), (const uint8_t*)data, (const uint8_t*)data + size);
+	}
+
+	void Kernel(cl_kernel kernel, const string& name, const cl::NDRange& offset, const cl::NDRange& global, const cl::NDRange& local) {
+		lock_guard<mutex> lock(guard);
+		const map<cl_uint, vector<uint8_t>>& kernel_args = args[kernel];
+		Header(TRACE_KERNEL);
+		Put((uint16_t)name.size());
+		file.write(name.data(), name.size());
+		Put((uint8_t)global.dimensions());
+		for (const cl::NDRange* range : { &offset, &global, &local })
+			for (size_t d = 0; d < 3; d++)
+				Put((uint64_t)(d < range->dimensions() ? (*range)[d] : 0));
+		Put((uint8_t)kernel_args.size());
+		for (const auto& arg : kernel_args) {
+			Put((uint8_t)arg.first);
+			Put((uint32_t)(arg.second.size() - 1));
+			file.write((const char*)arg.second.data(), arg.second.size());
+		}
+	}
+
+	//the runtime may hand out a released handle again, so a destroyed buffer loses its id
+	void Forget(cl_mem buffer) {
+		lock_guard<mutex> lock(guard);
+		ids.erase(buffer);
+	}
+
+private:
+	template <typename T>
+	void Put(const T& value) { file.write((const char*)&value, sizeof(T)); }
+
+	void Header(TraceRecordType type) {
+		Put((uint8_t)type);
+		Put((uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+		records++;
+	}
+
+	void Payload(const void* data, size_t size, bool always = false) {
+		uint64_t stored = (data && (always || size <= TRACE_PAYLOAD_LIMIT)) ? size : 0;
+		Put(stored);
+		file.write((const char*)data, stored);
+	}
+
+	uint32_t Register(cl_mem buffer, size_t size, cl_mem_flags flags, const void* contents);
+
+	//buffers not created through TrackedBuffer (e.g. sub-buffers) are registered the first time they are used
+	uint32_t Id(cl_mem buffer) {
+		auto found = ids.find(buffer);
+		if (found != ids.end()) return found->second;
+		size_t size = 0;
+		cl_mem_flags flags = 0;
+		clGetMemObjectInfo(buffer, CL_MEM_SIZE, sizeof(size), &size, nullptr);
+		clGetMemObjectInfo(buffer, CL_MEM_FLAGS, sizeof(flags), &flags, nullptr);
+		return Register(buffer, size, flags, nullptr);
+	}
+
+	mutex guard;
+	ofstream file;
+	chrono::steady_clock::time_point start;
+	map<cl_mem, uint32_t> ids;
+	map<cl_kernel, map<cl_uint, vector<uint8_t>>> args;
+	uint32_t next_id = 0;
+	size_t records = 0;
+};
+
+CommandRecorder& GetCommandRecorder() {
+	static CommandRecorder recorder;
+	return recorder;
+}
+
+void CL_CALLBACK ForgetRecordedBuffer(cl_mem buffer, void*) {
+	GetCommandRecorder().Forget(buffer);
+}
+
+uint32_t CommandRecorder::Register(cl_mem buffer, size_t size, cl_mem_flags flags, const void* contents) {
+	uint32_t id = next_id++;
+	ids[buffer] = id;
+	clSetMemObjectDestructorCallback(buffer, ForgetRecordedBuffer, nullptr);
+	Header(TRACE_ALLOC);
+	Put(id); Put((uint64_t)size); Put((uint64_t)flags);
+	Payload(contents, size, true);
+	return id;
+}
+
+//command queue that reports every transfer and launch to the recorder while it is open; the wrappers hide the
+//cl::CommandQueue methods of the same name, so calls through a plain cl::CommandQueue are not recorded and helpers that
+//take one (tuning, calibration) wrap it in a RecordingQueue of their own
+class RecordingQueue : public cl::CommandQueue {
+public:
+	RecordingQueue() {}
+	RecordingQueue(const cl::Context& context, const cl::Device& device, cl_command_queue_properties properties = 0)
+		: cl::CommandQueue(context, device, properties) {}
+	explicit RecordingQueue(const cl::CommandQueue& queue) : cl::CommandQueue(queue) {}
+
+	cl_int enqueueWriteBuffer(const cl::Buffer& buffer, cl_bool blocking, size_t offset, size_t size, const void* ptr,
+		const vector<cl::Event>* events = nullptr, cl::Event* event = nullptr) const {
+		if (GetCommandRecorder().IsOpen()) GetCommandRecorder().Write(buffer(), offset, size, ptr);
+		return cl::CommandQueue::enqueueWriteBuffer(buffer, blocking, offset, size, ptr, events, event);
+	}
+
+	cl_int enqueueReadBuffer(const cl::Buffer& buffer, cl_bool blocking, size_t offset, size_t size, void* ptr,
+		const vector<cl::Event>* events = nullptr, cl::Event* event = nullptr) const {
+		if (GetCommandRecorder().IsOpen()) GetCommandRecorder().Read(buffer(), offset, size);
+		return cl::CommandQueue::enqueueReadBuffer(buffer, blocking, offset, size, ptr, events, event);
+	}
+
+	//rectangular transfers are recorded as the contiguous span of the buffer they touch, without payload
+	cl_int enqueueWriteBufferRect(const cl::Buffer& buffer, cl_bool blocking, const cl::array<size_t, 3>& buffer_offset,
+		const cl::array<size_t, 3>& host_offset, const cl::array<size_t, 3>& region, size_t buffer_row_pitch, size_t buffer_slice_pitch,
+		size_t host_row_pitch, size_t host_slice_pitch, const void* ptr, const vector<cl::Event>* events = nullptr, cl::Event* event = nullptr) const {
+		if (GetCommandRecorder().IsOpen()) {
+			size_t row_pitch = buffer_row_pitch ? buffer_row_pitch : region[0];
+			size_t slice_pitch = buffer_slice_pitch ? buffer_slice_pitch : row_pitch * region[1];
+			GetCommandRecorder().Write(buffer(), buffer_offset[2] * slice_pitch + buffer_offset[1] * row_pitch + buffer_offset[0],
+				(region[2] - 1) * slice_pitch + (region[1] - 1) * row_pitch + region[0], nullptr);
+		}
+		return cl::CommandQueue::enqueueWriteBufferRect(buffer, blocking, buffer_offset, host_offset, region, buffer_row_pitch,
+			buffer_slice_pitch, host_row_pitch, host_slice_pitch, ptr, events, event);
+	}
+
+	cl_int enqueueReadBufferRect(const cl::Buffer& buffer, cl_bool blocking, const cl::array<size_t, 3>& buffer_offset,
+		const cl::array<size_t, 3>& host_offset, const cl::array<size_t, 3>& region, size_t buffer_row_pitch, size_t buffer_slice_pitch,
+		size_t host_row_pitch, size_t host_slice_pitch, void* ptr, const vector<cl::Event>* events = nullptr, cl::Event* event = nullptr) const {
+		if (GetCommandRecorder().IsOpen()) {
+			size_t row_pitch = buffer_row_pitch ? buffer_row_pitch : region[0];
+			size_t slice_pitch = buffer_slice_pitch ? buffer_slice_pitch : row_pitch * region[1];
+			GetCommandRecorder().Read(buffer(), buffer_offset[2] * slice_pitch + buffer_offset[1] * row_pitch + buffer_offset[0],
+				(region[2] - 1) * slice_pitch + (region[1] - 1) * row_pitch + region[0]);
+		}
+		return cl::CommandQueue::enqueueReadBufferRect(buffer, blocking, buffer_offset, host_offset, region, buffer_row_pitch,
+			buffer_slice_pitch, host_row_pitch, host_slice_pitch, ptr, events, event);
+	}
+
+	template <typename P>
+	cl_int enqueueFillBuffer(const cl::Buffer& buffer, P pattern, size_t offset, size_t size,
+		const vector<cl::Event>* events = nullptr, cl::Event* event = nullptr) const {
+		if (GetCommandRecorder().IsOpen()) GetCommandRecorder().Fill(buffer(), offset, size, &pattern, sizeof(P));
+		return cl::CommandQueue::enqueueFillBuffer(buffer, pattern, offset, size, events, event);
+	}
+
+	cl_int enqueueCopyBuffer(const cl::Buffer& source, const cl::Buffer& destination, size_t source_offset, size_t destination_offset,
+		size_t size, const vector<cl::Event>* events = nullptr, cl::Event* event = nullptr) const {
+		if (GetCommandRecorder().IsOpen()) GetCommandRecorder().Copy(source(), destination(), source_offset, destination_offset, size);
+		return cl::CommandQueue::enqueueCopyBuffer(source, destination, source_offset, destination_offset, size, events, event);
+	}
+
+	cl_int enqueueNDRangeKernel(const cl::Kernel& kernel, const cl::NDRange& offset, const cl::NDRange& global,
+		const cl::NDRange& local = cl::NullRange, const vector<cl::Event>* events = nullptr, cl::Event* event = nullptr) const {
+		if (GetCommandRecorder().IsOpen())
+			GetCommandRecorder().Kernel(kernel(), kernel.getInfo<CL_KERNEL_FUNCTION_NAME>(), offset, global, local);
+		return cl::CommandQueue::enqueueNDRangeKernel(kernel, offset, global, local, events, event);
+	}
+};
+
+//kernel whose arguments are reported to the recorder, so that launches through a RecordingQueue carry them
+class RecordingKernel : public cl::Kernel {
+public:
+	RecordingKernel() {}
+	RecordingKernel(const cl::Program& program, const char* name) : cl::Kernel(program, name) {
+		if (GetCommandRecorder().IsOpen()) GetCommandRecorder().ClearArgs((*this)());
+	}
+
+	template <typename T>
+	cl_int setArg(cl_uint index, const T& value) {
+		if (GetCommandRecorder().IsOpen()) GetCommandRecorder().SetArg((*this)(), index, TRACE_ARG_VALUE, &value, sizeof(T));
+		return cl::Kernel::setArg(index, value);
+	}
+
+	cl_int setArg(cl_uint index, const cl::Buffer& value) {
+		if (GetCommandRecorder().IsOpen()) {
+			cl_mem handle = value();
+			GetCommandRecorder().SetArg((*this)(), index, TRACE_ARG_BUFFER, &handle, sizeof(handle));
+		}
+		return cl::Kernel::setArg(index, value);
+	}
+
+	cl_int setArg(cl_uint index, const cl::LocalSpaceArg& value) {
+		if (GetCommandRecorder().IsOpen()) {
+			uint64_t size = value.size_;
+			GetCommandRecorder().SetArg((*this)(), index, TRACE_ARG_LOCAL, &size, sizeof(size));
+		}
+		return cl::Kernel::setArg(index, value);
+	}
+};
+
+struct DeviceAllocation {
+	string site;
+	size_t bytes;
+};
+
+void CL_CALLBACK ReleaseDeviceAllocation(cl_mem, void* user_data) {
+	DeviceAllocation* allocation = (DeviceAllocation*)user_data;
+	GetMemoryTracker().Release(allocation->site, allocation->bytes, true);
+	delete allocation;
+}
+
+//creates a buffer whose size is accounted to the given site until the runtime destroys it
+cl::Buffer TrackedBuffer(const cl::Context& context, cl_mem_flags flags, size_t size, const string& site, void* host_ptr = nullptr) {
+	cl::Buffer buffer(context, flags, size, host_ptr);
+	GetMemoryTracker().Allocate(site, size, true);
+	clSetMemObjectDestructorCallback(buffer(), ReleaseDeviceAllocation, new DeviceAllocation{ site, size });
+	if (GetCommandRecorder().IsOpen()) GetCommandRecorder().Alloc(buffer(), size, flags, host_ptr);
+	return buffer;
+}
+
+//candidate local shapes for 2D image kernels: wide rows suit row-major images, square tiles suit 2D caches
+const size_t LOCAL_SHAPES_2D[][2] = {
+	{ 256, 1 }, { 128, 2 }, { 64, 4 }, { 32, 8 }, { 16, 16 }, { 8, 32 },
+	{ 128, 1 }, { 64, 2 }, { 32, 4 }, { 16, 8 }, { 8, 8 }
+};
+
+//picks the fastest local shape for a 2D launch of a kernel whose arguments are already set
+//candidates are pruned per shape: a shape must fit the device with its own local memory footprint (see GetOccupancy),
+//and only the shapes with the best lane efficiency (group size against the kernel's preferred multiple) are kept.
+//set_shape is called with each shape before it is checked and timed, for kernels whose local arguments grow with the
+//group (e.g. a tile and its halo): it sets them for that shape, so the footprint read back is the shape's own
+//each remaining candidate is timed twice (the first run absorbs warm-up) over the width x height range
+//with device_timing off no profiling queue is created and the candidates are timed on the host on main_queue itself
+//the runs are reported to the recorder like any other launch; the kernel must tolerate being run repeatedly
+cl::NDRange TuneLocalShape(const cl::CommandQueue& main_queue, const cl::Kernel& kernel, size_t width, size_t height, bool device_timing = true,
+	const function<void(size_t, size_t)>& set_shape = nullptr) {
+	RecordingQueue queue(device_timing ? ProfilingQueue(main_queue) : main_queue);
+	cl::Device device = queue.getInfo<CL_QUEUE_DEVICE>();
+	KernelResources resources = GetKernelResources(kernel, device);
+	vector<size_t> max_items = device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
+
+	vector<pair<size_t, size_t>> candidates;
+	double best_efficiency = 0;
+	for (const auto& shape : LOCAL_SHAPES_2D) {
+		if ((shape[0] > max_items[0]) || (shape[1] > max_items[1]))
+			continue;
+		if (set_shape) {
+			set_shape(shape[0], shape[1]);
+			resources = GetKernelResources(kernel, device);
+		}
+		Occupancy occupancy = GetOccupancy(resources, device, shape[0] * shape[1]);
+		if (occupancy.groups_per_unit == 0)
+			continue;
+		if (occupancy.lane_efficiency > best_efficiency) {
+			best_efficiency = occupancy.lane_efficiency;
+			candidates.clear();
+		}
+		if (occupancy.lane_efficiency == best_efficiency)
+			candidates.emplace_back(shape[0], shape[1]);
+	}
+
+	cl::NDRange best(1, 1);
+	cl_ulong best_time = 0;
+	for (const auto& shape : candidates) {
+		if (set_shape)
+			set_shape(shape.first, shape.second);
+		cl_ulong time = 0;
+		try {
+			for (int run = 0; run < 2; run++) {
+				cl::Event event;
+				auto start = chrono::steady_clock::now();
+				queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(RoundUp(width, shape.first), RoundUp(height, shape.second)),
+					cl::NDRange(shape.first, shape.second), nullptr, &event);
+				cl_ulong run_time = (cl_ulong)(CommandSeconds(queue, event, start) * 1e9);
+				if ((run == 0) || (run_time < time))
+					time = run_time;
+			}
+		}
+		catch (const cl::Error&) {
+			continue; //e.g. not enough local memory for this shape
+		}
+		if ((best_time == 0) || (time < best_time)) {
+			best_time = time;
+			best = cl::NDRange(shape.first, shape.second);
+		}
+	}
+	if (set_shape)
+		set_shape(best[0], best[1]);
+
+	return best;
+}
+
+//number of NUMA nodes the kernel reports online (e.g. "0-1"), 1 when unknown
+int NumaNodeCount() {
+	ifstream file("/sys/devices/system/node/online");
+	int first = 0, last = 0;
+	char dash = 0;
+	if (!(file >> first)) return 1;
+	if (file >> dash >> last) return last + 1;
+	return first + 1;
+}
+
+const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+//host memory for large buffers (images, CL_MEM_USE_HOST_PTR backing), optionally on 2 MB huge pages and on one
+//NUMA node. huge pages come from the reserved pool (MAP_HUGETLB) when it has room, otherwise transparent huge
+//pages are requested with madvise. the node is only a preference (MPOL_PREFERRED) set before the first touch, so
+//the allocation still succeeds when the node is full. other systems get plain page-aligned memory
+class HostBuffer {
+public:
+	HostBuffer(size_t bytes, bool huge_pages, int numa_node, const string& site) : bytes(bytes), site(site) {
+#ifdef __linux__
+		mapped = huge_pages ? RoundUp(bytes, HUGE_PAGE_SIZE) : bytes;
+		if (huge_pages) {
+			data = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			backing = "hugetlb";
+		}
+		if (!huge_pages || (data == MAP_FAILED)) {
+			data = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			backing = "4k";
+			if ((data != MAP_FAILED) && huge_pages && (madvise(data, mapped, MADV_HUGEPAGE) == 0))
+				backing = "thp";
+		}
+		if (data == MAP_FAILED) throw bad_alloc();
+		if ((numa_node >= 0) && (numa_node < 8 * (int)sizeof(unsigned long))) {
+			const int MPOL_PREFERRED_MODE = 1; //MPOL_PREFERRED from numaif.h, which needs libnuma
+			unsigned long node_mask = 1UL << numa_node;
+			if (syscall(SYS_mbind, data, mapped, MPOL_PREFERRED_MODE, &node_mask, 8 * sizeof(node_mask), 0) == 0)
+				backing += ", node " + to_string(numa_node);
+		}
+#else
+		mapped = RoundUp(bytes, 4096);
+		data = aligned_alloc(4096, mapped);
+		if (!data) throw bad_alloc();
+		backing = "4k";
+#endif
+		GetMemoryTracker().Allocate(site, bytes, false);
+	}
+
+	~HostBuffer() {
+#ifdef __linux__
+		munmap(data, mapped);
+#else
+		free(data);
+#endif
+		GetMemoryTracker().Release(site, bytes, false);
+	}
+
+	HostBuffer(const HostBuffer&) = delete;
+
+	void* Data() const { return data; }
+	size_t Size() const { return bytes; }
+	const string& Backing() const { return backing; } //"hugetlb", "thp" or "4k", and the node if it was bound
+
+private:
+	void* data = nullptr;
+	size_t bytes = 0;
+	size_t mapped = 0;
+	string site;
+	string backing;
+};
+
+//measured costs of device work, used to decide whether a small step is worth a launch
+struct CostModel {
+	double launch_latency;     //seconds from enqueue to completion of a trivial kernel
+	double element_time;       //device seconds per element of a simple element-wise kernel
+	double transfer_latency;   //seconds for a tiny blocking transfer
+	double transfer_bandwidth; //bytes per second of a large blocking transfer
+
+	double Launch(size_t elements) const { return launch_latency + elements * element_time; }
+	double Transfer(size_t bytes) const { return transfer_latency + bytes / transfer_bandwidth; }
+};
+
+//calibrates a cost model on the queue's device with a self-contained probe kernel
+//every measurement keeps the fastest of a few repetitions; with device_timing off the kernel time is taken on the host
+//(less the launch latency) on main_queue itself, without creating a profiling queue
+//the probe's buffer, launches and transfers are reported to the recorder, so a replay pays the same start-up cost
+CostModel CalibrateCostModel(const cl::CommandQueue& main_queue, bool device_timing = true) {
+	RecordingQueue queue(device_timing ? ProfilingQueue(main_queue) : main_queue);
+	const size_t large = 1 << 20;
+	const int repetitions = 5;
+	cl::Context context = queue.getInfo<CL_QUEUE_CONTEXT>();
+	cl::Program program(context, string("kernel void probe(global int* A) { A[get_global_id(0)] += 1; }"), true);
+	RecordingKernel probe(program, "probe");
+	cl::Buffer buffer = TrackedBuffer(context, CL_MEM_READ_WRITE, large * sizeof(cl_int), "calibration");
+	vector<cl_int> host(large, 0);
+	probe.setArg(0, buffer);
+
+	CostModel model = { 0, 0, 0, 0 };
+	for (int r = 0; r < repetitions; r++) {
+		auto start = chrono::steady_clock::now();
+		queue.enqueueNDRangeKernel(probe, cl::NullRange, cl::NDRange(1), cl::NullRange);
+		queue.finish();
+		double latency = SecondsSince(start);
+
+		cl::Event event;
+		start = chrono::steady_clock::now();
+		queue.enqueueNDRangeKernel(probe, cl::NullRange, cl::NDRange(large), cl::NullRange, nullptr, &event);
+		double kernel_time = CommandSeconds(queue, event, start);
+		if (!device_timing)
+			kernel_time = max(kernel_time - latency, 0.0);
+		double element_time = kernel_time / large;
+
+		start = chrono::steady_clock::now();
+		queue.enqueueReadBuffer(buffer, CL_TRUE, 0, sizeof(cl_int), host.data());
+		double transfer_latency = SecondsSince(start);
+
+		start = chrono::steady_clock::now();
+		queue.enqueueWriteBuffer(buffer, CL_TRUE, 0, large * sizeof(cl_int), host.data());
+		double transfer_time = SecondsSince(start);
+
+		if ((r == 0) || (latency < model.launch_latency)) model.launch_latency = latency;
+		if ((r == 0) || (element_time < model.element_time)) model.element_time = element_time;
+		if ((r == 0) || (transfer_latency < model.transfer_latency)) model.transfer_latency = transfer_latency;
+		if ((r == 0) || (large * sizeof(cl_int) / transfer_time > model.transfer_bandwidth)) model.transfer_bandwidth = large * sizeof(cl_int) / transfer_time;
+	}
+	return model;
+}
+
+//distributions of the synthetic image generator, numbered as in the generate_image kernel
+enum SyntheticDistribution {
+	SYNTH_UNIFORM,
+	SYNTH_GAUSSIAN,
+	SYNTH_CONSTANT,
+	SYNTH_BIMODAL,
+	SYNTH_SPARSE,
+	SYNTH_NATURAL,
+	SYNTH_COUNT
+};
+
+const char* const SYNTHETIC_DISTRIBUTION_NAMES[SYNTH_COUNT] = { "uniform", "gaussian", "constant", "bimodal", "sparse", "natural" };
+
+//returns the distribution with the given name, or -1 if there is none
+int ParseSyntheticDistribution(const string& name) {
+	for (int d = 0; d < SYNTH_COUNT; d++) {
+		if (name == SYNTHETIC_DISTRIBUTION_NAMES[d])
+			return d;
+	}
+	return -1;
+}
+
+//fills a planar width x height x channels image of ushort pixels with the generate_image kernel of the program
+//bits selects 8-bit (256 levels) or 16-bit values; with scale_to_16bit, 8-bit levels are multiplied by 257 as the loaders do
+void GenerateSyntheticImage(const cl::CommandQueue& queue, const cl::Program& program, const cl::Buffer& image,
+	size_t width, size_t height, size_t channels, int distribution, int bits, bool scale_to_16bit, unsigned int seed, cl::Event* event = nullptr) {
+	cl::Kernel kernel(program, "generate_image");
+	kernel.setArg(0, image);
+	kernel.setArg(1, distribution);
+	kernel.setArg(2, seed);
+	kernel.setArg(3, (bits == 8) ? 256 : 65536);
+	kernel.setArg(4, ((bits == 8) && scale_to_16bit) ? 257 : 1);
+	queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(width, height, channels), cl::NullRange, nullptr, event);
+}
@@ -2,8 +2,13 @@
 #include <vector>
 #include <string>
 #include "Utils.h"
+#include "BatchIO.h"
+#include "TileStore.h"
+#include "Sidecar.h"
 #include "CImg.h"
 #include <cmath>
+#include <chrono>
+#include <memory>
 
 using namespace cimg_library;
 
@@ -13,11 +18,217 @@ void print_help() {
     std::cerr << "  -d : select device" << std::endl;
     std::cerr << "  -l : list all platforms and devices" << std::endl;
     std::cerr << "  -f : input image file" << std::endl;
+    std::cerr << "  --list : text file with one input image per line, processed in order without display" << std::endl;
+    std::cerr << "  -o : output image file, or output directory when processing a --list" << std::endl;
     std::cerr << "  -b : number of bins (default 256, max 256 for 8-bit images)" << std::endl;
-    std::cerr << "  -s : scan type (bl for Blelloch, hs for Hillis-Steele, default bl)" << std::endl;
+    std::cerr << "  -s : scan type (bl for Blelloch, hs for Hillis-Steele, lb for single-pass look-back, default bl)" << std::endl;
+    std::cerr << "  -r : region of interest x,y,w,h to equalise in place (default whole image)" << std::endl;
+    std::cerr << "  -a : row pitch alignment of device images in bytes, e.g. 128 or 256 (default 0, packed rows)" << std::endl;
+    std::cerr << "  -i : in-place mode, back projection overwrites the device input and results go straight into the loaded image" << std::endl;
+    std::cerr << "  --max-memory : host + device memory budget in bytes (K, M, G suffixes), streams the image in strips when exceeded" << std::endl;
+    std::cerr << "  --persistent : always use the persistent work-queue kernels (default: only for heterogeneous tile sets)" << std::endl;
+    std::cerr << "  --schedule : where the scan and LUT steps run, auto (cost model), device or host (default auto)" << std::endl;
+    std::cerr << "  --explain : print the cost model and the placement chosen for each image" << std::endl;
+    std::cerr << "  --profile : instrumentation level, off (no events, no profiling queue), sampled[:N] (one in N images, default 10) or full (default)" << std::endl;
+    std::cerr << "  --no-display : do not open any windows" << std::endl;
+    std::cerr << "  --metrics : write per image, channel and step timings to a CSV file" << std::endl;
+    std::cerr << "  --trace : write per image load/equalise/save timestamps (steady clock) to a CSV file" << std::endl;
+    std::cerr << "  --huge-pages : back the device image and LUT buffers with host memory on 2 MB pages (CL_MEM_USE_HOST_PTR, for CPU devices)" << std::endl;
+    std::cerr << "  --numa-node : n|auto place that host memory on NUMA node n, auto picks the node of the --sub-device partition" << std::endl;
+    std::cerr << "  --occupancy : print the resource usage and theoretical occupancy of the image kernels" << std::endl;
+    std::cerr << "  --io : stdio|uring|threads how a --list batch reads and writes its files (default stdio); uring and threads" << std::endl;
+    std::cerr << "         keep --io-depth reads in flight ahead of the pipeline and write the outputs in the background (PNM files)" << std::endl;
+    std::cerr << "  --io-depth : files in flight for --io uring or threads (default 4)" << std::endl;
+    std::cerr << "  --tiles : also write the input as a tile container with per-tile histograms (a file, or a directory" << std::endl;
+    std::cerr << "            of .tiles files when processing a --list) for region equalisation with tile_roi" << std::endl;
+    std::cerr << "  --tile-size : edge of the --tiles tiles in pixels (default 256)" << std::endl;
+    std::cerr << "  --save-lut : write the histograms, cumulative histograms and LUTs to a sidecar file (a directory of .lut" << std::endl;
+    std::cerr << "               files when processing a --list)" << std::endl;
+    std::cerr << "  --load-lut : apply the LUTs of a sidecar instead of computing them, skipping straight to back projection" << std::endl;
+    std::cerr << "  --record : write every buffer allocation, transfer and kernel launch to a binary trace for replay" << std::endl;
+    std::cerr << "  --sub-device : i,n run on the i-th of n equal partitions of the selected device (batch workers)" << std::endl;
     std::cerr << "  -h : print this message" << std::endl;
 }
 
+// Parses a byte count with an optional K, M or G suffix (powers of 1024), returns 0 if invalid
+size_t parse_byte_size(const char* text) {
+    char* end = nullptr;
+    double value = strtod(text, &end);
+    if (end == text || value < 0) return 0;
+    switch (toupper(*end)) {
+        case 'K': value *= 1024.0; break;
+        case 'M': value *= 1024.0 * 1024.0; break;
+        case 'G': value *= 1024.0 * 1024.0 * 1024.0; break;
+        case '\0': break;
+        default: return 0;
+    }
+    return (size_t)value;
+}
+
+// Tile descriptor for the persistent kernels, laid out as an OpenCL int4 (x, y, w, h)
+struct Tile {
+    cl_int x, y, w, h;
+};
+
+const int persistent_tile_size = 64;
+
+// Splits a w x h region at (x, y) into tiles of at most tile_size x tile_size pixels
+std::vector<Tile> make_tiles(int x, int y, int w, int h, int tile_size) {
+    std::vector<Tile> tiles;
+    for (int ty = 0; ty < h; ty += tile_size) {
+        for (int tx = 0; tx < w; tx += tile_size) {
+            Tile tile = {x + tx, y + ty, std::min(tile_size, w - tx), std::min(tile_size, h - ty)};
+            tiles.push_back(tile);
+        }
+    }
+    return tiles;
+}
+
+// A tile set is heterogeneous when the pixel counts vary by more than half their mean, at which
+// point a static one-tile-per-group launch would leave groups with small tiles idle
+bool is_heterogeneous(const std::vector<Tile>& tiles) {
+    double sum = 0, sum_squares = 0;
+    for (const Tile& tile : tiles) {
+        double pixels = (double)tile.w * tile.h;
+        sum += pixels;
+        sum_squares += pixels * pixels;
+    }
+    double mean = sum / tiles.size();
+    double variance = sum_squares / tiles.size() - mean * mean;
+    return std::sqrt(std::max(0.0, variance)) > 0.5 * mean;
+}
+
+// Per work-group totals of the persistent kernels, summed over launches
+struct LoadBalance {
+    size_t launches = 0;
+    std::vector<size_t> tiles;
+    std::vector<size_t> pixels;
+
+    void add(const std::vector<cl_int>& stats) {
+        size_t groups = stats.size() / 2;
+        tiles.resize(groups, 0);
+        pixels.resize(groups, 0);
+        for (size_t g = 0; g < groups; g++) {
+            tiles[g] += stats[2 * g];
+            pixels[g] += stats[2 * g + 1];
+        }
+        launches++;
+    }
+
+    std::string report(const std::string& name) const {
+        if (launches == 0) return "";
+        size_t total_pixels = 0;
+        for (size_t p : pixels) total_pixels += p;
+        double mean_pixels = (double)total_pixels / pixels.size();
+        std::stringstream sstream;
+        sstream << "Load balance (" << name << "): " << pixels.size() << " work-groups over " << launches << " launches, "
+                << *std::min_element(tiles.begin(), tiles.end()) << "-" << *std::max_element(tiles.begin(), tiles.end()) << " tiles per group, "
+                << "busiest group " << (mean_pixels > 0 ? *std::max_element(pixels.begin(), pixels.end()) / mean_pixels : 0.0) << "x the mean pixels\n";
+        return sstream.str();
+    }
+};
+
+// True for the PNM files the batch I/O layer decodes from memory; other formats are still read by CImg
+bool is_pnm(const std::string& filename) {
+    std::string extension = filename.substr(filename.find_last_of('.') + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    return extension == "pgm" || extension == "ppm" || extension == "pnm";
+}
+
+// Decodes a PNM file read by the batch reader through a FILE* over its bytes
+template <typename T>
+CImg<T> load_pnm_memory(const FileView& view) {
+    FILE* file = fmemopen((void*)view.data, view.size, "rb");
+    if (!file) throw CImgIOException("Cannot open file");
+    CImg<T> image;
+    try {
+        image.load_pnm(file);
+    }
+    catch (CImgException&) {
+        fclose(file);
+        throw;
+    }
+    fclose(file);
+    return image;
+}
+
+// Encodes an image as PNM in memory for the batch writer
+template <typename T>
+std::vector<char> save_pnm_memory(const CImg<T>& image) {
+    char* data = nullptr;
+    size_t size = 0;
+    FILE* file = open_memstream(&data, &size);
+    if (!file) throw CImgIOException("Cannot encode output image");
+    image.save_pnm(file);
+    fclose(file);
+    std::vector<char> bytes(data, data + size);
+    free(data);
+    return bytes;
+}
+
+// Seconds on the steady clock, which forked batch workers share on Linux
+double now_seconds() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Inclusive (or, matching scan_bl, exclusive) scan of a histogram on the host
+void host_scan(const std::vector<unsigned int>& histogram, std::vector<unsigned int>& cum_histogram, bool exclusive) {
+    cum_histogram.resize(histogram.size());
+    unsigned int sum = 0;
+    for (size_t i = 0; i < histogram.size(); i++) {
+        if (exclusive) cum_histogram[i] = sum;
+        sum += histogram[i];
+        if (!exclusive) cum_histogram[i] = sum;
+    }
+}
+
+// Host version of the normalize_lut kernel
+void host_normalize_lut(const std::vector<unsigned int>& cum_histogram, std::vector<unsigned short>& lut, float scale, int nr_bins) {
+    for (int id = 0; id < 65536; id++) {
+        int bin = (id * nr_bins) / 65536;
+        if (bin >= nr_bins) bin = nr_bins - 1;
+        lut[id] = (unsigned short)((int)cum_histogram[bin] * scale);
+    }
+}
+
+// Placement of the scan and LUT steps. Both are tiny next to the image steps, so the cost of a launch and
+// its transfers can outweigh doing the work on the host, where the histogram already is after Step 2.
+struct Schedule {
+    bool scan_on_host = false;
+    bool lut_on_host = false;
+};
+
+// Picks the cheapest of the four placements from the calibrated device costs and the measured host
+// seconds per element. A host scan feeding a device LUT uploads the cumulative histogram, a host LUT is
+// uploaded for the back projection, and device results are read back as before.
+Schedule plan_schedule(const CostModel& model, double host_scan_time, double host_lut_time,
+                       size_t hist_size, int channels, bool segmented_scan, bool explain) {
+    size_t hist_bytes = hist_size * sizeof(unsigned int);
+    size_t lut_bytes = 65536 * sizeof(unsigned short);
+    double scan_device = (segmented_scan ? model.Launch(channels * hist_size) : channels * model.Launch(hist_size)) + channels * model.Transfer(hist_bytes);
+    double scan_host = channels * hist_size * host_scan_time;
+    double lut_device = channels * (model.Launch(65536) + model.Transfer(lut_bytes));
+    double lut_host = channels * (65536 * host_lut_time + model.Transfer(lut_bytes));
+
+    Schedule best;
+    double best_cost = 0;
+    for (int placement = 0; placement < 4; placement++) {
+        Schedule schedule;
+        schedule.scan_on_host = (placement & 1) != 0;
+        schedule.lut_on_host = (placement & 2) != 0;
+        double cost = (schedule.scan_on_host ? scan_host : scan_device) + (schedule.lut_on_host ? lut_host : lut_device);
+        if (schedule.scan_on_host && !schedule.lut_on_host) cost += channels * model.Transfer(hist_bytes);
+        if (explain)
+            std::cout << "  scan on " << (schedule.scan_on_host ? "host" : "device") << ", lut on " << (schedule.lut_on_host ? "host" : "device")
+                      << ": " << cost * 1e6 << " us" << std::endl;
+        if (placement == 0 || cost < best_cost) {
+            best = schedule;
+            best_cost = cost;
+        }
+    }
+    return best;
+}
+
 // Helper function to compute the next power of 2
 size_t next_power_of_2(size_t n) {
     if (n == 0) return 1;
@@ -34,66 +245,194 @@ int main(int argc, char **argv) {
     int platform_id = 0;
     int device_id = 0;
     std::string image_filename = "mdr16.ppm"; // Default to 16-bit RGB PPM
-    int num_bins = 256; // Default number of bins
+    int requested_bins = 256; // Default number of bins
     std::string scan_type = "bl"; // Default scan type (Blelloch)
+    std::string roi_string; // Region of interest, empty for the whole image
+    int pitch_alignment = 0; // Row pitch alignment in bytes, 0 for packed rows
+    size_t max_memory = 0; // Host + device memory budget in bytes, 0 for unlimited
+    bool in_place = false; // Single device image buffer per channel, no host channel split
+    std::string list_filename; // Batch input list, empty for the single -f image
+    std::string output_path; // Output file (or directory for a list), empty to not save
+    bool display = true;
+    std::string metrics_filename, trace_filename;
+    std::string record_filename; // Command trace for the replay tool, empty to not record
+    int sub_device_index = 0, sub_device_count = 0; // Equal partition of the device, 0 for the whole device
+    bool force_persistent = false;
+    std::string schedule_mode = "auto"; // Placement of the scan and LUT steps: auto, device or host
+    bool explain = false;
+    bool show_occupancy = false;
+    bool huge_pages = false;
+    std::string numa_option; // NUMA node of the host-backed buffers, empty for no binding
+    std::string io_mode = "stdio"; // File I/O: stdio, uring or threads
+    int io_depth = 4;
+    bool write_failed = false;
+    std::string tiles_path; // Tile container output (or directory for a list), empty to not write one
+    int tile_size = 256;
+    std::string save_lut_path, load_lut_filename; // Histogram sidecars, empty to not write or read one
+    std::string profile_level = "full"; // Instrumentation: off, sampled or full
+    int profile_interval = 10; // Profile one in this many images when sampled
 
     for (int i = 1; i < argc; i++) {
         if ((strcmp(argv[i], "-p") == 0) && (i < (argc - 1))) { platform_id = atoi(argv[++i]); }
         else if ((strcmp(argv[i], "-d") == 0) && (i < (argc - 1))) { device_id = atoi(argv[++i]); }
         else if (strcmp(argv[i], "-l") == 0) { std::cout << ListPlatformsDevices() << std::endl; }
         else if ((strcmp(argv[i], "-f") == 0) && (i < (argc - 1))) { image_filename = argv[++i]; }
-        else if ((strcmp(argv[i], "-b") == 0) && (i < (argc - 1))) { num_bins = atoi(argv[++i]); }
+        else if ((strcmp(argv[i], "-b") == 0) && (i < (argc - 1))) { requested_bins = atoi(argv[++i]); }
         else if ((strcmp(argv[i], "-s") == 0) && (i < (argc - 1))) { scan_type = argv[++i]; }
+        else if ((strcmp(argv[i], "-r") == 0) && (i < (argc - 1))) { roi_string = argv[++i]; }
+        else if ((strcmp(argv[i], "-a") == 0) && (i < (argc - 1))) { pitch_alignment = atoi(argv[++i]); }
+        else if (strcmp(argv[i], "-i") == 0) { in_place = true; }
+        else if ((strcmp(argv[i], "--list") == 0) && (i < (argc - 1))) { list_filename = argv[++i]; }
+        else if ((strcmp(argv[i], "-o") == 0) && (i < (argc - 1))) { output_path = argv[++i]; }
+        else if (strcmp(argv[i], "--persistent") == 0) { force_persistent = true; }
+        else if ((strcmp(argv[i], "--schedule") == 0) && (i < (argc - 1))) { schedule_mode = argv[++i]; }
+        else if (strcmp(argv[i], "--explain") == 0) { explain = true; }
+        else if (strcmp(argv[i], "--occupancy") == 0) { show_occupancy = true; }
+        else if (strcmp(argv[i], "--huge-pages") == 0) { huge_pages = true; }
+        else if ((strcmp(argv[i], "--io") == 0) && (i < (argc - 1))) { io_mode = argv[++i]; }
+        else if ((strcmp(argv[i], "--io-depth") == 0) && (i < (argc - 1))) { io_depth = atoi(argv[++i]); }
+        else if ((strcmp(argv[i], "--tiles") == 0) && (i < (argc - 1))) { tiles_path = argv[++i]; }
+        else if ((strcmp(argv[i], "--tile-size") == 0) && (i < (argc - 1))) { tile_size = atoi(argv[++i]); }
+        else if ((strcmp(argv[i], "--save-lut") == 0) && (i < (argc - 1))) { save_lut_path = argv[++i]; }
+        else if ((strcmp(argv[i], "--load-lut") == 0) && (i < (argc - 1))) { load_lut_filename = argv[++i]; }
+        else if ((strcmp(argv[i], "--numa-node") == 0) && (i < (argc - 1))) { numa_option = argv[++i]; }
+        else if ((strcmp(argv[i], "--profile") == 0) && (i < (argc - 1))) {
+            profile_level = argv[++i];
+            if (profile_level.compare(0, 8, "sampled:") == 0) {
+                profile_interval = atoi(profile_level.c_str() + 8);
+                profile_level = "sampled";
+            }
+            if ((profile_level != "off" && profile_level != "sampled" && profile_level != "full") || profile_interval <= 0) {
+                std::cerr << "Error: Invalid profiling level '" << argv[i] << "'. Use 'off', 'sampled[:N]' or 'full'." << std::endl;
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--no-display") == 0) { display = false; }
+        else if ((strcmp(argv[i], "--metrics") == 0) && (i < (argc - 1))) { metrics_filename = argv[++i]; }
+        else if ((strcmp(argv[i], "--trace") == 0) && (i < (argc - 1))) { trace_filename = argv[++i]; }
+        else if ((strcmp(argv[i], "--record") == 0) && (i < (argc - 1))) { record_filename = argv[++i]; }
+        else if ((strcmp(argv[i], "--sub-device") == 0) && (i < (argc - 1))) {
+            if ((sscanf(argv[++i], "%d,%d", &sub_device_index, &sub_device_count) != 2) ||
+                sub_device_count <= 0 || sub_device_index < 0 || sub_device_index >= sub_device_count) {
+                std::cerr << "Error: Invalid sub-device '" << argv[i] << "', expected i,n with 0 <= i < n" << std::endl;
+                return 1;
+            }
+        }
+        else if ((strcmp(argv[i], "--max-memory") == 0) && (i < (argc - 1))) {
+            max_memory = parse_byte_size(argv[++i]);
+            if (max_memory == 0) {
+                std::cerr << "Error: Invalid memory budget '" << argv[i] << "'" << std::endl;
+                return 1;
+            }
+        }
         else if (strcmp(argv[i], "-h") == 0) { print_help(); return 0; }
     }
 
-    if (num_bins <= 0) {
+    if (requested_bins <= 0) {
         std::cerr << "Error: Number of bins must be positive" << std::endl;
         return 1;
     }
 
+    if (tile_size <= 0) {
+        std::cerr << "Error: Tile size must be positive" << std::endl;
+        return 1;
+    }
+
+    // A sidecar replaces Steps 2 to 4 of every image with its tables
+    HistogramSidecar imported_lut;
+    bool imported = !load_lut_filename.empty();
+    if (imported && !imported_lut.Load(load_lut_filename)) {
+        std::cerr << "Error: Cannot read histogram sidecar '" << load_lut_filename << "'" << std::endl;
+        return 1;
+    }
+
     // Validate scan type
-    if (scan_type != "bl" && scan_type != "hs") {
-        std::cerr << "Error: Invalid scan type '" << scan_type << "'. Use 'bl' for Blelloch or 'hs' for Hillis-Steele." << std::endl;
+    if (scan_type != "bl" && scan_type != "hs" && scan_type != "lb") {
+        std::cerr << "Error: Invalid scan type '" << scan_type << "'. Use 'bl' for Blelloch, 'hs' for Hillis-Steele or 'lb' for look-back." << std::endl;
         return 1;
     }
 
-    cimg::exception_mode(0);
+    if ((io_mode != "stdio" && io_mode != "uring" && io_mode != "threads") || io_depth <= 0) {
+        std::cerr << "Error: Invalid I/O mode '" << io_mode << "' or depth " << io_depth << ". Use 'stdio', 'uring' or 'threads' and a positive depth." << std::endl;
+        return 1;
+    }
 
-    try {
-        // Check bit depth and enforce 8-bit bin cap
-        FILE* file = fopen(image_filename.c_str(), "rb");
-        if (!file) throw CImgIOException("Cannot open file");
-        
-        char magic[3] = {0};
-        int maxval = 0;
-        fscanf(file, "%2s %*d %*d %d", magic, &maxval);
-        fclose(file);
+    if (schedule_mode != "auto" && schedule_mode != "device" && schedule_mode != "host") {
+        std::cerr << "Error: Invalid schedule '" << schedule_mode << "'. Use 'auto', 'device' or 'host'." << std::endl;
+        return 1;
+    }
 
-        bool is_8bit = (maxval <= 255);
-        if (is_8bit && num_bins > 256) {
-            std::cout << "Note: 8-bit image detected (maxval = " << maxval << "). Capping num_bins at 256 (requested " << num_bins << ")." << std::endl;
-            num_bins = 256;
+    // NUMA node of the host-backed buffers. Equal partitions take the compute units in order and a socket's cores
+    // are numbered contiguously, so partition i of n lies on node i * nodes / n
+    int numa_node = -1;
+    if (numa_option == "auto") {
+        if (sub_device_count > 0) numa_node = sub_device_index * NumaNodeCount() / sub_device_count;
+    } else if (!numa_option.empty()) {
+        numa_node = atoi(numa_option.c_str());
+        if (numa_node < 0 || numa_node >= NumaNodeCount()) {
+            std::cerr << "Error: Invalid NUMA node '" << numa_option << "', this system has " << NumaNodeCount() << std::endl;
+            return 1;
         }
+    }
 
-        // Load input image
-        CImg<unsigned short> image_input;
-        if (is_8bit) {
-            CImg<unsigned char> image_8bit(image_filename.c_str());
-            image_input.assign(image_8bit.width(), image_8bit.height(), 1, image_8bit.spectrum());
-            cimg_forXYC(image_input, x, y, c) {
-                image_input(x, y, 0, c) = (unsigned short)(image_8bit(x, y, 0, c) * 257); // Scale 0-255 to 0-65535
-            }
+    if (pitch_alignment < 0 || (pitch_alignment % sizeof(unsigned short)) != 0) {
+        std::cerr << "Error: Row pitch alignment must be a non-negative multiple of " << sizeof(unsigned short) << " bytes" << std::endl;
+        return 1;
+    }
+
+    cimg::exception_mode(0);
+    GetMemoryTracker(); // Constructed before the exit handler is registered, so it outlives it
+    atexit([] { std::cout << GetMemoryTracker().Report(); });
+
+    if (!record_filename.empty() && !GetCommandRecorder().Open(record_filename)) {
+        std::cerr << "Error: Cannot write command trace '" << record_filename << "'" << std::endl;
+        return 1;
+    }
+
+    try {
+        // Input images: the single -f image or every line of the --list file
+        std::vector<std::string> image_filenames;
+        if (list_filename.empty()) {
+            image_filenames.push_back(image_filename);
         } else {
-            image_input = CImg<unsigned short>(image_filename.c_str());
+            std::ifstream list_file(list_filename);
+            if (!list_file) throw CImgIOException("Cannot open image list");
+            for (std::string line; std::getline(list_file, line);) {
+                if (!line.empty()) image_filenames.push_back(line);
+            }
+            display = false;
         }
 
-        CImgDisplay disp_input(image_input, "Input Image");
+        // Setup OpenCL (batch workers each take one partition of the device)
+        cl::Context context = (sub_device_count > 0) ? GetSubDeviceContext(platform_id, device_id, sub_device_index, sub_device_count)
+                                                     : GetContext(platform_id, device_id);
+        std::cout << "Running on " << GetPlatformName(platform_id) << ", " << GetDeviceName(platform_id, device_id);
+        if (sub_device_count > 0)
+            std::cout << " (partition " << sub_device_index << " of " << sub_device_count << ", "
+                      << context.getInfo<CL_CONTEXT_DEVICES>()[0].getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() << " compute units)";
+        std::cout << std::endl;
 
-        // Setup OpenCL
-        cl::Context context = GetContext(platform_id, device_id);
-        std::cout << "Running on " << GetPlatformName(platform_id) << ", " << GetDeviceName(platform_id, device_id) << std::endl;
-        cl::CommandQueue queue(context, context.getInfo<CL_CONTEXT_DEVICES>()[0], CL_QUEUE_PROFILING_ENABLE);
+        // Instrumentation. Full profiles every image, sampled one in profile_interval images and off none, without
+        // ever creating a profiling queue (tuning and calibration then time themselves on the host instead).
+        // Commands of unprofiled images get no events and nothing waits on them, so the runtime can batch them.
+        RecordingQueue profiled_queue, unprofiled_queue;
+        if (profile_level != "off")
+            profiled_queue = RecordingQueue(context, context.getInfo<CL_CONTEXT_DEVICES>()[0], CL_QUEUE_PROFILING_ENABLE);
+        if (profile_level != "full")
+            unprofiled_queue = RecordingQueue(context, context.getInfo<CL_CONTEXT_DEVICES>()[0]);
+        bool profiling = (profile_level != "off");
+        RecordingQueue queue = profiling ? profiled_queue : unprofiled_queue;
+        auto profiled = [&](cl::Event& event) { return profiling ? &event : nullptr; };
+        auto elapsed = [&](const cl::Event& event) {
+            if (!profiling) return 0.0;
+            event.wait();
+            return (event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event.getProfilingInfo<CL_PROFILING_COMMAND_START>()) * 1e-9;
+        };
+        size_t image_index = 0, profiled_images = 0;
+        // Summed load-to-equalised wall time and image counts for the overhead comparison, which leaves out the first
+        // image as it absorbs tuning, calibration and warm-up
+        double profiled_time = 0, unprofiled_time = 0;
+        size_t timed_profiled = 0, timed_unprofiled = 0;
 
         // Load and build kernel code
         cl::Program::Sources sources;
@@ -108,230 +447,778 @@ int main(int argc, char **argv) {
             throw err;
         }
 
-        // Image properties
-        size_t width = image_input.width();
-        size_t height = image_input.height();
-        size_t channels = image_input.spectrum();
-        size_t image_size = width * height;
-        size_t padded_num_bins = next_power_of_2(num_bins);
-        size_t hist_size = (scan_type == "bl") ? padded_num_bins : num_bins;
-
-        // Separate channels
-        std::vector<CImg<unsigned short>> input_channels(channels);
-        for (int c = 0; c < channels; c++) {
-            input_channels[c] = CImg<unsigned short>(width, height, 1, 1);
-            cimg_forXY(image_input, x, y) {
-                input_channels[c](x, y) = image_input(x, y, 0, c);
+        // Cost model for placing the scan and LUT steps, with the host costs measured on a 65536-entry table
+        CostModel cost_model = {0, 0, 0, 0};
+        double host_scan_time = 0, host_lut_time = 0;
+        if (schedule_mode == "auto") {
+            cost_model = CalibrateCostModel(queue, profile_level != "off");
+            std::vector<unsigned int> table(65536, 1), cum_table;
+            std::vector<unsigned short> lut_table(65536);
+            for (int r = 0; r < 5; r++) {
+                double start = now_seconds();
+                host_scan(table, cum_table, false);
+                double scan_time = (now_seconds() - start) / table.size();
+                start = now_seconds();
+                host_normalize_lut(cum_table, lut_table, 1.0f, 65536);
+                double lut_time = (now_seconds() - start) / lut_table.size();
+                if (r == 0 || scan_time < host_scan_time) host_scan_time = scan_time;
+                if (r == 0 || lut_time < host_lut_time) host_lut_time = lut_time;
             }
+            if (explain)
+                std::cout << "Cost model: launch " << cost_model.launch_latency * 1e6 << " us + " << cost_model.element_time * 1e9 << " ns/element, transfer "
+                          << cost_model.transfer_latency * 1e6 << " us + " << cost_model.transfer_bandwidth * 1e-9 << " GB/s, host scan "
+                          << host_scan_time * 1e9 << " ns/element, host lut " << host_lut_time * 1e9 << " ns/element" << std::endl;
         }
 
-        // Device buffers
-        std::vector<cl::Buffer> dev_image_input(channels);
-        std::vector<cl::Buffer> dev_image_output(channels);
-        std::vector<cl::Buffer> dev_histogram(channels);
-        std::vector<cl::Buffer> dev_cum_histogram(channels);
-        std::vector<cl::Buffer> dev_lut(channels);
-
-        for (int c = 0; c < channels; c++) {
-            dev_image_input[c] = cl::Buffer(context, CL_MEM_READ_ONLY, image_size * sizeof(unsigned short));
-            dev_image_output[c] = cl::Buffer(context, CL_MEM_WRITE_ONLY, image_size * sizeof(unsigned short));
-            dev_histogram[c] = cl::Buffer(context, CL_MEM_READ_WRITE, hist_size * sizeof(unsigned int));
-            dev_cum_histogram[c] = cl::Buffer(context, CL_MEM_READ_WRITE, hist_size * sizeof(unsigned int));
-            dev_lut[c] = cl::Buffer(context, CL_MEM_READ_WRITE, 65536 * sizeof(unsigned short));
+        // Machine-readable metrics and trace, merged across workers by the batch driver
+        const char* step_names[] = {"input", "histogram", "scan", "lut", "back_project"};
+        std::ofstream metrics_file, trace_file;
+        if (!metrics_filename.empty()) {
+            metrics_file.open(metrics_filename);
+            metrics_file << "image,channel,step,transfer_time,kernel_time,total_time,work,span\n";
+        }
+        if (!trace_filename.empty()) {
+            trace_file.open(trace_filename);
+            trace_file << std::fixed << "image,pixels,stage,start,end\n";
         }
 
-        // Metrics structure
-        struct StepMetrics {
-            double transfer_time = 0;
-            double kernel_time = 0;
-            double total_time = 0;
-            size_t work = 0;
-            size_t span = 0;
+        // Persistent kernels: one work-group per compute unit, a shared tile counter and per-group statistics
+        size_t persistent_groups = queue.getInfo<CL_QUEUE_DEVICE>().getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+        cl::Buffer dev_tile_counter = TrackedBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_int), "dev_tile_counter");
+        cl::Buffer dev_tile_stats = TrackedBuffer(context, CL_MEM_READ_WRITE, 2 * persistent_groups * sizeof(cl_int), "dev_tile_stats");
+        LoadBalance hist_balance, backproject_balance;
+
+        // Runs a persistent kernel whose arguments from tiles_arg on are (tiles, tile_count, next_tile, stats)
+        auto run_persistent = [&](RecordingKernel& kernel, int tiles_arg, std::vector<Tile>& tiles, LoadBalance& balance, cl::Event* event) {
+            cl::Buffer dev_tiles = TrackedBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, tiles.size() * sizeof(Tile), "dev_tiles", tiles.data());
+            queue.enqueueFillBuffer(dev_tile_counter, (cl_int)0, 0, sizeof(cl_int));
+            kernel.setArg(tiles_arg, dev_tiles);
+            kernel.setArg(tiles_arg + 1, (int)tiles.size());
+            kernel.setArg(tiles_arg + 2, dev_tile_counter);
+            kernel.setArg(tiles_arg + 3, dev_tile_stats);
+            size_t local = std::min((size_t)256, kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(queue.getInfo<CL_QUEUE_DEVICE>()));
+            queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(persistent_groups * local), cl::NDRange(local), nullptr, profiled(*event));
+            std::vector<cl_int> stats(2 * persistent_groups);
+            queue.enqueueReadBuffer(dev_tile_stats, CL_TRUE, 0, stats.size() * sizeof(cl_int), stats.data());
+            balance.add(stats);
         };
-        std::vector<std::vector<StepMetrics>> metrics(channels, std::vector<StepMetrics>(5));
-
-        // Visualization displays
-        std::vector<CImgDisplay> disp_hist(channels);
-        std::vector<CImgDisplay> disp_cum_hist(channels);
-        std::vector<CImgDisplay> disp_norm_cum_hist(channels);
-
-        // Process each channel
-        size_t local_size = 256; // Fixed for simplicity; ideally query device
-        for (int c = 0; c < channels; c++) {
-            // Step 1: Input Transfer and Initialization
-            cl::Event event1a, event1b;
-            queue.enqueueWriteBuffer(dev_image_input[c], CL_TRUE, 0, image_size * sizeof(unsigned short), input_channels[c].data(), nullptr, &event1a);
-            std::vector<unsigned int> zeros(hist_size, 0);
-            queue.enqueueWriteBuffer(dev_histogram[c], CL_TRUE, 0, hist_size * sizeof(unsigned int), zeros.data(), nullptr, &event1b);
-            event1a.wait();
-            event1b.wait();
-            metrics[c][0].transfer_time = (event1a.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event1a.getProfilingInfo<CL_PROFILING_COMMAND_START>() +
-                                           event1b.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event1b.getProfilingInfo<CL_PROFILING_COMMAND_START>()) * 1e-9;
-            metrics[c][0].total_time = metrics[c][0].transfer_time;
-            metrics[c][0].work = image_size + hist_size; // n + h or n + padded_h
-            metrics[c][0].span = 1; // Parallel transfers
-
-            // Step 2: Histogram Calculation
-            cl::Event event2a, event2b;
-            cl::Kernel hist_kernel(program, "hist_local");
-            size_t global_size = ((image_size + local_size - 1) / local_size) * local_size;
-            hist_kernel.setArg(0, dev_image_input[c]);
-            hist_kernel.setArg(1, dev_histogram[c]);
+
+        // Tuned local shapes of hist_local and back_project per region size, reused across images
+        std::map<std::pair<size_t, size_t>, std::pair<cl::NDRange, cl::NDRange>> tuned_shapes;
+
+        CImgDisplay disp_input, disp_output;
+        std::vector<CImgDisplay> disp_hist, disp_cum_hist, disp_norm_cum_hist;
+
+        // Batch I/O: the reader keeps the next io_depth files in flight while the current one is equalised, and
+        // the writer saves outputs in the background, so the pipeline does not stall on the disks
+        std::unique_ptr<BatchReader> reader;
+        std::unique_ptr<BatchWriter> writer;
+        if (io_mode != "stdio") {
+            // Only PNM files are decoded from the bytes read; CImg loads the others by name, so the reader skips them
+            std::vector<bool> decoded_in_memory;
+            for (const std::string& image_filename : image_filenames) decoded_in_memory.push_back(is_pnm(image_filename));
+            reader.reset(new BatchReader(image_filenames, io_depth, io_mode == "uring", decoded_in_memory));
+            if (!output_path.empty()) writer.reset(new BatchWriter(io_depth, io_mode == "uring"));
+            std::cout << "Batch I/O: reads " << reader->Backend() << (writer ? ", writes " + writer->Backend() : "") << std::endl;
+        }
+
+        for (const std::string& image_filename : image_filenames) {
+            profiling = (profile_level == "full") || (profile_level == "sampled" && image_index % profile_interval == 0);
+            queue = profiling ? profiled_queue : unprofiled_queue;
+            image_index++;
+            double load_start = now_seconds();
+            int num_bins = requested_bins;
+
+            // Check bit depth and enforce 8-bit bin cap
+            FileView view;
+            if (reader) reader->Next(view);
+            if (reader && !view.ok) throw CImgIOException("Cannot open file");
+            bool from_memory = reader && !view.skipped;
+
+            char magic[3] = {0};
+            int maxval = 0;
+            if (from_memory) {
+                std::string header(view.data, std::min(view.size, (size_t)256));
+                sscanf(header.c_str(), "%2s %*d %*d %d", magic, &maxval);
+            } else {
+                FILE* file = fopen(image_filename.c_str(), "rb");
+                if (!file) throw CImgIOException("Cannot open file");
+                fscanf(file, "%2s %*d %*d %d", magic, &maxval);
+                fclose(file);
+            }
+
+            bool is_8bit = (maxval <= 255);
+            if (is_8bit && num_bins > 256) {
+                std::cout << "Note: 8-bit image detected (maxval = " << maxval << "). Capping num_bins at 256 (requested " << num_bins << ")." << std::endl;
+                num_bins = 256;
+            }
+
+            // Load input image
+            CImg<unsigned short> image_input;
+            if (is_8bit) {
+                CImg<unsigned char> image_8bit = from_memory ? load_pnm_memory<unsigned char>(view) : CImg<unsigned char>(image_filename.c_str());
+                HostAllocation track_image_8bit("image_8bit", image_8bit.size());
+                image_input.assign(image_8bit.width(), image_8bit.height(), 1, image_8bit.spectrum());
+                cimg_forXYC(image_input, x, y, c) {
+                    image_input(x, y, 0, c) = (unsigned short)(image_8bit(x, y, 0, c) * 257); // Scale 0-255 to 0-65535
+                }
+            } else {
+                image_input = from_memory ? load_pnm_memory<unsigned short>(view) : CImg<unsigned short>(image_filename.c_str());
+            }
+            HostAllocation track_image_input("image_input", image_input.size() * sizeof(unsigned short));
+
+            if (display) disp_input.assign(image_input, "Input Image");
+            double load_end = now_seconds();
+
+            // Image properties
+            size_t width = image_input.width();
+            size_t height = image_input.height();
+            size_t channels = image_input.spectrum();
+            size_t image_size = width * height;
+
+            uint64_t source_hash = 0;
+            if (imported || !save_lut_path.empty())
+                source_hash = HashSamples(image_input.data(), image_input.size() * sizeof(unsigned short));
+            if (imported) {
+                if (imported_lut.channels != (int)channels) {
+                    std::cerr << "Error: Sidecar '" << load_lut_filename << "' has " << imported_lut.channels << " channels, the image " << channels << std::endl;
+                    return 1;
+                }
+                num_bins = imported_lut.bins;
+                std::cout << "LUTs: " << imported_lut.bins << " bins (" << imported_lut.scan << " scan) from '" << load_lut_filename << "', "
+                          << (imported_lut.source_hash == source_hash ? "computed on this image" : "computed on another image") << std::endl;
+            }
+
+            // Region of interest, equalised in place inside the full image
+            int roi[4] = {0, 0, (int)width, (int)height}; // x, y, w, h
+            if (!roi_string.empty()) {
+                if ((sscanf(roi_string.c_str(), "%d,%d,%d,%d", &roi[0], &roi[1], &roi[2], &roi[3]) != 4) ||
+                    roi[0] < 0 || roi[1] < 0 || roi[2] <= 0 || roi[3] <= 0 ||
+                    (size_t)(roi[0] + roi[2]) > width || (size_t)(roi[1] + roi[3]) > height) {
+                    std::cerr << "Error: Invalid region of interest '" << roi_string << "' for a " << width << "x" << height << " image" << std::endl;
+                    return 1;
+                }
+            }
+            size_t roi_size = (size_t)roi[2] * roi[3];
+            bool full_roi = (roi_size == image_size);
+
+            // Device images are stored row by row, each row padded to the requested alignment
+            size_t row_pitch_bytes = width * sizeof(unsigned short);
+            if (pitch_alignment > 0) row_pitch_bytes = RoundUp(row_pitch_bytes, pitch_alignment);
+            size_t row_pitch = row_pitch_bytes / sizeof(unsigned short); // In pixels
+
+            size_t padded_num_bins = next_power_of_2(num_bins);
+            size_t hist_size = (scan_type == "bl") ? padded_num_bins : num_bins;
+
+            Schedule schedule;
+            if (schedule_mode == "auto") {
+                if (explain) std::cout << "Estimated scan and LUT cost for " << channels << " x " << hist_size << " bins:" << std::endl;
+                schedule = plan_schedule(cost_model, host_scan_time, host_lut_time, hist_size, channels, scan_type != "lb", explain);
+            } else {
+                schedule.scan_on_host = schedule.lut_on_host = (schedule_mode == "host");
+            }
+            if (explain)
+                std::cout << "Schedule: scan on " << (schedule.scan_on_host ? "host" : "device") << ", lut on " << (schedule.lut_on_host ? "host" : "device") << std::endl;
+
+            // Memory plan: by default every channel is resident on the device with separate input and output
+            // buffers, and the host keeps split and recombined copies of the image. In-place mode (-i) keeps one
+            // device buffer per channel and reads results straight back into image_input. If the plan would
+            // exceed --max-memory, the ROI rows are streamed through strip buffers shared by all channels and
+            // the host side also works in place.
+            size_t image_bytes = image_size * channels * sizeof(unsigned short);
+            size_t table_bytes = channels * (2 * hist_size * sizeof(unsigned int) + 65536 * sizeof(unsigned short));
+            size_t image_buffers = in_place ? 1 : 2; // Device image buffers per channel (or per strip)
+            size_t resident_bytes = image_bytes + table_bytes + channels * image_buffers * row_pitch_bytes * height;
+            if (!in_place) resident_bytes += 2 * image_bytes + image_size * sizeof(unsigned short); // input_channels, output_image, output_buffer
+            bool streaming = (max_memory > 0) && (resident_bytes > max_memory);
+            bool host_in_place = in_place || streaming;
+            size_t strip_rows = roi[3]; // ROI rows handled per pass
+            if (streaming) {
+                size_t fixed_bytes = image_bytes + table_bytes;
+                strip_rows = (max_memory > fixed_bytes) ? (max_memory - fixed_bytes) / (image_buffers * row_pitch_bytes) : 0;
+                if (strip_rows == 0) {
+                    std::cout << "Note: memory budget of " << max_memory << " B is below the " << fixed_bytes << " B needed outside the image strips, streaming single rows." << std::endl;
+                    strip_rows = 1;
+                }
+                strip_rows = std::min(strip_rows, (size_t)roi[3]);
+                std::cout << "Memory budget: " << max_memory << " B < " << resident_bytes << " B resident, streaming " << strip_rows << "-row strips" << std::endl;
+            }
+            size_t strip_count = (roi[3] + strip_rows - 1) / strip_rows;
+            size_t device_image_bytes = row_pitch_bytes * (streaming ? strip_rows : height);
+
+            // Separate channels
+            std::vector<CImg<unsigned short>> input_channels(host_in_place ? 0 : channels);
+            HostAllocation track_input_channels("input_channels", input_channels.size() * image_size * sizeof(unsigned short));
+            for (int c = 0; c < input_channels.size(); c++) {
+                input_channels[c] = CImg<unsigned short>(width, height, 1, 1);
+                cimg_forXY(image_input, x, y) {
+                    input_channels[c](x, y) = image_input(x, y, 0, c);
+                }
+            }
+
+            // Host memory behind the image and LUT buffers with --huge-pages or --numa-node. On a CPU device the
+            // kernels then work directly on these pages, so back_project's LUT gathers and the image rows see fewer
+            // TLB misses and no remote-node traffic. Declared first so it outlives the buffers.
+            std::vector<std::unique_ptr<HostBuffer>> host_buffers;
+            auto image_buffer = [&](cl_mem_flags flags, size_t bytes, const std::string& site) {
+                if (!huge_pages && numa_node < 0) return TrackedBuffer(context, flags, bytes, site);
+                host_buffers.emplace_back(new HostBuffer(bytes, huge_pages, numa_node, site + "_host"));
+                return TrackedBuffer(context, flags | CL_MEM_USE_HOST_PTR, bytes, site, host_buffers.back()->Data());
+            };
+
+            // Device buffers (streaming shares one set of strip buffers between all channels, in-place
+            // mode aliases the output to the input)
+            std::vector<cl::Buffer> dev_image_input(channels);
+            std::vector<cl::Buffer> dev_image_output(channels);
+            std::vector<cl::Buffer> dev_histogram(channels);
+            std::vector<cl::Buffer> dev_cum_histogram(channels);
+
+            // The histograms of all channels share one [channels][segment_stride] buffer for the segmented scans,
+            // each segment starting on the device's base address alignment so it can also be a sub-buffer
+            size_t base_align_bytes = queue.getInfo<CL_QUEUE_DEVICE>().getInfo<CL_DEVICE_MEM_BASE_ADDR_ALIGN>() / 8;
+            size_t segment_stride = RoundUp(hist_size * sizeof(unsigned int), base_align_bytes) / sizeof(unsigned int);
+            cl::Buffer dev_histograms = TrackedBuffer(context, CL_MEM_READ_WRITE, channels * segment_stride * sizeof(unsigned int), "dev_histogram");
+            cl::Buffer dev_cum_histograms = TrackedBuffer(context, CL_MEM_READ_WRITE, channels * segment_stride * sizeof(unsigned int), "dev_cum_histogram");
+            std::vector<cl::Buffer> dev_lut(channels);
+
+            for (int c = 0; c < channels; c++) {
+                if (!streaming || c == 0) {
+                    dev_image_input[c] = image_buffer(in_place ? CL_MEM_READ_WRITE : CL_MEM_READ_ONLY, device_image_bytes, "dev_image_input");
+                    dev_image_output[c] = in_place ? dev_image_input[c] : image_buffer(CL_MEM_READ_WRITE, device_image_bytes, "dev_image_output");
+                } else {
+                    dev_image_input[c] = dev_image_input[0];
+                    dev_image_output[c] = dev_image_output[0];
+                }
+                cl_buffer_region segment = {c * segment_stride * sizeof(unsigned int), hist_size * sizeof(unsigned int)};
+                dev_histogram[c] = dev_histograms.createSubBuffer(CL_MEM_READ_WRITE, CL_BUFFER_CREATE_TYPE_REGION, &segment);
+                dev_cum_histogram[c] = dev_cum_histograms.createSubBuffer(CL_MEM_READ_WRITE, CL_BUFFER_CREATE_TYPE_REGION, &segment);
+                dev_lut[c] = image_buffer(CL_MEM_READ_WRITE, 65536 * sizeof(unsigned short), "dev_lut");
+            }
+
+            if (!host_buffers.empty() && image_index == 1)
+                std::cout << "Host-backed image buffers: " << host_buffers.front()->Backing() << std::endl;
+
+            // Copies image rows [y, y + rows) of one channel between host and device. Resident buffers hold the
+            // whole image; a streaming buffer holds the strip starting at row y. When the host works in place
+            // only the ROI columns move, the rest of image_input already holds its final values.
+            auto transfer_rows = [&](bool to_device, const cl::Buffer& buffer, unsigned short* host, size_t y, size_t rows, cl::Event* event) {
+                size_t x_bytes = host_in_place ? roi[0] * sizeof(unsigned short) : 0;
+                cl::array<size_t, 3> buffer_origin = {x_bytes, streaming ? 0 : y, 0};
+                cl::array<size_t, 3> host_origin = {x_bytes, y, 0};
+                cl::array<size_t, 3> region = {(host_in_place ? roi[2] : width) * sizeof(unsigned short), rows, 1};
+                if (to_device)
+                    queue.enqueueWriteBufferRect(buffer, CL_TRUE, buffer_origin, host_origin, region,
+                                                 row_pitch_bytes, 0, width * sizeof(unsigned short), 0, host, nullptr, profiled(*event));
+                else
+                    queue.enqueueReadBufferRect(buffer, CL_TRUE, buffer_origin, host_origin, region,
+                                                row_pitch_bytes, 0, width * sizeof(unsigned short), 0, host, nullptr, profiled(*event));
+                return elapsed(*event);
+            };
+
+            // Metrics structure
+            struct StepMetrics {
+                double transfer_time = 0;
+                double kernel_time = 0;
+                double total_time = 0;
+                size_t work = 0;
+                size_t span = 0;
+            };
+            std::vector<std::vector<StepMetrics>> metrics(channels, std::vector<StepMetrics>(5));
+
+            // Visualization displays
+            if (display) {
+                disp_hist.resize(channels);
+                disp_cum_hist.resize(channels);
+                disp_norm_cum_hist.resize(channels);
+            }
+
+            // Image kernels and their tuned 2-D local shapes (tuned once on the first channel's buffers,
+            // before Step 1 zeroes the histogram the tuning runs accumulate into)
+            RecordingKernel hist_kernel(program, "hist_local");
+            hist_kernel.setArg(0, dev_image_input[0]);
+            hist_kernel.setArg(1, dev_histogram[0]);
             hist_kernel.setArg(2, num_bins);
             hist_kernel.setArg(3, cl::Local(num_bins * sizeof(unsigned int)));
-            queue.enqueueNDRangeKernel(hist_kernel, cl::NullRange, cl::NDRange(global_size), cl::NDRange(local_size), nullptr, &event2a);
-            event2a.wait();
-            metrics[c][1].kernel_time = (event2a.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event2a.getProfilingInfo<CL_PROFILING_COMMAND_START>()) * 1e-9;
-            std::vector<unsigned int> histogram(hist_size);
-            queue.enqueueReadBuffer(dev_histogram[c], CL_TRUE, 0, hist_size * sizeof(unsigned int), histogram.data(), nullptr, &event2b);
-            event2b.wait();
-            metrics[c][1].transfer_time = (event2b.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event2b.getProfilingInfo<CL_PROFILING_COMMAND_START>()) * 1e-9;
-            metrics[c][1].total_time = metrics[c][1].kernel_time + metrics[c][1].transfer_time;
-            metrics[c][1].work = image_size + num_bins; // n + h
-            metrics[c][1].span = (size_t)std::ceil(std::log2((double)image_size / local_size)) + 1; // log(n/L) + 1
-
-            CImg<unsigned char> hist_img(num_bins, 200, 1, 1, 0);
-            const unsigned char white[] = {255};
-            unsigned int max_hist = *std::max_element(histogram.begin(), histogram.begin() + num_bins);
-            for (int x = 0; x < num_bins; x++) {
-                int height = (int)((histogram[x] / (float)max_hist) * 200);
-                hist_img.draw_line(x, 200, x, 200 - height, white);
-            }
-            disp_hist[c] = CImgDisplay(hist_img, ("Histogram Channel " + std::to_string(c + 1)).c_str());
-
-            // Step 3: Cumulative Histogram
-            cl::Event event3a, event3b;
-            if (scan_type == "bl") {
-                cl::Kernel scan_kernel(program, "scan_bl");
-                scan_kernel.setArg(0, dev_histogram[c]);
+            RecordingKernel backproject_kernel(program, "back_project");
+            backproject_kernel.setArg(0, dev_image_input[0]);
+            backproject_kernel.setArg(1, dev_image_output[0]);
+            backproject_kernel.setArg(2, dev_lut[0]);
+            RecordingKernel hist_persistent_kernel(program, "hist_persistent");
+            hist_persistent_kernel.setArg(2, num_bins);
+            hist_persistent_kernel.setArg(3, cl::Local(num_bins * sizeof(unsigned int)));
+            hist_persistent_kernel.setArg(4, (int)row_pitch);
+            RecordingKernel backproject_persistent_kernel(program, "back_project_persistent");
+            backproject_persistent_kernel.setArg(3, (int)row_pitch);
+
+            // Sets the ROI rows [region_y, region_y + region_h) of the current device buffer
+            auto set_region = [&](RecordingKernel& kernel, size_t region_y, size_t region_h) {
+                kernel.setArg(4, roi[2]);
+                kernel.setArg(5, (int)region_h);
+                kernel.setArg(6, (int)row_pitch);
+                kernel.setArg(7, roi[0]);
+                kernel.setArg(8, (int)region_y);
+            };
+            size_t first_region_y = streaming ? 0 : roi[1];
+            size_t first_region_h = strip_rows;
+            set_region(hist_kernel, first_region_y, first_region_h);
+            set_region(backproject_kernel, first_region_y, first_region_h);
+            std::pair<size_t, size_t> tuning_key(roi[2], first_region_h);
+            if (tuned_shapes.find(tuning_key) == tuned_shapes.end()) {
+                tuned_shapes[tuning_key] = std::make_pair(TuneLocalShape(queue, hist_kernel, roi[2], first_region_h, profile_level != "off"),
+                                                          TuneLocalShape(queue, backproject_kernel, roi[2], first_region_h, profile_level != "off"));
+            }
+            cl::NDRange hist_local_shape = tuned_shapes[tuning_key].first;
+            cl::NDRange backproject_local_shape = tuned_shapes[tuning_key].second;
+            size_t local_size = hist_local_shape[0] * hist_local_shape[1];
+            std::cout << "Region: " << roi[2] << "x" << roi[3] << " at (" << roi[0] << ", " << roi[1] << "), row pitch " << row_pitch_bytes << " bytes" << std::endl;
+            std::cout << "Local shapes: hist_local " << hist_local_shape[0] << "x" << hist_local_shape[1]
+                      << ", back_project " << backproject_local_shape[0] << "x" << backproject_local_shape[1] << std::endl;
+            if (show_occupancy) {
+                // Local memory of the histogram kernels grows with the bin count, which is set by now
+                cl::Device device = queue.getInfo<CL_QUEUE_DEVICE>();
+                auto persistent_local = [&](const cl::Kernel& kernel) {
+                    return std::min((size_t)256, kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+                };
+                // The scan in use and normalize_lut, with the local sizes they are launched with in Steps 3 and 4;
+                // normalize_lut leaves its group size to the runtime, so its row shows the largest it may pick
+                const size_t scan_local_size = 256;
+                cl::Kernel scan_kernel(program, (scan_type == "bl") ? "scan_bl_segmented" : (scan_type == "lb") ? "scan_lookback" : "scan_hs_segmented");
+                if (scan_type == "lb") {
+                    scan_kernel.setArg(3, cl::Local(scan_local_size * sizeof(cl_int)));
+                    scan_kernel.setArg(4, cl::Local(scan_local_size * sizeof(cl_int)));
+                }
+                size_t scan_group = (scan_type == "bl") ? padded_num_bins : (scan_type == "lb") ? scan_local_size : (size_t)num_bins;
+                cl::Kernel normalize_kernel(program, "normalize_lut");
+                std::cout << OccupancyReport({ { hist_kernel, local_size },
+                                               { backproject_kernel, backproject_local_shape[0] * backproject_local_shape[1] },
+                                               { hist_persistent_kernel, persistent_local(hist_persistent_kernel) },
+                                               { backproject_persistent_kernel, persistent_local(backproject_persistent_kernel) },
+                                               { scan_kernel, scan_group },
+                                               { normalize_kernel, normalize_kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device) } }, device);
+            }
+
+            // Tile container written as a by-product of Step 2 (--tiles): while a channel's whole image is on the
+            // device, hist_tiles counts the histograms of its tiles there; otherwise WriteTileFile counts them
+            size_t tiles_x = (width + tile_size - 1) / tile_size;
+            size_t tiles_y = (height + tile_size - 1) / tile_size;
+            bool tiles_on_device = !tiles_path.empty() && !streaming && (full_roi || !host_in_place);
+            std::vector<cl_uint> tile_histograms(tiles_on_device ? channels * tiles_x * tiles_y * num_bins : 0);
+            HostAllocation track_tile_histograms("tile_histograms", tile_histograms.size() * sizeof(cl_uint));
+
+            // Histograms kept on the host for the host scan and the displays
+            std::vector<std::vector<unsigned int>> histograms(channels), cum_histograms(channels);
+            HostAllocation track_histograms("histogram", channels * hist_size * sizeof(unsigned int));
+            HostAllocation track_cum_histograms("cum_histogram", channels * hist_size * sizeof(unsigned int));
+
+            // Steps 1 and 2 for each channel
+            for (int c = 0; c < channels; c++) {
+                unsigned short* host_channel = host_in_place ? image_input.data(0, 0, 0, c) : input_channels[c].data();
+
+                // Step 1: Input Transfer and Initialization
+                cl::Event event1a, event1b;
+                std::vector<unsigned int> zeros(hist_size, 0);
+                queue.enqueueWriteBuffer(dev_histogram[c], CL_TRUE, 0, hist_size * sizeof(unsigned int), zeros.data(), nullptr, profiled(event1b));
+                metrics[c][0].transfer_time = elapsed(event1b);
+
+                // Step 2: Histogram Calculation (the input transfer of each strip is accounted to Step 1)
+                cl::Event event2a, event2b;
+                hist_kernel.setArg(0, dev_image_input[c]);
+                hist_kernel.setArg(1, dev_histogram[c]);
+                hist_persistent_kernel.setArg(0, dev_image_input[c]);
+                hist_persistent_kernel.setArg(1, dev_histogram[c]);
+                for (size_t strip = 0; strip < strip_count; strip++) {
+                    size_t strip_y = roi[1] + strip * strip_rows;
+                    size_t strip_h = std::min(strip_rows, roi[1] + roi[3] - strip_y);
+                    if (host_in_place)
+                        metrics[c][0].transfer_time += transfer_rows(true, dev_image_input[c], host_channel, strip_y, strip_h, &event1a);
+                    else
+                        metrics[c][0].transfer_time += transfer_rows(true, dev_image_input[c], host_channel, 0, height, &event1a);
+
+                    if (imported) continue; // The histogram comes from the sidecar, only the input is needed
+                    std::vector<Tile> tiles = make_tiles(roi[0], streaming ? 0 : strip_y, roi[2], strip_h, persistent_tile_size);
+                    if (force_persistent || is_heterogeneous(tiles)) {
+                        run_persistent(hist_persistent_kernel, 5, tiles, hist_balance, &event2a);
+                    } else {
+                        set_region(hist_kernel, streaming ? 0 : strip_y, strip_h);
+                        queue.enqueueNDRangeKernel(hist_kernel, cl::NullRange, cl::NDRange(RoundUp(roi[2], hist_local_shape[0]), RoundUp(strip_h, hist_local_shape[1])),
+                                                   hist_local_shape, nullptr, profiled(event2a));
+                    }
+                    metrics[c][1].kernel_time += elapsed(event2a);
+                }
+                if (tiles_on_device) {
+                    size_t channel_bins = tiles_x * tiles_y * num_bins;
+                    cl::Buffer dev_tile_histograms = TrackedBuffer(context, CL_MEM_WRITE_ONLY, channel_bins * sizeof(cl_uint), "dev_tile_histograms");
+                    RecordingKernel tiles_kernel(program, "hist_tiles");
+                    tiles_kernel.setArg(0, dev_image_input[c]);
+                    tiles_kernel.setArg(1, dev_tile_histograms);
+                    tiles_kernel.setArg(2, num_bins);
+                    tiles_kernel.setArg(3, cl::Local(num_bins * sizeof(unsigned int)));
+                    tiles_kernel.setArg(4, (int)width);
+                    tiles_kernel.setArg(5, (int)height);
+                    tiles_kernel.setArg(6, (int)row_pitch);
+                    tiles_kernel.setArg(7, tile_size);
+                    size_t local = std::min((size_t)256, tiles_kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(queue.getInfo<CL_QUEUE_DEVICE>()));
+                    queue.enqueueNDRangeKernel(tiles_kernel, cl::NullRange, cl::NDRange(tiles_x * local, tiles_y), cl::NDRange(local, 1));
+                    queue.enqueueReadBuffer(dev_tile_histograms, CL_TRUE, 0, channel_bins * sizeof(cl_uint), &tile_histograms[c * channel_bins]);
+                }
+                metrics[c][0].total_time = metrics[c][0].transfer_time;
+                metrics[c][0].work = image_size + hist_size; // n + h or n + padded_h
+                metrics[c][0].span = 1; // Parallel transfers
+
+                std::vector<unsigned int>& histogram = histograms[c];
+                if (imported) {
+                    histogram = imported_lut.histograms[c];
+                } else {
+                    histogram.resize(hist_size);
+                    queue.enqueueReadBuffer(dev_histogram[c], CL_TRUE, 0, hist_size * sizeof(unsigned int), histogram.data(), nullptr, profiled(event2b));
+                    metrics[c][1].transfer_time = elapsed(event2b);
+                }
+                metrics[c][1].total_time = metrics[c][1].kernel_time + metrics[c][1].transfer_time;
+                metrics[c][1].work = roi_size + num_bins; // n + h
+                metrics[c][1].span = (size_t)std::ceil(std::log2(std::max(1.0, (double)roi_size / local_size))) + 1; // log(n/L) + 1
+
+                CImg<unsigned char> hist_img(num_bins, 200, 1, 1, 0);
+                const unsigned char white[] = {255};
+                unsigned int max_hist = *std::max_element(histogram.begin(), histogram.begin() + num_bins);
+                for (int x = 0; x < num_bins; x++) {
+                    int height = (int)((histogram[x] / (float)max_hist) * 200);
+                    hist_img.draw_line(x, 200, x, 200 - height, white);
+                }
+                if (display) disp_hist[c] = CImgDisplay(hist_img, ("Histogram Channel " + std::to_string(c + 1)).c_str());
+            }
+
+            // The input is still intact here, in-place modes only overwrite it during Step 5
+            if (!tiles_path.empty()) {
+                std::string tiles_filename = tiles_path;
+                if (!list_filename.empty()) {
+                    std::string base = image_filename.substr(image_filename.find_last_of('/') + 1);
+                    tiles_filename += "/" + base.substr(0, base.find_last_of('.')) + ".tiles";
+                }
+                if (!WriteTileFile(tiles_filename, image_input.data(), width, height, channels, is_8bit ? 8 : 16, tile_size, num_bins, tile_histograms)) {
+                    std::cerr << "Error: Cannot write tile container '" << tiles_filename << "'" << std::endl;
+                    write_failed = true;
+                }
+            }
+
+            // Step 3: Cumulative Histogram. The Blelloch and Hillis-Steele scans cover the histograms of all channels
+            // in one segmented launch, whose kernel time is shared equally between the channels; the look-back
+            // scan runs per channel.
+            cl::Event event3a;
+            if (imported) {
+                cum_histograms = imported_lut.cum_histograms;
+            } else if (schedule.scan_on_host) {
+                for (int c = 0; c < channels; c++) {
+                    double start = now_seconds();
+                    host_scan(histograms[c], cum_histograms[c], scan_type == "bl");
+                    metrics[c][2].kernel_time = now_seconds() - start;
+                    metrics[c][2].work = hist_size; // h
+                    metrics[c][2].span = hist_size; // Serial
+                    if (!schedule.lut_on_host) { // normalize_lut reads the cumulative histogram on the device
+                        cl::Event event3b;
+                        queue.enqueueWriteBuffer(dev_histogram[c], CL_TRUE, 0, hist_size * sizeof(unsigned int), cum_histograms[c].data(), nullptr, profiled(event3b));
+                        metrics[c][2].transfer_time = elapsed(event3b);
+                    }
+                }
+            } else if (scan_type == "bl") {
+                RecordingKernel scan_kernel(program, "scan_bl_segmented");
+                scan_kernel.setArg(0, dev_histograms);
                 scan_kernel.setArg(1, (int)padded_num_bins);
-                queue.enqueueNDRangeKernel(scan_kernel, cl::NullRange, cl::NDRange(padded_num_bins), cl::NDRange(padded_num_bins), nullptr, &event3a);
-                event3a.wait();
-                metrics[c][2].kernel_time = (event3a.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event3a.getProfilingInfo<CL_PROFILING_COMMAND_START>()) * 1e-9;
-                metrics[c][2].work = 2 * padded_num_bins - 1; // 2h - 1
-                metrics[c][2].span = (size_t)std::ceil(std::log2((double)padded_num_bins)); // log(h)
+                scan_kernel.setArg(2, (int)segment_stride);
+                queue.enqueueNDRangeKernel(scan_kernel, cl::NullRange, cl::NDRange(padded_num_bins, channels), cl::NDRange(padded_num_bins, 1), nullptr, profiled(event3a));
+                for (int c = 0; c < channels; c++) {
+                    metrics[c][2].kernel_time = elapsed(event3a) / channels;
+                    metrics[c][2].work = 2 * padded_num_bins - 1; // 2h - 1
+                    metrics[c][2].span = (size_t)std::ceil(std::log2((double)padded_num_bins)); // log(h)
+                }
+            } else if (scan_type == "lb") {
+                const size_t scan_local_size = 256;
+                size_t tiles = (num_bins + scan_local_size - 1) / scan_local_size;
+                cl::Buffer next_tile = TrackedBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_int), "dev_scan_tiles");
+                cl::Buffer tile_flags = TrackedBuffer(context, CL_MEM_READ_WRITE, tiles * sizeof(cl_int), "dev_scan_tiles");
+                cl::Buffer tile_aggregates = TrackedBuffer(context, CL_MEM_READ_WRITE, tiles * sizeof(cl_int), "dev_scan_tiles");
+                cl::Buffer tile_prefixes = TrackedBuffer(context, CL_MEM_READ_WRITE, tiles * sizeof(cl_int), "dev_scan_tiles");
+                RecordingKernel scan_kernel(program, "scan_lookback");
+                scan_kernel.setArg(2, num_bins);
+                scan_kernel.setArg(3, cl::Local(scan_local_size * sizeof(cl_int)));
+                scan_kernel.setArg(4, cl::Local(scan_local_size * sizeof(cl_int)));
+                scan_kernel.setArg(5, next_tile);
+                scan_kernel.setArg(6, tile_flags);
+                scan_kernel.setArg(7, tile_aggregates);
+                scan_kernel.setArg(8, tile_prefixes);
+                for (int c = 0; c < channels; c++) {
+                    queue.enqueueFillBuffer(next_tile, (cl_int)0, 0, sizeof(cl_int));
+                    queue.enqueueFillBuffer(tile_flags, (cl_int)0, 0, tiles * sizeof(cl_int));
+                    scan_kernel.setArg(0, dev_histogram[c]);
+                    scan_kernel.setArg(1, dev_cum_histogram[c]);
+                    queue.enqueueNDRangeKernel(scan_kernel, cl::NullRange, cl::NDRange(tiles * scan_local_size), cl::NDRange(scan_local_size), nullptr, profiled(event3a));
+                    metrics[c][2].kernel_time = elapsed(event3a);
+                    metrics[c][2].work = num_bins * (size_t)std::ceil(std::log2((double)std::min((size_t)num_bins, scan_local_size))) + tiles; // h * log(L) + tiles
+                    metrics[c][2].span = (size_t)std::ceil(std::log2((double)scan_local_size)) + tiles; // log(L) + look-back chain
+                }
+                queue.enqueueCopyBuffer(dev_cum_histograms, dev_histograms, 0, 0, channels * segment_stride * sizeof(unsigned int));
             } else {
-                cl::Kernel scan_kernel(program, "scan_hs");
-                scan_kernel.setArg(0, dev_histogram[c]);
-                scan_kernel.setArg(1, dev_cum_histogram[c]);
-                queue.enqueueNDRangeKernel(scan_kernel, cl::NullRange, cl::NDRange(num_bins), cl::NullRange, nullptr, &event3a);
-                event3a.wait();
-                metrics[c][2].kernel_time = (event3a.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event3a.getProfilingInfo<CL_PROFILING_COMMAND_START>()) * 1e-9;
-                metrics[c][2].work = num_bins * (size_t)std::ceil(std::log2((double)num_bins)); // h * log(h)
-                metrics[c][2].span = (size_t)std::ceil(std::log2((double)num_bins)); // log(h)
-                queue.enqueueCopyBuffer(dev_cum_histogram[c], dev_histogram[c], 0, 0, num_bins * sizeof(unsigned int));
-            }
-            std::vector<unsigned int> cum_histogram(hist_size);
-            queue.enqueueReadBuffer(dev_histogram[c], CL_TRUE, 0, hist_size * sizeof(unsigned int), cum_histogram.data(), nullptr, &event3b);
-            event3b.wait();
-            metrics[c][2].transfer_time = (event3b.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event3b.getProfilingInfo<CL_PROFILING_COMMAND_START>()) * 1e-9;
-            metrics[c][2].total_time = metrics[c][2].kernel_time + metrics[c][2].transfer_time;
-
-            CImg<unsigned char> cum_hist_img(num_bins, 200, 1, 1, 0);
-            unsigned int max_cum_hist = cum_histogram[num_bins - 1];
-            for (int x = 0; x < num_bins; x++) {
-                int height = (int)((cum_histogram[x] / (float)max_cum_hist) * 200);
-                cum_hist_img.draw_line(x, 200, x, 200 - height, white);
-            }
-            disp_cum_hist[c] = CImgDisplay(cum_hist_img, ("Cumulative Histogram Channel " + std::to_string(c + 1)).c_str());
-
-            // Step 4: Normalize LUT
-            cl::Event event4a, event4b;
-            float scale = 65535.0f / (image_input.width() * image_input.height());
-            cl::Kernel normalize_kernel(program, "normalize_lut");
-            normalize_kernel.setArg(0, dev_histogram[c]);
-            normalize_kernel.setArg(1, dev_lut[c]);
-            normalize_kernel.setArg(2, scale);
-            normalize_kernel.setArg(3, num_bins);
-            queue.enqueueNDRangeKernel(normalize_kernel, cl::NullRange, cl::NDRange(65536), cl::NullRange, nullptr, &event4a);
-            event4a.wait();
-            metrics[c][3].kernel_time = (event4a.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event4a.getProfilingInfo<CL_PROFILING_COMMAND_START>()) * 1e-9;
-            std::vector<unsigned short> lut(65536);
-            queue.enqueueReadBuffer(dev_lut[c], CL_TRUE, 0, 65536 * sizeof(unsigned short), lut.data(), nullptr, &event4b);
-            event4b.wait();
-            metrics[c][3].transfer_time = (event4b.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event4b.getProfilingInfo<CL_PROFILING_COMMAND_START>()) * 1e-9;
-            metrics[c][3].total_time = metrics[c][3].kernel_time + metrics[c][3].transfer_time;
-            metrics[c][3].work = 65536; // 65536 operations
-            metrics[c][3].span = 1; // Parallel
-
-            CImg<unsigned char> norm_cum_hist_img(num_bins, 200, 1, 1, 0);
-            for (int x = 0; x < num_bins; x++) {
-                int lut_index = (int)((float)x / num_bins * 65536);
-                int height = (int)((lut[lut_index] / 65535.0f) * 200);
-                norm_cum_hist_img.draw_line(x, 200, x, 200 - height, white);
-            }
-            disp_norm_cum_hist[c] = CImgDisplay(norm_cum_hist_img, ("Normalized Cumulative Histogram Channel " + std::to_string(c + 1)).c_str());
-
-            // Step 5: Back Projection
-            cl::Event event5a, event5b;
-            cl::Kernel backproject_kernel(program, "back_project");
-            backproject_kernel.setArg(0, dev_image_input[c]);
-            backproject_kernel.setArg(1, dev_image_output[c]);
-            backproject_kernel.setArg(2, dev_lut[c]);
-            queue.enqueueNDRangeKernel(backproject_kernel, cl::NullRange, cl::NDRange(image_size), cl::NullRange, nullptr, &event5a);
-            event5a.wait();
-            metrics[c][4].kernel_time = (event5a.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event5a.getProfilingInfo<CL_PROFILING_COMMAND_START>()) * 1e-9;
-            std::vector<unsigned short> output_buffer(image_size);
-            queue.enqueueReadBuffer(dev_image_output[c], CL_TRUE, 0, image_size * sizeof(unsigned short), output_buffer.data(), nullptr, &event5b);
-            event5b.wait();
-            metrics[c][4].transfer_time = (event5b.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event5b.getProfilingInfo<CL_PROFILING_COMMAND_START>()) * 1e-9;
-            metrics[c][4].total_time = metrics[c][4].kernel_time + metrics[c][4].transfer_time;
-            metrics[c][4].work = image_size; // n
-            metrics[c][4].span = 1; // Parallel
-
-            cimg_forXY(input_channels[c], x, y) {
-                input_channels[c](x, y) = output_buffer[x + y * width];
+                RecordingKernel scan_kernel(program, "scan_hs_segmented");
+                scan_kernel.setArg(0, dev_histograms);
+                scan_kernel.setArg(1, dev_cum_histograms);
+                scan_kernel.setArg(2, (int)segment_stride);
+                queue.enqueueNDRangeKernel(scan_kernel, cl::NullRange, cl::NDRange(num_bins, channels), cl::NDRange(num_bins, 1), nullptr, profiled(event3a));
+                for (int c = 0; c < channels; c++) {
+                    metrics[c][2].kernel_time = elapsed(event3a) / channels;
+                    metrics[c][2].work = num_bins * (size_t)std::ceil(std::log2((double)num_bins)); // h * log(h)
+                    metrics[c][2].span = (size_t)std::ceil(std::log2((double)num_bins)); // log(h)
+                }
+                // The kernel swaps its buffers after every pass, so the result is in the second buffer only after an odd number of passes
+                if ((size_t)std::ceil(std::log2((double)num_bins)) % 2 == 1)
+                    queue.enqueueCopyBuffer(dev_cum_histograms, dev_histograms, 0, 0, channels * segment_stride * sizeof(unsigned int));
             }
-        }
 
-        // Combine channels
-        CImg<unsigned short> output_image(width, height, 1, channels);
-        cimg_forXY(output_image, x, y) {
+            // Tables of Steps 2 to 4 for --save-lut
+            HistogramSidecar exported_lut;
+            if (!save_lut_path.empty()) {
+                exported_lut.Assign(channels, num_bins);
+                exported_lut.scan = imported ? imported_lut.scan : schedule.scan_on_host ? "host" : scan_type;
+                exported_lut.source_hash = source_hash;
+                exported_lut.pixels = imported ? imported_lut.pixels : roi_size;
+            }
+
+            // Steps 3 (read back), 4 and 5 for each channel
             for (int c = 0; c < channels; c++) {
-                output_image(x, y, 0, c) = input_channels[c](x, y);
+                unsigned short* host_channel = host_in_place ? image_input.data(0, 0, 0, c) : input_channels[c].data();
+                const unsigned char white[] = {255};
+                std::vector<unsigned int>& cum_histogram = cum_histograms[c];
+                if (!imported && !schedule.scan_on_host) {
+                    cl::Event event3b;
+                    cum_histogram.resize(hist_size);
+                    queue.enqueueReadBuffer(dev_histogram[c], CL_TRUE, 0, hist_size * sizeof(unsigned int), cum_histogram.data(), nullptr, profiled(event3b));
+                    metrics[c][2].transfer_time = elapsed(event3b);
+                }
+                metrics[c][2].total_time = metrics[c][2].kernel_time + metrics[c][2].transfer_time;
+
+                CImg<unsigned char> cum_hist_img(num_bins, 200, 1, 1, 0);
+                unsigned int max_cum_hist = cum_histogram[num_bins - 1];
+                for (int x = 0; x < num_bins; x++) {
+                    int height = (int)((cum_histogram[x] / (float)max_cum_hist) * 200);
+                    cum_hist_img.draw_line(x, 200, x, 200 - height, white);
+                }
+                if (display) disp_cum_hist[c] = CImgDisplay(cum_hist_img, ("Cumulative Histogram Channel " + std::to_string(c + 1)).c_str());
+
+                // Step 4: Normalize LUT
+                cl::Event event4a, event4b;
+                float scale = 65535.0f / roi_size;
+                std::vector<unsigned short> lut(65536);
+                HostAllocation track_lut("lut", 65536 * sizeof(unsigned short));
+                if (imported) {
+                    lut = imported_lut.luts[c];
+                    queue.enqueueWriteBuffer(dev_lut[c], CL_TRUE, 0, 65536 * sizeof(unsigned short), lut.data(), nullptr, profiled(event4b));
+                } else if (schedule.lut_on_host) {
+                    double start = now_seconds();
+                    host_normalize_lut(cum_histogram, lut, scale, num_bins);
+                    metrics[c][3].kernel_time = now_seconds() - start;
+                    queue.enqueueWriteBuffer(dev_lut[c], CL_TRUE, 0, 65536 * sizeof(unsigned short), lut.data(), nullptr, profiled(event4b));
+                } else {
+                    RecordingKernel normalize_kernel(program, "normalize_lut");
+                    normalize_kernel.setArg(0, dev_histogram[c]);
+                    normalize_kernel.setArg(1, dev_lut[c]);
+                    normalize_kernel.setArg(2, scale);
+                    normalize_kernel.setArg(3, num_bins);
+                    queue.enqueueNDRangeKernel(normalize_kernel, cl::NullRange, cl::NDRange(65536), cl::NullRange, nullptr, profiled(event4a));
+                    metrics[c][3].kernel_time = elapsed(event4a);
+                    queue.enqueueReadBuffer(dev_lut[c], CL_TRUE, 0, 65536 * sizeof(unsigned short), lut.data(), nullptr, profiled(event4b));
+                }
+                metrics[c][3].transfer_time = elapsed(event4b);
+                metrics[c][3].total_time = metrics[c][3].kernel_time + metrics[c][3].transfer_time;
+                metrics[c][3].work = 65536; // 65536 operations
+                metrics[c][3].span = schedule.lut_on_host ? 65536 : 1; // Serial on the host, parallel on the device
+                if (!save_lut_path.empty()) {
+                    exported_lut.histograms[c].assign(histograms[c].begin(), histograms[c].begin() + num_bins);
+                    exported_lut.cum_histograms[c].assign(cum_histogram.begin(), cum_histogram.begin() + num_bins);
+                    exported_lut.luts[c] = lut;
+                }
+
+                CImg<unsigned char> norm_cum_hist_img(num_bins, 200, 1, 1, 0);
+                for (int x = 0; x < num_bins; x++) {
+                    int lut_index = (int)((float)x / num_bins * 65536);
+                    int height = (int)((lut[lut_index] / 65535.0f) * 200);
+                    norm_cum_hist_img.draw_line(x, 200, x, 200 - height, white);
+                }
+                if (display) disp_norm_cum_hist[c] = CImgDisplay(norm_cum_hist_img, ("Normalized Cumulative Histogram Channel " + std::to_string(c + 1)).c_str());
+
+                // Step 5: Back Projection
+                cl::Event event5a, event5b;
+                backproject_kernel.setArg(0, dev_image_input[c]);
+                backproject_kernel.setArg(1, dev_image_output[c]);
+                backproject_kernel.setArg(2, dev_lut[c]);
+                backproject_persistent_kernel.setArg(0, dev_image_input[c]);
+                backproject_persistent_kernel.setArg(1, dev_image_output[c]);
+                backproject_persistent_kernel.setArg(2, dev_lut[c]);
+                std::vector<unsigned short> output_buffer(host_in_place ? 0 : image_size);
+                HostAllocation track_output_buffer("output_buffer", output_buffer.size() * sizeof(unsigned short));
+                for (size_t strip = 0; strip < strip_count; strip++) {
+                    size_t strip_y = roi[1] + strip * strip_rows;
+                    size_t strip_h = std::min(strip_rows, roi[1] + roi[3] - strip_y);
+                    if (strip_count > 1 || (streaming && channels > 1)) // Only the last strip of the last channel is still on the device
+                        metrics[c][4].transfer_time += transfer_rows(true, dev_image_input[c], host_channel, strip_y, strip_h, &event5b);
+                    if (!host_in_place && !full_roi) // Pixels outside the ROI pass through unchanged
+                        queue.enqueueCopyBuffer(dev_image_input[c], dev_image_output[c], 0, 0, device_image_bytes);
+
+                    std::vector<Tile> tiles = make_tiles(roi[0], streaming ? 0 : strip_y, roi[2], strip_h, persistent_tile_size);
+                    if (force_persistent || is_heterogeneous(tiles)) {
+                        run_persistent(backproject_persistent_kernel, 4, tiles, backproject_balance, &event5a);
+                    } else {
+                        set_region(backproject_kernel, streaming ? 0 : strip_y, strip_h);
+                        queue.enqueueNDRangeKernel(backproject_kernel, cl::NullRange, cl::NDRange(RoundUp(roi[2], backproject_local_shape[0]), RoundUp(strip_h, backproject_local_shape[1])),
+                                                   backproject_local_shape, nullptr, profiled(event5a));
+                    }
+                    metrics[c][4].kernel_time += elapsed(event5a);
+                    if (host_in_place)
+                        metrics[c][4].transfer_time += transfer_rows(false, dev_image_output[c], host_channel, strip_y, strip_h, &event5b);
+                    else
+                        metrics[c][4].transfer_time += transfer_rows(false, dev_image_output[c], output_buffer.data(), 0, height, &event5b);
+                }
+                metrics[c][4].total_time = metrics[c][4].kernel_time + metrics[c][4].transfer_time;
+                metrics[c][4].work = roi_size; // n
+                metrics[c][4].span = 1; // Parallel
+
+                if (!host_in_place) {
+                    cimg_forXY(input_channels[c], x, y) {
+                        input_channels[c](x, y) = output_buffer[x + y * width];
+                    }
+                }
             }
-        }
-        CImgDisplay disp_output(output_image, "Equalized Image");
-
-        // Print metrics
-        double combined_total_time = 0.0;
-        for (int c = 0; c < channels; c++) {
-            std::cout << "\nPerformance Metrics (seconds) and Complexity for Channel " << (c + 1) 
-                      << " (Bins: " << num_bins << (scan_type == "bl" ? ", Padded to " + std::to_string(padded_num_bins) : "") 
-                      << ", Scan: " << (scan_type == "bl" ? "Blelloch" : "Hillis-Steele") << "):\n";
-            double overall_total_time = 0.0;
-            for (int step = 0; step < 5; step++) {
-                switch (step) {
-                    case 0: std::cout << "Step 1: Input Transfer and Initialization\n"; break;
-                    case 1: std::cout << "Step 2: Histogram Calculation\n"; break;
-                    case 2: std::cout << "Step 3: Cumulative Histogram\n"; break;
-                    case 3: std::cout << "Step 4: Normalize LUT\n"; break;
-                    case 4: std::cout << "Step 5: Back Projection\n"; break;
+
+            if (!save_lut_path.empty()) {
+                std::string lut_filename = save_lut_path;
+                if (!list_filename.empty()) {
+                    std::string base = image_filename.substr(image_filename.find_last_of('/') + 1);
+                    lut_filename += "/" + base.substr(0, base.find_last_of('.')) + ".lut";
+                }
+                if (!exported_lut.Save(lut_filename)) {
+                    std::cerr << "Error: Cannot write histogram sidecar '" << lut_filename << "'" << std::endl;
+                    write_failed = true;
                 }
-                std::cout << "  Transfer Time: " << metrics[c][step].transfer_time << "\n";
-                std::cout << "  Kernel Time: " << metrics[c][step].kernel_time << "\n";
-                std::cout << "  Total Time: " << metrics[c][step].total_time << "\n";
-                std::cout << "  Work: " << metrics[c][step].work << " operations\n";
-                std::cout << "  Span: " << metrics[c][step].span << " steps\n";
-                overall_total_time += metrics[c][step].total_time;
-            }
-            std::cout << "Overall Total Time for Channel " << (c + 1) << ": " << overall_total_time << " seconds\n";
-            combined_total_time += overall_total_time;
+            }
+
+            // Combine channels (in place, the result was already written into image_input)
+            CImg<unsigned short> output_image;
+            if (!host_in_place) {
+                output_image.assign(width, height, 1, channels);
+                cimg_forXY(output_image, x, y) {
+                    for (int c = 0; c < channels; c++) {
+                        output_image(x, y, 0, c) = input_channels[c](x, y);
+                    }
+                }
+            }
+            HostAllocation track_output_image("output_image", output_image.size() * sizeof(unsigned short));
+            const CImg<unsigned short>& result_image = host_in_place ? image_input : output_image;
+            if (display) disp_output.assign(result_image, "Equalized Image");
+            double equalise_end = now_seconds();
+            if (profiling)
+                profiled_images++;
+            if (image_index > 1) {
+                (profiling ? profiled_time : unprofiled_time) += equalise_end - load_start;
+                (profiling ? timed_profiled : timed_unprofiled)++;
+            }
+
+            // Save the result, back at 8 bits for 8-bit inputs
+            if (!output_path.empty()) {
+                std::string output_filename = output_path;
+                if (!list_filename.empty())
+                    output_filename += "/" + image_filename.substr(image_filename.find_last_of('/') + 1);
+                if (writer && is_pnm(output_filename))
+                    writer->Write(output_filename, is_8bit ? save_pnm_memory(CImg<unsigned char>(result_image / 257)) : save_pnm_memory(result_image));
+                else if (is_8bit)
+                    CImg<unsigned char>(result_image / 257).save(output_filename.c_str());
+                else
+                    result_image.save(output_filename.c_str());
+            }
+            double save_end = now_seconds();
+
+            // Print metrics (unprofiled images only have the wall time)
+            if (!profiling) {
+                std::cout << "\nEqualised in " << equalise_end - load_start << " seconds (not profiled)\n";
+            } else {
+                double combined_total_time = 0.0;
+                for (int c = 0; c < channels; c++) {
+                    std::cout << "\nPerformance Metrics (seconds) and Complexity for Channel " << (c + 1) 
+                              << " (Bins: " << num_bins << (scan_type == "bl" ? ", Padded to " + std::to_string(padded_num_bins) : "") 
+                              << ", Scan: " << (scan_type == "bl" ? "Blelloch" : scan_type == "lb" ? "Look-back" : "Hillis-Steele") << "):\n";
+                    double overall_total_time = 0.0;
+                    for (int step = 0; step < 5; step++) {
+                        switch (step) {
+                            case 0: std::cout << "Step 1: Input Transfer and Initialization\n"; break;
+                            case 1: std::cout << "Step 2: Histogram Calculation\n"; break;
+                            case 2: std::cout << "Step 3: Cumulative Histogram\n"; break;
+                            case 3: std::cout << "Step 4: Normalize LUT\n"; break;
+                            case 4: std::cout << "Step 5: Back Projection\n"; break;
+                        }
+                        std::cout << "  Transfer Time: " << metrics[c][step].transfer_time << "\n";
+                        std::cout << "  Kernel Time: " << metrics[c][step].kernel_time << "\n";
+                        std::cout << "  Total Time: " << metrics[c][step].total_time << "\n";
+                        std::cout << "  Work: " << metrics[c][step].work << " operations\n";
+                        std::cout << "  Span: " << metrics[c][step].span << " steps\n";
+                        overall_total_time += metrics[c][step].total_time;
+                    }
+                    std::cout << "Overall Total Time for Channel " << (c + 1) << ": " << overall_total_time << " seconds\n";
+                    combined_total_time += overall_total_time;
+                }
+                if (channels > 1) {
+                    std::cout << "\nTotal Time for All Channels Combined: " << combined_total_time << " seconds\n";
+                }
+
+                if (metrics_file.is_open()) {
+                    for (int c = 0; c < channels; c++) {
+                        for (int step = 0; step < 5; step++) {
+                            metrics_file << image_filename << "," << c << "," << step_names[step] << ","
+                                         << metrics[c][step].transfer_time << "," << metrics[c][step].kernel_time << "," << metrics[c][step].total_time << ","
+                                         << metrics[c][step].work << "," << metrics[c][step].span << "\n";
+                        }
+                    }
+                }
+            }
+            if (trace_file.is_open()) {
+                trace_file << image_filename << "," << image_size << ",load," << load_start << "," << load_end << "\n";
+                trace_file << image_filename << "," << image_size << ",equalise," << load_end << "," << equalise_end << "\n";
+                trace_file << image_filename << "," << image_size << ",save," << equalise_end << "," << save_end << "\n";
+            }
+        }
+
+        if (writer) {
+            size_t failed = writer->Finish();
+            if (failed > 0) {
+                std::cerr << "ERROR: " << failed << " output image(s) could not be written" << std::endl;
+                write_failed = true;
+            }
         }
-        if (channels > 1) {
-            std::cout << "\nTotal Time for All Channels Combined: " << combined_total_time << " seconds\n";
+
+        std::cout << hist_balance.report("hist_persistent") << backproject_balance.report("back_project_persistent");
+
+        // Instrumentation overhead: compare the mean wall time of profiled and unprofiled images after the first
+        // (runs of a single level can be compared with each other in the same way)
+        std::cout << "Instrumentation " << profile_level << ": " << profiled_images << " of " << image_index << " images profiled";
+        if (timed_profiled > 0)
+            std::cout << ", " << profiled_time / timed_profiled << " s per profiled image";
+        if (timed_unprofiled > 0)
+            std::cout << ", " << unprofiled_time / timed_unprofiled << " s per unprofiled image";
+        if (timed_profiled > 0 && timed_unprofiled > 0)
+            std::cout << " (overhead " << 100.0 * ((profiled_time / timed_profiled) / (unprofiled_time / timed_unprofiled) - 1.0) << "%)";
+        if (image_index > 0)
+            std::cout << ", excluding the first image";
+        std::cout << std::endl;
+        if (GetCommandRecorder().IsOpen()) {
+            std::cout << "Recorded " << GetCommandRecorder().Records() << " commands to " << record_filename << std::endl;
+            GetCommandRecorder().Close();
         }
 
         // Wait for windows to close
-        bool all_closed = false;
+        bool all_closed = !display;
         while (!all_closed) {
             all_closed = disp_input.is_closed() && disp_output.is_closed();
-            for (int c = 0; c < channels; c++) {
+            for (int c = 0; c < disp_hist.size(); c++) {
                 all_closed &= disp_hist[c].is_closed() && disp_cum_hist[c].is_closed() && disp_norm_cum_hist[c].is_closed();
             }
             disp_input.wait(1);
             disp_output.wait(1);
-            for (int c = 0; c < channels; c++) {
+            for (int c = 0; c < disp_hist.size(); c++) {
                 disp_hist[c].wait(1);
                 disp_cum_hist[c].wait(1);
                 disp_norm_cum_hist[c].wait(1);
@@ -341,10 +1228,12 @@ int main(int argc, char **argv) {
     }
     catch (const cl::Error& err) {
         std::cerr << "ERROR: " << err.what() << ", " << getErrorString(err.err()) << std::endl;
+        return 1;
     }
     catch (CImgException& err) {
         std::cerr << "ERROR: " << err.what() << std::endl;
+        return 1;
     }
 
-    return 0;
+    return write_failed ? 1 : 0;
 }
\ No newline at end of file
@@ -0,0 +1,215 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <map>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+// Batch driver for assignment1: splits an image list between N forked worker processes, each running
+// assignment1 on its own equal partition of the device, then merges the per-worker metrics and traces.
+// The driver itself never touches OpenCL, so the runtime is only ever initialised after the fork.
+
+void print_help() {
+    std::cerr << "Application usage:" << std::endl;
+    std::cerr << "  -w : number of worker processes (default 2)" << std::endl;
+    std::cerr << "  --list : text file with one input image per line" << std::endl;
+    std::cerr << "  -o : output directory for the images, worker files and merged reports (must exist)" << std::endl;
+    std::cerr << "  -p : select platform" << std::endl;
+    std::cerr << "  -d : select device" << std::endl;
+    std::cerr << "  -- : any following options are passed on to every assignment1 worker" << std::endl;
+    std::cerr << "  -h : print this message" << std::endl;
+}
+
+std::vector<std::string> split_csv(const std::string& line) {
+    std::vector<std::string> fields;
+    std::stringstream stream(line);
+    for (std::string field; std::getline(stream, field, ',');)
+        fields.push_back(field);
+    return fields;
+}
+
+// Per-step totals summed over images and channels
+struct StepTotals {
+    double transfer_time = 0;
+    double kernel_time = 0;
+    double total_time = 0;
+};
+
+// Span of one worker's trace
+struct WorkerTotals {
+    bool traced = false;
+    size_t images = 0;
+    size_t pixels = 0;
+    double start = 0;
+    double end = 0;
+};
+
+int main(int argc, char **argv) {
+    int workers = 2;
+    std::string list_filename;
+    std::string output_dir;
+    std::string platform_id = "0";
+    std::string device_id = "0";
+    std::vector<std::string> worker_options;
+
+    for (int i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "-w") == 0) && (i < (argc - 1))) { workers = atoi(argv[++i]); }
+        else if ((strcmp(argv[i], "--list") == 0) && (i < (argc - 1))) { list_filename = argv[++i]; }
+        else if ((strcmp(argv[i], "-o") == 0) && (i < (argc - 1))) { output_dir = argv[++i]; }
+        else if ((strcmp(argv[i], "-p") == 0) && (i < (argc - 1))) { platform_id = argv[++i]; }
+        else if ((strcmp(argv[i], "-d") == 0) && (i < (argc - 1))) { device_id = argv[++i]; }
+        else if (strcmp(argv[i], "--") == 0) { worker_options.assign(argv + i + 1, argv + argc); break; }
+        else if (strcmp(argv[i], "-h") == 0) { print_help(); return 0; }
+    }
+
+    if (workers <= 0 || list_filename.empty() || output_dir.empty()) {
+        print_help();
+        return 1;
+    }
+
+    std::vector<std::string> images;
+    std::ifstream list_file(list_filename);
+    for (std::string line; std::getline(list_file, line);) {
+        if (!line.empty()) images.push_back(line);
+    }
+    if (images.empty()) {
+        std::cerr << "Error: No images in '" << list_filename << "'" << std::endl;
+        return 1;
+    }
+    workers = std::min(workers, (int)images.size());
+
+    // Deterministic split: image i goes to worker i % workers, so reruns see the same shards
+    std::vector<std::string> worker_prefixes(workers);
+    for (int w = 0; w < workers; w++) {
+        worker_prefixes[w] = output_dir + "/worker_" + std::to_string(w);
+        std::ofstream worker_list(worker_prefixes[w] + ".list");
+        for (size_t i = w; i < images.size(); i += workers)
+            worker_list << images[i] << "\n";
+    }
+
+    std::vector<pid_t> pids(workers);
+    for (int w = 0; w < workers; w++) {
+        std::vector<std::string> args = {
+            "./assignment1", "-p", platform_id, "-d", device_id,
+            "--list", worker_prefixes[w] + ".list", "-o", output_dir, "--no-display",
+            "--metrics", worker_prefixes[w] + "_metrics.csv", "--trace", worker_prefixes[w] + "_trace.csv",
+            "--sub-device", std::to_string(w) + "," + std::to_string(workers) };
+        args.insert(args.end(), worker_options.begin(), worker_options.end());
+
+        pids[w] = fork();
+        if (pids[w] < 0) {
+            perror("fork");
+            return 1;
+        }
+        if (pids[w] == 0) {
+            // Worker: console output goes to its own log instead of interleaving with the others
+            int log = open((worker_prefixes[w] + ".log").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (log >= 0) {
+                dup2(log, STDOUT_FILENO);
+                dup2(log, STDERR_FILENO);
+                close(log);
+            }
+            std::vector<char*> argv_worker;
+            for (std::string& arg : args)
+                argv_worker.push_back(&arg[0]);
+            argv_worker.push_back(nullptr);
+            execv(argv_worker[0], argv_worker.data());
+            perror("execv");
+            _exit(127);
+        }
+    }
+
+    int failed = 0;
+    for (int w = 0; w < workers; w++) {
+        int status = 0;
+        waitpid(pids[w], &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            std::cerr << "Worker " << w << " failed (status " << status << "), see " << worker_prefixes[w] << ".log" << std::endl;
+            failed++;
+        }
+    }
+
+    // Merge the worker files, prefixing every row with the worker index
+    std::vector<std::string> step_order;
+    std::map<std::string, StepTotals> steps;
+    std::vector<WorkerTotals> worker_totals(workers);
+    std::ofstream merged_metrics(output_dir + "/batch_metrics.csv");
+    std::ofstream merged_trace(output_dir + "/batch_trace.csv");
+    merged_metrics << "worker,image,channel,step,transfer_time,kernel_time,total_time,work,span\n";
+    merged_trace << "worker,image,pixels,stage,start,end\n";
+
+    for (int w = 0; w < workers; w++) {
+        std::ifstream metrics_file(worker_prefixes[w] + "_metrics.csv");
+        std::string line;
+        std::getline(metrics_file, line); // Header
+        while (std::getline(metrics_file, line)) {
+            std::vector<std::string> fields = split_csv(line);
+            if (fields.size() < 6) continue;
+            merged_metrics << w << "," << line << "\n";
+            if (steps.find(fields[2]) == steps.end()) step_order.push_back(fields[2]);
+            StepTotals& step = steps[fields[2]];
+            step.transfer_time += atof(fields[3].c_str());
+            step.kernel_time += atof(fields[4].c_str());
+            step.total_time += atof(fields[5].c_str());
+        }
+
+        std::ifstream trace_file(worker_prefixes[w] + "_trace.csv");
+        std::getline(trace_file, line); // Header
+        WorkerTotals& totals = worker_totals[w];
+        while (std::getline(trace_file, line)) {
+            std::vector<std::string> fields = split_csv(line);
+            if (fields.size() < 5) continue;
+            merged_trace << w << "," << line << "\n";
+            double start = atof(fields[3].c_str()), end = atof(fields[4].c_str());
+            totals.start = totals.traced ? std::min(totals.start, start) : start;
+            totals.traced = true;
+            totals.end = std::max(totals.end, end);
+            if (fields[2] == "load") {
+                totals.images++;
+                totals.pixels += strtoull(fields[1].c_str(), nullptr, 10);
+            }
+        }
+    }
+
+    // Aggregate report
+    size_t images_done = 0, pixels_done = 0;
+    double batch_start = 0, batch_end = 0;
+    for (int w = 0; w < workers; w++) {
+        const WorkerTotals& totals = worker_totals[w];
+        if (totals.images == 0) continue;
+        batch_start = (images_done == 0) ? totals.start : std::min(batch_start, totals.start);
+        batch_end = std::max(batch_end, totals.end);
+        images_done += totals.images;
+        pixels_done += totals.pixels;
+    }
+    double wall_time = batch_end - batch_start;
+
+    std::cout << "Batch of " << images_done << "/" << images.size() << " images on " << workers << " workers";
+    if (wall_time > 0)
+        std::cout << ": " << wall_time << " s, " << images_done / wall_time << " images/s, " << pixels_done / wall_time * 1e-6 << " MPix/s";
+    std::cout << std::endl;
+    for (int w = 0; w < workers; w++) {
+        const WorkerTotals& totals = worker_totals[w];
+        double time = totals.end - totals.start;
+        std::cout << "  Worker " << w << ": " << totals.images << " images, " << time << " s";
+        if (time > 0) std::cout << ", " << totals.images / time << " images/s";
+        std::cout << std::endl;
+    }
+    std::cout << "Per-step time summed over images and channels [s]:" << std::endl;
+    for (const std::string& name : step_order) {
+        const StepTotals& step = steps[name];
+        std::cout << "  " << name << ": transfer " << step.transfer_time << ", kernel " << step.kernel_time
+                  << ", total " << step.total_time;
+        if (images_done > 0) std::cout << " (" << step.total_time / images_done << " per image)";
+        std::cout << std::endl;
+    }
+    std::cout << "Merged reports: " << output_dir << "/batch_metrics.csv, " << output_dir << "/batch_trace.csv" << std::endl;
+
+    return failed ? 1 : 0;
+}
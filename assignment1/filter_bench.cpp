@@ -0,0 +1,232 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include "ImageCore.h"
+
+// Sweeps the edge-preserving smoothing of ImageCore over radii on synthetic images generated on the device: per size
+// and radius, the device time and throughput of the exact bilateral filter (bilateral_tile) and of its bilateral grid
+// approximation, and the RMS difference of the approximation from the exact result in 16-bit levels. Then, per size
+// and mask, it checks the FFT convolution against the direct one: their device times and the RMS difference of the
+// FFT result, which must stay within CONVOLVE_FFT_TOLERANCE levels or the bench exits with 1. Nothing is read from or
+// written to disk.
+
+// Largest RMS difference [16-bit levels] of the FFT convolution from the direct one, rounding and float error
+const double CONVOLVE_FFT_TOLERANCE = 1.0;
+
+void print_help() {
+    std::cerr << "Application usage:" << std::endl;
+    std::cerr << "  -p : select platform " << std::endl;
+    std::cerr << "  -d : select device" << std::endl;
+    std::cerr << "  -l : list all platforms and devices" << std::endl;
+    std::cerr << "  --sizes : comma-separated image sizes WxH (default 512x512,2048x2048)" << std::endl;
+    std::cerr << "  --radii : comma-separated radii or ranges A-B (default 1-16; the exact filter stops at 16)" << std::endl;
+    std::cerr << "  --sigma-r : range sigma, a fraction of full scale (default 0.1)" << std::endl;
+    std::cerr << "  --masks : comma-separated masks on which the FFT convolution is checked against the direct one, as" << std::endl;
+    std::cerr << "            pipeline's --mask (default disk:4,disk:8; none to skip)" << std::endl;
+    std::cerr << "  --dist : distribution of the synthetic images (default natural)" << std::endl;
+    std::cerr << "  -r : repetitions per row, the fastest is reported (default 3)" << std::endl;
+    std::cerr << "  --seed : random seed (default 1)" << std::endl;
+    std::cerr << "  -h : print this message" << std::endl;
+}
+
+std::vector<std::string> split_list(const std::string& text) {
+    std::vector<std::string> items;
+    std::stringstream stream(text);
+    for (std::string item; std::getline(stream, item, ',');)
+        if (!item.empty()) items.push_back(item);
+    return items;
+}
+
+// Device time of the stage's commands in the last call, fastest of repetitions
+template <typename Filter>
+double best_seconds(ImageCore& core, int repetitions, const std::string& stage, Filter filter) {
+    double best = 0;
+    for (int r = 0; r < repetitions; r++) {
+        core.ClearStageTimes();
+        filter();
+        double seconds = 0;
+        for (const std::pair<std::string, double>& entry : core.StageTimes())
+            if (entry.first == stage) seconds += entry.second;
+        if (r == 0 || seconds < best) best = seconds;
+    }
+    return best;
+}
+
+int main(int argc, char **argv) {
+    int platform_id = 0;
+    int device_id = 0;
+    std::string sizes_list = "512x512,2048x2048";
+    std::string radii_list = "1-16";
+    std::string masks_list = "disk:4,disk:8";
+    std::string distribution_name = "natural";
+    float sigma_range = 0.1f;
+    int repetitions = 3;
+    unsigned int seed = 1;
+
+    for (int i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "-p") == 0) && (i < (argc - 1))) { platform_id = atoi(argv[++i]); }
+        else if ((strcmp(argv[i], "-d") == 0) && (i < (argc - 1))) { device_id = atoi(argv[++i]); }
+        else if (strcmp(argv[i], "-l") == 0) { std::cout << ListPlatformsDevices() << std::endl; }
+        else if ((strcmp(argv[i], "--sizes") == 0) && (i < (argc - 1))) { sizes_list = argv[++i]; }
+        else if ((strcmp(argv[i], "--radii") == 0) && (i < (argc - 1))) { radii_list = argv[++i]; }
+        else if ((strcmp(argv[i], "--sigma-r") == 0) && (i < (argc - 1))) { sigma_range = (float)atof(argv[++i]); }
+        else if ((strcmp(argv[i], "--masks") == 0) && (i < (argc - 1))) { masks_list = argv[++i]; }
+        else if ((strcmp(argv[i], "--dist") == 0) && (i < (argc - 1))) { distribution_name = argv[++i]; }
+        else if ((strcmp(argv[i], "-r") == 0) && (i < (argc - 1))) { repetitions = atoi(argv[++i]); }
+        else if ((strcmp(argv[i], "--seed") == 0) && (i < (argc - 1))) { seed = (unsigned int)strtoul(argv[++i], nullptr, 10); }
+        else if (strcmp(argv[i], "-h") == 0) { print_help(); return 0; }
+    }
+
+    std::vector<std::pair<int, int>> sizes;
+    for (const std::string& size : split_list(sizes_list)) {
+        int width = 0, height = 0;
+        if (sscanf(size.c_str(), "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0) {
+            std::cerr << "Error: Invalid size '" << size << "'" << std::endl;
+            return 1;
+        }
+        sizes.push_back(std::make_pair(width, height));
+    }
+    std::vector<int> radii;
+    for (const std::string& item : split_list(radii_list)) {
+        int first = 0, last = 0;
+        int fields = sscanf(item.c_str(), "%d-%d", &first, &last);
+        if (fields == 1) last = first;
+        if (fields < 1 || first < 1 || last < first) {
+            std::cerr << "Error: Invalid radius '" << item << "'" << std::endl;
+            return 1;
+        }
+        for (int radius = first; radius <= last; radius++) radii.push_back(radius);
+    }
+    std::vector<std::string> mask_specs;
+    std::vector<std::vector<float>> masks;
+    std::vector<std::pair<int, int>> mask_sizes;
+    for (const std::string& spec : split_list(masks_list == "none" ? "" : masks_list)) {
+        std::vector<float> mask;
+        int mask_width = 0, mask_height = 0;
+        if (!ParseMask(spec, mask, mask_width, mask_height)) {
+            std::cerr << "Error: Invalid mask '" << spec << "'" << std::endl;
+            return 1;
+        }
+        mask_specs.push_back(spec);
+        masks.push_back(mask);
+        mask_sizes.push_back(std::make_pair(mask_width, mask_height));
+    }
+    int distribution = ParseSyntheticDistribution(distribution_name);
+    if (distribution < 0) {
+        std::cerr << "Error: Unknown distribution '" << distribution_name << "'" << std::endl;
+        return 1;
+    }
+    if (repetitions <= 0 || sigma_range <= 0) {
+        print_help();
+        return 1;
+    }
+
+    try {
+        cl::Context context = GetContext(platform_id, device_id);
+        std::cout << "Running on " << GetPlatformName(platform_id) << ", " << GetDeviceName(platform_id, device_id) << std::endl;
+        cl::CommandQueue queue(context, context.getInfo<CL_CONTEXT_DEVICES>()[0], CL_QUEUE_PROFILING_ENABLE);
+        ImageCore core(context, queue);
+
+        // generate_image comes from the same kernel file, built once more here as ImageCore keeps its program
+        cl::Program::Sources sources;
+        AddSources(sources, "kernels/my_kernels.cl");
+        cl::Program program(context, sources);
+        program.build();
+
+        // Synthetic input of each size, shared by both sweeps
+        std::vector<DeviceImage> images;
+        for (const std::pair<int, int>& size : sizes) {
+            DeviceImage image;
+            image.width = size.first;
+            image.height = size.second;
+            image.channels = 1;
+            image.bits = 16;
+            image.buffer = TrackedBuffer(context, CL_MEM_READ_WRITE, image.Bytes(), "dev_image_input");
+            GenerateSyntheticImage(queue, program, image.buffer, image.width, image.height, 1, distribution, 16, true, seed);
+            images.push_back(image);
+        }
+
+        std::cout << "width,height,radius,bilateral_time,bilateral_mpix_per_s,grid_time,grid_mpix_per_s,grid_rms_error" << std::endl;
+
+        for (const DeviceImage& image : images) {
+            int width = image.width, height = image.height;
+            size_t pixels = (size_t)width * height;
+            std::vector<unsigned short> exact(pixels), approximate(pixels);
+
+            for (int radius : radii) {
+                DeviceImage output;
+                double bilateral_time = 0;
+                if (radius <= BILATERAL_MAX_RADIUS) {
+                    bilateral_time = best_seconds(core, repetitions, "bilateral", [&]() { output = core.Bilateral(image, radius, sigma_range); });
+                    core.Download(output, exact.data());
+                }
+                double grid_time = best_seconds(core, repetitions, "bilateral_grid", [&]() { output = core.BilateralGrid(image, radius, sigma_range); });
+                core.Download(output, approximate.data());
+
+                std::cout << width << "," << height << "," << radius << ",";
+                if (radius <= BILATERAL_MAX_RADIUS) {
+                    double squares = 0;
+                    for (size_t i = 0; i < pixels; i++)
+                        squares += ((double)exact[i] - approximate[i]) * ((double)exact[i] - approximate[i]);
+                    std::cout << bilateral_time << "," << pixels / bilateral_time * 1e-6 << ",";
+                    std::cout << grid_time << "," << pixels / grid_time * 1e-6 << "," << std::sqrt(squares / pixels) << std::endl;
+                } else {
+                    std::cout << ",," << grid_time << "," << pixels / grid_time * 1e-6 << "," << std::endl;
+                }
+            }
+        }
+
+        // FFT against direct convolution; a method that does not fit the device (constant or local memory) is skipped
+        int mismatches = 0;
+        if (!masks.empty())
+            std::cout << "width,height,mask,direct_time,fft_time,fft_rms_error,status" << std::endl;
+        for (const DeviceImage& image : images) {
+            size_t pixels = image.Pixels();
+            std::vector<unsigned short> direct(pixels), fft(pixels);
+            for (size_t m = 0; m < masks.size(); m++) {
+                int mask_width = mask_sizes[m].first, mask_height = mask_sizes[m].second;
+                double times[2] = { 0, 0 };
+                bool ran[2] = { false, false };
+                const int methods[2] = { CONVOLVE_DIRECT, CONVOLVE_FFT };
+                for (int k = 0; k < 2; k++) {
+                    try {
+                        DeviceImage output;
+                        times[k] = best_seconds(core, repetitions, "convolve", [&]() {
+                            output = core.Convolve(image, masks[m], mask_width, mask_height, methods[k]);
+                        });
+                        core.Download(output, (k == 0 ? direct : fft).data());
+                        ran[k] = true;
+                    }
+                    catch (const cl::Error& err) {
+                        if (err.err() != CL_OUT_OF_RESOURCES) throw;
+                    }
+                }
+
+                std::cout << image.width << "," << image.height << "," << mask_specs[m] << ",";
+                std::cout << (ran[0] ? std::to_string(times[0]) : "-") << "," << (ran[1] ? std::to_string(times[1]) : "-") << ",";
+                if (ran[0] && ran[1]) {
+                    double squares = 0;
+                    for (size_t i = 0; i < pixels; i++)
+                        squares += ((double)direct[i] - fft[i]) * ((double)direct[i] - fft[i]);
+                    double rms = std::sqrt(squares / pixels);
+                    bool ok = rms <= CONVOLVE_FFT_TOLERANCE;
+                    if (!ok) mismatches++;
+                    std::cout << rms << "," << (ok ? "ok" : "MISMATCH") << std::endl;
+                } else {
+                    std::cout << ",skipped" << std::endl;
+                }
+            }
+        }
+        if (mismatches > 0) {
+            std::cout << mismatches << " FFT convolution(s) differ from the direct result by more than " << CONVOLVE_FFT_TOLERANCE
+                      << " levels RMS" << std::endl;
+            return 1;
+        }
+    }
+    catch (const cl::Error& err) {
+        std::cerr << "ERROR: " << err.what() << ", " << getErrorString(err.err()) << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
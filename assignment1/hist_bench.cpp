@@ -0,0 +1,188 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include "Utils.h"
+
+// Sweeps the histogram and scan kernels over synthetic images generated on the device, one row per
+// distribution, size, bit depth and bin count. The distributions range from uniform (little contention
+// on any bin) to constant (every work-item hits the same bin), so the rows show how the local-memory
+// atomics hold up. Nothing is read from or written to disk.
+
+void print_help() {
+    std::cerr << "Application usage:" << std::endl;
+    std::cerr << "  -p : select platform " << std::endl;
+    std::cerr << "  -d : select device" << std::endl;
+    std::cerr << "  -l : list all platforms and devices" << std::endl;
+    std::cerr << "  --sizes : comma-separated image sizes WxH (default 512x512,2048x2048,8192x8192)" << std::endl;
+    std::cerr << "  --bins : comma-separated bin counts (default 256,4096; counts above 256 skip 8-bit images)" << std::endl;
+    std::cerr << "  --dist : comma-separated distributions (default all)" << std::endl;
+    std::cerr << "  -r : repetitions per row, the fastest is reported (default 3)" << std::endl;
+    std::cerr << "  --seed : random seed (default 1)" << std::endl;
+    std::cerr << "  -h : print this message" << std::endl;
+}
+
+std::vector<std::string> split_list(const std::string& text) {
+    std::vector<std::string> items;
+    std::stringstream stream(text);
+    for (std::string item; std::getline(stream, item, ',');)
+        if (!item.empty()) items.push_back(item);
+    return items;
+}
+
+double event_seconds(const cl::Event& event) {
+    return (event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event.getProfilingInfo<CL_PROFILING_COMMAND_START>()) * 1e-9;
+}
+
+int main(int argc, char **argv) {
+    int platform_id = 0;
+    int device_id = 0;
+    std::string sizes_list = "512x512,2048x2048,8192x8192";
+    std::string bins_list = "256,4096";
+    std::string distributions_list;
+    int repetitions = 3;
+    unsigned int seed = 1;
+
+    for (int i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "-p") == 0) && (i < (argc - 1))) { platform_id = atoi(argv[++i]); }
+        else if ((strcmp(argv[i], "-d") == 0) && (i < (argc - 1))) { device_id = atoi(argv[++i]); }
+        else if (strcmp(argv[i], "-l") == 0) { std::cout << ListPlatformsDevices() << std::endl; }
+        else if ((strcmp(argv[i], "--sizes") == 0) && (i < (argc - 1))) { sizes_list = argv[++i]; }
+        else if ((strcmp(argv[i], "--bins") == 0) && (i < (argc - 1))) { bins_list = argv[++i]; }
+        else if ((strcmp(argv[i], "--dist") == 0) && (i < (argc - 1))) { distributions_list = argv[++i]; }
+        else if ((strcmp(argv[i], "-r") == 0) && (i < (argc - 1))) { repetitions = atoi(argv[++i]); }
+        else if ((strcmp(argv[i], "--seed") == 0) && (i < (argc - 1))) { seed = (unsigned int)strtoul(argv[++i], nullptr, 10); }
+        else if (strcmp(argv[i], "-h") == 0) { print_help(); return 0; }
+    }
+
+    std::vector<std::pair<int, int>> sizes;
+    for (const std::string& size : split_list(sizes_list)) {
+        int width = 0, height = 0;
+        if (sscanf(size.c_str(), "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0) {
+            std::cerr << "Error: Invalid size '" << size << "'" << std::endl;
+            return 1;
+        }
+        sizes.push_back(std::make_pair(width, height));
+    }
+    std::vector<int> bin_counts;
+    for (const std::string& bins : split_list(bins_list)) {
+        bin_counts.push_back(atoi(bins.c_str()));
+        if (bin_counts.back() <= 0 || bin_counts.back() > 65536) {
+            std::cerr << "Error: Invalid bin count '" << bins << "'" << std::endl;
+            return 1;
+        }
+    }
+    std::vector<int> distributions;
+    if (distributions_list.empty()) {
+        for (int d = 0; d < SYNTH_COUNT; d++) distributions.push_back(d);
+    } else {
+        for (const std::string& name : split_list(distributions_list)) {
+            distributions.push_back(ParseSyntheticDistribution(name));
+            if (distributions.back() < 0) {
+                std::cerr << "Error: Unknown distribution '" << name << "'" << std::endl;
+                return 1;
+            }
+        }
+    }
+    if (repetitions <= 0) {
+        print_help();
+        return 1;
+    }
+
+    try {
+        cl::Context context = GetContext(platform_id, device_id);
+        std::cout << "Running on " << GetPlatformName(platform_id) << ", " << GetDeviceName(platform_id, device_id) << std::endl;
+        cl::CommandQueue queue(context, context.getInfo<CL_CONTEXT_DEVICES>()[0], CL_QUEUE_PROFILING_ENABLE);
+
+        cl::Program::Sources sources;
+        AddSources(sources, "kernels/my_kernels.cl");
+        cl::Program program(context, sources);
+        try {
+            program.build();
+        }
+        catch (const cl::Error& err) {
+            std::cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
+            std::cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
+            throw err;
+        }
+
+        const size_t scan_local_size = 256;
+        std::cout << "distribution,width,height,bits,bins,generate_time,hist_time,hist_mpix_per_s,scan_time,max_bin_share" << std::endl;
+
+        for (const std::pair<int, int>& size : sizes) {
+            int width = size.first, height = size.second;
+            size_t pixels = (size_t)width * height;
+            cl::Buffer dev_image = TrackedBuffer(context, CL_MEM_READ_WRITE, pixels * sizeof(unsigned short), "dev_image_input");
+
+            for (int bins : bin_counts) {
+                size_t tiles = (bins + scan_local_size - 1) / scan_local_size;
+                cl::Buffer dev_histogram = TrackedBuffer(context, CL_MEM_READ_WRITE, bins * sizeof(cl_int), "dev_histogram");
+                cl::Buffer dev_cum_histogram = TrackedBuffer(context, CL_MEM_READ_WRITE, bins * sizeof(cl_int), "dev_cum_histogram");
+                cl::Buffer next_tile = TrackedBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_int), "dev_scan_tiles");
+                cl::Buffer tile_flags = TrackedBuffer(context, CL_MEM_READ_WRITE, tiles * sizeof(cl_int), "dev_scan_tiles");
+                cl::Buffer tile_aggregates = TrackedBuffer(context, CL_MEM_READ_WRITE, tiles * sizeof(cl_int), "dev_scan_tiles");
+                cl::Buffer tile_prefixes = TrackedBuffer(context, CL_MEM_READ_WRITE, tiles * sizeof(cl_int), "dev_scan_tiles");
+
+                cl::Kernel hist_kernel(program, "hist_local");
+                hist_kernel.setArg(0, dev_image);
+                hist_kernel.setArg(1, dev_histogram);
+                hist_kernel.setArg(2, bins);
+                hist_kernel.setArg(3, cl::Local(bins * sizeof(cl_int)));
+                hist_kernel.setArg(4, width);
+                hist_kernel.setArg(5, height);
+                hist_kernel.setArg(6, width);
+                hist_kernel.setArg(7, 0);
+                hist_kernel.setArg(8, 0);
+                cl::Kernel scan_kernel(program, "scan_lookback");
+                scan_kernel.setArg(0, dev_histogram);
+                scan_kernel.setArg(1, dev_cum_histogram);
+                scan_kernel.setArg(2, bins);
+                scan_kernel.setArg(3, cl::Local(scan_local_size * sizeof(cl_int)));
+                scan_kernel.setArg(4, cl::Local(scan_local_size * sizeof(cl_int)));
+                scan_kernel.setArg(5, next_tile);
+                scan_kernel.setArg(6, tile_flags);
+                scan_kernel.setArg(7, tile_aggregates);
+                scan_kernel.setArg(8, tile_prefixes);
+
+                cl::NDRange local_shape = TuneLocalShape(queue, hist_kernel, width, height);
+
+                for (int bits : {8, 16}) {
+                    if (bits == 8 && bins > 256) continue;
+                    for (int distribution : distributions) {
+                        cl::Event generate_event;
+                        GenerateSyntheticImage(queue, program, dev_image, width, height, 1, distribution, bits, true, seed, &generate_event);
+                        generate_event.wait();
+
+                        double hist_time = 0, scan_time = 0;
+                        for (int r = 0; r < repetitions; r++) {
+                            cl::Event hist_event, scan_event;
+                            queue.enqueueFillBuffer(dev_histogram, (cl_int)0, 0, bins * sizeof(cl_int));
+                            queue.enqueueNDRangeKernel(hist_kernel, cl::NullRange, cl::NDRange(RoundUp(width, local_shape[0]), RoundUp(height, local_shape[1])),
+                                                       local_shape, nullptr, &hist_event);
+                            queue.enqueueFillBuffer(next_tile, (cl_int)0, 0, sizeof(cl_int));
+                            queue.enqueueFillBuffer(tile_flags, (cl_int)0, 0, tiles * sizeof(cl_int));
+                            queue.enqueueNDRangeKernel(scan_kernel, cl::NullRange, cl::NDRange(tiles * scan_local_size), cl::NDRange(scan_local_size), nullptr, &scan_event);
+                            scan_event.wait();
+                            if (r == 0 || event_seconds(hist_event) < hist_time) hist_time = event_seconds(hist_event);
+                            if (r == 0 || event_seconds(scan_event) < scan_time) scan_time = event_seconds(scan_event);
+                        }
+
+                        // Share of the pixels in the fullest bin: 1 means every atomic hit the same address
+                        std::vector<cl_int> histogram(bins);
+                        queue.enqueueReadBuffer(dev_histogram, CL_TRUE, 0, bins * sizeof(cl_int), histogram.data());
+                        double max_bin_share = (double)*std::max_element(histogram.begin(), histogram.end()) / pixels;
+
+                        std::cout << SYNTHETIC_DISTRIBUTION_NAMES[distribution] << "," << width << "," << height << "," << bits << "," << bins << ","
+                                  << event_seconds(generate_event) << "," << hist_time << "," << pixels / hist_time * 1e-6 << ","
+                                  << scan_time << "," << max_bin_share << std::endl;
+                    }
+                }
+            }
+        }
+    }
+    catch (const cl::Error& err) {
+        std::cerr << "ERROR: " << err.what() << ", " << getErrorString(err.err()) << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -1,8 +1,12 @@
 // Histogram kernel using local memory for 16-bit input with variable bins
-kernel void hist_local(global const ushort* A, global int* H, int nr_bins, local int* local_hist) {
-    int gid = get_global_id(0);    // Global thread ID
-    int lid = get_local_id(0);     // Local thread ID within work-group
-    int group_size = get_local_size(0); // Number of threads in work-group
+// Launched as a 2-D range over a width x height region of interest starting at (roi_x, roi_y)
+// in an image whose rows are row_pitch pixels apart (row_pitch >= image width for padded rows)
+kernel void hist_local(global const ushort* A, global int* H, int nr_bins, local int* local_hist,
+                       int width, int height, int row_pitch, int roi_x, int roi_y) {
+    int x = get_global_id(0);      // x coord. within the ROI
+    int y = get_global_id(1);      // y coord. within the ROI
+    int lid = get_local_id(0) + get_local_id(1) * get_local_size(0); // Linear thread ID within work-group
+    int group_size = get_local_size(0) * get_local_size(1); // Number of threads in work-group
 
     // Initialize local histogram (each thread clears a portion)
     for (int i = lid; i < nr_bins; i += group_size) {
@@ -11,20 +15,20 @@ kernel void hist_local(global const ushort* A, global int* H, int nr_bins, local
     barrier(CLK_LOCAL_MEM_FENCE); // Ensure all local memory is initialized
 
     // Calculate bin index for this thread's value
-    if (gid < get_global_size(0)) { // Ensure we don't exceed image size
-        ushort value = A[gid];
-        int bin_index = (value * nr_bins) / 65536; // Scale 16-bit value to nr_bins
+    if (x < width && y < height) { // Global range is rounded up to the local shape, skip the padding
+        ushort value = A[(roi_y + y) * row_pitch + roi_x + x];
+        int bin_index = (int)(((uint)value * (uint)nr_bins) >> 16); // Scale 16-bit value to nr_bins
         if (bin_index >= nr_bins) bin_index = nr_bins - 1; // Clamp to valid range
-        
+
         // Atomically increment local histogram
         atomic_add(&local_hist[bin_index], 1);
     }
     barrier(CLK_LOCAL_MEM_FENCE); // Wait for all threads in group to finish
 
-    // Reduce local histogram to global histogram
-    if (lid < nr_bins) {
-        if (local_hist[lid] > 0) {
-            atomic_add(&H[lid], local_hist[lid]);
+    // Reduce local histogram to global histogram (bins may outnumber threads)
+    for (int i = lid; i < nr_bins; i += group_size) {
+        if (local_hist[i] > 0) {
+            atomic_add(&H[i], local_hist[i]);
         }
     }
 }
@@ -105,6 +109,62 @@ kernel void scan_bl(global int* A, const int padded_nr_bins) {
     }
 }
 
+// Segmented Hillis-Steele scan of a flattened [segments][segment_stride] array in one launch. The range is
+// bins x segments with one work-group of bins work-items per segment; each group scans its own row as scan_hs.
+kernel void scan_hs_segmented(global int* A, global int* B, const int segment_stride) {
+    int id = get_global_id(0);
+    int N = get_global_size(0);
+    int offset = get_global_id(1) * segment_stride;
+    global int* C;
+
+    A += offset;
+    B += offset;
+    for (int stride = 1; stride < N; stride *= 2) {
+        B[id] = A[id];
+        if (id >= stride)
+            B[id] += A[id - stride];
+
+        barrier(CLK_GLOBAL_MEM_FENCE);
+
+        C = A; A = B; B = C; // Swap A & B
+    }
+}
+
+// Segmented Blelloch exclusive scan of a flattened [segments][segment_stride] array in one launch. The range is
+// padded_nr_bins x segments with one work-group per segment; each group scans its own row as scan_bl.
+kernel void scan_bl_segmented(global int* A, const int padded_nr_bins, const int segment_stride) {
+    int id = get_global_id(0);
+    if (id >= padded_nr_bins) return; // Guard against out-of-bounds access
+    int N = padded_nr_bins;
+    int t;
+
+    A += get_global_id(1) * segment_stride;
+
+    // Up-sweep
+    for (int stride = 1; stride < N; stride *= 2) {
+        if (((id + 1) % (stride * 2)) == 0)
+            A[id] += A[id - stride];
+
+        barrier(CLK_GLOBAL_MEM_FENCE);
+    }
+
+    // Down-sweep
+    if (id == 0)
+        A[N - 1] = 0; // Exclusive scan
+
+    barrier(CLK_GLOBAL_MEM_FENCE);
+
+    for (int stride = N / 2; stride > 0; stride /= 2) {
+        if (((id + 1) % (stride * 2)) == 0) {
+            t = A[id];
+            A[id] += A[id - stride];
+            A[id - stride] = t;
+        }
+
+        barrier(CLK_GLOBAL_MEM_FENCE);
+    }
+}
+
 // Calculates block sums
 kernel void block_sum(global const int* A, global int* B, int local_size) {
     int id = get_global_id(0);
@@ -136,7 +196,1134 @@ kernel void normalize_lut(global const int* cum_histogram, global ushort* lut, f
 }
 
 // Back projection kernel for 16-bit data
-kernel void back_project(global const ushort* input, global ushort* output, global ushort* lut) {
-    int id = get_global_id(0);
+// 2-D range over the ROI, same addressing as hist_local; pixels outside the ROI are not touched
+kernel void back_project(global const ushort* input, global ushort* output, global ushort* lut,
+                         int width, int height, int row_pitch, int roi_x, int roi_y) {
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    if (x >= width || y >= height) return; // Padding of the rounded-up global range
+    int id = (roi_y + y) * row_pitch + roi_x + x;
     output[id] = lut[input[id]];
-}
\ No newline at end of file
+}
+
+// Persistent-thread variants of hist_local and back_project for irregular tile workloads.
+// The host launches one work-group per compute unit; each group keeps pulling the next tile
+// descriptor (x, y, w, h in the row-pitched image) from the global counter next_tile until the
+// queue is drained, so groups that drew small tiles simply take more of them.
+// stats receives (tiles, pixels) per work-group for the host's load-balance report.
+kernel void hist_persistent(global const ushort* A, global int* H, int nr_bins, local int* local_hist, int row_pitch,
+                            global const int4* tiles, int tile_count, global int* next_tile, global int* stats) {
+    local int tile_index; // Broadcast of the tile drawn by the first work-item
+    int lid = get_local_id(0);
+    int group_size = get_local_size(0);
+    int tiles_done = 0;
+    int pixels_done = 0;
+
+    for (int i = lid; i < nr_bins; i += group_size) {
+        local_hist[i] = 0;
+    }
+
+    while (true) {
+        if (lid == 0) tile_index = atomic_inc(next_tile);
+        barrier(CLK_LOCAL_MEM_FENCE);
+        int t = tile_index;
+        barrier(CLK_LOCAL_MEM_FENCE); // All reads done before the next draw overwrites it
+        if (t >= tile_count) break; // Uniform across the group
+
+        int4 tile = tiles[t]; // x, y, w, h
+        int tile_pixels = tile.z * tile.w;
+        for (int i = lid; i < tile_pixels; i += group_size) {
+            ushort value = A[(tile.y + i / tile.z) * row_pitch + tile.x + i % tile.z];
+            int bin_index = (int)(((uint)value * (uint)nr_bins) >> 16);
+            if (bin_index >= nr_bins) bin_index = nr_bins - 1;
+            atomic_add(&local_hist[bin_index], 1);
+        }
+        tiles_done++;
+        pixels_done += tile_pixels;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int i = lid; i < nr_bins; i += group_size) {
+        if (local_hist[i] > 0) {
+            atomic_add(&H[i], local_hist[i]);
+        }
+    }
+    if (lid == 0) {
+        stats[2 * get_group_id(0)] = tiles_done;
+        stats[2 * get_group_id(0) + 1] = pixels_done;
+    }
+}
+
+kernel void back_project_persistent(global const ushort* input, global ushort* output, global ushort* lut, int row_pitch,
+                                    global const int4* tiles, int tile_count, global int* next_tile, global int* stats) {
+    local int tile_index;
+    int lid = get_local_id(0);
+    int group_size = get_local_size(0);
+    int tiles_done = 0;
+    int pixels_done = 0;
+
+    while (true) {
+        if (lid == 0) tile_index = atomic_inc(next_tile);
+        barrier(CLK_LOCAL_MEM_FENCE);
+        int t = tile_index;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (t >= tile_count) break;
+
+        int4 tile = tiles[t];
+        int tile_pixels = tile.z * tile.w;
+        for (int i = lid; i < tile_pixels; i += group_size) {
+            int id = (tile.y + i / tile.z) * row_pitch + tile.x + i % tile.z;
+            output[id] = lut[input[id]];
+        }
+        tiles_done++;
+        pixels_done += tile_pixels;
+    }
+
+    if (lid == 0) {
+        stats[2 * get_group_id(0)] = tiles_done;
+        stats[2 * get_group_id(0) + 1] = pixels_done;
+    }
+}
+
+// Tile states of the single-pass scan
+#define TILE_NONE 0      // Nothing published yet
+#define TILE_AGGREGATE 1 // tile_aggregates holds the sum of the tile alone
+#define TILE_PREFIX 2    // tile_prefixes holds the inclusive sum of all tiles up to and including this one
+
+// Single-pass inclusive scan with decoupled look-back. Tiles of one work-group are claimed in order from
+// next_tile, so every earlier tile belongs to a group that is already running and the look-back cannot
+// wait on a group that never gets scheduled. next_tile and tile_flags must be zeroed before the launch.
+kernel void scan_lookback(global const int* A, global int* B, int N, local int* scratch_1, local int* scratch_2,
+                          global int* next_tile, global int* tile_flags, global int* tile_aggregates, global int* tile_prefixes) {
+    int lid = get_local_id(0);
+    int L = get_local_size(0);
+    local int tile;
+    local int tile_prefix;
+    local int *scratch_3;
+
+    if (lid == 0)
+        tile = atomic_inc(next_tile);
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    int id = tile * L + lid;
+    scratch_1[lid] = (id < N) ? A[id] : 0;
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Local Hillis-Steele scan of the tile, as in scan_add
+    for (int i = 1; i < L; i *= 2) {
+        if (lid >= i)
+            scratch_2[lid] = scratch_1[lid] + scratch_1[lid - i];
+        else
+            scratch_2[lid] = scratch_1[lid];
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        scratch_3 = scratch_2;
+        scratch_2 = scratch_1;
+        scratch_1 = scratch_3;
+    }
+
+    if (lid == 0) {
+        int aggregate = scratch_1[L - 1];
+        int prefix = 0;
+
+        if (tile == 0) {
+            tile_prefixes[0] = aggregate;
+            write_mem_fence(CLK_GLOBAL_MEM_FENCE);
+            atomic_xchg(&tile_flags[0], TILE_PREFIX);
+        } else {
+            // Publish the aggregate first so later tiles can look past this one
+            tile_aggregates[tile] = aggregate;
+            write_mem_fence(CLK_GLOBAL_MEM_FENCE);
+            atomic_xchg(&tile_flags[tile], TILE_AGGREGATE);
+
+            // Walk back until a tile with a full prefix, spinning on tiles that have published nothing
+            for (int i = tile - 1; i >= 0;) {
+                int flag = atomic_or(&tile_flags[i], 0);
+                if (flag == TILE_NONE) continue;
+                read_mem_fence(CLK_GLOBAL_MEM_FENCE);
+                if (flag == TILE_PREFIX) {
+                    prefix += atomic_or(&tile_prefixes[i], 0);
+                    break;
+                }
+                prefix += atomic_or(&tile_aggregates[i], 0);
+                i--;
+            }
+
+            tile_prefixes[tile] = prefix + aggregate;
+            write_mem_fence(CLK_GLOBAL_MEM_FENCE);
+            atomic_xchg(&tile_flags[tile], TILE_PREFIX);
+        }
+        tile_prefix = prefix;
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (id < N)
+        B[id] = scratch_1[lid] + tile_prefix;
+}
+
+// Distributions of generate_image, numbered as SyntheticDistribution in Utils.h
+#define SYNTH_UNIFORM 0
+#define SYNTH_GAUSSIAN 1
+#define SYNTH_CONSTANT 2
+#define SYNTH_BIMODAL 3
+#define SYNTH_SPARSE 4
+#define SYNTH_NATURAL 5
+
+// Integer hash used as a counter-based random number generator
+uint hash_uint(uint x) {
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+// Uniform value in [0, 1) for a counter in one of several independent streams
+float random_uniform(uint seed, uint stream, uint counter) {
+    return hash_uint(counter ^ hash_uint(seed + stream * 0x9e3779b9u)) * (1.0f / 4294967296.0f);
+}
+
+// Normal value (Box-Muller) with the given mean and standard deviation
+float random_normal(uint seed, uint stream, uint counter, float mean, float sigma) {
+    float u1 = max(random_uniform(seed, stream, counter), 1e-7f);
+    float u2 = random_uniform(seed, stream + 1, counter);
+    return mean + sigma * sqrt(-2.0f * log(u1)) * cos(6.2831853f * u2);
+}
+
+// Smoothly interpolated lattice noise in [0, 1) with the given cell size
+float value_noise(uint seed, uint stream, int x, int y, int cell) {
+    int cx = x / cell, cy = y / cell;
+    float fx = (float)(x - cx * cell) / cell, fy = (float)(y - cy * cell) / cell;
+    fx = fx * fx * (3.0f - 2.0f * fx); // Smoothstep
+    fy = fy * fy * (3.0f - 2.0f * fy);
+    float v00 = random_uniform(seed, stream, hash_uint(cx) ^ (uint)cy);
+    float v10 = random_uniform(seed, stream, hash_uint(cx + 1) ^ (uint)cy);
+    float v01 = random_uniform(seed, stream, hash_uint(cx) ^ (uint)(cy + 1));
+    float v11 = random_uniform(seed, stream, hash_uint(cx + 1) ^ (uint)(cy + 1));
+    return mix(mix(v00, v10, fx), mix(v01, v11, fx), fy);
+}
+
+// Synthetic planar image of levels grey levels, each stored multiplied by scale (257 turns 8-bit levels into the
+// 16-bit range as the image loader does). The range is width x height x channels; every pixel is an independent
+// function of (seed, channel, x, y), so the same arguments always produce the same image.
+kernel void generate_image(global ushort* output, int distribution, uint seed, int levels, int scale) {
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    int c = get_global_id(2);
+    int width = get_global_size(0);
+    int height = get_global_size(1);
+    uint counter = (uint)(y * width + x);
+    uint stream = 4 * (uint)c;
+    float v;
+
+    switch (distribution) {
+        case SYNTH_UNIFORM:
+            v = random_uniform(seed, stream, counter);
+            break;
+        case SYNTH_GAUSSIAN:
+            v = random_normal(seed, stream, counter, 0.5f, 0.12f);
+            break;
+        case SYNTH_CONSTANT: // Every pixel in one bin, the worst case for atomic contention
+            v = 0.5f;
+            break;
+        case SYNTH_BIMODAL:
+            v = random_normal(seed, stream, counter, (random_uniform(seed, stream + 2, counter) < 0.5f) ? 0.25f : 0.75f, 0.06f);
+            break;
+        case SYNTH_SPARSE: // Black background with 1% of pixels set
+            v = (random_uniform(seed, stream, counter) < 0.01f) ? random_uniform(seed, stream + 1, counter) : 0.0f;
+            break;
+        default: { // SYNTH_NATURAL: octaves of smooth noise shared by all channels, a per-channel tint and sensor noise
+            float amplitude = 0.5f;
+            v = 0.0f;
+            for (int cell = 256; cell >= 4; cell /= 2) {
+                v += amplitude * value_noise(seed, 0, x, y, cell);
+                amplitude *= 0.5f;
+            }
+            v = v * (0.8f + 0.2f * value_noise(seed, stream + 1, x, y, 512)) + random_normal(seed, stream + 2, counter, 0.0f, 0.01f);
+            break;
+        }
+    }
+
+    int level = (int)(clamp(v, 0.0f, 1.0f) * (levels - 1) + 0.5f);
+    output[(c * height + y) * width + x] = (ushort)(level * scale);
+}
+
+// Stages of the device-resident image pipeline (ImageCore.h). Images are planar: channel c of a width x height
+// image starts at sample c * width * height.
+
+// Depth conversions, one work-item per sample; 8-bit levels map to the 16-bit range and back as the image loader does
+kernel void widen_8_to_16(global const uchar* input, global ushort* output) {
+    int id = get_global_id(0);
+    output[id] = (ushort)(input[id] * 257);
+}
+
+kernel void narrow_16_to_8(global const ushort* input, global uchar* output) {
+    int id = get_global_id(0);
+    output[id] = (uchar)(input[id] / 257);
+}
+
+// Luma of the first three channels (Rec. 709 weights, as tutorial2's rgb2grey), 2-D range width x height
+kernel void rgb2grey_planar(global const ushort* input, global ushort* output) {
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    int image_size = get_global_size(0) * get_global_size(1);
+    int id = y * get_global_size(0) + x;
+    float luma = 0.2126f * input[id] + 0.7152f * input[id + image_size] + 0.0722f * input[id + 2 * image_size];
+    output[id] = convert_ushort_sat_rte(luma);
+}
+
+// 3x3 convolution with a row-major mask, 3-D range width x height x channels; border pixels repeat the edge
+kernel void convolution3x3(global const ushort* input, global ushort* output, constant float* mask) {
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    int c = get_global_id(2);
+    int width = get_global_size(0);
+    int height = get_global_size(1);
+    global const ushort* plane = input + (size_t)c * width * height;
+
+    float result = 0.0f;
+    for (int j = -1; j <= 1; j++) {
+        int row = clamp(y + j, 0, height - 1) * width;
+        for (int i = -1; i <= 1; i++)
+            result += plane[row + clamp(x + i, 0, width - 1)] * mask[(j + 1) * 3 + i + 1];
+    }
+    output[((size_t)c * height + y) * width + x] = convert_ushort_sat_rte(result);
+}
+
+// Histograms of the tile_size x tile_size tiles of a row-pitched image, for the tile container (TileStore.h).
+// One work-group per tile over a (tiles_x * L) x tiles_y range with L x 1 groups; each group counts its tile
+// in local memory and writes its own nr_bins counts to H[(tile_y * tiles_x + tile_x) * nr_bins], no zeroing needed.
+kernel void hist_tiles(global const ushort* A, global int* H, int nr_bins, local int* local_hist,
+                       int width, int height, int row_pitch, int tile_size) {
+    int lid = get_local_id(0);
+    int group_size = get_local_size(0);
+    int tile_x = get_group_id(0);
+    int tile_y = get_group_id(1);
+    int x0 = tile_x * tile_size;
+    int y0 = tile_y * tile_size;
+    int w = min(tile_size, width - x0);
+    int h = min(tile_size, height - y0);
+
+    for (int i = lid; i < nr_bins; i += group_size) {
+        local_hist[i] = 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int i = lid; i < w * h; i += group_size) {
+        ushort value = A[(y0 + i / w) * row_pitch + x0 + i % w];
+        int bin_index = (int)(((uint)value * (uint)nr_bins) >> 16);
+        if (bin_index >= nr_bins) bin_index = nr_bins - 1;
+        atomic_add(&local_hist[bin_index], 1);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    global int* tile_hist = H + (size_t)(tile_y * get_num_groups(0) + tile_x) * nr_bins;
+    for (int i = lid; i < nr_bins; i += group_size) {
+        tile_hist[i] = local_hist[i];
+    }
+}
+
+// Otsu thresholding (ImageCore::Threshold). k thresholds t_1 < ... < t_k split the bins into k + 1 classes, class j
+// holding the bins (t_j-1, t_j]. With P the inclusive scan of the histogram (scan_lookback) and S that of its first
+// moment bin * H[bin], the between-class variance of a candidate is maximised by maximising sum_j S_j^2 / P_j over
+// its classes, the remaining terms being the same for every candidate. S and the scores are kept in long, exactly: a
+// float loses the low bits that separate close candidates on large images.
+#define OTSU_MAX_THRESHOLDS 3
+
+// Inclusive scan of bin * H[bin] in long, as its int sum overflows on large images. A single work-group walks the
+// bins in chunks of its size, scanning each chunk in local memory and carrying the running total
+kernel void scan_moment(global const int* H, global long* S, int nr_bins, local long* scratch) {
+    int lid = get_local_id(0);
+    int n = get_local_size(0);
+    long carry = 0;
+    for (int base = 0; base < nr_bins; base += n) {
+        int i = base + lid;
+        scratch[lid] = (i < nr_bins) ? (long)i * H[i] : 0;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        for (int stride = 1; stride < n; stride *= 2) {
+            long value = (lid >= stride) ? scratch[lid - stride] : 0;
+            barrier(CLK_LOCAL_MEM_FENCE);
+            scratch[lid] += value;
+            barrier(CLK_LOCAL_MEM_FENCE);
+        }
+        if (i < nr_bins) S[i] = carry + scratch[lid];
+        carry += scratch[n - 1];
+        barrier(CLK_LOCAL_MEM_FENCE); // Chunk total read before the next chunk overwrites it
+    }
+}
+
+// Threshold j of candidate id is digit j of id in base nr_bins. Only strictly increasing thresholds below the last
+// bin are valid, so every class covers at least one bin
+bool otsu_decode(int id, int nr_bins, int thresholds, int* t) {
+    for (int j = 0; j < thresholds; j++) {
+        t[j] = id % nr_bins;
+        id /= nr_bins;
+        if (t[j] >= nr_bins - 1 || (j > 0 && t[j] <= t[j - 1])) return false;
+    }
+    return true;
+}
+
+// sum_j floor(S_j^2 / P_j) in long. S_j^2 overflows, so with S_j = q P_j + r (q the class mean, below nr_bins) each
+// term is computed as q (S_j + r) + floor(r^2 / P_j), every part of which fits: the score is exact but for the
+// fractions of the class terms
+long otsu_score(global const int* P, global const long* S, int nr_bins, int thresholds, const int* t) {
+    long score = 0;
+    int previous_p = 0;
+    long previous_s = 0;
+    for (int j = 0; j <= thresholds; j++) {
+        int end = (j < thresholds) ? t[j] : nr_bins - 1;
+        long p = P[end] - previous_p;
+        long s = S[end] - previous_s;
+        if (p > 0) {
+            long q = s / p, r = s % p;
+            score += q * (s + r) + r * r / p;
+        }
+        previous_p = P[end];
+        previous_s = S[end];
+    }
+    return score;
+}
+
+// Reduces the (score, id) pairs of a work-group to the best one in slot 0, ties going to the lower id;
+// the local size must be a power of two
+void otsu_argmax_local(local long* score, local int* id) {
+    int lid = get_local_id(0);
+    for (int stride = get_local_size(0) / 2; stride > 0; stride /= 2) {
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (lid < stride) {
+            long other = score[lid + stride];
+            int other_id = id[lid + stride];
+            if (other > score[lid] || (other == score[lid] && other_id < id[lid])) {
+                score[lid] = other;
+                id[lid] = other_id;
+            }
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+// Scores candidates [0, candidates) in a grid-stride loop; every work-group writes its best score and id
+// (-1 and -1 if it drew no valid candidate) for otsu_select
+kernel void otsu_candidates(global const int* P, global const long* S, int nr_bins, int thresholds, int candidates,
+                            local long* best_score, local int* best_id, global long* group_score, global int* group_id) {
+    int lid = get_local_id(0);
+    long score = -1;
+    int score_id = -1;
+    for (int id = get_global_id(0); id < candidates; id += get_global_size(0)) {
+        int t[OTSU_MAX_THRESHOLDS];
+        if (!otsu_decode(id, nr_bins, thresholds, t)) continue;
+        long candidate_score = otsu_score(P, S, nr_bins, thresholds, t);
+        if (candidate_score > score) { // A work-item's ids increase, so ties keep the lowest
+            score = candidate_score;
+            score_id = id;
+        }
+    }
+    best_score[lid] = score;
+    best_id[lid] = score_id;
+    otsu_argmax_local(best_score, best_id);
+    if (lid == 0) {
+        group_score[get_group_id(0)] = best_score[0];
+        group_id[get_group_id(0)] = best_id[0];
+    }
+}
+
+// Best of the groups results of otsu_candidates into best[0], one work-group
+kernel void otsu_select(global const long* group_score, global const int* group_id, int groups,
+                        local long* best_score, local int* best_id, global int* best) {
+    int lid = get_local_id(0);
+    long score = -1;
+    int score_id = -1;
+    for (int g = lid; g < groups; g += get_local_size(0)) {
+        if (group_score[g] > score) {
+            score = group_score[g];
+            score_id = group_id[g];
+        }
+    }
+    best_score[lid] = score;
+    best_id[lid] = score_id;
+    otsu_argmax_local(best_score, best_id);
+    if (lid == 0) best[0] = best_id[0];
+}
+
+// LUT of the thresholds in best[0]: values in class j map to j * 65535 / thresholds, binned as normalize_lut bins
+kernel void threshold_lut(global const int* best, global ushort* lut, int nr_bins, int thresholds) {
+    int id = get_global_id(0);
+    if (id >= 65536) return;
+    int bin = (int)(((uint)id * (uint)nr_bins) >> 16);
+    int code = best[0];
+    int level = 0;
+    for (int j = 0; j < thresholds; j++) {
+        if (bin > code % nr_bins) level++;
+        code /= nr_bins;
+    }
+    lut[id] = (ushort)(level * 65535 / thresholds);
+}
+
+// 3-D tiled CLAHE of volumes (volume.cpp). A slab of slices [z0, z0 + slices) of a width x height x depth volume is
+// processed as a width x (height * slices) image. The volume is split into tiles_x x tiles_y x tiles_z tiles,
+// voxel (x, y, z) falling in tile (x * tiles_x / width, y * tiles_y / height, z * tiles_z / depth).
+
+// Histograms of the tiles, H[(tile_z * tiles_y + tile_y) * tiles_x + tile_x][nr_bins], accumulated slab by slab
+kernel void hist_tiles3d(global const ushort* A, global int* H, int nr_bins, int width, int height, int depth, int z0,
+                         int tiles_x, int tiles_y, int tiles_z) {
+    int x = get_global_id(0);
+    int row = get_global_id(1);
+    int y = row % height;
+    int z = z0 + row / height;
+    int tile = ((z * tiles_z / depth) * tiles_y + y * tiles_y / height) * tiles_x + x * tiles_x / width;
+    int bin_index = (int)(((uint)A[(size_t)row * width + x] * (uint)nr_bins) >> 16);
+    atomic_add(&H[(size_t)tile * nr_bins + bin_index], 1);
+}
+
+// Clipped, renormalised CDF of every tile as its LUT at bin resolution, one work-item per tile. Counts above
+// clip_limit times the mean bin count are cut and spread evenly over all bins before the scan
+kernel void clahe_lut(global const int* H, global ushort* lut, int nr_bins, float clip_limit) {
+    int tile = get_global_id(0);
+    global const int* hist = H + (size_t)tile * nr_bins;
+    global ushort* tile_lut = lut + (size_t)tile * nr_bins;
+
+    int total = 0;
+    for (int i = 0; i < nr_bins; i++) total += hist[i];
+    int limit = max(1, (int)(clip_limit * total / nr_bins));
+    int excess = 0;
+    for (int i = 0; i < nr_bins; i++) excess += max(0, hist[i] - limit);
+    int spread = excess / nr_bins;
+    int remainder = excess % nr_bins;
+
+    float scale = 65535.0f / max(total, 1);
+    int sum = 0;
+    for (int i = 0; i < nr_bins; i++) {
+        sum += min(hist[i], limit) + spread + (i < remainder ? 1 : 0);
+        tile_lut[i] = (ushort)min(sum * scale, 65535.0f);
+    }
+}
+
+// Position of voxel coordinate i between the two nearest tile centres along one axis: sets the lower and upper tile
+// and returns the weight of the upper one; beyond the outer centres both are the border tile
+float clahe_axis(int i, int size, int tiles, int* t0, int* t1) {
+    float f = (i + 0.5f) * tiles / size - 0.5f;
+    if (f <= 0.0f) { *t0 = *t1 = 0; return 0.0f; }
+    if (f >= tiles - 1) { *t0 = *t1 = tiles - 1; return 0.0f; }
+    *t0 = (int)f;
+    *t1 = *t0 + 1;
+    return f - *t0;
+}
+
+// Applies the tile LUTs to a slab, interpolating trilinearly between the eight nearest tile centres, across slices too
+kernel void clahe_apply(global const ushort* input, global ushort* output, global const ushort* lut, int nr_bins,
+                        int width, int height, int depth, int z0, int tiles_x, int tiles_y, int tiles_z) {
+    int x = get_global_id(0);
+    int row = get_global_id(1);
+    int y = row % height;
+    int z = z0 + row / height;
+    size_t id = (size_t)row * width + x;
+    int bin_index = (int)(((uint)input[id] * (uint)nr_bins) >> 16);
+
+    int x0, x1, y0, y1, z0_tile, z1_tile;
+    float wx = clahe_axis(x, width, tiles_x, &x0, &x1);
+    float wy = clahe_axis(y, height, tiles_y, &y0, &y1);
+    float wz = clahe_axis(z, depth, tiles_z, &z0_tile, &z1_tile);
+    float result = 0.0f;
+    for (int k = 0; k < 8; k++) {
+        int tx = (k & 1) ? x1 : x0;
+        int ty = (k & 2) ? y1 : y0;
+        int tz = (k & 4) ? z1_tile : z0_tile;
+        float weight = ((k & 1) ? wx : 1.0f - wx) * ((k & 2) ? wy : 1.0f - wy) * ((k & 4) ? wz : 1.0f - wz);
+        result += weight * lut[((size_t)(tz * tiles_y + ty) * tiles_x + tx) * nr_bins + bin_index];
+    }
+    output[id] = convert_ushort_sat_rte(result);
+}
+
+// LUT engine (ImageCore::Grade). The per-channel 1-D LUTs (equalisation composed with a tone curve) are applied as
+// back_project does; a 3-D colour LUT then maps the first three channels. Planar images of pixels pixels.
+#define CUBE_TRILINEAR 0
+#define CUBE_TETRAHEDRAL 1
+
+// Composes a tone curve after the LUTs of all channels, one work-item per entry
+kernel void compose_lut(global ushort* lut, global const ushort* curve) {
+    int id = get_global_id(0);
+    lut[id] = curve[lut[id]];
+}
+
+// Lattice coordinates in [0, size - 1] of a pixel after its 1-D LUTs, through the cube's input domain
+void cube_position(global const ushort* input, global const ushort* luts, int pixels, int id, int size,
+                   float4 domain_min, float4 domain_max, float* position) {
+    float low[3] = {domain_min.x, domain_min.y, domain_min.z};
+    float high[3] = {domain_max.x, domain_max.y, domain_max.z};
+    for (int k = 0; k < 3; k++) {
+        float value = luts[k * 65536 + input[k * pixels + id]] / 65535.0f;
+        position[k] = clamp((value - low[k]) / (high[k] - low[k]), 0.0f, 1.0f) * (size - 1);
+    }
+}
+
+// Corners (bit 0 red, bit 1 green, bit 2 blue set for the upper lattice point) and weights that interpolate a point
+// at fractions f within its lattice cell; returns how many. Tetrahedral splits the cell along its main diagonal into
+// six tetrahedra and blends the four corners of the one holding the point, picked by the order of the fractions
+int cube_weights(int interpolation, const float* f, int* corner, float* weight) {
+    if (interpolation == CUBE_TRILINEAR) {
+        for (int k = 0; k < 8; k++) {
+            corner[k] = k;
+            weight[k] = ((k & 1) ? f[0] : 1.0f - f[0]) * ((k & 2) ? f[1] : 1.0f - f[1]) * ((k & 4) ? f[2] : 1.0f - f[2]);
+        }
+        return 8;
+    }
+    int a = 0, b = 1, c = 2; // Axes by decreasing fraction
+    if (f[b] > f[a]) { int t = a; a = b; b = t; }
+    if (f[c] > f[b]) { int t = b; b = c; c = t; }
+    if (f[b] > f[a]) { int t = a; a = b; b = t; }
+    corner[0] = 0;
+    weight[0] = 1.0f - f[a];
+    corner[1] = 1 << a;
+    weight[1] = f[a] - f[b];
+    corner[2] = (1 << a) | (1 << b);
+    weight[2] = f[b] - f[c];
+    corner[3] = 7;
+    weight[3] = f[c];
+    return 4;
+}
+
+void cube_store(global ushort* output, int pixels, int id, const float* rgb) {
+    for (int k = 0; k < 3; k++) output[k * pixels + id] = convert_ushort_sat_rte(rgb[k] * 65535.0f);
+}
+
+// Colour cube staged in local memory: every work-group copies the size^3 x 3 lattice of 16-bit normalised values
+// (red fastest, as in .cube files) into cube, so it must fit the device's local memory. 1-D range over the pixels
+kernel void apply_cube_local(global const ushort* input, global ushort* output, global const ushort* luts, int pixels,
+                             global const ushort* lattice, local ushort* cube, int size, int interpolation,
+                             float4 domain_min, float4 domain_max) {
+    int id = get_global_id(0);
+    int entries = size * size * size * 3;
+    for (int i = get_local_id(0); i < entries; i += get_local_size(0)) cube[i] = lattice[i];
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (id >= pixels) return; // Padding of the rounded-up range, after the barrier
+
+    float position[3], fraction[3], weight[8], rgb[3] = {0.0f, 0.0f, 0.0f};
+    int base[3], corner[8];
+    cube_position(input, luts, pixels, id, size, domain_min, domain_max, position);
+    for (int k = 0; k < 3; k++) {
+        base[k] = min((int)position[k], size - 2);
+        fraction[k] = position[k] - base[k];
+    }
+    int count = cube_weights(interpolation, fraction, corner, weight);
+    for (int i = 0; i < count; i++) {
+        int r = base[0] + (corner[i] & 1), g = base[1] + ((corner[i] >> 1) & 1), b = base[2] + ((corner[i] >> 2) & 1);
+        local const ushort* point = cube + ((b * size + g) * size + r) * 3;
+        for (int k = 0; k < 3; k++) rgb[k] += weight[i] * point[k] / 65535.0f;
+    }
+    cube_store(output, pixels, id, rgb);
+}
+
+// Colour cube staged as an RGBA Image3D: trilinear interpolation uses the sampler's filtering (with the texture units'
+// reduced weight precision), tetrahedral reads its four corners unfiltered
+kernel void apply_cube_image(global const ushort* input, global ushort* output, global const ushort* luts, int pixels,
+                             read_only image3d_t cube, int size, int interpolation, float4 domain_min, float4 domain_max) {
+    const sampler_t filtered = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_LINEAR;
+    const sampler_t unfiltered = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;
+    int id = get_global_id(0);
+    if (id >= pixels) return;
+
+    float position[3], fraction[3], weight[8], rgb[3] = {0.0f, 0.0f, 0.0f};
+    int base[3], corner[8];
+    cube_position(input, luts, pixels, id, size, domain_min, domain_max, position);
+    if (interpolation == CUBE_TRILINEAR) {
+        float4 texel = read_imagef(cube, filtered, (float4)(position[0] + 0.5f, position[1] + 0.5f, position[2] + 0.5f, 0.0f));
+        rgb[0] = texel.x;
+        rgb[1] = texel.y;
+        rgb[2] = texel.z;
+    } else {
+        for (int k = 0; k < 3; k++) {
+            base[k] = min((int)position[k], size - 2);
+            fraction[k] = position[k] - base[k];
+        }
+        int count = cube_weights(interpolation, fraction, corner, weight);
+        for (int i = 0; i < count; i++) {
+            int4 point = (int4)(base[0] + (corner[i] & 1), base[1] + ((corner[i] >> 1) & 1), base[2] + ((corner[i] >> 2) & 1), 0);
+            float4 texel = read_imagef(cube, unfiltered, point);
+            rgb[0] += weight[i] * texel.x;
+            rgb[1] += weight[i] * texel.y;
+            rgb[2] += weight[i] * texel.z;
+        }
+    }
+    cube_store(output, pixels, id, rgb);
+}
+
+// Joint colour histogram and palette quantisation (ImageCore::Quantise). The first three channels of a planar 16-bit
+// image of pixels pixels are reduced to bits bits each and counted jointly in 2^(3 bits) bins, numbered by the Morton
+// code of the reduced colour (red, green, blue bits interleaved from the top), so a run of bins is a box of colour space
+uint morton_rgb(uint r, uint g, uint b, int bits) {
+    uint code = 0;
+    for (int i = 0; i < bits; i++)
+        code |= (((r >> i) & 1) << (3 * i + 2)) | (((g >> i) & 1) << (3 * i + 1)) | (((b >> i) & 1) << (3 * i));
+    return code;
+}
+
+// Centre of a bin as a normalised colour, w = 0
+float4 bin_colour(int bin, int bits) {
+    uint rgb[3] = {0, 0, 0};
+    for (int i = 0; i < bits; i++)
+        for (int k = 0; k < 3; k++) rgb[k] |= ((bin >> (3 * i + 2 - k)) & 1) << i;
+    float scale = 1.0f / (1 << bits);
+    return (float4)((rgb[0] + 0.5f) * scale, (rgb[1] + 0.5f) * scale, (rgb[2] + 0.5f) * scale, 0.0f);
+}
+
+int nearest_colour(float4 colour, local const float4* palette, int colours) {
+    int best = 0;
+    float best_distance = INFINITY;
+    for (int j = 0; j < colours; j++) {
+        float4 d = colour - palette[j];
+        float distance = dot(d, d);
+        if (distance < best_distance) {
+            best_distance = distance;
+            best = j;
+        }
+    }
+    return best;
+}
+
+// Counts of the window_bins bins starting at bin window, privatised in local memory as in hist_local. 1-D range of a
+// few groups per compute unit striding over the pixels, so every group clears and flushes its local copy once; the
+// host launches one window after another when all the bins do not fit local memory
+kernel void hist_rgb(global const ushort* input, global int* H, int pixels, int bits, int window, int window_bins,
+                     local int* local_hist) {
+    int lid = get_local_id(0);
+    int group_size = get_local_size(0);
+    int shift = 16 - bits;
+
+    for (int i = lid; i < window_bins; i += group_size) local_hist[i] = 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int id = get_global_id(0); id < pixels; id += get_global_size(0)) {
+        int bin = (int)morton_rgb(input[id] >> shift, input[pixels + id] >> shift, input[2 * pixels + id] >> shift, bits) - window;
+        if (bin >= 0 && bin < window_bins) atomic_inc(&local_hist[bin]);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int i = lid; i < window_bins; i += group_size)
+        if (local_hist[i] > 0) atomic_add(&H[window + i], local_hist[i]);
+}
+
+// Initial palette: entry j is the centre of the bin where the inclusive scan of the histogram crosses
+// (j + 1/2) / colours of the pixels, i.e. weighted quantiles along the Morton curve, which spreads the entries over the
+// populated boxes of colour space. Compared in integers (2 count colours against (2j + 1) total) so every entry gets
+// exactly one bin. One work-item per bin
+kernel void palette_seed(global const int* cum_histogram, int nr_bins, int bits, int colours, global float4* palette) {
+    int bin = get_global_id(0);
+    if (bin >= nr_bins) return;
+    long total = cum_histogram[nr_bins - 1];
+    long before = 2 * (long)(bin > 0 ? cum_histogram[bin - 1] : 0) * colours - total;
+    long after = 2 * (long)cum_histogram[bin] * colours - total;
+    // Entries j with before <= 2 j total < after
+    int first = before > 0 ? (int)((before + 2 * total - 1) / (2 * total)) : 0;
+    int last = after > 0 ? (int)((after + 2 * total - 1) / (2 * total)) : 0;
+    for (int j = first; j < min(last, colours); j++) palette[j] = bin_colour(bin, bits);
+}
+
+// k-means assignment over the histogram: the nearest palette entry of every populated bin's centre, -1 for empty
+// bins. One work-item per bin, palette cached in local memory
+kernel void palette_assign(global const int* H, int nr_bins, int bits, global const float4* palette, int colours,
+                           local float4* local_palette, global int* assignment) {
+    int bin = get_global_id(0);
+    for (int j = get_local_id(0); j < colours; j += get_local_size(0)) local_palette[j] = palette[j];
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (bin >= nr_bins) return; // Padding of the rounded-up range, after the barrier
+    assignment[bin] = (H[bin] > 0) ? nearest_colour(bin_colour(bin, bits), local_palette, colours) : -1;
+}
+
+// k-means update: entry get_group_id(0) becomes the count-weighted mean of the bin centres assigned to it, or stays as
+// it is if none are. One work-group of a power-of-two size per entry; sums (colour, count) are reduced in local memory,
+// so no floating-point atomics are needed
+kernel void palette_update(global const int* H, global const int* assignment, int nr_bins, int bits, global float4* palette,
+                           local float4* sums) {
+    int j = get_group_id(0);
+    int lid = get_local_id(0);
+    int N = get_local_size(0);
+    float4 sum = 0.0f;
+    for (int bin = lid; bin < nr_bins; bin += N) {
+        if (assignment[bin] != j) continue;
+        float4 colour = bin_colour(bin, bits);
+        colour.w = 1.0f;
+        sum += colour * (float)H[bin];
+    }
+    sums[lid] = sum;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (int stride = N / 2; stride > 0; stride /= 2) {
+        if (lid < stride) sums[lid] += sums[lid + stride];
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    if (lid == 0 && sums[0].w > 0.0f) palette[j] = (float4)(sums[0].xyz / sums[0].w, 0.0f);
+}
+
+// Every pixel's first three channels replaced by the colour of its nearest palette entry, measured at full precision.
+// 1-D range over the pixels, palette cached in local memory
+kernel void palette_map(global const ushort* input, global ushort* output, int pixels, global const float4* palette,
+                        int colours, local float4* local_palette) {
+    int id = get_global_id(0);
+    for (int j = get_local_id(0); j < colours; j += get_local_size(0)) local_palette[j] = palette[j];
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (id >= pixels) return;
+    float4 colour = (float4)(input[id], input[pixels + id], input[2 * pixels + id], 0.0f) / 65535.0f;
+    float4 entry = local_palette[nearest_colour(colour, local_palette, colours)];
+    output[id] = convert_ushort_sat_rte(entry.x * 65535.0f);
+    output[pixels + id] = convert_ushort_sat_rte(entry.y * 65535.0f);
+    output[2 * pixels + id] = convert_ushort_sat_rte(entry.z * 65535.0f);
+}
+
+// Canny edge detection (ImageCore::Canny) of a single-channel 16-bit image. Edge states: 0 none, 1 weak, 2 strong.
+#define CANNY_TILE 16
+
+// Sobel or Scharr gradient of every pixel from one local tile per work-group: the CANNY_TILE x CANNY_TILE groups load
+// their tile with a one-pixel halo (edges repeated) once, then every work-item applies both 3x3 masks from local memory.
+// magnitude is in units of a full-scale step (the masks are normalised by their smoothing weights); direction is the
+// gradient direction rounded to 0 (along x), 1 (diagonal x = y), 2 (along y) or 3 (diagonal x = -y)
+kernel void gradient_tile(global const ushort* input, global float* magnitude, global uchar* direction, int width, int height,
+                          int scharr) {
+    local float tile[CANNY_TILE + 2][CANNY_TILE + 2];
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    int lx = get_local_id(0);
+    int ly = get_local_id(1);
+    int x0 = get_group_id(0) * CANNY_TILE - 1;
+    int y0 = get_group_id(1) * CANNY_TILE - 1;
+    for (int i = ly * CANNY_TILE + lx; i < (CANNY_TILE + 2) * (CANNY_TILE + 2); i += CANNY_TILE * CANNY_TILE) {
+        int tx = i % (CANNY_TILE + 2), ty = i / (CANNY_TILE + 2);
+        tile[ty][tx] = input[clamp(y0 + ty, 0, height - 1) * width + clamp(x0 + tx, 0, width - 1)] / 65535.0f;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (x >= width || y >= height) return; // Padding of the rounded-up range, after the barrier
+
+    float side = scharr ? 3.0f : 1.0f, centre = scharr ? 10.0f : 2.0f; // Smoothing weights across the derivative
+    int cx = lx + 1, cy = ly + 1;
+    float gx = (side * (tile[cy - 1][cx + 1] - tile[cy - 1][cx - 1]) + centre * (tile[cy][cx + 1] - tile[cy][cx - 1]) +
+                side * (tile[cy + 1][cx + 1] - tile[cy + 1][cx - 1])) / (2.0f * side + centre);
+    float gy = (side * (tile[cy + 1][cx - 1] - tile[cy - 1][cx - 1]) + centre * (tile[cy + 1][cx] - tile[cy - 1][cx]) +
+                side * (tile[cy + 1][cx + 1] - tile[cy - 1][cx + 1])) / (2.0f * side + centre);
+    int id = y * width + x;
+    magnitude[id] = hypot(gx, gy);
+    const float tan_22_5 = 0.41421356f;
+    if (fabs(gy) <= tan_22_5 * fabs(gx)) direction[id] = 0;
+    else if (fabs(gx) <= tan_22_5 * fabs(gy)) direction[id] = 2;
+    else direction[id] = (gx * gy > 0.0f) ? 1 : 3;
+}
+
+// Non-maximum suppression and double threshold: a pixel stays an edge only if its magnitude is a maximum across the
+// edge (along its gradient direction; ties go to the later neighbour, so plateaus stay one pixel thick), and is then
+// strong at magnitude >= high or weak at >= low. 2-D range over the image
+kernel void nonmax_suppress(global const float* magnitude, global const uchar* direction, global uchar* state, int width,
+                            int height, float low, float high) {
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    if (x >= width || y >= height) return;
+    const int dx[4] = {1, 1, 0, -1};
+    const int dy[4] = {0, 1, 1, 1};
+    int id = y * width + x;
+    int d = direction[id];
+    float m = magnitude[id];
+    int xa = x - dx[d], ya = y - dy[d], xb = x + dx[d], yb = y + dy[d];
+    float before = (xa >= 0 && xa < width && ya >= 0 && ya < height) ? magnitude[ya * width + xa] : 0.0f;
+    float after = (xb >= 0 && xb < width && yb >= 0 && yb < height) ? magnitude[yb * width + xb] : 0.0f;
+    bool maximum = m > before && m >= after;
+    state[id] = (maximum && m >= high) ? 2 : (maximum && m >= low) ? 1 : 0;
+}
+
+// One hysteresis launch: weak pixels 8-connected to strong ones become strong. Each CANNY_TILE x CANNY_TILE group
+// repeats the promotion in local memory until its tile stops changing, so a launch carries edges across a whole tile;
+// connections between tiles take further launches. Launches are chained through flags: launch pass does nothing if
+// flags[pass] is 0 (an earlier launch converged), and sets flags[pass + 1] if it promoted any pixel. The host enqueues
+// a batch of launches with flags[0] = 1 and the rest 0, and reads only the last flag to see whether to go on
+kernel void hysteresis_tile(global uchar* state, int width, int height, global int* flags, int pass) {
+    local uchar tile[CANNY_TILE + 2][CANNY_TILE + 2];
+    local int changed;
+    if (flags[pass] == 0) return; // Uniform across the launch
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    int lx = get_local_id(0);
+    int ly = get_local_id(1);
+    int x0 = get_group_id(0) * CANNY_TILE - 1;
+    int y0 = get_group_id(1) * CANNY_TILE - 1;
+    for (int i = ly * CANNY_TILE + lx; i < (CANNY_TILE + 2) * (CANNY_TILE + 2); i += CANNY_TILE * CANNY_TILE) {
+        int tx = i % (CANNY_TILE + 2), ty = i / (CANNY_TILE + 2);
+        int gx = x0 + tx, gy = y0 + ty;
+        tile[ty][tx] = (gx >= 0 && gx < width && gy >= 0 && gy < height) ? state[gy * width + gx] : 0;
+    }
+    bool inside = x < width && y < height;
+    int cx = lx + 1, cy = ly + 1;
+    bool promoted = false;
+    while (true) {
+        if (lx == 0 && ly == 0) changed = 0;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (inside && tile[cy][cx] == 1) {
+            bool strong = false;
+            for (int j = -1; j <= 1; j++)
+                for (int i = -1; i <= 1; i++) strong = strong || tile[cy + j][cx + i] == 2;
+            if (strong) {
+                tile[cy][cx] = 2; // Neighbours may see it in this round or the next, promotion only grows
+                promoted = true;
+                changed = 1;
+            }
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+        int again = changed;
+        barrier(CLK_LOCAL_MEM_FENCE); // Everyone has read changed before it is reset
+        if (!again) break;
+    }
+    if (promoted) {
+        state[y * width + x] = 2;
+        flags[pass + 1] = 1;
+    }
+}
+
+// Edge map of the final states: 65535 on strong pixels, 0 elsewhere. 1-D range over the pixels
+kernel void edge_map(global const uchar* state, global ushort* output) {
+    int id = get_global_id(0);
+    output[id] = (state[id] == 2) ? 65535 : 0;
+}
+
+// Bilateral filter (ImageCore::Bilateral): every output sample is the mean of its (2 radius + 1)^2 neighbourhood (edges
+// repeated), weighted by spatial[(j + radius) * (2 radius + 1) + i + radius] for the offset (i, j) and by
+// range[|difference| >> BILATERAL_RANGE_SHIFT] for the difference to the centre, both tables precomputed by the host.
+// 3-D range over width x height x channels with BILATERAL_TILE x BILATERAL_TILE x 1 groups; each group loads its tile
+// and a radius-pixel halo into tile, (BILATERAL_TILE + 2 radius)^2 samples, once
+#define BILATERAL_TILE 16
+#define BILATERAL_RANGE_SHIFT 4 // 4096 range weights over the 16-bit differences
+
+kernel void bilateral_tile(global const ushort* input, global ushort* output, int width, int height, int radius,
+                           constant float* spatial, constant float* range, local ushort* tile) {
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    int c = get_global_id(2);
+    int lx = get_local_id(0);
+    int ly = get_local_id(1);
+    int span = BILATERAL_TILE + 2 * radius;
+    int x0 = get_group_id(0) * BILATERAL_TILE - radius;
+    int y0 = get_group_id(1) * BILATERAL_TILE - radius;
+    global const ushort* plane = input + (size_t)c * width * height;
+    for (int i = ly * BILATERAL_TILE + lx; i < span * span; i += BILATERAL_TILE * BILATERAL_TILE)
+        tile[i] = plane[clamp(y0 + i / span, 0, height - 1) * width + clamp(x0 + i % span, 0, width - 1)];
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (x >= width || y >= height) return; // Padding of the rounded-up range, after the barrier
+
+    int diameter = 2 * radius + 1;
+    int centre = tile[(ly + radius) * span + lx + radius];
+    float sum = 0.0f, weight_sum = 0.0f;
+    for (int j = 0; j < diameter; j++) {
+        local const ushort* row = tile + (ly + j) * span + lx;
+        constant float* spatial_row = spatial + j * diameter;
+        for (int i = 0; i < diameter; i++) {
+            int value = row[i];
+            float weight = spatial_row[i] * range[abs(value - centre) >> BILATERAL_RANGE_SHIFT];
+            sum += weight * value;
+            weight_sum += weight;
+        }
+    }
+    output[((size_t)c * height + y) * width + x] = convert_ushort_sat_rte(sum / weight_sum); // The centre weighs 1
+}
+
+// Bilateral grid (ImageCore::BilateralGrid), the approximation for large radii. Every channel is splatted into a coarse
+// gw x gh x gd grid (cells of cell x cell pixels and range_cell levels, centred on multiples of them) of (sum of the
+// values, count), the grid is blurred with [1 4 6 4 1] / 16 along each axis, and every sample is sliced out as sum /
+// count interpolated trilinearly at its own position and value. The work per pixel does not depend on the radius.
+// Grids are stored [channel][z][y][x]; sums are uint, so a cell holds at most 65537 pixels (cell <= 256)
+
+// Nearest-cell splat, 3-D range over width x height x channels
+kernel void grid_splat(global const ushort* input, global uint* grid_sum, global uint* grid_count, int width, int height,
+                       int cell, int range_cell, int gw, int gh, int gd) {
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    int c = get_global_id(2);
+    int value = input[((size_t)c * height + y) * width + x];
+    int gx = (x + cell / 2) / cell, gy = (y + cell / 2) / cell, gz = (value + range_cell / 2) / range_cell;
+    int index = ((c * gd + gz) * gh + gy) * gw + gx;
+    atomic_add(&grid_sum[index], (uint)value);
+    atomic_inc(&grid_count[index]);
+}
+
+// (sum, count) pairs of the splatted grid as floats, one work-item per cell
+kernel void grid_convert(global const uint* grid_sum, global const uint* grid_count, global float2* grid) {
+    int id = get_global_id(0);
+    grid[id] = (float2)(grid_sum[id], grid_count[id]);
+}
+
+// One separable pass of the grid blur along axis (0 x, 1 y, 2 value), zero beyond the grid; 3-D range over
+// gw x gh x (gd * channels)
+kernel void grid_blur(global const float2* source, global float2* destination, int gw, int gh, int gd, int axis) {
+    const float taps[5] = {1.0f / 16, 4.0f / 16, 6.0f / 16, 4.0f / 16, 1.0f / 16};
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    int cz = get_global_id(2); // c * gd + z
+    int position[3] = {x, y, cz % gd};
+    int extent[3] = {gw, gh, gd};
+    int stride = (axis == 0) ? 1 : (axis == 1) ? gw : gw * gh;
+    int index = (cz * gh + y) * gw + x;
+    float2 sum = 0.0f;
+    for (int k = -2; k <= 2; k++) {
+        int p = position[axis] + k;
+        if (p >= 0 && p < extent[axis]) sum += taps[k + 2] * source[index + k * stride];
+    }
+    destination[index] = sum;
+}
+
+// Trilinear slice of the blurred grid, 3-D range over width x height x channels
+kernel void grid_slice(global const ushort* input, global const float2* grid, global ushort* output, int width, int height,
+                       int cell, int range_cell, int gw, int gh, int gd) {
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    int c = get_global_id(2);
+    size_t id = ((size_t)c * height + y) * width + x;
+    int value = input[id];
+    float position[3] = {(float)x / cell, (float)y / cell, (float)value / range_cell};
+    int extent[3] = {gw, gh, gd};
+    int base[3];
+    float fraction[3];
+    for (int k = 0; k < 3; k++) {
+        base[k] = min((int)position[k], extent[k] - 2);
+        fraction[k] = position[k] - base[k];
+    }
+    float2 sum = 0.0f;
+    for (int corner = 0; corner < 8; corner++) {
+        int dx = corner & 1, dy = (corner >> 1) & 1, dz = (corner >> 2) & 1;
+        float weight = (dx ? fraction[0] : 1.0f - fraction[0]) * (dy ? fraction[1] : 1.0f - fraction[1]) *
+                       (dz ? fraction[2] : 1.0f - fraction[2]);
+        sum += weight * grid[((c * gd + base[2] + dz) * gh + base[1] + dy) * gw + base[0] + dx];
+    }
+    output[id] = (sum.y > 0.0f) ? convert_ushort_sat_rte(sum.x / sum.y) : (ushort)value;
+}
+
+// Convolution with masks of any odd size (ImageCore::Convolve), edges repeated as in convolution3x3; like it, mask
+// element (i, j) weighs the pixel at offset (i - mask_width / 2, j - mask_height / 2).
+
+// Direct convolution, 3-D range over width x height x channels
+kernel void convolution2d(global const ushort* input, global ushort* output, int width, int height, constant float* mask,
+                          int mask_width, int mask_height) {
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    int c = get_global_id(2);
+    global const ushort* plane = input + (size_t)c * width * height;
+    int rx = mask_width / 2, ry = mask_height / 2;
+    float result = 0.0f;
+    for (int j = 0; j < mask_height; j++) {
+        int row = clamp(y + j - ry, 0, height - 1) * width;
+        for (int i = 0; i < mask_width; i++)
+            result += plane[row + clamp(x + i - rx, 0, width - 1)] * mask[j * mask_width + i];
+    }
+    output[((size_t)c * height + y) * width + x] = convert_ushort_sat_rte(result);
+}
+
+// Separable convolution of a rank-1 mask, taps[i] * taps[j], as a row pass into float and a column pass back,
+// 3-D ranges over width x height x channels
+kernel void convolution_rows(global const ushort* input, global float* output, int width, int height, constant float* taps,
+                             int radius) {
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    int c = get_global_id(2);
+    global const ushort* row = input + ((size_t)c * height + y) * width;
+    float result = 0.0f;
+    for (int i = -radius; i <= radius; i++)
+        result += row[clamp(x + i, 0, width - 1)] * taps[i + radius];
+    output[((size_t)c * height + y) * width + x] = result;
+}
+
+kernel void convolution_cols(global const float* input, global ushort* output, int width, int height, constant float* taps,
+                             int radius) {
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    int c = get_global_id(2);
+    global const float* plane = input + (size_t)c * width * height;
+    float result = 0.0f;
+    for (int j = -radius; j <= radius; j++)
+        result += plane[clamp(y + j, 0, height - 1) * width + x] * taps[j + radius];
+    output[((size_t)c * height + y) * width + x] = convert_ushort_sat_rte(result);
+}
+
+// Frequency-domain convolution of one channel over a padded width x height complex array (powers of two), rows of
+// which are transformed by fft_rows, transposed by transpose_complex for the column pass, multiplied by the mask's
+// spectrum (computed the same way, so both stay transposed) and transformed back the other way round.
+
+// Padded array of channel c: element (px, py) is the pixel (px - rx, py - ry), clamped to the image, so the circular
+// convolution does not wrap into the output at (x + rx, y + ry). 2-D range over the padded array
+kernel void fft_load(global const ushort* input, global float2* data, int width, int height, int c, int padded_width,
+                     int rx, int ry) {
+    int px = get_global_id(0);
+    int py = get_global_id(1);
+    int x = clamp(px - rx, 0, width - 1), y = clamp(py - ry, 0, height - 1);
+    data[py * padded_width + px] = (float2)(input[((size_t)c * height + y) * width + x], 0.0f);
+}
+
+// Padded mask: element (px, py) holds the tap (rx - px, ry - py), modulo the padded sides, so the mask is flipped and
+// centred on the origin and the product of the spectra is the correlation convolution2d computes. The sides exceed the
+// mask's, so every element gets at most one tap; the others are zero. 2-D range over the padded array
+kernel void fft_load_mask(global const float* mask, global float2* data, int mask_width, int mask_height, int padded_width,
+                          int padded_height) {
+    int px = get_global_id(0);
+    int py = get_global_id(1);
+    int i = mask_width / 2 - px, j = mask_height / 2 - py;
+    if (i < 0) i += padded_width;
+    if (j < 0) j += padded_height;
+    float tap = (i < mask_width && j < mask_height) ? mask[j * mask_width + i] : 0.0f;
+    data[py * padded_width + px] = (float2)(tap, 0.0f);
+}
+
+// In-place radix-2 FFT of every n-point row (n = 2^log2n), one work-group per row: the row is loaded into local memory
+// in bit-reversed order, then each of the log2n stages of butterflies runs in local memory, the work-items taking
+// n / 2 / group size butterflies each. direction -1 is the forward transform, +1 the inverse (scaled by 1 / n)
+kernel void fft_rows(global float2* data, int n, int log2n, float direction, local float2* buffer) {
+    int lid = get_local_id(0);
+    int group_size = get_local_size(0);
+    global float2* row = data + (size_t)get_group_id(0) * n;
+    for (int k = lid; k < n; k += group_size) {
+        int reversed = 0;
+        for (int b = 0; b < log2n; b++) reversed |= ((k >> b) & 1) << (log2n - 1 - b);
+        buffer[reversed] = row[k];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int half = 1; half < n; half *= 2) {
+        for (int k = lid; k < n / 2; k += group_size) {
+            int position = k % half;
+            int i = (k / half) * 2 * half + position, j = i + half;
+            float cosine, sine = sincos(direction * M_PI_F * position / half, &cosine);
+            float2 odd = buffer[j];
+            float2 t = (float2)(odd.x * cosine - odd.y * sine, odd.x * sine + odd.y * cosine);
+            buffer[j] = buffer[i] - t;
+            buffer[i] += t;
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    float scale = (direction > 0.0f) ? 1.0f / n : 1.0f;
+    for (int k = lid; k < n; k += group_size) row[k] = buffer[k] * scale;
+}
+
+// Transpose of a width x height complex array through 16 x 16 local tiles (padded a column against bank conflicts),
+// so both the reads and the writes are coalesced. 2-D range over width x height in 16 x 16 groups
+kernel void transpose_complex(global const float2* input, global float2* output, int width, int height) {
+    local float2 tile[16][17];
+    int lx = get_local_id(0);
+    int ly = get_local_id(1);
+    int x = get_group_id(0) * 16 + lx;
+    int y = get_group_id(1) * 16 + ly;
+    if (x < width && y < height) tile[ly][lx] = input[y * width + x];
+    barrier(CLK_LOCAL_MEM_FENCE);
+    int tx = get_group_id(1) * 16 + lx; // Output column = input row
+    int ty = get_group_id(0) * 16 + ly;
+    if (tx < height && ty < width) output[ty * height + tx] = tile[lx][ly];
+}
+
+// Pointwise complex product with the mask's spectrum, one work-item per element
+kernel void spectrum_multiply(global float2* data, global const float2* spectrum) {
+    int id = get_global_id(0);
+    float2 a = data[id], b = spectrum[id];
+    data[id] = (float2)(a.x * b.x - a.y * b.y, a.x * b.y + a.y * b.x);
+}
+
+// Real part of the convolved array back into channel c of the image, 2-D range over width x height
+kernel void fft_store(global const float2* data, global ushort* output, int width, int height, int c, int padded_width,
+                      int rx, int ry) {
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    output[((size_t)c * height + y) * width + x] = convert_ushort_sat_rte(data[(y + ry) * padded_width + x + rx].x);
+}
@@ -0,0 +1,287 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include "ImageCore.h"
+#include "CImg.h"
+
+using namespace cimg_library;
+
+// Runs a chain of image-processing stages on one image without leaving the device: the image is uploaded once,
+// every stage takes and returns a DeviceImage handle (ImageCore.h) and only the final result is downloaded. This
+// replaces e.g. running tutorial2's rgb2grey, saving, and equalising the saved file with assignment1.
+// The grade stage applies a tone curve and/or a 3-D colour LUT from a .cube file (ImageCore::Grade); directly after
+// equalise the two share one set of LUTs, so grading adds no pass over the pixels. The quantise stage reduces the
+// colours to a palette chosen on the device from a joint RGB histogram (ImageCore::Quantise), and canny turns the
+// image into a Canny edge map (ImageCore::Canny), e.g. --stages equalise,canny for edge maps of equalised images.
+// bilateral and bilateral_grid smooth without blurring edges, exactly or by a bilateral grid for large radii. convolve
+// applies a mask of any size, directly, as two 1-D passes or through FFTs depending on the mask.
+
+void print_help() {
+    std::cerr << "Application usage:" << std::endl;
+    std::cerr << "  -p : select platform " << std::endl;
+    std::cerr << "  -d : select device" << std::endl;
+    std::cerr << "  -l : list all platforms and devices" << std::endl;
+    std::cerr << "  -f : input image file (default: mdr16.ppm)" << std::endl;
+    std::cerr << "  -o : output image file, not saved if omitted" << std::endl;
+    std::cerr << "  --stages : comma-separated stages run in order (default grey,equalise)" << std::endl;
+    std::cerr << "             grey, blur, gaussian, sharpen, equalise, otsu (binary Otsu threshold), otsuN (N = 3 or 4 levels)" << std::endl;
+    std::cerr << "             grade (--curve and --cube; fused into a preceding equalise), quantise (--colours), canny," << std::endl;
+    std::cerr << "             bilateral or bilateral_grid (--radius and --sigma-r) or convolve (--mask)" << std::endl;
+    std::cerr << "  -b : number of bins of the equalisation and thresholds (default 256, at most 256 for 8-bit images;" << std::endl;
+    std::cerr << "       bins^(N - 1) at most 16M for otsuN)" << std::endl;
+    std::cerr << "  --bits : bits per sample of the output, 8 or 16 (default: those of the input)" << std::endl;
+    std::cerr << "  --curve : tone curve of the grade stage, gamma:G, log or file:PATH (\"in out\" pairs on [0, 1])" << std::endl;
+    std::cerr << "  --cube : 3-D colour LUT (.cube file) of the grade stage, applied to the first three channels" << std::endl;
+    std::cerr << "  --interp : interpolation of the colour LUT, trilinear (default) or tetrahedral" << std::endl;
+    std::cerr << "  --cube-staging : colour LUT in an image, in local memory or auto (default: image if supported)" << std::endl;
+    std::cerr << "  --colours : palette entries of the quantise stage, 1 to 256 (default 16)" << std::endl;
+    std::cerr << "  --palette-bits : bits per channel of the joint colour histogram, 1 to 6 (default 5, 32K bins)" << std::endl;
+    std::cerr << "  --kmeans : k-means iterations refining the palette (default 8)" << std::endl;
+    std::cerr << "  --palette : file to save the palette of the quantise stage to, as a GIMP palette" << std::endl;
+    std::cerr << "  --canny : low,high hysteresis thresholds of the canny stage, fractions of a full-scale step (default 0.05,0.15)" << std::endl;
+    std::cerr << "  --scharr : Scharr instead of Sobel gradients in the canny stage" << std::endl;
+    std::cerr << "  --radius : radius of the bilateral stages, at most 16 for bilateral (default 4)" << std::endl;
+    std::cerr << "  --sigma-r : range sigma of the bilateral stages, a fraction of full scale (default 0.1)" << std::endl;
+    std::cerr << "  --mask : mask of the convolve stage, box:N, gaussian:SIGMA, disk:R or file:PATH (\"W H\" and the values)" << std::endl;
+    std::cerr << "           (default gaussian:2)" << std::endl;
+    std::cerr << "  --conv : method of the convolve stage, auto (default), direct, separable or fft" << std::endl;
+    std::cerr << "  --no-display : do not open image windows" << std::endl;
+    std::cerr << "  -h : print this message" << std::endl;
+}
+
+// Levels of an Otsu stage: 2 for "otsu", N for "otsuN"; 0 if the stage is not one
+int otsu_levels(const std::string& stage) {
+    if (stage == "otsu") return 2;
+    if (stage == "otsu3") return 3;
+    if (stage == "otsu4") return 4;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int platform_id = 0;
+    int device_id = 0;
+    std::string image_filename = "mdr16.ppm";
+    std::string output_filename;
+    std::string stages_list = "grey,equalise";
+    int bins = 256;
+    int output_bits = 0;
+    std::string curve_spec;
+    std::string cube_filename;
+    std::string interp_name = "trilinear";
+    std::string staging_name = "auto";
+    int colours = 16;
+    int palette_bits = 5;
+    int kmeans_iterations = 8;
+    std::string palette_filename;
+    float canny_low = 0.05f, canny_high = 0.15f;
+    bool scharr = false;
+    int radius = 4;
+    float sigma_range = 0.1f;
+    std::string mask_spec = "gaussian:2";
+    std::string conv_name = "auto";
+    bool display = true;
+
+    for (int i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "-p") == 0) && (i < (argc - 1))) { platform_id = atoi(argv[++i]); }
+        else if ((strcmp(argv[i], "-d") == 0) && (i < (argc - 1))) { device_id = atoi(argv[++i]); }
+        else if (strcmp(argv[i], "-l") == 0) { std::cout << ListPlatformsDevices() << std::endl; }
+        else if ((strcmp(argv[i], "-f") == 0) && (i < (argc - 1))) { image_filename = argv[++i]; }
+        else if ((strcmp(argv[i], "-o") == 0) && (i < (argc - 1))) { output_filename = argv[++i]; }
+        else if ((strcmp(argv[i], "--stages") == 0) && (i < (argc - 1))) { stages_list = argv[++i]; }
+        else if ((strcmp(argv[i], "-b") == 0) && (i < (argc - 1))) { bins = atoi(argv[++i]); }
+        else if ((strcmp(argv[i], "--bits") == 0) && (i < (argc - 1))) { output_bits = atoi(argv[++i]); }
+        else if ((strcmp(argv[i], "--curve") == 0) && (i < (argc - 1))) { curve_spec = argv[++i]; }
+        else if ((strcmp(argv[i], "--cube") == 0) && (i < (argc - 1))) { cube_filename = argv[++i]; }
+        else if ((strcmp(argv[i], "--interp") == 0) && (i < (argc - 1))) { interp_name = argv[++i]; }
+        else if ((strcmp(argv[i], "--cube-staging") == 0) && (i < (argc - 1))) { staging_name = argv[++i]; }
+        else if ((strcmp(argv[i], "--colours") == 0) && (i < (argc - 1))) { colours = atoi(argv[++i]); }
+        else if ((strcmp(argv[i], "--palette-bits") == 0) && (i < (argc - 1))) { palette_bits = atoi(argv[++i]); }
+        else if ((strcmp(argv[i], "--kmeans") == 0) && (i < (argc - 1))) { kmeans_iterations = atoi(argv[++i]); }
+        else if ((strcmp(argv[i], "--palette") == 0) && (i < (argc - 1))) { palette_filename = argv[++i]; }
+        else if ((strcmp(argv[i], "--canny") == 0) && (i < (argc - 1))) {
+            if (sscanf(argv[++i], "%f,%f", &canny_low, &canny_high) != 2) { print_help(); return 1; }
+        }
+        else if (strcmp(argv[i], "--scharr") == 0) { scharr = true; }
+        else if ((strcmp(argv[i], "--radius") == 0) && (i < (argc - 1))) { radius = atoi(argv[++i]); }
+        else if ((strcmp(argv[i], "--sigma-r") == 0) && (i < (argc - 1))) { sigma_range = (float)atof(argv[++i]); }
+        else if ((strcmp(argv[i], "--mask") == 0) && (i < (argc - 1))) { mask_spec = argv[++i]; }
+        else if ((strcmp(argv[i], "--conv") == 0) && (i < (argc - 1))) { conv_name = argv[++i]; }
+        else if (strcmp(argv[i], "--no-display") == 0) { display = false; }
+        else if (strcmp(argv[i], "-h") == 0) { print_help(); return 0; }
+    }
+
+    std::vector<std::string> stages;
+    std::stringstream stages_stream(stages_list);
+    for (std::string stage; std::getline(stages_stream, stage, ',');) {
+        if (stage != "grey" && stage != "blur" && stage != "gaussian" && stage != "sharpen" && stage != "equalise" && stage != "grade" &&
+            stage != "quantise" && stage != "canny" && stage != "bilateral" && stage != "bilateral_grid" &&
+            stage != "convolve" && otsu_levels(stage) == 0) {
+            std::cerr << "Error: Unknown stage '" << stage << "'" << std::endl;
+            return 1;
+        }
+        stages.push_back(stage);
+    }
+    for (const std::string& stage : stages) {
+        if (stage == "bilateral" && radius > BILATERAL_MAX_RADIUS) {
+            std::cerr << "Error: The bilateral stage takes a radius of at most " << BILATERAL_MAX_RADIUS << ", use bilateral_grid" << std::endl;
+            return 1;
+        }
+        size_t candidates = ImageCore::OtsuCandidates(bins, otsu_levels(stage));
+        if (otsu_levels(stage) > 0 && (candidates > OTSU_MAX_CANDIDATES || bins < otsu_levels(stage))) {
+            std::cerr << "Error: " << bins << " bins do not fit stage " << stage << ", which needs at least " << otsu_levels(stage)
+                      << " bins and at most " << OTSU_MAX_CANDIDATES << " threshold sets (bins^" << otsu_levels(stage) - 1 << ")" << std::endl;
+            return 1;
+        }
+    }
+    if (bins <= 0 || bins > 65536 || (output_bits != 0 && output_bits != 8 && output_bits != 16) ||
+        colours < 1 || colours > QUANTISE_MAX_COLOURS || palette_bits < 1 || palette_bits > QUANTISE_MAX_BITS || kmeans_iterations < 0 ||
+        canny_low < 0 || canny_high < canny_low || radius < 1 || sigma_range <= 0) {
+        print_help();
+        return 1;
+    }
+
+    GradeSpec grade;
+    ColourCube cube;
+    if (!curve_spec.empty() && !ParseCurve(curve_spec, grade.curve)) {
+        std::cerr << "Error: Invalid curve '" << curve_spec << "'" << std::endl;
+        return 1;
+    }
+    if (!cube_filename.empty()) {
+        std::string error;
+        if (!cube.Load(cube_filename, error)) {
+            std::cerr << "Error: Cannot load colour LUT '" << cube_filename << "': " << error << std::endl;
+            return 1;
+        }
+        grade.cube = &cube;
+    }
+    if (interp_name == "trilinear") grade.interpolation = CUBE_TRILINEAR;
+    else if (interp_name == "tetrahedral") grade.interpolation = CUBE_TETRAHEDRAL;
+    else {
+        std::cerr << "Error: Unknown interpolation '" << interp_name << "'" << std::endl;
+        return 1;
+    }
+    std::vector<float> mask;
+    int mask_width = 0, mask_height = 0;
+    if (!ParseMask(mask_spec, mask, mask_width, mask_height)) {
+        std::cerr << "Error: Invalid mask '" << mask_spec << "'" << std::endl;
+        return 1;
+    }
+    const char* conv_names[4] = {"auto", "direct", "separable", "fft"};
+    int conv_method = -1;
+    for (int m = 0; m < 4; m++)
+        if (conv_name == conv_names[m]) conv_method = m; // CONVOLVE_AUTO ... CONVOLVE_FFT
+    if (conv_method < 0) {
+        std::cerr << "Error: Unknown convolution method '" << conv_name << "'" << std::endl;
+        return 1;
+    }
+    if (staging_name == "auto") grade.staging = CUBE_STAGING_AUTO;
+    else if (staging_name == "image") grade.staging = CUBE_STAGING_IMAGE;
+    else if (staging_name == "local") grade.staging = CUBE_STAGING_LOCAL;
+    else {
+        std::cerr << "Error: Unknown colour LUT staging '" << staging_name << "'" << std::endl;
+        return 1;
+    }
+
+    cimg::exception_mode(0);
+
+    try {
+        // Check bit depth as assignment1 does; 8-bit images stay 8-bit until the first stage that needs 16 bits
+        FILE* file = fopen(image_filename.c_str(), "rb");
+        if (!file) throw CImgIOException("Cannot open file");
+        int maxval = 0;
+        fscanf(file, "%*2s %*d %*d %d", &maxval);
+        fclose(file);
+        int input_bits = (maxval <= 255) ? 8 : 16;
+        if (input_bits == 8 && bins > 256) {
+            std::cout << "Note: 8-bit image detected (maxval = " << maxval << "). Capping bins at 256 (requested " << bins << ")." << std::endl;
+            bins = 256;
+        }
+        if (output_bits == 0) output_bits = input_bits;
+
+        cl::Context context = GetContext(platform_id, device_id);
+        std::cout << "Running on " << GetPlatformName(platform_id) << ", " << GetDeviceName(platform_id, device_id) << std::endl;
+        cl::CommandQueue queue(context, context.getInfo<CL_CONTEXT_DEVICES>()[0], CL_QUEUE_PROFILING_ENABLE);
+        ImageCore core(context, queue);
+
+        // CImg stores channel planes, the layout of DeviceImage
+        DeviceImage image;
+        CImg<unsigned char> input_8bit;
+        CImg<unsigned short> input_16bit;
+        if (input_bits == 8) {
+            input_8bit.load(image_filename.c_str());
+            image = core.Upload(input_8bit.data(), input_8bit.width(), input_8bit.height(), input_8bit.spectrum(), 8);
+        } else {
+            input_16bit.load(image_filename.c_str());
+            image = core.Upload(input_16bit.data(), input_16bit.width(), input_16bit.height(), input_16bit.spectrum(), 16);
+        }
+
+        std::vector<cl_float4> palette;
+        for (size_t s = 0; s < stages.size(); s++) {
+            const std::string& stage = stages[s];
+            if (stage == "grey") image = core.ToGrey(image);
+            else if (stage == "blur") image = core.Convolve(image, MASK_BOX_BLUR);
+            else if (stage == "gaussian") image = core.Convolve(image, MASK_GAUSSIAN);
+            else if (stage == "sharpen") image = core.Convolve(image, MASK_SHARPEN);
+            else if (stage == "equalise" && s + 1 < stages.size() && stages[s + 1] == "grade") {
+                image = core.Grade(image, grade, bins); // One set of LUTs for both stages
+                s++;
+            }
+            else if (stage == "equalise") image = core.Equalise(image, bins);
+            else if (stage == "grade") image = core.Grade(image, grade);
+            else if (stage == "quantise") image = core.Quantise(image, colours, palette_bits, kmeans_iterations, &palette);
+            else if (stage == "canny") image = core.Canny(image, canny_low, canny_high, scharr);
+            else if (stage == "bilateral") image = core.Bilateral(image, radius, sigma_range);
+            else if (stage == "bilateral_grid") image = core.BilateralGrid(image, radius, sigma_range);
+            else if (stage == "convolve") {
+                int method = (conv_method == CONVOLVE_AUTO) ? core.ConvolveMethod(image, mask, mask_width, mask_height) : conv_method;
+                std::cout << "Convolving with a " << mask_width << "x" << mask_height << " mask, " << conv_names[method] << std::endl;
+                image = core.Convolve(image, mask, mask_width, mask_height, method);
+            }
+            else image = core.Threshold(image, bins, otsu_levels(stage));
+        }
+        image = core.Convert(image, output_bits);
+
+        CImgDisplay disp_input, disp_output;
+        if (output_bits == 8) {
+            CImg<unsigned char> result(image.width, image.height, 1, image.channels);
+            core.Download(image, result.data());
+            if (!output_filename.empty()) result.save(output_filename.c_str());
+            if (display) disp_output.assign(result, "output");
+        } else {
+            CImg<unsigned short> result(image.width, image.height, 1, image.channels);
+            core.Download(image, result.data());
+            if (!output_filename.empty()) result.save(output_filename.c_str());
+            if (display) disp_output.assign(result, "output");
+        }
+
+        if (!palette_filename.empty() && !palette.empty()) {
+            std::ofstream palette_file(palette_filename);
+            palette_file << "GIMP Palette\nName: " << image_filename << "\nColumns: 8\n#\n";
+            for (const cl_float4& entry : palette)
+                palette_file << std::lround(entry.s[0] * 255) << " " << std::lround(entry.s[1] * 255) << " " << std::lround(entry.s[2] * 255) << std::endl;
+            if (!palette_file) std::cerr << "Error: Cannot write palette '" << palette_filename << "'" << std::endl;
+        }
+
+        std::cout << core.Report();
+
+        if (display) {
+            if (input_bits == 8) disp_input.assign(input_8bit, "input");
+            else disp_input.assign(input_16bit, "input");
+            while (!disp_input.is_closed() && !disp_output.is_closed()
+                && !disp_input.is_keyESC() && !disp_output.is_keyESC()) {
+                disp_input.wait(1);
+                disp_output.wait(1);
+            }
+        }
+    }
+    catch (const cl::Error& err) {
+        std::cerr << "ERROR: " << err.what() << ", " << getErrorString(err.err()) << std::endl;
+        return 1;
+    }
+    catch (CImgException& err) {
+        std::cerr << "ERROR: " << err.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
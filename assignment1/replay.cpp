@@ -0,0 +1,360 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <map>
+#include "Utils.h"
+
+// Re-executes a command trace written by assignment1 --record (see CommandRecorder in Utils.h) and times every
+// command. Buffers get the recorded sizes; contents that were not stored in the trace (the images) are replaced
+// by pseudo-random data, so a slow production sequence can be benchmarked without its input files. Commands can
+// be restricted to an index range for bisecting; allocations are always replayed so later commands stay valid.
+// Sub-buffers are replayed as buffers of their own, so aliasing between them and their parent is not reproduced.
+
+void print_help() {
+    std::cerr << "Application usage:" << std::endl;
+    std::cerr << "  -p : select platform " << std::endl;
+    std::cerr << "  -d : select device" << std::endl;
+    std::cerr << "  -l : list all platforms and devices" << std::endl;
+    std::cerr << "  -t : command trace to replay" << std::endl;
+    std::cerr << "  -k : kernel source the trace was recorded with (default kernels/my_kernels.cl)" << std::endl;
+    std::cerr << "  --from : index of the first command to replay (default 0)" << std::endl;
+    std::cerr << "  --to : index of the last command to replay (default the last one)" << std::endl;
+    std::cerr << "  -r : repetitions of the trace, the fastest time of every command is reported (default 3)" << std::endl;
+    std::cerr << "  --seed : random seed of the synthetic data (default 1)" << std::endl;
+    std::cerr << "  -v : list every replayed command with its time" << std::endl;
+    std::cerr << "  -h : print this message" << std::endl;
+}
+
+struct Argument {
+    cl_uint index;
+    TraceArgKind kind;
+    std::vector<uint8_t> bytes;
+};
+
+struct Command {
+    TraceRecordType type;
+    uint64_t time; // Host time in ns since recording started
+    uint32_t buffer, source; // Buffer ids; source is only used by copies
+    uint64_t offset, source_offset, size, flags;
+    std::vector<uint8_t> payload; // Stored contents or fill pattern
+    std::string name;
+    size_t dimensions;
+    size_t ranges[3][3]; // Offset, global and local range
+    std::vector<Argument> args;
+};
+
+template <typename T>
+T get(std::ifstream& file) {
+    T value = T();
+    file.read((char*)&value, sizeof(T));
+    return value;
+}
+
+std::vector<uint8_t> get_bytes(std::ifstream& file, size_t size) {
+    std::vector<uint8_t> bytes(size);
+    file.read((char*)bytes.data(), size);
+    return bytes;
+}
+
+// Reads every record of the trace, throws on a malformed or truncated file
+std::vector<Command> read_trace(const std::string& file_name) {
+    std::ifstream file(file_name, std::ios::binary);
+    char magic[sizeof(TRACE_MAGIC)];
+    if (!file.read(magic, sizeof(magic)) || !std::equal(magic, magic + sizeof(magic), TRACE_MAGIC))
+        throw std::runtime_error("'" + file_name + "' is not a command trace");
+
+    std::vector<Command> commands;
+    for (uint8_t type; file.read((char*)&type, 1);) {
+        Command command = Command();
+        command.type = (TraceRecordType)type;
+        command.time = get<uint64_t>(file);
+        switch (command.type) {
+            case TRACE_ALLOC:
+                command.buffer = get<uint32_t>(file);
+                command.size = get<uint64_t>(file);
+                command.flags = get<uint64_t>(file);
+                command.payload = get_bytes(file, get<uint64_t>(file));
+                break;
+            case TRACE_WRITE:
+            case TRACE_READ:
+                command.buffer = get<uint32_t>(file);
+                command.offset = get<uint64_t>(file);
+                command.size = get<uint64_t>(file);
+                if (command.type == TRACE_WRITE) command.payload = get_bytes(file, get<uint64_t>(file));
+                break;
+            case TRACE_FILL:
+                command.buffer = get<uint32_t>(file);
+                command.offset = get<uint64_t>(file);
+                command.size = get<uint64_t>(file);
+                command.payload = get_bytes(file, get<uint32_t>(file));
+                break;
+            case TRACE_COPY:
+                command.source = get<uint32_t>(file);
+                command.buffer = get<uint32_t>(file);
+                command.source_offset = get<uint64_t>(file);
+                command.offset = get<uint64_t>(file);
+                command.size = get<uint64_t>(file);
+                break;
+            case TRACE_KERNEL: {
+                std::vector<uint8_t> name = get_bytes(file, get<uint16_t>(file));
+                command.name.assign(name.begin(), name.end());
+                command.dimensions = get<uint8_t>(file);
+                for (int r = 0; r < 3; r++)
+                    for (int d = 0; d < 3; d++)
+                        command.ranges[r][d] = get<uint64_t>(file);
+                int arg_count = get<uint8_t>(file);
+                for (int a = 0; a < arg_count; a++) {
+                    Argument arg;
+                    arg.index = get<uint8_t>(file);
+                    uint32_t size = get<uint32_t>(file);
+                    arg.kind = (TraceArgKind)get<uint8_t>(file);
+                    arg.bytes = get_bytes(file, size);
+                    command.args.push_back(arg);
+                }
+                break;
+            }
+            default:
+                throw std::runtime_error("unknown record type " + std::to_string(type) + " in '" + file_name + "'");
+        }
+        if (!file) throw std::runtime_error("'" + file_name + "' is truncated");
+        commands.push_back(command);
+    }
+    return commands;
+}
+
+// NDRange of the given dimensions, or NullRange when the recorded range is absent (all zero)
+cl::NDRange make_range(const size_t* range, size_t dimensions) {
+    if (dimensions == 0 || range[0] == 0) return cl::NullRange;
+    if (dimensions == 1) return cl::NDRange(range[0]);
+    if (dimensions == 2) return cl::NDRange(range[0], range[1]);
+    return cl::NDRange(range[0], range[1], range[2]);
+}
+
+template <typename P>
+void fill_pattern(cl::CommandQueue& queue, const cl::Buffer& buffer, const std::vector<uint8_t>& pattern, size_t offset, size_t size, cl::Event* event) {
+    P value;
+    memcpy(&value, pattern.data(), sizeof(P));
+    queue.enqueueFillBuffer(buffer, value, offset, size, nullptr, event);
+}
+
+// Fill with a pattern of any of the sizes OpenCL allows, given as the recorded bytes
+void fill_buffer(cl::CommandQueue& queue, const cl::Buffer& buffer, const std::vector<uint8_t>& pattern, size_t offset, size_t size, cl::Event* event) {
+    switch (pattern.size()) {
+        case 1: fill_pattern<cl_uchar>(queue, buffer, pattern, offset, size, event); break;
+        case 2: fill_pattern<cl_ushort>(queue, buffer, pattern, offset, size, event); break;
+        case 4: fill_pattern<cl_uint>(queue, buffer, pattern, offset, size, event); break;
+        case 8: fill_pattern<cl_ulong>(queue, buffer, pattern, offset, size, event); break;
+        case 16: fill_pattern<cl_uint4>(queue, buffer, pattern, offset, size, event); break;
+        case 32: fill_pattern<cl_uint8>(queue, buffer, pattern, offset, size, event); break;
+        case 64: fill_pattern<cl_uint16>(queue, buffer, pattern, offset, size, event); break;
+        case 128: fill_pattern<cl_ulong16>(queue, buffer, pattern, offset, size, event); break;
+        default: throw cl::Error(CL_INVALID_VALUE, "fill_buffer");
+    }
+}
+
+const char* command_name(const Command& command) {
+    switch (command.type) {
+        case TRACE_ALLOC: return "alloc";
+        case TRACE_WRITE: return "write";
+        case TRACE_READ: return "read";
+        case TRACE_FILL: return "fill";
+        case TRACE_COPY: return "copy";
+        default: return command.name.c_str();
+    }
+}
+
+int main(int argc, char **argv) {
+    int platform_id = 0;
+    int device_id = 0;
+    std::string trace_filename;
+    std::string kernel_filename = "kernels/my_kernels.cl";
+    size_t from = 0, to = (size_t)-1;
+    int repetitions = 3;
+    unsigned int seed = 1;
+    bool verbose = false;
+
+    for (int i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "-p") == 0) && (i < (argc - 1))) { platform_id = atoi(argv[++i]); }
+        else if ((strcmp(argv[i], "-d") == 0) && (i < (argc - 1))) { device_id = atoi(argv[++i]); }
+        else if (strcmp(argv[i], "-l") == 0) { std::cout << ListPlatformsDevices() << std::endl; }
+        else if ((strcmp(argv[i], "-t") == 0) && (i < (argc - 1))) { trace_filename = argv[++i]; }
+        else if ((strcmp(argv[i], "-k") == 0) && (i < (argc - 1))) { kernel_filename = argv[++i]; }
+        else if ((strcmp(argv[i], "--from") == 0) && (i < (argc - 1))) { from = strtoull(argv[++i], nullptr, 10); }
+        else if ((strcmp(argv[i], "--to") == 0) && (i < (argc - 1))) { to = strtoull(argv[++i], nullptr, 10); }
+        else if ((strcmp(argv[i], "-r") == 0) && (i < (argc - 1))) { repetitions = atoi(argv[++i]); }
+        else if ((strcmp(argv[i], "--seed") == 0) && (i < (argc - 1))) { seed = (unsigned int)strtoul(argv[++i], nullptr, 10); }
+        else if (strcmp(argv[i], "-v") == 0) { verbose = true; }
+        else if (strcmp(argv[i], "-h") == 0) { print_help(); return 0; }
+    }
+
+    if (trace_filename.empty() || repetitions <= 0 || from > to) {
+        print_help();
+        return 1;
+    }
+
+    std::vector<Command> commands;
+    try {
+        commands = read_trace(trace_filename);
+    }
+    catch (const std::runtime_error& err) {
+        std::cerr << "Error: " << err.what() << std::endl;
+        return 1;
+    }
+    if (commands.empty() || from >= commands.size()) {
+        std::cerr << "Error: No commands to replay in '" << trace_filename << "'" << std::endl;
+        return 1;
+    }
+    to = std::min(to, commands.size() - 1);
+    std::cout << "Read " << commands.size() << " commands from " << trace_filename << std::endl;
+
+    try {
+        cl::Context context = GetContext(platform_id, device_id);
+        std::cout << "Running on " << GetPlatformName(platform_id) << ", " << GetDeviceName(platform_id, device_id) << std::endl;
+        cl::CommandQueue queue(context, context.getInfo<CL_CONTEXT_DEVICES>()[0], CL_QUEUE_PROFILING_ENABLE);
+
+        cl::Program::Sources sources;
+        AddSources(sources, kernel_filename);
+        cl::Program program(context, sources);
+        try {
+            program.build();
+        }
+        catch (const cl::Error& err) {
+            std::cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
+            std::cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
+            throw err;
+        }
+
+        // Buffers created from host data hold descriptors (e.g. tile lists) that random contents would turn into
+        // out-of-bounds accesses, so a trace without them is refused
+        for (const Command& command : commands) {
+            if (command.type == TRACE_ALLOC && (command.flags & CL_MEM_COPY_HOST_PTR) && command.size > 0 && command.payload.empty()) {
+                std::cerr << "Error: The trace lacks the initial contents of buffer " << command.buffer << " (" << command.size
+                          << " bytes); record it again" << std::endl;
+                return 1;
+            }
+        }
+
+        // Synthetic contents, shared by every allocation and write whose data was not stored
+        size_t synthetic_size = 0, read_size = 0;
+        for (const Command& command : commands) {
+            if ((command.type == TRACE_ALLOC || command.type == TRACE_WRITE) && command.payload.empty())
+                synthetic_size = std::max(synthetic_size, (size_t)command.size);
+            if (command.type == TRACE_READ)
+                read_size = std::max(read_size, (size_t)command.size);
+        }
+        std::vector<uint32_t> synthetic((synthetic_size + sizeof(uint32_t) - 1) / sizeof(uint32_t));
+        uint32_t state = seed ? seed : 1;
+        for (uint32_t& word : synthetic) {
+            state ^= state << 13; state ^= state >> 17; state ^= state << 5; // xorshift32
+            word = state;
+        }
+        std::vector<uint8_t> read_back(read_size);
+
+        std::map<std::string, cl::Kernel> kernels;
+        std::vector<double> best(commands.size(), 0.0);
+        double best_wall = 0;
+
+        for (int r = 0; r < repetitions; r++) {
+            std::map<uint32_t, cl::Buffer> buffers;
+            std::vector<std::pair<size_t, cl::Event>> events;
+            queue.finish();
+            auto start = std::chrono::steady_clock::now();
+
+            for (size_t i = 0; i < commands.size(); i++) {
+                const Command& command = commands[i];
+                if (command.type == TRACE_ALLOC) {
+                    // Only the access flags carry over, the host pointers of the recording are gone
+                    cl_mem_flags flags = command.flags & (CL_MEM_READ_WRITE | CL_MEM_WRITE_ONLY | CL_MEM_READ_ONLY);
+                    if (!command.payload.empty())
+                        buffers[command.buffer] = cl::Buffer(context, flags | CL_MEM_COPY_HOST_PTR, command.size, (void*)command.payload.data());
+                    else {
+                        buffers[command.buffer] = cl::Buffer(context, flags, command.size);
+                        queue.enqueueWriteBuffer(buffers[command.buffer], CL_FALSE, 0, command.size, synthetic.data());
+                    }
+                    continue;
+                }
+                if (i < from || i > to) continue;
+
+                events.emplace_back(i, cl::Event());
+                cl::Event* event = &events.back().second;
+                switch (command.type) {
+                    case TRACE_WRITE:
+                        queue.enqueueWriteBuffer(buffers[command.buffer], CL_FALSE, command.offset, command.size,
+                                                 command.payload.empty() ? (const void*)synthetic.data() : (const void*)command.payload.data(), nullptr, event);
+                        break;
+                    case TRACE_READ:
+                        queue.enqueueReadBuffer(buffers[command.buffer], CL_FALSE, command.offset, command.size, read_back.data(), nullptr, event);
+                        break;
+                    case TRACE_FILL:
+                        fill_buffer(queue, buffers[command.buffer], command.payload, command.offset, command.size, event);
+                        break;
+                    case TRACE_COPY:
+                        queue.enqueueCopyBuffer(buffers[command.source], buffers[command.buffer], command.source_offset, command.offset,
+                                                command.size, nullptr, event);
+                        break;
+                    default: {
+                        if (kernels.find(command.name) == kernels.end())
+                            kernels[command.name] = cl::Kernel(program, command.name.c_str());
+                        cl::Kernel& kernel = kernels[command.name];
+                        for (const Argument& arg : command.args) {
+                            if (arg.kind == TRACE_ARG_BUFFER)
+                                kernel.setArg(arg.index, buffers[*(const uint32_t*)arg.bytes.data()]);
+                            else if (arg.kind == TRACE_ARG_LOCAL)
+                                kernel.setArg(arg.index, cl::Local(*(const uint64_t*)arg.bytes.data()));
+                            else
+                                kernel.setArg(arg.index, arg.bytes.size(), arg.bytes.data());
+                        }
+                        queue.enqueueNDRangeKernel(kernel, make_range(command.ranges[0], command.dimensions),
+                                                   make_range(command.ranges[1], command.dimensions),
+                                                   make_range(command.ranges[2], command.dimensions), nullptr, event);
+                    }
+                }
+            }
+            queue.finish();
+            double wall = SecondsSince(start);
+            if (r == 0 || wall < best_wall) best_wall = wall;
+
+            for (const std::pair<size_t, cl::Event>& entry : events) {
+                const cl::Event& event = entry.second;
+                double seconds = (event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event.getProfilingInfo<CL_PROFILING_COMMAND_START>()) * 1e-9;
+                if (r == 0 || seconds < best[entry.first]) best[entry.first] = seconds;
+            }
+        }
+
+        // Per-command listing and totals per kernel name or transfer type
+        std::vector<std::string> order;
+        std::map<std::string, std::pair<size_t, double>> totals;
+        std::map<std::string, uint64_t> bytes;
+        double device_time = 0;
+        if (verbose) std::cout << "index,recorded_time,command,size,device_time" << std::endl;
+        for (size_t i = from; i <= to; i++) {
+            const Command& command = commands[i];
+            if (command.type == TRACE_ALLOC) continue;
+            std::string name = command_name(command);
+            if (totals.find(name) == totals.end()) order.push_back(name);
+            totals[name].first++;
+            totals[name].second += best[i];
+            if (command.type != TRACE_KERNEL) bytes[name] += command.size;
+            device_time += best[i];
+            if (verbose)
+                std::cout << i << "," << command.time * 1e-9 << "," << name << "," << (command.type == TRACE_KERNEL ? 0 : command.size) << "," << best[i] << std::endl;
+        }
+
+        std::cout << "Replayed commands " << from << " to " << to << " (recorded over " << (commands[to].time - commands[from].time) * 1e-9 << " s):" << std::endl;
+        for (const std::string& name : order) {
+            const std::pair<size_t, double>& total = totals[name];
+            std::cout << "  " << name << ": " << total.first << " x, " << total.second << " s, " << total.second / total.first << " s each";
+            if (bytes.count(name) && total.second > 0)
+                std::cout << ", " << bytes[name] / total.second * 1e-9 << " GB/s";
+            std::cout << std::endl;
+        }
+        std::cout << "Device time " << device_time << " s, wall time " << best_wall << " s (fastest of " << repetitions << ")" << std::endl;
+    }
+    catch (const cl::Error& err) {
+        std::cerr << "ERROR: " << err.what() << ", " << getErrorString(err.err()) << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,221 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include "Utils.h"
+#include <chrono>
+
+// Benchmarks the single-pass decoupled look-back scan (scan_lookback) against the multi-pass scan built from
+// scan_add, block_sum and scan_add_adjust, over array sizes growing by 4x. Both compute an inclusive scan of
+// the same device-generated input and every result is checked on the host.
+
+void print_help() {
+    std::cerr << "Application usage:" << std::endl;
+    std::cerr << "  -p : select platform " << std::endl;
+    std::cerr << "  -d : select device" << std::endl;
+    std::cerr << "  -l : list all platforms and devices" << std::endl;
+    std::cerr << "  --min : smallest array size in elements (default 1K)" << std::endl;
+    std::cerr << "  --max : largest array size in elements (default 256M)" << std::endl;
+    std::cerr << "  -w : work-group size of both scans (default 256)" << std::endl;
+    std::cerr << "  -r : repetitions per size, the fastest is reported (default 3)" << std::endl;
+    std::cerr << "  -h : print this message" << std::endl;
+}
+
+// Parses an element count with an optional K, M or G suffix (powers of 1024), returns 0 if invalid
+size_t parse_count(const char* text) {
+    char* end = nullptr;
+    double value = strtod(text, &end);
+    if (end == text || value < 0) return 0;
+    switch (toupper(*end)) {
+        case 'K': value *= 1024.0; break;
+        case 'M': value *= 1024.0 * 1024.0; break;
+        case 'G': value *= 1024.0 * 1024.0 * 1024.0; break;
+    }
+    return (size_t)value;
+}
+
+// Seconds on the steady clock
+double now_seconds() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Input pattern, repeated over the whole array by enqueueFillBuffer
+struct Pattern {
+    cl_int values[4];
+};
+const Pattern input_pattern = {{1, 0, 2, 1}};
+
+// Inclusive scan of element i of the repeated input pattern
+size_t expected_scan(size_t i) {
+    const size_t pattern_scan[] = {1, 1, 3, 4};
+    return (i / 4) * 4 + pattern_scan[i % 4];
+}
+
+double kernel_seconds(const std::vector<cl::Event>& events) {
+    double seconds = 0;
+    for (const cl::Event& event : events)
+        seconds += (event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event.getProfilingInfo<CL_PROFILING_COMMAND_START>()) * 1e-9;
+    return seconds;
+}
+
+// Multi-pass inclusive scan of n elements (a multiple of local_size): scan every block, scan the block sums
+// recursively, then add the inclusive sum of block g - 1 to block g by launching the adjustment with an offset
+void multi_pass_scan(cl::CommandQueue& queue, cl::Program& program, cl::Buffer& input, cl::Buffer& output,
+                     size_t n, size_t local_size, std::vector<cl::Event>& events) {
+    cl::Kernel scan_kernel(program, "scan_add");
+    scan_kernel.setArg(0, input);
+    scan_kernel.setArg(1, output);
+    scan_kernel.setArg(2, cl::Local(local_size * sizeof(cl_int)));
+    scan_kernel.setArg(3, cl::Local(local_size * sizeof(cl_int)));
+    events.emplace_back();
+    queue.enqueueNDRangeKernel(scan_kernel, cl::NullRange, cl::NDRange(n), cl::NDRange(local_size), nullptr, &events.back());
+    if (n <= local_size) return;
+
+    size_t blocks = n / local_size;
+    size_t padded_blocks = RoundUp(blocks, local_size);
+    cl::Context context = queue.getInfo<CL_QUEUE_CONTEXT>();
+    cl::Buffer block_sums = TrackedBuffer(context, CL_MEM_READ_WRITE, padded_blocks * sizeof(cl_int), "block_sums");
+    cl::Buffer scanned_sums = TrackedBuffer(context, CL_MEM_READ_WRITE, padded_blocks * sizeof(cl_int), "scanned_sums");
+    queue.enqueueFillBuffer(block_sums, (cl_int)0, 0, padded_blocks * sizeof(cl_int));
+
+    cl::Kernel block_sum_kernel(program, "block_sum");
+    block_sum_kernel.setArg(0, output);
+    block_sum_kernel.setArg(1, block_sums);
+    block_sum_kernel.setArg(2, (int)local_size);
+    events.emplace_back();
+    queue.enqueueNDRangeKernel(block_sum_kernel, cl::NullRange, cl::NDRange(blocks), cl::NullRange, nullptr, &events.back());
+
+    multi_pass_scan(queue, program, block_sums, scanned_sums, padded_blocks, local_size, events);
+
+    cl::Kernel adjust_kernel(program, "scan_add_adjust");
+    adjust_kernel.setArg(0, output);
+    adjust_kernel.setArg(1, scanned_sums);
+    events.emplace_back();
+    queue.enqueueNDRangeKernel(adjust_kernel, cl::NDRange(local_size), cl::NDRange(n - local_size), cl::NDRange(local_size), nullptr, &events.back());
+}
+
+// Single-pass inclusive scan of n elements, one tile of local_size elements per work-group
+void single_pass_scan(cl::CommandQueue& queue, cl::Program& program, cl::Buffer& input, cl::Buffer& output,
+                      size_t n, size_t local_size, std::vector<cl::Event>& events) {
+    size_t tiles = (n + local_size - 1) / local_size;
+    cl::Context context = queue.getInfo<CL_QUEUE_CONTEXT>();
+    cl::Buffer next_tile = TrackedBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_int), "next_tile");
+    cl::Buffer tile_flags = TrackedBuffer(context, CL_MEM_READ_WRITE, tiles * sizeof(cl_int), "tile_flags");
+    cl::Buffer tile_aggregates = TrackedBuffer(context, CL_MEM_READ_WRITE, tiles * sizeof(cl_int), "tile_aggregates");
+    cl::Buffer tile_prefixes = TrackedBuffer(context, CL_MEM_READ_WRITE, tiles * sizeof(cl_int), "tile_prefixes");
+    queue.enqueueFillBuffer(next_tile, (cl_int)0, 0, sizeof(cl_int));
+    queue.enqueueFillBuffer(tile_flags, (cl_int)0, 0, tiles * sizeof(cl_int));
+
+    cl::Kernel scan_kernel(program, "scan_lookback");
+    scan_kernel.setArg(0, input);
+    scan_kernel.setArg(1, output);
+    scan_kernel.setArg(2, (int)n);
+    scan_kernel.setArg(3, cl::Local(local_size * sizeof(cl_int)));
+    scan_kernel.setArg(4, cl::Local(local_size * sizeof(cl_int)));
+    scan_kernel.setArg(5, next_tile);
+    scan_kernel.setArg(6, tile_flags);
+    scan_kernel.setArg(7, tile_aggregates);
+    scan_kernel.setArg(8, tile_prefixes);
+    events.emplace_back();
+    queue.enqueueNDRangeKernel(scan_kernel, cl::NullRange, cl::NDRange(tiles * local_size), cl::NDRange(local_size), nullptr, &events.back());
+}
+
+// Compares the device result with the closed form of the input pattern, reading back in chunks
+bool check_scan(cl::CommandQueue& queue, cl::Buffer& output, size_t n) {
+    const size_t chunk = 1 << 24;
+    std::vector<cl_int> result(std::min(n, chunk));
+    for (size_t offset = 0; offset < n; offset += chunk) {
+        size_t count = std::min(chunk, n - offset);
+        queue.enqueueReadBuffer(output, CL_TRUE, offset * sizeof(cl_int), count * sizeof(cl_int), result.data());
+        for (size_t i = 0; i < count; i++) {
+            if ((size_t)result[i] != expected_scan(offset + i)) {
+                std::cerr << "Mismatch at " << offset + i << ": " << result[i] << " instead of " << expected_scan(offset + i) << std::endl;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    int platform_id = 0;
+    int device_id = 0;
+    size_t min_size = 1024;
+    size_t max_size = 256 * 1024 * 1024;
+    size_t local_size = 256;
+    int repetitions = 3;
+
+    for (int i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "-p") == 0) && (i < (argc - 1))) { platform_id = atoi(argv[++i]); }
+        else if ((strcmp(argv[i], "-d") == 0) && (i < (argc - 1))) { device_id = atoi(argv[++i]); }
+        else if (strcmp(argv[i], "-l") == 0) { std::cout << ListPlatformsDevices() << std::endl; }
+        else if ((strcmp(argv[i], "--min") == 0) && (i < (argc - 1))) { min_size = parse_count(argv[++i]); }
+        else if ((strcmp(argv[i], "--max") == 0) && (i < (argc - 1))) { max_size = parse_count(argv[++i]); }
+        else if ((strcmp(argv[i], "-w") == 0) && (i < (argc - 1))) { local_size = atoi(argv[++i]); }
+        else if ((strcmp(argv[i], "-r") == 0) && (i < (argc - 1))) { repetitions = atoi(argv[++i]); }
+        else if (strcmp(argv[i], "-h") == 0) { print_help(); return 0; }
+    }
+
+    if (min_size == 0 || max_size < min_size || local_size == 0 || (local_size & (local_size - 1)) != 0 || repetitions <= 0) {
+        print_help();
+        return 1;
+    }
+
+    try {
+        cl::Context context = GetContext(platform_id, device_id);
+        std::cout << "Running on " << GetPlatformName(platform_id) << ", " << GetDeviceName(platform_id, device_id) << std::endl;
+        cl::CommandQueue queue(context, context.getInfo<CL_CONTEXT_DEVICES>()[0], CL_QUEUE_PROFILING_ENABLE);
+
+        cl::Program::Sources sources;
+        AddSources(sources, "kernels/my_kernels.cl");
+        cl::Program program(context, sources);
+        try {
+            program.build();
+        }
+        catch (const cl::Error& err) {
+            std::cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
+            std::cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
+            throw err;
+        }
+
+        std::cout << "size,method,passes,kernel_time,wall_time,elements_per_second,correct" << std::endl;
+        bool all_correct = true;
+        for (size_t n = min_size; n <= max_size; n *= 4) {
+            // The multi-pass scan works on whole blocks, so both buffers are padded; the padding is never checked
+            size_t padded_n = RoundUp(n, local_size);
+            cl::Buffer input = TrackedBuffer(context, CL_MEM_READ_ONLY, padded_n * sizeof(cl_int), "scan_input");
+            cl::Buffer output = TrackedBuffer(context, CL_MEM_READ_WRITE, padded_n * sizeof(cl_int), "scan_output");
+            queue.enqueueFillBuffer(input, input_pattern, 0, padded_n * sizeof(cl_int));
+            queue.finish();
+
+            for (int method = 0; method < 2; method++) {
+                double best_kernel = 0, best_wall = 0;
+                size_t passes = 0;
+                bool correct = true;
+                for (int r = 0; r < repetitions; r++) {
+                    std::vector<cl::Event> events;
+                    double start = now_seconds();
+                    if (method == 0)
+                        multi_pass_scan(queue, program, input, output, padded_n, local_size, events);
+                    else
+                        single_pass_scan(queue, program, input, output, n, local_size, events);
+                    queue.finish();
+                    double wall = now_seconds() - start;
+                    double kernel = kernel_seconds(events);
+                    if (r == 0 || wall < best_wall) best_wall = wall;
+                    if (r == 0 || kernel < best_kernel) best_kernel = kernel;
+                    passes = events.size();
+                    correct = correct && check_scan(queue, output, n);
+                }
+                all_correct = all_correct && correct;
+                std::cout << n << "," << (method == 0 ? "multi_pass" : "lookback") << "," << passes << ","
+                          << best_kernel << "," << best_wall << "," << n / best_wall << "," << (correct ? "yes" : "no") << std::endl;
+            }
+        }
+        std::cout << GetMemoryTracker().Report();
+        return all_correct ? 0 : 1;
+    }
+    catch (const cl::Error& err) {
+        std::cerr << "ERROR: " << err.what() << ", " << getErrorString(err.err()) << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,103 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include "Utils.h"
+#include "CImg.h"
+
+using namespace cimg_library;
+
+// Writes a synthetic test image generated on the device with the generate_image kernel. PNM files hold
+// 1 or 3 channels; 2- and 4-channel images need a format CImg can store them in, e.g. .cimg.
+
+void print_help() {
+    std::cerr << "Application usage:" << std::endl;
+    std::cerr << "  -p : select platform " << std::endl;
+    std::cerr << "  -d : select device" << std::endl;
+    std::cerr << "  -l : list all platforms and devices" << std::endl;
+    std::cerr << "  -o : output image file" << std::endl;
+    std::cerr << "  --dist : distribution, one of uniform, gaussian, constant, bimodal, sparse, natural (default natural)" << std::endl;
+    std::cerr << "  --size : image size WxH (default 1024x1024)" << std::endl;
+    std::cerr << "  -c : number of channels, 1-4 (default 1)" << std::endl;
+    std::cerr << "  --bits : 8 or 16 bits per channel (default 16)" << std::endl;
+    std::cerr << "  --seed : random seed (default 1)" << std::endl;
+    std::cerr << "  -h : print this message" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    int platform_id = 0;
+    int device_id = 0;
+    std::string output_filename;
+    std::string distribution_name = "natural";
+    int width = 1024, height = 1024;
+    int channels = 1;
+    int bits = 16;
+    unsigned int seed = 1;
+
+    for (int i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "-p") == 0) && (i < (argc - 1))) { platform_id = atoi(argv[++i]); }
+        else if ((strcmp(argv[i], "-d") == 0) && (i < (argc - 1))) { device_id = atoi(argv[++i]); }
+        else if (strcmp(argv[i], "-l") == 0) { std::cout << ListPlatformsDevices() << std::endl; }
+        else if ((strcmp(argv[i], "-o") == 0) && (i < (argc - 1))) { output_filename = argv[++i]; }
+        else if ((strcmp(argv[i], "--dist") == 0) && (i < (argc - 1))) { distribution_name = argv[++i]; }
+        else if ((strcmp(argv[i], "--size") == 0) && (i < (argc - 1))) {
+            if (sscanf(argv[++i], "%dx%d", &width, &height) != 2) width = height = 0;
+        }
+        else if ((strcmp(argv[i], "-c") == 0) && (i < (argc - 1))) { channels = atoi(argv[++i]); }
+        else if ((strcmp(argv[i], "--bits") == 0) && (i < (argc - 1))) { bits = atoi(argv[++i]); }
+        else if ((strcmp(argv[i], "--seed") == 0) && (i < (argc - 1))) { seed = (unsigned int)strtoul(argv[++i], nullptr, 10); }
+        else if (strcmp(argv[i], "-h") == 0) { print_help(); return 0; }
+    }
+
+    int distribution = ParseSyntheticDistribution(distribution_name);
+    if (output_filename.empty() || distribution < 0 || width <= 0 || height <= 0 || channels < 1 || channels > 4 || (bits != 8 && bits != 16)) {
+        print_help();
+        return 1;
+    }
+
+    cimg::exception_mode(0);
+
+    try {
+        cl::Context context = GetContext(platform_id, device_id);
+        std::cout << "Running on " << GetPlatformName(platform_id) << ", " << GetDeviceName(platform_id, device_id) << std::endl;
+        cl::CommandQueue queue(context, context.getInfo<CL_CONTEXT_DEVICES>()[0], CL_QUEUE_PROFILING_ENABLE);
+
+        cl::Program::Sources sources;
+        AddSources(sources, "kernels/my_kernels.cl");
+        cl::Program program(context, sources);
+        try {
+            program.build();
+        }
+        catch (const cl::Error& err) {
+            std::cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
+            std::cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
+            throw err;
+        }
+
+        size_t image_bytes = (size_t)width * height * channels * sizeof(unsigned short);
+        cl::Buffer dev_image(context, CL_MEM_WRITE_ONLY, image_bytes);
+        cl::Event event;
+        GenerateSyntheticImage(queue, program, dev_image, width, height, channels, distribution, bits, false, seed, &event);
+        event.wait();
+
+        // generate_image writes channel planes, the same layout as CImg
+        CImg<unsigned short> image(width, height, 1, channels);
+        queue.enqueueReadBuffer(dev_image, CL_TRUE, 0, image_bytes, image.data());
+        if (bits == 8)
+            CImg<unsigned char>(image).save(output_filename.c_str());
+        else
+            image.save(output_filename.c_str());
+
+        std::cout << "Generated " << width << "x" << height << "x" << channels << " " << bits << "-bit " << distribution_name << " image in "
+                  << (event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event.getProfilingInfo<CL_PROFILING_COMMAND_START>()) * 1e-9 << " s" << std::endl;
+    }
+    catch (const cl::Error& err) {
+        std::cerr << "ERROR: " << err.what() << ", " << getErrorString(err.err()) << std::endl;
+        return 1;
+    }
+    catch (CImgException& err) {
+        std::cerr << "ERROR: " << err.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,121 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include "ImageCore.h"
+#include "TileStore.h"
+#include "CImg.h"
+
+using namespace cimg_library;
+
+// Equalises a region of an image stored as a tile container (assignment1 --tiles, TileStore.h). The container is
+// memory-mapped and only the tiles overlapping the region are read. The region histogram is the sum of the stored
+// histograms of the tiles wholly inside it; only the partial edge tiles are counted on the device before the scan,
+// LUT and back projection of the region.
+
+void print_help() {
+    std::cerr << "Application usage:" << std::endl;
+    std::cerr << "  -p : select platform " << std::endl;
+    std::cerr << "  -d : select device" << std::endl;
+    std::cerr << "  -l : list all platforms and devices" << std::endl;
+    std::cerr << "  -f : tile container written by assignment1 --tiles" << std::endl;
+    std::cerr << "  -r : region x,y,w,h to equalise (default whole image)" << std::endl;
+    std::cerr << "  -b : number of bins, dividing the bins stored in the container (default: the stored bins)" << std::endl;
+    std::cerr << "  -o : output image file of the equalised region, not saved if omitted" << std::endl;
+    std::cerr << "  --no-display : do not open an image window" << std::endl;
+    std::cerr << "  -h : print this message" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    int platform_id = 0;
+    int device_id = 0;
+    std::string tiles_filename;
+    std::string roi_string;
+    std::string output_filename;
+    int bins = 0;
+    bool display = true;
+
+    for (int i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "-p") == 0) && (i < (argc - 1))) { platform_id = atoi(argv[++i]); }
+        else if ((strcmp(argv[i], "-d") == 0) && (i < (argc - 1))) { device_id = atoi(argv[++i]); }
+        else if (strcmp(argv[i], "-l") == 0) { std::cout << ListPlatformsDevices() << std::endl; }
+        else if ((strcmp(argv[i], "-f") == 0) && (i < (argc - 1))) { tiles_filename = argv[++i]; }
+        else if ((strcmp(argv[i], "-r") == 0) && (i < (argc - 1))) { roi_string = argv[++i]; }
+        else if ((strcmp(argv[i], "-b") == 0) && (i < (argc - 1))) { bins = atoi(argv[++i]); }
+        else if ((strcmp(argv[i], "-o") == 0) && (i < (argc - 1))) { output_filename = argv[++i]; }
+        else if (strcmp(argv[i], "--no-display") == 0) { display = false; }
+        else if (strcmp(argv[i], "-h") == 0) { print_help(); return 0; }
+    }
+
+    TileFile tiles;
+    if (tiles_filename.empty() || !tiles.Open(tiles_filename)) {
+        std::cerr << "Error: Cannot open tile container '" << tiles_filename << "'" << std::endl;
+        return 1;
+    }
+    const TileHeader& header = tiles.Header();
+    if (bins == 0) bins = header.bins;
+    if (bins < 0 || header.bins % bins != 0) {
+        std::cerr << "Error: " << bins << " bins do not divide the " << header.bins << " bins stored in the container" << std::endl;
+        return 1;
+    }
+    int roi[4] = {0, 0, (int)header.width, (int)header.height}; // x, y, w, h
+    if (!roi_string.empty()) {
+        if ((sscanf(roi_string.c_str(), "%d,%d,%d,%d", &roi[0], &roi[1], &roi[2], &roi[3]) != 4) ||
+            roi[0] < 0 || roi[1] < 0 || roi[2] <= 0 || roi[3] <= 0 ||
+            (uint32_t)(roi[0] + roi[2]) > header.width || (uint32_t)(roi[1] + roi[3]) > header.height) {
+            std::cerr << "Error: Invalid region of interest '" << roi_string << "' for a " << header.width << "x" << header.height << " image" << std::endl;
+            return 1;
+        }
+    }
+
+    cimg::exception_mode(0);
+
+    try {
+        auto start = std::chrono::steady_clock::now();
+        TileRegionPlan plan = tiles.PlanRegion(roi[0], roi[1], roi[2], roi[3], bins);
+        std::vector<unsigned short> region((size_t)roi[2] * roi[3] * header.channels);
+        tiles.ReadRegion(roi[0], roi[1], roi[2], roi[3], region.data());
+        double host_time = SecondsSince(start);
+        std::cout << "Region: " << roi[2] << "x" << roi[3] << " at (" << roi[0] << ", " << roi[1] << ") of a " << header.width << "x" << header.height
+                  << " image, " << header.tile_size << "-pixel tiles" << std::endl;
+        std::cout << "Histogram: " << plan.interior_tiles << " stored tile histograms, " << plan.edge_pixels << " of "
+                  << (size_t)roi[2] * roi[3] << " pixels per channel counted (" << plan.edges.size() << " edge bands)" << std::endl;
+        std::cout << "Tiles read and histograms summed in " << host_time * 1e3 << " ms" << std::endl;
+
+        cl::Context context = GetContext(platform_id, device_id);
+        std::cout << "Running on " << GetPlatformName(platform_id) << ", " << GetDeviceName(platform_id, device_id) << std::endl;
+        cl::CommandQueue queue(context, context.getInfo<CL_CONTEXT_DEVICES>()[0], CL_QUEUE_PROFILING_ENABLE);
+        ImageCore core(context, queue);
+
+        DeviceImage image = core.Upload(region.data(), roi[2], roi[3], header.channels, 16);
+        image = core.Equalise(image, bins, plan.histograms, plan.edges);
+        image = core.Convert(image, header.bits);
+
+        CImgDisplay disp_output;
+        if (header.bits == 8) {
+            CImg<unsigned char> result(image.width, image.height, 1, image.channels);
+            core.Download(image, result.data());
+            if (!output_filename.empty()) result.save(output_filename.c_str());
+            if (display) disp_output.assign(result, "Equalized Region");
+        } else {
+            CImg<unsigned short> result(image.width, image.height, 1, image.channels);
+            core.Download(image, result.data());
+            if (!output_filename.empty()) result.save(output_filename.c_str());
+            if (display) disp_output.assign(result, "Equalized Region");
+        }
+
+        std::cout << core.Report();
+
+        while (display && !disp_output.is_closed() && !disp_output.is_keyESC())
+            disp_output.wait(1);
+    }
+    catch (const cl::Error& err) {
+        std::cerr << "ERROR: " << err.what() << ", " << getErrorString(err.err()) << std::endl;
+        return 1;
+    }
+    catch (CImgException& err) {
+        std::cerr << "ERROR: " << err.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
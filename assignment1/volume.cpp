@@ -0,0 +1,415 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <functional>
+#include <algorithm>
+#include "Utils.h"
+#include "CImg.h"
+
+using namespace cimg_library;
+
+// Histogram equalisation of 3-D volumes (CT/MRI stacks), loaded from any volume format CImg reads (e.g. .cimg,
+// .hdr/.nii, .inr) or stacked from a list of 2-D slice images. Each channel is equalised with one global histogram
+// over all its slices, or with a 3-D tiled CLAHE that interpolates between tiles across slices too. The volume never
+// has to fit on the device: it is streamed through two slab buffers per pass, so the upload of the next slab overlaps
+// the kernels running on the current one.
+
+void print_help() {
+    std::cerr << "Application usage:" << std::endl;
+    std::cerr << "  -p : select platform " << std::endl;
+    std::cerr << "  -d : select device" << std::endl;
+    std::cerr << "  -l : list all platforms and devices" << std::endl;
+    std::cerr << "  -f : input volume file" << std::endl;
+    std::cerr << "  --slices : text file with one 2-D slice image per line, stacked in order instead of -f" << std::endl;
+    std::cerr << "  -o : output volume file (a format that keeps depth, e.g. .cimg or .hdr), not saved if omitted" << std::endl;
+    std::cerr << "  -b : number of bins (default 256, at most 256 for 8-bit volumes)" << std::endl;
+    std::cerr << "  --slab : slices per device slab (default 16)" << std::endl;
+    std::cerr << "  --clahe : tx,ty,tz tiles of a 3-D CLAHE instead of the global equalisation" << std::endl;
+    std::cerr << "  --clip : CLAHE clip limit as a multiple of the mean bin count (default 3)" << std::endl;
+    std::cerr << "  --no-display : do not show the middle slice before and after" << std::endl;
+    std::cerr << "  -h : print this message" << std::endl;
+}
+
+// Bits per sample recorded in the header of a volume or slice file: 8, or 16 for deeper (and floating-point) data,
+// which is converted to 16-bit samples anyway; 0 for a format whose header is not read here. The depth comes from the
+// file rather than from its contents, so a dark 16-bit scan is not mistaken for an 8-bit one.
+int sample_bits(const std::string& filename) {
+    std::string extension = filename.substr(filename.find_last_of('.') + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    std::string header_filename = filename;
+    if (extension == "img") // Analyze data, whose header is the .hdr file next to it
+        header_filename = filename.substr(0, filename.size() - 3) + "hdr";
+    std::ifstream file(header_filename, std::ios::binary);
+    if (!file) return 0;
+
+    if (extension == "pgm" || extension == "ppm" || extension == "pnm" || extension == "pbm") {
+        // Magic, width, height and maxval (none for bitmaps), separated by white space and # comments
+        auto token = [&] {
+            std::string value;
+            while (file >> value && value[0] == '#') std::getline(file, value);
+            return value;
+        };
+        std::string magic = token();
+        if (magic == "P1" || magic == "P4") return 8;
+        token();
+        token();
+        int maxval = atoi(token().c_str());
+        return (maxval <= 0) ? 0 : (maxval <= 255) ? 8 : 16;
+    }
+    if (extension == "cimg" || extension == "cimgz") {
+        // First line: image count, pixel type and byte order
+        std::string images, type;
+        file >> images >> type;
+        if (type.empty()) return 0;
+        return (type == "bool" || type == "char" || type == "uchar" || type == "unsigned_char" || type == "schar" ||
+                type == "signed_char" || type == "int8" || type == "uint8") ? 8 : 16;
+    }
+    if (extension == "hdr" || extension == "img" || extension == "nii") {
+        // Analyze 7.5 and NIfTI-1: bitpix is the short at byte 72, in the byte order that makes sizeof_hdr (the int
+        // at byte 0) 348
+        int32_t header_size = 0;
+        int16_t bitpix = 0;
+        file.read((char*)&header_size, sizeof(header_size));
+        file.seekg(72);
+        file.read((char*)&bitpix, sizeof(bitpix));
+        if (!file) return 0;
+        if (header_size != 348) bitpix = (int16_t)(((uint16_t)bitpix >> 8) | ((uint16_t)bitpix << 8));
+        return (bitpix <= 0) ? 0 : (bitpix <= 8) ? 8 : 16;
+    }
+    if (extension == "inr") {
+        // Text header in 256-byte blocks with a PIXSIZE=<bits> bits line
+        std::string header(256, '\0');
+        file.read(&header[0], header.size());
+        size_t found = header.find("PIXSIZE=");
+        if (found == std::string::npos) return 0;
+        int bits = atoi(header.c_str() + found + 8);
+        return (bits <= 0) ? 0 : (bits <= 8) ? 8 : 16;
+    }
+    if (extension == "png") {
+        // Bit depth of the IHDR chunk, after the signature, the chunk's length and type, the width and the height
+        char depth = 0;
+        file.seekg(24);
+        file.read(&depth, 1);
+        return !file ? 0 : (depth <= 8) ? 8 : 16;
+    }
+    if (extension == "jpg" || extension == "jpeg" || extension == "bmp")
+        return 8;
+    return 0;
+}
+
+// Enqueues the kernels of one slab: slab buffer slot, first slice, slice count, events to wait for, completion event
+typedef std::function<void(int, int, int, const std::vector<cl::Event>&, cl::Event&)> SlabLauncher;
+
+// Streams the depth slices of one channel (plane, slice after slice) through the slab buffers input[0] and input[1].
+// The transfer queue uploads slab s + 1 while the compute queue runs launch on slab s; with read_back the results in
+// output[slot] are downloaded back over the slab they came from, one slab behind, so no read is queued ahead of the
+// next upload. Waits for everything before returning.
+void stream_slabs(cl::CommandQueue& transfer_queue, cl::CommandQueue& compute_queue, cl::Buffer input[2], cl::Buffer output[2],
+                  unsigned short* plane, size_t slice_samples, int depth, int slab, bool read_back, const SlabLauncher& launch) {
+    cl::Event kernel_done[2], read_done[2];
+    bool used[2] = {false, false};
+    int previous_z0 = 0, previous_slices = 0;
+    for (int z0 = 0, s = 0; z0 < depth; z0 += slab, s++) {
+        int slot = s % 2;
+        int slices = std::min(slab, depth - z0);
+        std::vector<cl::Event> write_wait; // input[slot] is free once the kernels of slab s - 2 are done
+        if (used[slot]) write_wait.push_back(kernel_done[slot]);
+        cl::Event written;
+        transfer_queue.enqueueWriteBuffer(input[slot], CL_FALSE, 0, slices * slice_samples * sizeof(unsigned short), plane + z0 * slice_samples,
+                                          write_wait.empty() ? nullptr : &write_wait, &written);
+        std::vector<cl::Event> kernel_wait = {written}; // output[slot] is free once slab s - 2 was read back
+        if (read_back && used[slot]) kernel_wait.push_back(read_done[slot]);
+        launch(slot, z0, slices, kernel_wait, kernel_done[slot]);
+        if (read_back && s > 0) {
+            std::vector<cl::Event> read_wait = {kernel_done[1 - slot]};
+            transfer_queue.enqueueReadBuffer(output[1 - slot], CL_FALSE, 0, previous_slices * slice_samples * sizeof(unsigned short),
+                                             plane + previous_z0 * slice_samples, &read_wait, &read_done[1 - slot]);
+        }
+        used[slot] = true;
+        previous_z0 = z0;
+        previous_slices = slices;
+        if (z0 + slab >= depth && read_back) {
+            std::vector<cl::Event> read_wait = {kernel_done[slot]};
+            transfer_queue.enqueueReadBuffer(output[slot], CL_FALSE, 0, slices * slice_samples * sizeof(unsigned short),
+                                             plane + z0 * slice_samples, &read_wait, &read_done[slot]);
+        }
+    }
+    compute_queue.finish();
+    transfer_queue.finish();
+}
+
+int main(int argc, char **argv) {
+    int platform_id = 0;
+    int device_id = 0;
+    std::string volume_filename, slices_filename, output_filename;
+    int bins = 256;
+    int slab = 16;
+    int tiles[3] = {0, 0, 0}; // CLAHE tiles along x, y and z, none for the global equalisation
+    float clip_limit = 3.0f;
+    bool display = true;
+
+    for (int i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "-p") == 0) && (i < (argc - 1))) { platform_id = atoi(argv[++i]); }
+        else if ((strcmp(argv[i], "-d") == 0) && (i < (argc - 1))) { device_id = atoi(argv[++i]); }
+        else if (strcmp(argv[i], "-l") == 0) { std::cout << ListPlatformsDevices() << std::endl; }
+        else if ((strcmp(argv[i], "-f") == 0) && (i < (argc - 1))) { volume_filename = argv[++i]; }
+        else if ((strcmp(argv[i], "--slices") == 0) && (i < (argc - 1))) { slices_filename = argv[++i]; }
+        else if ((strcmp(argv[i], "-o") == 0) && (i < (argc - 1))) { output_filename = argv[++i]; }
+        else if ((strcmp(argv[i], "-b") == 0) && (i < (argc - 1))) { bins = atoi(argv[++i]); }
+        else if ((strcmp(argv[i], "--slab") == 0) && (i < (argc - 1))) { slab = atoi(argv[++i]); }
+        else if ((strcmp(argv[i], "--clahe") == 0) && (i < (argc - 1))) {
+            if (sscanf(argv[++i], "%d,%d,%d", &tiles[0], &tiles[1], &tiles[2]) != 3 || tiles[0] <= 0 || tiles[1] <= 0 || tiles[2] <= 0) {
+                std::cerr << "Error: Invalid CLAHE tiles '" << argv[i] << "', expected tx,ty,tz" << std::endl;
+                return 1;
+            }
+        }
+        else if ((strcmp(argv[i], "--clip") == 0) && (i < (argc - 1))) { clip_limit = (float)atof(argv[++i]); }
+        else if (strcmp(argv[i], "--no-display") == 0) { display = false; }
+        else if (strcmp(argv[i], "-h") == 0) { print_help(); return 0; }
+    }
+
+    bool clahe = tiles[0] > 0;
+    if ((volume_filename.empty() == slices_filename.empty()) || bins <= 0 || bins > 65536 || slab <= 0 || clip_limit <= 0) {
+        print_help();
+        return 1;
+    }
+
+    cimg::exception_mode(0);
+
+    try {
+        // Load the volume, 8-bit data scaled to the 16-bit range as assignment1 does
+        CImg<unsigned short> volume;
+        int bits = 0;
+        if (!volume_filename.empty()) {
+            volume.load(volume_filename.c_str());
+            bits = sample_bits(volume_filename);
+        } else {
+            std::ifstream list(slices_filename);
+            if (!list) throw CImgIOException("Cannot open slice list");
+            std::vector<std::string> slice_filenames;
+            for (std::string line; std::getline(list, line);)
+                if (!line.empty()) slice_filenames.push_back(line);
+            if (slice_filenames.empty()) throw CImgIOException("Empty slice list");
+            for (size_t z = 0; z < slice_filenames.size(); z++) {
+                CImg<unsigned short> slice(slice_filenames[z].c_str());
+                if (z == 0) volume.assign(slice.width(), slice.height(), slice_filenames.size(), slice.spectrum());
+                else if (slice.width() != volume.width() || slice.height() != volume.height() || slice.spectrum() != volume.spectrum())
+                    throw CImgIOException(("Slice " + slice_filenames[z] + " does not match the size of the first slice").c_str());
+                volume.draw_image(0, 0, z, 0, slice);
+                int slice_bits = sample_bits(slice_filenames[z]); // Deepest slice, unknown if any slice is
+                bits = (z == 0) ? slice_bits : (bits == 0 || slice_bits == 0) ? 0 : std::max(bits, slice_bits);
+            }
+        }
+        if (bits == 0) {
+            std::cout << "Note: Bit depth not found in the file header, treating the volume as 16-bit" << std::endl;
+            bits = 16;
+        }
+        bool is_8bit = (bits == 8);
+        if (is_8bit) {
+            std::cout << "Note: 8-bit volume, scaling to 16 bits" << (bins > 256 ? " and capping bins at 256" : "") << std::endl;
+            volume *= 257;
+            bins = std::min(bins, 256);
+        }
+        HostAllocation track_volume("volume", volume.size() * sizeof(unsigned short));
+
+        int width = volume.width(), height = volume.height(), depth = volume.depth(), channels = volume.spectrum();
+        size_t slice_samples = (size_t)width * height;
+        slab = std::min(slab, depth);
+        if (clahe && (tiles[0] > width || tiles[1] > height || tiles[2] > depth)) {
+            std::cerr << "Error: More CLAHE tiles than voxels along an axis of the " << width << "x" << height << "x" << depth << " volume" << std::endl;
+            return 1;
+        }
+        std::cout << "Volume: " << width << "x" << height << "x" << depth << ", " << channels << " channel(s), "
+                  << (depth + slab - 1) / slab << " slabs of " << slab << " slices" << std::endl;
+
+        CImg<unsigned short> input_slice;
+        if (display) input_slice = volume.get_slice(depth / 2);
+
+        cl::Context context = GetContext(platform_id, device_id);
+        std::cout << "Running on " << GetPlatformName(platform_id) << ", " << GetDeviceName(platform_id, device_id) << std::endl;
+        cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+        cl::CommandQueue transfer_queue(context, device);
+        cl::CommandQueue compute_queue(context, device);
+
+        cl::Program::Sources sources;
+        AddSources(sources, "kernels/my_kernels.cl");
+        cl::Program program(context, sources);
+        try {
+            program.build();
+        }
+        catch (const cl::Error& err) {
+            std::cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(device) << std::endl;
+            std::cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << std::endl;
+            throw err;
+        }
+
+        // Two slab buffers per direction; in and out buffers of the same slot hold the same slab
+        size_t slab_bytes = slab * slice_samples * sizeof(unsigned short);
+        cl::Buffer dev_slab_input[2], dev_slab_output[2];
+        for (int slot = 0; slot < 2; slot++) {
+            dev_slab_input[slot] = TrackedBuffer(context, CL_MEM_READ_ONLY, slab_bytes, "dev_slab_input");
+            dev_slab_output[slot] = TrackedBuffer(context, CL_MEM_WRITE_ONLY, slab_bytes, "dev_slab_output");
+        }
+        size_t tile_count = clahe ? (size_t)tiles[0] * tiles[1] * tiles[2] : 1;
+        cl::Buffer dev_histogram = TrackedBuffer(context, CL_MEM_READ_WRITE, tile_count * bins * sizeof(cl_int), "dev_histogram");
+        cl::Buffer dev_lut = TrackedBuffer(context, CL_MEM_READ_WRITE, (clahe ? tile_count * bins : 65536) * sizeof(cl_ushort), "dev_lut");
+
+        // Global equalisation: hist_local over each slab, scan_lookback and normalize_lut once per channel, back_project per slab
+        cl::Kernel hist_kernel(program, "hist_local");
+        hist_kernel.setArg(1, dev_histogram);
+        hist_kernel.setArg(2, bins);
+        hist_kernel.setArg(3, cl::Local(bins * sizeof(cl_int)));
+        hist_kernel.setArg(4, width);
+        hist_kernel.setArg(6, width);
+        hist_kernel.setArg(7, 0);
+        hist_kernel.setArg(8, 0);
+        cl::Kernel backproject_kernel(program, "back_project");
+        backproject_kernel.setArg(2, dev_lut);
+        backproject_kernel.setArg(3, width);
+        backproject_kernel.setArg(5, width);
+        backproject_kernel.setArg(6, 0);
+        backproject_kernel.setArg(7, 0);
+        const size_t scan_local_size = 256;
+        size_t scan_tiles = (bins + scan_local_size - 1) / scan_local_size;
+        cl::Buffer dev_cum_histogram = TrackedBuffer(context, CL_MEM_READ_WRITE, bins * sizeof(cl_int), "dev_cum_histogram");
+        cl::Buffer next_tile = TrackedBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_int), "dev_scan_tiles");
+        cl::Buffer tile_flags = TrackedBuffer(context, CL_MEM_READ_WRITE, scan_tiles * sizeof(cl_int), "dev_scan_tiles");
+        cl::Buffer tile_aggregates = TrackedBuffer(context, CL_MEM_READ_WRITE, scan_tiles * sizeof(cl_int), "dev_scan_tiles");
+        cl::Buffer tile_prefixes = TrackedBuffer(context, CL_MEM_READ_WRITE, scan_tiles * sizeof(cl_int), "dev_scan_tiles");
+        cl::Kernel scan_kernel(program, "scan_lookback");
+        scan_kernel.setArg(0, dev_histogram);
+        scan_kernel.setArg(1, dev_cum_histogram);
+        scan_kernel.setArg(2, bins);
+        scan_kernel.setArg(3, cl::Local(scan_local_size * sizeof(cl_int)));
+        scan_kernel.setArg(4, cl::Local(scan_local_size * sizeof(cl_int)));
+        scan_kernel.setArg(5, next_tile);
+        scan_kernel.setArg(6, tile_flags);
+        scan_kernel.setArg(7, tile_aggregates);
+        scan_kernel.setArg(8, tile_prefixes);
+        cl::Kernel lut_kernel(program, "normalize_lut");
+        lut_kernel.setArg(0, dev_cum_histogram);
+        lut_kernel.setArg(1, dev_lut);
+        lut_kernel.setArg(2, 65535.0f / (slice_samples * depth));
+        lut_kernel.setArg(3, bins);
+
+        // CLAHE: hist_tiles3d over each slab, clahe_lut once per channel, clahe_apply per slab
+        cl::Kernel tiles_kernel(program, "hist_tiles3d");
+        cl::Kernel clahe_lut_kernel(program, "clahe_lut");
+        cl::Kernel clahe_apply_kernel(program, "clahe_apply");
+        if (clahe) {
+            tiles_kernel.setArg(1, dev_histogram);
+            tiles_kernel.setArg(2, bins);
+            tiles_kernel.setArg(3, width);
+            tiles_kernel.setArg(4, height);
+            tiles_kernel.setArg(5, depth);
+            clahe_lut_kernel.setArg(0, dev_histogram);
+            clahe_lut_kernel.setArg(1, dev_lut);
+            clahe_lut_kernel.setArg(2, bins);
+            clahe_lut_kernel.setArg(3, clip_limit);
+            clahe_apply_kernel.setArg(2, dev_lut);
+            clahe_apply_kernel.setArg(3, bins);
+            clahe_apply_kernel.setArg(4, width);
+            clahe_apply_kernel.setArg(5, height);
+            clahe_apply_kernel.setArg(6, depth);
+            for (int axis = 0; axis < 3; axis++) {
+                tiles_kernel.setArg(7 + axis, tiles[axis]);
+                clahe_apply_kernel.setArg(8 + axis, tiles[axis]);
+            }
+        }
+
+        // Local shape of hist_local and back_project over a full slab, tuned once on the first slab buffer; the
+        // compute queue has no profiling, so the candidates are timed on the host in its own order
+        cl::NDRange local_shape = cl::NullRange;
+        if (!clahe) {
+            hist_kernel.setArg(0, dev_slab_input[0]);
+            hist_kernel.setArg(5, (int)(slab * height));
+            local_shape = TuneLocalShape(compute_queue, hist_kernel, width, slab * height, false);
+        }
+        auto global_shape = [&](int slices) {
+            if (clahe) return cl::NDRange(width, slices * height);
+            return cl::NDRange(RoundUp(width, local_shape[0]), RoundUp(slices * height, local_shape[1]));
+        };
+
+        double histogram_time = 0, apply_time = 0;
+        for (int c = 0; c < channels; c++) {
+            unsigned short* plane = volume.data(0, 0, 0, c);
+
+            // Pass 1: histograms of all slabs
+            auto start = std::chrono::steady_clock::now();
+            compute_queue.enqueueFillBuffer(dev_histogram, (cl_int)0, 0, tile_count * bins * sizeof(cl_int));
+            stream_slabs(transfer_queue, compute_queue, dev_slab_input, dev_slab_output, plane, slice_samples, depth, slab, false,
+                [&](int slot, int z0, int slices, const std::vector<cl::Event>& wait, cl::Event& done) {
+                    cl::Kernel& kernel = clahe ? tiles_kernel : hist_kernel;
+                    kernel.setArg(0, dev_slab_input[slot]);
+                    if (clahe) {
+                        kernel.setArg(6, z0);
+                    } else {
+                        kernel.setArg(5, slices * height);
+                    }
+                    compute_queue.enqueueNDRangeKernel(kernel, cl::NullRange, global_shape(slices), clahe ? cl::NullRange : local_shape, &wait, &done);
+                });
+
+            // LUTs from the complete histograms
+            if (clahe) {
+                compute_queue.enqueueNDRangeKernel(clahe_lut_kernel, cl::NullRange, cl::NDRange(tile_count), cl::NullRange);
+            } else {
+                compute_queue.enqueueFillBuffer(next_tile, (cl_int)0, 0, sizeof(cl_int));
+                compute_queue.enqueueFillBuffer(tile_flags, (cl_int)0, 0, scan_tiles * sizeof(cl_int));
+                compute_queue.enqueueNDRangeKernel(scan_kernel, cl::NullRange, cl::NDRange(scan_tiles * scan_local_size), cl::NDRange(scan_local_size));
+                compute_queue.enqueueNDRangeKernel(lut_kernel, cl::NullRange, cl::NDRange(65536), cl::NullRange);
+            }
+            compute_queue.finish();
+            histogram_time += SecondsSince(start);
+
+            // Pass 2: apply the LUTs slab by slab, results read back in place
+            start = std::chrono::steady_clock::now();
+            stream_slabs(transfer_queue, compute_queue, dev_slab_input, dev_slab_output, plane, slice_samples, depth, slab, true,
+                [&](int slot, int z0, int slices, const std::vector<cl::Event>& wait, cl::Event& done) {
+                    cl::Kernel& kernel = clahe ? clahe_apply_kernel : backproject_kernel;
+                    kernel.setArg(0, dev_slab_input[slot]);
+                    kernel.setArg(1, dev_slab_output[slot]);
+                    if (clahe) {
+                        kernel.setArg(7, z0);
+                    } else {
+                        kernel.setArg(4, slices * height);
+                    }
+                    compute_queue.enqueueNDRangeKernel(kernel, cl::NullRange, global_shape(slices), clahe ? cl::NullRange : local_shape, &wait, &done);
+                });
+            apply_time += SecondsSince(start);
+        }
+
+        double voxels = (double)slice_samples * depth * channels;
+        std::cout << (clahe ? "CLAHE" : "Global equalisation") << ", " << bins << " bins";
+        if (clahe) std::cout << ", " << tiles[0] << "x" << tiles[1] << "x" << tiles[2] << " tiles, clip limit " << clip_limit;
+        std::cout << std::endl;
+        std::cout << "Histogram pass: " << histogram_time << " s (" << voxels / histogram_time * 1e-6 << " MVox/s)" << std::endl;
+        std::cout << "Apply pass: " << apply_time << " s (" << voxels / apply_time * 1e-6 << " MVox/s)" << std::endl;
+
+        if (!output_filename.empty()) {
+            if (is_8bit)
+                CImg<unsigned char>(volume / 257).save(output_filename.c_str());
+            else
+                volume.save(output_filename.c_str());
+        }
+
+        if (display) {
+            CImgDisplay disp_input(input_slice, "Input (middle slice)");
+            CImgDisplay disp_output(volume.get_slice(depth / 2), "Equalized (middle slice)");
+            while (!disp_input.is_closed() && !disp_output.is_closed()
+                && !disp_input.is_keyESC() && !disp_output.is_keyESC()) {
+                disp_input.wait(1);
+                disp_output.wait(1);
+            }
+        }
+    }
+    catch (const cl::Error& err) {
+        std::cerr << "ERROR: " << err.what() << ", " << getErrorString(err.err()) << std::endl;
+        return 1;
+    }
+    catch (CImgException& err) {
+        std::cerr << "ERROR: " << err.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
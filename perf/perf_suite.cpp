@@ -0,0 +1,464 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <map>
+#include <functional>
+#include "../assignment1/Utils.h"
+
+// Performance regression suite: times every kernel of tutorial1, tutorial2 and assignment1 on fixed
+// synthetic inputs and compares the median kernel times with a versioned baseline. The baselines are
+// recorded on the PoCL CPU device, which is picked by default so runs on different machines compare
+// like with like. Exits with 1 when any kernel is slower than its baseline by more than its tolerance, or has no
+// baseline time in a recorded baseline.
+//
+// The baseline holds the device it was recorded on and one kernel per line, as written by --update:
+//   "assignment1.hist_local": { "time": 0.00123, "tolerance": 0.2 },
+// A time of null (or a kernel missing from the file) marks a kernel whose baseline has not been recorded yet; it
+// fails the check unless --bootstrap is given. A baseline with no device has never been recorded: the times are
+// reported but nothing is compared, and the check passes until --update is run on the reference device. A baseline
+// recorded on another device fails the check, unless --any-device is given to report the times without comparing.
+
+void print_help() {
+    std::cerr << "Application usage:" << std::endl;
+    std::cerr << "  -p : select platform (default: the first PoCL CPU device)" << std::endl;
+    std::cerr << "  -d : select device" << std::endl;
+    std::cerr << "  -l : list all platforms and devices" << std::endl;
+    std::cerr << "  --baseline : baseline JSON file (default baseline.json)" << std::endl;
+    std::cerr << "  --update : record the measured times as the new baseline, keeping the tolerances" << std::endl;
+    std::cerr << "  --bootstrap : do not fail on kernels without a baseline time (e.g. newly added kernels)" << std::endl;
+    std::cerr << "  --any-device : report the times without failing when the baseline was recorded on another device" << std::endl;
+    std::cerr << "  --filter : only run kernels whose name contains this text" << std::endl;
+    std::cerr << "  -r : timed repetitions per kernel, the median is used (default 11)" << std::endl;
+    std::cerr << "  -h : print this message" << std::endl;
+}
+
+const double default_tolerance = 0.2; // Allowed slow-down of kernels new to the baseline
+
+struct BaselineEntry {
+    bool recorded = false;
+    double time = 0;
+    double tolerance = default_tolerance;
+};
+
+// Kernel entries of a baseline file; device receives the recorded device name, empty if there is none
+std::map<std::string, BaselineEntry> load_baseline(const std::string& filename, std::string& device) {
+    std::map<std::string, BaselineEntry> baseline;
+    std::ifstream file(filename);
+    device.clear();
+    for (std::string line; std::getline(file, line);) {
+        char name[256];
+        if (sscanf(line.c_str(), " \"device\" : \"%255[^\"]\"", name) == 1) {
+            device = name;
+            continue;
+        }
+        char time[64];
+        double tolerance = 0;
+        if (sscanf(line.c_str(), " \"%255[^\"]\" : { \"time\" : %63[^,] , \"tolerance\" : %lf", name, time, &tolerance) != 3)
+            continue;
+        BaselineEntry& entry = baseline[name];
+        entry.recorded = (strncmp(time, "null", 4) != 0);
+        entry.time = entry.recorded ? atof(time) : 0;
+        entry.tolerance = tolerance;
+    }
+    return baseline;
+}
+
+void save_baseline(const std::string& filename, const std::string& device, const std::map<std::string, BaselineEntry>& baseline) {
+    std::ofstream file(filename);
+    file << "{\n  \"device\": \"" << device << "\",\n  \"kernels\": {\n";
+    size_t i = 0;
+    for (const auto& entry : baseline) {
+        file << "    \"" << entry.first << "\": { \"time\": ";
+        if (entry.second.recorded) file << entry.second.time; else file << "null";
+        file << ", \"tolerance\": " << entry.second.tolerance << " }" << (++i < baseline.size() ? "," : "") << "\n";
+    }
+    file << "  }\n}\n";
+}
+
+// Finds the first CPU device of a platform whose name mentions PoCL
+bool find_pocl_cpu(int& platform_id, int& device_id) {
+    std::vector<cl::Platform> platforms;
+    cl::Platform::get(&platforms);
+    for (int i = 0; i < (int)platforms.size(); i++) {
+        std::string name = platforms[i].getInfo<CL_PLATFORM_NAME>();
+        if (name.find("Portable Computing Language") == std::string::npos && name.find("PoCL") == std::string::npos)
+            continue;
+        std::vector<cl::Device> devices;
+        platforms[i].getDevices((cl_device_type)CL_DEVICE_TYPE_ALL, &devices);
+        for (int j = 0; j < (int)devices.size(); j++) {
+            if (devices[j].getInfo<CL_DEVICE_TYPE>() & CL_DEVICE_TYPE_CPU) {
+                platform_id = i;
+                device_id = j;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+cl::Program build_program(const cl::Context& context, const std::string& filename) {
+    cl::Program::Sources sources;
+    AddSources(sources, filename);
+    cl::Program program(context, sources);
+    try {
+        program.build();
+    }
+    catch (const cl::Error& err) {
+        std::cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
+        std::cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
+        throw err;
+    }
+    return program;
+}
+
+// Fixed host input: a hash of the index, the same on every run and machine
+template <typename T>
+std::vector<T> fixed_input(size_t size, unsigned int modulus) {
+    std::vector<T> values(size);
+    for (size_t i = 0; i < size; i++) {
+        unsigned int x = (unsigned int)i * 2654435761u;
+        values[i] = (T)((x ^ (x >> 13)) % modulus);
+    }
+    return values;
+}
+
+int main(int argc, char **argv) {
+    int platform_id = -1;
+    int device_id = 0;
+    std::string baseline_filename = "baseline.json";
+    bool update = false;
+    bool bootstrap = false;
+    bool any_device = false;
+    std::string filter;
+    int repetitions = 11;
+
+    for (int i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "-p") == 0) && (i < (argc - 1))) { platform_id = atoi(argv[++i]); }
+        else if ((strcmp(argv[i], "-d") == 0) && (i < (argc - 1))) { device_id = atoi(argv[++i]); }
+        else if (strcmp(argv[i], "-l") == 0) { std::cout << ListPlatformsDevices() << std::endl; }
+        else if ((strcmp(argv[i], "--baseline") == 0) && (i < (argc - 1))) { baseline_filename = argv[++i]; }
+        else if (strcmp(argv[i], "--update") == 0) { update = true; }
+        else if (strcmp(argv[i], "--bootstrap") == 0) { bootstrap = true; }
+        else if (strcmp(argv[i], "--any-device") == 0) { any_device = true; }
+        else if ((strcmp(argv[i], "--filter") == 0) && (i < (argc - 1))) { filter = argv[++i]; }
+        else if ((strcmp(argv[i], "-r") == 0) && (i < (argc - 1))) { repetitions = atoi(argv[++i]); }
+        else if (strcmp(argv[i], "-h") == 0) { print_help(); return 0; }
+    }
+
+    if (repetitions <= 0) {
+        print_help();
+        return 1;
+    }
+
+    try {
+        if (platform_id < 0 && !find_pocl_cpu(platform_id, device_id)) {
+            std::cerr << "Error: No PoCL CPU device found; the baselines are recorded on one, pick another device with -p and -d" << std::endl;
+            return 1;
+        }
+        cl::Context context = GetContext(platform_id, device_id);
+        std::string device_name = GetPlatformName(platform_id) + ", " + GetDeviceName(platform_id, device_id);
+        std::cout << "Running on " << device_name << std::endl;
+        cl::CommandQueue queue(context, context.getInfo<CL_CONTEXT_DEVICES>()[0], CL_QUEUE_PROFILING_ENABLE);
+        size_t base_align_bytes = queue.getInfo<CL_QUEUE_DEVICE>().getInfo<CL_DEVICE_MEM_BASE_ADDR_ALIGN>() / 8;
+
+        cl::Program tutorial1 = build_program(context, "../tutorial1/kernels/my_kernels.cl");
+        cl::Program tutorial2 = build_program(context, "../tutorial2/kernels/my_kernels.cl");
+        cl::Program assignment1 = build_program(context, "../assignment1/kernels/my_kernels.cl");
+
+        std::string baseline_device;
+        std::map<std::string, BaselineEntry> baseline = load_baseline(baseline_filename, baseline_device);
+        bool never_recorded = baseline_device.empty();
+        bool other_device = !never_recorded && baseline_device != device_name;
+        if (other_device && !update && !any_device) {
+            std::cerr << "Error: The baseline was recorded on " << baseline_device
+                      << "; run on that device, or pass --any-device to report the times without comparing" << std::endl;
+            return 1;
+        }
+        if (never_recorded)
+            std::cout << "Warning: the baseline has not been recorded yet; times are reported but not compared" << std::endl;
+        else if (other_device)
+            std::cout << "Warning: the baseline was recorded on " << baseline_device << "; times are reported but not compared" << std::endl;
+        std::map<std::string, double> measured;
+
+        // Runs one warm-up and then the timed repetitions of a kernel, keeping the median kernel time.
+        // setup runs before every launch (e.g. to reset accumulators) and is not timed.
+        auto measure = [&](const std::string& name, std::function<void()> setup, std::function<void(cl::Event*)> launch) {
+            if (!filter.empty() && name.find(filter) == std::string::npos) return;
+            std::vector<double> times;
+            for (int r = 0; r <= repetitions; r++) {
+                cl::Event event;
+                setup();
+                launch(&event);
+                event.wait();
+                if (r > 0)
+                    times.push_back((event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event.getProfilingInfo<CL_PROFILING_COMMAND_START>()) * 1e-9);
+            }
+            std::sort(times.begin(), times.end());
+            measured[name] = times[times.size() / 2];
+        };
+        auto no_setup = [] {};
+
+        // tutorial1: 1-D integer vectors
+        const size_t vector_size = 1 << 22;
+        std::vector<int> A = fixed_input<int>(vector_size, 1000), B = fixed_input<int>(vector_size, 777);
+        cl::Buffer dev_A(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, vector_size * sizeof(int), A.data());
+        cl::Buffer dev_B(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, vector_size * sizeof(int), B.data());
+        cl::Buffer dev_C(context, CL_MEM_READ_WRITE, vector_size * sizeof(int));
+        cl::Kernel add(tutorial1, "add");
+        add.setArg(0, dev_A);
+        add.setArg(1, dev_B);
+        add.setArg(2, dev_C);
+        measure("tutorial1.add", no_setup, [&](cl::Event* event) {
+            queue.enqueueNDRangeKernel(add, cl::NullRange, cl::NDRange(vector_size), cl::NullRange, nullptr, event);
+        });
+        cl::Kernel avg_filter(tutorial1, "avg_filter");
+        avg_filter.setArg(0, dev_A);
+        avg_filter.setArg(1, dev_C);
+        measure("tutorial1.avg_filter", no_setup, [&](cl::Event* event) { // Offset by one so the window stays inside A
+            queue.enqueueNDRangeKernel(avg_filter, cl::NDRange(1), cl::NDRange(vector_size - 2), cl::NullRange, nullptr, event);
+        });
+
+        // tutorial2: 8-bit RGB image. The 3x3 filters read one row and pixel beyond every plane, so the input is
+        // a sub-buffer with an aligned margin on both sides of a larger buffer.
+        const size_t width = 2048, height = 2048, channels = 3;
+        size_t image_size = width * height * channels;
+        size_t margin = RoundUp(width + 1, base_align_bytes);
+        std::vector<unsigned char> image = fixed_input<unsigned char>(image_size + 2 * margin, 256);
+        cl::Buffer dev_image_padded(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, image_size + 2 * margin, image.data());
+        cl_buffer_region image_region = {margin, image_size};
+        cl::Buffer dev_image_input = dev_image_padded.createSubBuffer(CL_MEM_READ_ONLY, CL_BUFFER_CREATE_TYPE_REGION, &image_region);
+        cl::Buffer dev_image_output(context, CL_MEM_READ_WRITE, image_size);
+        std::vector<float> convolution_mask(9, 1.f / 9);
+        cl::Buffer dev_convolution_mask(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, convolution_mask.size() * sizeof(float), convolution_mask.data());
+        for (const char* name : {"identity", "filter_r", "rgb2grey", "identityND", "avg_filterND", "convolutionND"}) {
+            cl::Kernel kernel(tutorial2, name);
+            kernel.setArg(0, dev_image_input);
+            kernel.setArg(1, dev_image_output);
+            if (strcmp(name, "convolutionND") == 0) kernel.setArg(2, dev_convolution_mask);
+            bool nd = (strstr(name, "ND") != nullptr);
+            measure(std::string("tutorial2.") + name, no_setup, [&](cl::Event* event) {
+                queue.enqueueNDRangeKernel(kernel, cl::NullRange, nd ? cl::NDRange(width, height, channels) : cl::NDRange(image_size),
+                                           cl::NullRange, nullptr, event);
+            });
+        }
+
+        // assignment1: the equalisation steps on a natural-looking 16-bit image, with fixed local shapes so a
+        // change in the tuner does not show up as a kernel regression
+        const int bins = 256, segments = 4;
+        size_t pixels = width * height;
+        size_t segment_stride = RoundUp(bins * sizeof(cl_int), base_align_bytes) / sizeof(cl_int);
+        cl::Buffer dev_input(context, CL_MEM_READ_WRITE, pixels * sizeof(unsigned short));
+        cl::Buffer dev_output(context, CL_MEM_READ_WRITE, pixels * sizeof(unsigned short));
+        cl::Buffer dev_histogram(context, CL_MEM_READ_WRITE, segments * segment_stride * sizeof(cl_int));
+        cl::Buffer dev_cum_histogram(context, CL_MEM_READ_WRITE, segments * segment_stride * sizeof(cl_int));
+        cl::Buffer dev_lut(context, CL_MEM_READ_WRITE, 65536 * sizeof(unsigned short));
+        std::vector<cl_int> histogram = fixed_input<cl_int>(segments * segment_stride, 10000);
+        auto reset_histogram = [&] {
+            queue.enqueueWriteBuffer(dev_histogram, CL_TRUE, 0, histogram.size() * sizeof(cl_int), histogram.data());
+        };
+        auto zero_histogram = [&] { queue.enqueueFillBuffer(dev_histogram, (cl_int)0, 0, bins * sizeof(cl_int)); };
+
+        measure("assignment1.generate_image", no_setup, [&](cl::Event* event) {
+            GenerateSyntheticImage(queue, assignment1, dev_input, width, height, 1, SYNTH_NATURAL, 16, false, 1, event);
+        });
+        GenerateSyntheticImage(queue, assignment1, dev_input, width, height, 1, SYNTH_NATURAL, 16, false, 1);
+
+        const cl::NDRange image_local(64, 4);
+        cl::Kernel hist_local(assignment1, "hist_local");
+        hist_local.setArg(0, dev_input);
+        hist_local.setArg(1, dev_histogram);
+        hist_local.setArg(2, bins);
+        hist_local.setArg(3, cl::Local(bins * sizeof(cl_int)));
+        hist_local.setArg(4, (int)width);
+        hist_local.setArg(5, (int)height);
+        hist_local.setArg(6, (int)width);
+        hist_local.setArg(7, 0);
+        hist_local.setArg(8, 0);
+        measure("assignment1.hist_local", zero_histogram, [&](cl::Event* event) {
+            queue.enqueueNDRangeKernel(hist_local, cl::NullRange, cl::NDRange(width, height), image_local, nullptr, event);
+        });
+
+        cl::Kernel scan_hs(assignment1, "scan_hs");
+        scan_hs.setArg(0, dev_histogram);
+        scan_hs.setArg(1, dev_cum_histogram);
+        measure("assignment1.scan_hs", reset_histogram, [&](cl::Event* event) {
+            queue.enqueueNDRangeKernel(scan_hs, cl::NullRange, cl::NDRange(bins), cl::NDRange(bins), nullptr, event);
+        });
+        cl::Kernel scan_bl(assignment1, "scan_bl");
+        scan_bl.setArg(0, dev_histogram);
+        scan_bl.setArg(1, bins);
+        measure("assignment1.scan_bl", reset_histogram, [&](cl::Event* event) {
+            queue.enqueueNDRangeKernel(scan_bl, cl::NullRange, cl::NDRange(bins), cl::NDRange(bins), nullptr, event);
+        });
+        cl::Kernel scan_add(assignment1, "scan_add");
+        scan_add.setArg(0, dev_histogram);
+        scan_add.setArg(1, dev_cum_histogram);
+        scan_add.setArg(2, cl::Local(bins * sizeof(cl_int)));
+        scan_add.setArg(3, cl::Local(bins * sizeof(cl_int)));
+        measure("assignment1.scan_add", reset_histogram, [&](cl::Event* event) {
+            queue.enqueueNDRangeKernel(scan_add, cl::NullRange, cl::NDRange(segments * bins), cl::NDRange(bins), nullptr, event);
+        });
+        cl::Kernel scan_hs_segmented(assignment1, "scan_hs_segmented");
+        scan_hs_segmented.setArg(0, dev_histogram);
+        scan_hs_segmented.setArg(1, dev_cum_histogram);
+        scan_hs_segmented.setArg(2, (int)segment_stride);
+        measure("assignment1.scan_hs_segmented", reset_histogram, [&](cl::Event* event) {
+            queue.enqueueNDRangeKernel(scan_hs_segmented, cl::NullRange, cl::NDRange(bins, segments), cl::NDRange(bins, 1), nullptr, event);
+        });
+        cl::Kernel scan_bl_segmented(assignment1, "scan_bl_segmented");
+        scan_bl_segmented.setArg(0, dev_histogram);
+        scan_bl_segmented.setArg(1, bins);
+        scan_bl_segmented.setArg(2, (int)segment_stride);
+        measure("assignment1.scan_bl_segmented", reset_histogram, [&](cl::Event* event) {
+            queue.enqueueNDRangeKernel(scan_bl_segmented, cl::NullRange, cl::NDRange(bins, segments), cl::NDRange(bins, 1), nullptr, event);
+        });
+
+        const size_t scan_size = 1 << 22, scan_local_size = 256, scan_tiles = scan_size / scan_local_size;
+        cl::Buffer next_tile(context, CL_MEM_READ_WRITE, sizeof(cl_int));
+        cl::Buffer tile_flags(context, CL_MEM_READ_WRITE, scan_tiles * sizeof(cl_int));
+        cl::Buffer tile_aggregates(context, CL_MEM_READ_WRITE, scan_tiles * sizeof(cl_int));
+        cl::Buffer tile_prefixes(context, CL_MEM_READ_WRITE, scan_tiles * sizeof(cl_int));
+        cl::Kernel scan_lookback(assignment1, "scan_lookback");
+        scan_lookback.setArg(0, dev_A);
+        scan_lookback.setArg(1, dev_C);
+        scan_lookback.setArg(2, (int)scan_size);
+        scan_lookback.setArg(3, cl::Local(scan_local_size * sizeof(cl_int)));
+        scan_lookback.setArg(4, cl::Local(scan_local_size * sizeof(cl_int)));
+        scan_lookback.setArg(5, next_tile);
+        scan_lookback.setArg(6, tile_flags);
+        scan_lookback.setArg(7, tile_aggregates);
+        scan_lookback.setArg(8, tile_prefixes);
+        measure("assignment1.scan_lookback", [&] {
+            queue.enqueueFillBuffer(next_tile, (cl_int)0, 0, sizeof(cl_int));
+            queue.enqueueFillBuffer(tile_flags, (cl_int)0, 0, scan_tiles * sizeof(cl_int));
+        }, [&](cl::Event* event) {
+            queue.enqueueNDRangeKernel(scan_lookback, cl::NullRange, cl::NDRange(scan_size), cl::NDRange(scan_local_size), nullptr, event);
+        });
+
+        zero_histogram();
+        queue.enqueueNDRangeKernel(hist_local, cl::NullRange, cl::NDRange(width, height), image_local);
+        cl::Kernel scan_for_lut(assignment1, "scan_bl");
+        scan_for_lut.setArg(0, dev_histogram);
+        scan_for_lut.setArg(1, bins);
+        queue.enqueueNDRangeKernel(scan_for_lut, cl::NullRange, cl::NDRange(bins), cl::NDRange(bins));
+        cl::Kernel normalize_lut(assignment1, "normalize_lut");
+        normalize_lut.setArg(0, dev_histogram);
+        normalize_lut.setArg(1, dev_lut);
+        normalize_lut.setArg(2, 65535.0f / pixels);
+        normalize_lut.setArg(3, bins);
+        measure("assignment1.normalize_lut", no_setup, [&](cl::Event* event) {
+            queue.enqueueNDRangeKernel(normalize_lut, cl::NullRange, cl::NDRange(65536), cl::NullRange, nullptr, event);
+        });
+
+        cl::Kernel back_project(assignment1, "back_project");
+        back_project.setArg(0, dev_input);
+        back_project.setArg(1, dev_output);
+        back_project.setArg(2, dev_lut);
+        back_project.setArg(3, (int)width);
+        back_project.setArg(4, (int)height);
+        back_project.setArg(5, (int)width);
+        back_project.setArg(6, 0);
+        back_project.setArg(7, 0);
+        measure("assignment1.back_project", no_setup, [&](cl::Event* event) {
+            queue.enqueueNDRangeKernel(back_project, cl::NullRange, cl::NDRange(width, height), image_local, nullptr, event);
+        });
+
+        // Persistent variants of hist_local and back_project, over a fixed set of 64x64 tiles drawn by one work-group per
+        // compute unit
+        const int tile_size = 64;
+        std::vector<cl_int> tiles;
+        for (size_t y = 0; y < height; y += tile_size)
+            for (size_t x = 0; x < width; x += tile_size)
+                tiles.insert(tiles.end(), { (cl_int)x, (cl_int)y, tile_size, tile_size });
+        cl_int tile_count = (cl_int)(tiles.size() / 4);
+        size_t persistent_groups = queue.getInfo<CL_QUEUE_DEVICE>().getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+        const size_t persistent_local = 256;
+        cl::Buffer dev_tiles(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, tiles.size() * sizeof(cl_int), tiles.data());
+        cl::Buffer dev_tile_stats(context, CL_MEM_READ_WRITE, 2 * persistent_groups * sizeof(cl_int));
+        auto reset_tiles = [&] { queue.enqueueFillBuffer(next_tile, (cl_int)0, 0, sizeof(cl_int)); };
+
+        cl::Kernel hist_persistent(assignment1, "hist_persistent");
+        hist_persistent.setArg(0, dev_input);
+        hist_persistent.setArg(1, dev_histogram);
+        hist_persistent.setArg(2, bins);
+        hist_persistent.setArg(3, cl::Local(bins * sizeof(cl_int)));
+        hist_persistent.setArg(4, (int)width);
+        hist_persistent.setArg(5, dev_tiles);
+        hist_persistent.setArg(6, tile_count);
+        hist_persistent.setArg(7, next_tile);
+        hist_persistent.setArg(8, dev_tile_stats);
+        measure("assignment1.hist_persistent", [&] { zero_histogram(); reset_tiles(); }, [&](cl::Event* event) {
+            queue.enqueueNDRangeKernel(hist_persistent, cl::NullRange, cl::NDRange(persistent_groups * persistent_local), cl::NDRange(persistent_local),
+                                       nullptr, event);
+        });
+
+        cl::Kernel back_project_persistent(assignment1, "back_project_persistent");
+        back_project_persistent.setArg(0, dev_input);
+        back_project_persistent.setArg(1, dev_output);
+        back_project_persistent.setArg(2, dev_lut);
+        back_project_persistent.setArg(3, (int)width);
+        back_project_persistent.setArg(4, dev_tiles);
+        back_project_persistent.setArg(5, tile_count);
+        back_project_persistent.setArg(6, next_tile);
+        back_project_persistent.setArg(7, dev_tile_stats);
+        measure("assignment1.back_project_persistent", reset_tiles, [&](cl::Event* event) {
+            queue.enqueueNDRangeKernel(back_project_persistent, cl::NullRange, cl::NDRange(persistent_groups * persistent_local),
+                                       cl::NDRange(persistent_local), nullptr, event);
+        });
+
+        // Compare with the baseline: a kernel regresses when its median exceeds the baseline by more than its tolerance
+        int regressions = 0, unrecorded = 0;
+        std::cout << "kernel,baseline,measured,ratio,tolerance,status" << std::endl;
+        for (const auto& result : measured) {
+            BaselineEntry& entry = baseline[result.first];
+            std::string status = "unrecorded";
+            double ratio = entry.recorded ? result.second / entry.time : 0;
+            if (never_recorded) {
+                status = "unrecorded";
+            } else if (other_device) {
+                status = "other device";
+            } else if (!entry.recorded) {
+                unrecorded++;
+            } else {
+                if (ratio > 1 + entry.tolerance) {
+                    status = "REGRESSION";
+                    regressions++;
+                } else {
+                    status = (ratio < 1 - entry.tolerance) ? "faster" : "ok";
+                }
+            }
+            std::cout << result.first << "," << (entry.recorded ? std::to_string(entry.time) : "-") << "," << result.second << ","
+                      << (entry.recorded ? std::to_string(ratio) : "-") << "," << entry.tolerance << "," << status << std::endl;
+            if (update) {
+                entry.recorded = true;
+                entry.time = result.second;
+            }
+        }
+
+        if (update) {
+            save_baseline(baseline_filename, device_name, baseline);
+            std::cout << "Baseline written to " << baseline_filename << std::endl;
+            return 0;
+        }
+        if (regressions > 0) {
+            std::cout << regressions << " kernel(s) slower than their baseline" << std::endl;
+            return 1;
+        }
+        if (unrecorded > 0 && !bootstrap) {
+            std::cout << unrecorded << " kernel(s) without a baseline time; record them with --update on "
+                      << (baseline_device.empty() ? "the reference device" : baseline_device) << ", or pass --bootstrap" << std::endl;
+            return 1;
+        }
+        if (never_recorded)
+            std::cout << "No baseline to compare with; record one with --update on the reference device" << std::endl;
+        else if (other_device)
+            std::cout << "Not compared with the baseline of another device" << std::endl;
+        else
+            std::cout << "No regressions" << std::endl;
+    }
+    catch (const cl::Error& err) {
+        std::cerr << "ERROR: " << err.what() << ", " << getErrorString(err.err()) << std::endl;
+        return 1;
+    }
+    return 0;
+}